@@ -10,6 +10,39 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// convert_mesh_asset_rcpp
+void convert_mesh_asset_rcpp(std::string inputfile, std::string basedir, std::string outputfile, bool quantize, bool include_bvh, int bvh_type, int numbercores);
+RcppExport SEXP _rayrender_convert_mesh_asset_rcpp(SEXP inputfileSEXP, SEXP basedirSEXP, SEXP outputfileSEXP, SEXP quantizeSEXP, SEXP include_bvhSEXP, SEXP bvh_typeSEXP, SEXP numbercoresSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type inputfile(inputfileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type basedir(basedirSEXP);
+    Rcpp::traits::input_parameter< std::string >::type outputfile(outputfileSEXP);
+    Rcpp::traits::input_parameter< bool >::type quantize(quantizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type include_bvh(include_bvhSEXP);
+    Rcpp::traits::input_parameter< int >::type bvh_type(bvh_typeSEXP);
+    Rcpp::traits::input_parameter< int >::type numbercores(numbercoresSEXP);
+    convert_mesh_asset_rcpp(inputfile, basedir, outputfile, quantize, include_bvh, bvh_type, numbercores);
+    return R_NilValue;
+END_RCPP
+}
+// convert_mesh3d_asset_rcpp
+void convert_mesh3d_asset_rcpp(NumericMatrix vertices, NumericMatrix indices, NumericMatrix normals, NumericVector color, std::string outputfile, bool quantize, bool include_bvh, int bvh_type);
+RcppExport SEXP _rayrender_convert_mesh3d_asset_rcpp(SEXP verticesSEXP, SEXP indicesSEXP, SEXP normalsSEXP, SEXP colorSEXP, SEXP outputfileSEXP, SEXP quantizeSEXP, SEXP include_bvhSEXP, SEXP bvh_typeSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericMatrix >::type vertices(verticesSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type indices(indicesSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type normals(normalsSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type color(colorSEXP);
+    Rcpp::traits::input_parameter< std::string >::type outputfile(outputfileSEXP);
+    Rcpp::traits::input_parameter< bool >::type quantize(quantizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type include_bvh(include_bvhSEXP);
+    Rcpp::traits::input_parameter< int >::type bvh_type(bvh_typeSEXP);
+    convert_mesh3d_asset_rcpp(vertices, indices, normals, color, outputfile, quantize, include_bvh, bvh_type);
+    return R_NilValue;
+END_RCPP
+}
 // render_animation_rcpp
 void render_animation_rcpp(List camera_info, List scene_info, List camera_movement, int start_frame, CharacterVector filenames, Function post_process_frame, int toneval, bool bloom);
 RcppExport SEXP _rayrender_render_animation_rcpp(SEXP camera_infoSEXP, SEXP scene_infoSEXP, SEXP camera_movementSEXP, SEXP start_frameSEXP, SEXP filenamesSEXP, SEXP post_process_frameSEXP, SEXP tonevalSEXP, SEXP bloomSEXP) {
@@ -55,6 +88,8 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_rayrender_convert_mesh_asset_rcpp", (DL_FUNC) &_rayrender_convert_mesh_asset_rcpp, 7},
+    {"_rayrender_convert_mesh3d_asset_rcpp", (DL_FUNC) &_rayrender_convert_mesh3d_asset_rcpp, 8},
     {"_rayrender_render_animation_rcpp", (DL_FUNC) &_rayrender_render_animation_rcpp, 8},
     {"_rayrender_render_scene_rcpp", (DL_FUNC) &_rayrender_render_scene_rcpp, 2},
     {"_rayrender_tonemap_image", (DL_FUNC) &_rayrender_tonemap_image, 4},
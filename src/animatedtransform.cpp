@@ -835,6 +835,16 @@ aabb AnimatedTransform::MotionBounds(const aabb &b) const {
   return bounds;
 }
 
+aabb AnimatedTransform::MotionBounds(const aabb &b, Float time0, Float time1) const {
+  if (!actuallyAnimated) return (*startTransform)(b);
+  if (time0 <= startTime && time1 >= endTime) return MotionBounds(b);
+  aabb bounds;
+  for (int corner = 0; corner < 8; ++corner) {
+    bounds = surrounding_box(bounds, BoundPointMotion(b.Corner(corner), time0, time1));
+  }
+  return bounds;
+}
+
 
 void IntervalFindZeros(Float c1, Float c2, Float c3, Float c4, Float c5,
                        Float theta, Interval tInterval, Float *zeros,
@@ -899,3 +909,30 @@ aabb AnimatedTransform::BoundPointMotion(const point3f &p) const {
   }
   return bounds;
 }
+
+aabb AnimatedTransform::BoundPointMotion(const point3f &p, Float time0, Float time1) const {
+  if (!actuallyAnimated) return aabb((*startTransform)(p));
+  // Restrict the motion to the part of [time0, time1] inside the animation
+  Float t0 = clamp(time0, startTime, endTime);
+  Float t1 = clamp(time1, startTime, endTime);
+  if (t1 < t0) std::swap(t0, t1);
+  aabb bounds((*this)(t0, p), (*this)(t1, p));
+  if (!hasRotation) return bounds;
+  Float cosTheta = dot(R[0], R[1]);
+  Float theta = std::acos(clamp(cosTheta, -1, 1));
+  Float u0 = (t0 - startTime) / (endTime - startTime);
+  Float u1 = (t1 - startTime) / (endTime - startTime);
+  for (int c = 0; c < 3; ++c) {
+    // Find any motion derivative zeros for the component _c_ inside the interval
+    Float zeros[8];
+    int nZeros = 0;
+    IntervalFindZeros(c1[c].Eval(p), c2[c].Eval(p), c3[c].Eval(p),
+                      c4[c].Eval(p), c5[c].Eval(p), theta, Interval(u0, u1),
+                      zeros, &nZeros);
+    for (int i = 0; i < nZeros; ++i) {
+      point3f pz = (*this)(lerp(zeros[i], startTime, endTime), p);
+      bounds = surrounding_box(bounds, pz);
+    }
+  }
+  return bounds;
+}
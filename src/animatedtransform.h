@@ -24,6 +24,9 @@ public:
   }
   aabb MotionBounds(const aabb &b) const;
   aabb BoundPointMotion(const point3f &p) const;
+  //Bounds over the part of the motion that falls inside [time0, time1]
+  aabb MotionBounds(const aabb &b, Float time0, Float time1) const;
+  aabb BoundPointMotion(const point3f &p, Float time0, Float time1) const;
   
 private:
   // AnimatedTransform Private Data
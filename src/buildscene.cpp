@@ -22,6 +22,151 @@ Transform rotation_order_matrix(NumericVector temprotvec, NumericVector order_ro
   return(M);
 }
 
+//Meshes loaded from the same file with the same build parameters share one object-space BVH
+//and are placed with instances. Returns an empty key for shapes that can't be instanced.
+static std::string mesh_instance_key(int shape, const std::string& filename, const std::string& basedir,
+                                     Float scale, Float sigma, bool flipped) {
+  if(shape != 7 && shape != 8 && shape != 12 && shape != 16 && shape != 18) {
+    return(std::string());
+  }
+  std::ostringstream key;
+  key.precision(17);
+  key << shape << '|' << filename << '|' << basedir << '|' << scale << '|' << sigma << '|' << flipped;
+  return(key.str());
+}
+
+static int material_property_length(int material_type) {
+  if(material_type == 2) {
+    return(3);
+  } else if (material_type == 3) {
+    return(7);
+  } else if (material_type == 5) {
+    return(3);
+  } else if (material_type == 8) {
+    return(8);
+  } else if (material_type == 9) {
+    return(6);
+  }
+  return(2);
+}
+
+static std::shared_ptr<hitable> make_curve_set(List curve_entry, std::shared_ptr<material> tex, int bvh_type,
+                                               std::shared_ptr<Transform> ObjToWorld,
+                                               std::shared_ptr<Transform> WorldToObj, bool flipped) {
+  NumericMatrix control_points = as<NumericMatrix>(curve_entry["control_points"]);
+  NumericMatrix widths = as<NumericMatrix>(curve_entry["widths"]);
+  NumericMatrix normals = as<NumericMatrix>(curve_entry["normals"]);
+  int curve_type = as<int>(curve_entry["type"]);
+  CurveType type_curve = curve_type == 1 ? CurveType::Flat :
+                         (curve_type == 2 ? CurveType::Cylinder : CurveType::Ribbon);
+  return(std::make_shared<curve_set>(control_points.begin(), widths.begin(), normals.begin(),
+                                     control_points.ncol(), type_curve, as<int>(curve_entry["split_depth"]),
+                                     tex, bvh_type, ObjToWorld, WorldToObj, flipped));
+}
+
+//Voxel ids index a palette of diffuse colors when one is given, otherwise every filled voxel
+//uses the object's material
+static std::shared_ptr<hitable> make_voxel_grid(List voxel_entry, std::shared_ptr<material> tex,
+                                                std::shared_ptr<Transform> ObjToWorld,
+                                                std::shared_ptr<Transform> WorldToObj, bool flipped) {
+  IntegerMatrix coords = as<IntegerMatrix>(voxel_entry["coords"]);
+  IntegerVector ids = as<IntegerVector>(voxel_entry["ids"]);
+  IntegerVector dims = as<IntegerVector>(voxel_entry["dims"]);
+  std::vector<std::shared_ptr<material> > voxel_materials(1);
+  if(voxel_entry.containsElementNamed("palette")) {
+    NumericMatrix palette = as<NumericMatrix>(voxel_entry["palette"]);
+    for(int j = 0; j < palette.ncol(); j++) {
+      voxel_materials.push_back(std::make_shared<lambertian>(
+          std::make_shared<constant_texture>(point3f(palette(0,j),palette(1,j),palette(2,j)))));
+    }
+  } else {
+    voxel_materials.push_back(tex);
+  }
+  int grid_dims[3] = {dims(0), dims(1), dims(2)};
+  return(std::make_shared<voxel_grid>(coords.begin(), ids.begin(), coords.nrow(), grid_dims,
+                                      as<Float>(voxel_entry["voxel_size"]), voxel_materials,
+                                      ObjToWorld, WorldToObj, flipped));
+}
+
+//Density comes from an R array, or from a NRRD or raw file read here. The material color is the
+//single-scattering albedo of the medium.
+static std::shared_ptr<hitable> make_grid_medium(List volume_entry, NumericVector& properties,
+                                                 std::shared_ptr<Transform> ObjToWorld,
+                                                 std::shared_ptr<Transform> WorldToObj) {
+  IntegerVector dims = as<IntegerVector>(volume_entry["dims"]);
+  int grid_dims[3] = {dims(0), dims(1), dims(2)};
+  std::vector<float> density;
+  if(volume_entry.containsElementNamed("filename")) {
+    grid_medium::LoadVolume(as<std::string>(volume_entry["filename"]), as<std::string>(volume_entry["type"]),
+                            grid_dims, density);
+  } else {
+    NumericVector values = as<NumericVector>(volume_entry["density"]);
+    density.assign(values.begin(), values.end());
+  }
+  std::shared_ptr<texture> albedo = std::make_shared<constant_texture>(point3f(properties(0),properties(1),properties(2)));
+  return(std::make_shared<grid_medium>(density.data(), grid_dims, as<Float>(volume_entry["voxel_size"]),
+                                       as<Float>(volume_entry["density_scale"]), albedo,
+                                       ObjToWorld, WorldToObj));
+}
+
+
+//Content hash of the R description of a CSG tree, so identical baked CSG objects share one
+//distance field
+static uint64_t hash_csg_description(SEXP x, uint64_t seed) {
+  int sexp_type = TYPEOF(x);
+  R_xlen_t len = Rf_xlength(x);
+  seed = HashCombine(seed, static_cast<uint64_t>(sexp_type));
+  seed = HashCombine(seed, static_cast<uint64_t>(len));
+  if(sexp_type == VECSXP) {
+    for(R_xlen_t j = 0; j < len; j++) {
+      seed = hash_csg_description(VECTOR_ELT(x, j), seed);
+    }
+  } else if(sexp_type == REALSXP) {
+    seed = HashCombine(seed, HashBytes(reinterpret_cast<const char*>(REAL(x)), len * sizeof(double)));
+  } else if(sexp_type == INTSXP || sexp_type == LGLSXP) {
+    seed = HashCombine(seed, HashBytes(reinterpret_cast<const char*>(INTEGER(x)), len * sizeof(int)));
+  } else if(sexp_type == STRSXP) {
+    for(R_xlen_t j = 0; j < len; j++) {
+      const char* str = CHAR(STRING_ELT(x, j));
+      seed = HashCombine(seed, HashBytes(str, std::strlen(str)));
+    }
+  }
+  SEXP names = Rf_getAttrib(x, R_NamesSymbol);
+  if(!Rf_isNull(names)) {
+    seed = hash_csg_description(names, seed);
+  }
+  return(seed);
+}
+
+//Bakes the distance field of a CSG object, or loads it from the mesh cache directory if it was
+//baked by an earlier render. Returns nullptr (with a warning) for unbounded objects, which are
+//rendered unbaked.
+static std::shared_ptr<sdf_cache> bake_csg(csg& object, uint64_t key, int resolution,
+                                           const std::string& cache_dir, int numbercores) {
+  std::string filename;
+  if(!cache_dir.empty()) {
+    std::ostringstream name;
+    name << cache_dir;
+    if(cache_dir.back() != '/' && cache_dir.back() != '\\') {
+      name << '/';
+    }
+    name << std::hex << std::setw(16) << std::setfill('0') << key << ".rsdf";
+    filename = name.str();
+    std::shared_ptr<sdf_cache> field = sdf_cache::Load(filename, key);
+    if(field) {
+      return(field);
+    }
+  }
+  if(!object.bake(resolution, numbercores)) {
+    Rcpp::warning("Can't bake the distance field of an unbounded CSG object, rendering it unbaked");
+    return(nullptr);
+  }
+  if(!filename.empty() && !object.baked->Save(filename, key)) {
+    Rcpp::warning("Could not write the baked distance field to %s", filename);
+  }
+  return(object.baked);
+}
+
 
 std::shared_ptr<hitable> build_scene(IntegerVector& type, 
                      NumericVector& radius, IntegerVector& shape,
@@ -34,12 +179,12 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                      NumericVector& noisephase, NumericVector& noiseintensity, List noisecolorlist,
                      List& angle, 
                      LogicalVector& isimage, LogicalVector has_alpha,
-                     std::vector<Float* >& alpha_textures, std::vector<int* >& nveca,
-                     std::vector<Float* >& textures, std::vector<int* >& nvec,
+                     std::vector<std::shared_ptr<image_data> >& alpha_textures,
+                     std::vector<std::shared_ptr<mipmap> >& textures,
                      LogicalVector has_bump,
-                     std::vector<Float* >& bump_textures, std::vector<int* >& nvecb,
+                     std::vector<std::shared_ptr<image_data> >& bump_textures,
                      NumericVector& bump_intensity,
-                     std::vector<Float* >& roughness_textures,  std::vector<int* >& nvecr,
+                     std::vector<std::shared_ptr<image_data> >& roughness_textures,
                      LogicalVector has_roughness,
                      NumericVector& lightintensity,
                      LogicalVector& isflipped,
@@ -51,7 +196,8 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                      List& scale_list, NumericVector& sigma,  List &glossyinfo,
                      IntegerVector& shared_id_mat, LogicalVector& is_shared_mat,
                      std::vector<std::shared_ptr<material> >* shared_materials, List& image_repeat_list,
-                     List& csg_info, List& mesh_list, int bvh_type,
+                     List& csg_info, List& mesh_list, int bvh_type, bool robust_quadrics,
+                     std::string mesh_cache_dir, int numbercores,
                      TransformCache& transformCache, List& animation_info, 
                      random_gen& rng) {
   hitable_list list;
@@ -102,6 +248,26 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
   std::vector<std::shared_ptr<bump_texture> > bump(n);
   std::vector<std::shared_ptr<roughness_texture> > roughness(n);
   
+  //Count repeated meshes: these are built once in object space and placed with instances
+  std::vector<std::string> mesh_keys(n);
+  std::map<std::string, int> mesh_key_count;
+  std::map<std::string, std::shared_ptr<hitable> > shared_meshes;
+  //Baked CSG distance fields, shared between objects with identical trees
+  std::map<uint64_t, std::shared_ptr<sdf_cache> > baked_csg;
+  std::shared_ptr<Transform> IdentityTransform = transformCache.Lookup(Transform());
+  for(int i = 0; i < n; i++) {
+    if(shape(i) == 7 || shape(i) == 8 || shape(i) == 12 || shape(i) == 16 || shape(i) == 18) {
+      tempvector = as<NumericVector>(properties(i));
+      int pl = material_property_length(type(i));
+      //Mesh assets key on whether they use their own materials in place of sigma
+      mesh_keys[i] = mesh_instance_key(shape(i), Rcpp::as<std::string>(fileinfo(i)), 
+                                       Rcpp::as<std::string>(filebasedir(i)),
+                                       tempvector(pl+1), shape(i) == 18 ? tempvector(pl+2) : sigma(i), 
+                                       isflipped(i));
+      mesh_key_count[mesh_keys[i]]++;
+    }
+  }
+  
   for(int i = 0; i < n; i++) {
     tempvector = as<NumericVector>(properties(i));
     tempgradient = as<NumericVector>(gradient_colors(i));
@@ -127,39 +293,24 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       temp_animation_transform_start = IdentityMat;
       temp_animation_transform_end = IdentityMat;
     }
-    prop_len=2;
     //Generate texture
     std::shared_ptr<material> tex = nullptr;
     if(has_alpha(i)) {
-      alpha[i] = std::make_shared<alpha_texture>(alpha_textures[i], 
-                                                 nveca[i][0], nveca[i][1], nveca[i][2]);
+      alpha[i] = std::make_shared<alpha_texture>(alpha_textures[i]);
     }
     if(has_bump(i)) {
-      bump[i] = std::make_shared<bump_texture>(bump_textures[i], 
-                                               nvecb[i][0], nvecb[i][1], nvecb[i][2], 
-                              bump_intensity(i));
+      bump[i] = std::make_shared<bump_texture>(bump_textures[i], bump_intensity(i));
     }
     if(has_roughness(i)) {
-      roughness[i] = std::make_shared<roughness_texture>(roughness_textures[i], 
-                                                         nvecr[i][0], nvecr[i][1], nvecr[i][2]);
-    }
-    if(type(i) == 2) {
-      prop_len = 3;
-    } else if (type(i) == 3) {
-      prop_len = 7;
-    } else if (type(i) == 5) {
-      prop_len = 3;
-    } else if (type(i) == 8) {
-      prop_len = 8;
-    } else if (type(i) == 9) {
-      prop_len = 6;
+      roughness[i] = std::make_shared<roughness_texture>(roughness_textures[i]);
     }
+    prop_len = material_property_length(type(i));
     if(is_shared_mat(i) && shared_materials->size() > static_cast<size_t>(shared_id_mat(i))) {
       tex = shared_materials->at(shared_id_mat(i));
     } else {
       if(type(i) == 1) {
         if(isimage(i)) {
-          tex = std::make_shared<lambertian>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<lambertian>(std::make_shared<image_texture>(textures[i], 
                                                  temp_repeat[0], temp_repeat[1], 1.0));
         } else if (isnoise(i)) {
           tex = std::make_shared<lambertian>(std::make_shared<noise_texture>(noise(i),point3f(tempvector(0),tempvector(1),tempvector(2)),
@@ -189,7 +340,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
         }
       } else if (type(i) == 2) {
         if(isimage(i)) {
-          tex = std::make_shared<metal>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<metal>(std::make_shared<image_texture>(textures[i], 
                                             temp_repeat[0], temp_repeat[1], 1.0),
                           tempvector(3), 
                           point3f(temp_glossy(3), temp_glossy(4), temp_glossy(5)), 
@@ -243,7 +394,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                              tempvector(7));
       } else if (type(i) == 4) {
         if(isimage(i)) {
-          tex = std::make_shared<orennayar>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<orennayar>(std::make_shared<image_texture>(textures[i], 
                                                 temp_repeat[0], temp_repeat[1], 1.0), sigma(i));
         } else if (isnoise(i)) {
           tex = std::make_shared<orennayar>(std::make_shared<noise_texture>(noise(i),point3f(tempvector(0),tempvector(1),tempvector(2)),
@@ -273,7 +424,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       } else if (type(i) == 5) {
         std::shared_ptr<texture> light_tex = nullptr;
         if(isimage(i)) {
-          light_tex = std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          light_tex = std::make_shared<image_texture>(textures[i], 
                                         temp_repeat[0], temp_repeat[1], 1.0);
         } else if (isnoise(i)) {
           light_tex = std::make_shared<noise_texture>(noise(i),point3f(tempvector(0),tempvector(1),tempvector(2)),
@@ -309,7 +460,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
           dist = new BeckmannDistribution(temp_glossy(1), temp_glossy(2),roughness[i], has_roughness(i), true);
         }
         if(isimage(i)) {
-          tex = std::make_shared<MicrofacetReflection>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<MicrofacetReflection>(std::make_shared<image_texture>(textures[i], 
                                                            temp_repeat[0], temp_repeat[1], 1.0), dist, 
                                          point3f(temp_glossy(3), temp_glossy(4), temp_glossy(5)), 
                                          point3f(temp_glossy(6),temp_glossy(7),temp_glossy(8)));
@@ -357,7 +508,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
           dist = new BeckmannDistribution(temp_glossy(1), temp_glossy(2),roughness[i], has_roughness(i), true);
         }
         if(isimage(i)) {
-          tex = std::make_shared<glossy>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<glossy>(std::make_shared<image_texture>(textures[i], 
                                              temp_repeat[0], temp_repeat[1], 1.0), dist, 
                            point3f(temp_glossy(3), temp_glossy(4), temp_glossy(5)), 
                            point3f(temp_glossy(6),temp_glossy(7),temp_glossy(8)));
@@ -412,7 +563,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
           dist = new BeckmannDistribution(temp_glossy(1), temp_glossy(2),roughness[i], has_roughness(i), true);
         }
         if(isimage(i)) {
-          tex = std::make_shared<MicrofacetTransmission>(std::make_shared<image_texture>(textures[i],nvec[i][0],nvec[i][1],nvec[i][2], 
+          tex = std::make_shared<MicrofacetTransmission>(std::make_shared<image_texture>(textures[i], 
                                                                                        temp_repeat[0], temp_repeat[1], 1.0), dist, 
                                                                                        point3f(temp_glossy(3), temp_glossy(4), temp_glossy(5)), 
                                                                                        point3f(temp_glossy(6),temp_glossy(7),temp_glossy(8)));
@@ -492,6 +643,18 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       center = vec3f(x(i), y(i), z(i));
     } else if(shape(i) == 17) {
       center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 18) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 19) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 20) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 21) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 22) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 23) {
+      center = vec3f(x(i), y(i), z(i));
     }
     
     Transform GroupTransform(temp_group_transform);
@@ -514,7 +677,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
     if (shape(i) == 1) {
       std::shared_ptr<hitable> entry;
       entry = std::make_shared<sphere>(vec3f(0,0,0), radius(i), tex, alpha[i], bump[i],
-                                       ObjToWorld, WorldToObj, isflipped(i));
+                                       ObjToWorld, WorldToObj, isflipped(i), robust_quadrics);
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -600,11 +763,23 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                         tex,
-                         tempvector(prop_len+1),
-                         shutteropen, shutterclose, bvh_type, rng,
-                         ObjToWorld,WorldToObj, isflipped(i));
+      if(mesh_key_count[mesh_keys[i]] > 1) {
+        std::shared_ptr<hitable>& base = shared_meshes[mesh_keys[i]];
+        if(!base) {
+          base = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                                           tex,
+                                           tempvector(prop_len+1),
+                                           shutteropen, shutterclose, bvh_type, numbercores, rng,
+                                           IdentityTransform, IdentityTransform, isflipped(i));
+        }
+        entry = std::make_shared<instance>(base, tex, ObjToWorld, WorldToObj, isflipped(i));
+      } else {
+        entry = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                           tex,
+                           tempvector(prop_len+1),
+                           shutteropen, shutterclose, bvh_type, numbercores, rng,
+                           ObjToWorld,WorldToObj, isflipped(i));
+      }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -617,16 +792,25 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      if(sigma(i) == 0) {
-        entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+      bool is_instanced = mesh_key_count[mesh_keys[i]] > 1;
+      std::shared_ptr<Transform> MeshToWorld = is_instanced ? IdentityTransform : ObjToWorld;
+      std::shared_ptr<Transform> WorldToMesh = is_instanced ? IdentityTransform : WorldToObj;
+      if(is_instanced && shared_meshes[mesh_keys[i]]) {
+        entry = shared_meshes[mesh_keys[i]];
+      } else if(sigma(i) == 0) {
+        entry = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
                             tempvector(prop_len+1), 
                             shutteropen, shutterclose, bvh_type, rng,
-                            ObjToWorld,WorldToObj, isflipped(i));
+                            MeshToWorld,WorldToMesh, isflipped(i));
       } else {
-        entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+        entry = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
                             tempvector(prop_len+1), sigma(i),
                             shutteropen, shutterclose, bvh_type, rng,
-                            ObjToWorld,WorldToObj, isflipped(i));
+                            MeshToWorld,WorldToMesh, isflipped(i));
+      }
+      if(is_instanced) {
+        shared_meshes[mesh_keys[i]] = entry;
+        entry = std::make_shared<instance>(entry, nullptr, ObjToWorld, WorldToObj, isflipped(i));
       }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
@@ -672,11 +856,23 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                          sigma(i),
-                          tempvector(prop_len+1), true,
-                          shutteropen, shutterclose, bvh_type, rng,
-                          ObjToWorld,WorldToObj, isflipped(i));
+      if(mesh_key_count[mesh_keys[i]] > 1) {
+        std::shared_ptr<hitable>& base = shared_meshes[mesh_keys[i]];
+        if(!base) {
+          base = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                                           sigma(i),
+                                           tempvector(prop_len+1), true,
+                                           shutteropen, shutterclose, bvh_type, rng,
+                                           IdentityTransform, IdentityTransform, isflipped(i));
+        }
+        entry = std::make_shared<instance>(base, nullptr, ObjToWorld, WorldToObj, isflipped(i));
+      } else {
+        entry = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                            sigma(i),
+                            tempvector(prop_len+1), true,
+                            shutteropen, shutterclose, bvh_type, rng,
+                            ObjToWorld,WorldToObj, isflipped(i));
+      }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -687,7 +883,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       list.add(entry);
     } else if (shape(i) == 13) {
       std::shared_ptr<hitable> entry = std::make_shared<cone>(radius(i), tempvector(prop_len+1), tex, alpha[i], bump[i],
-                                                              ObjToWorld,WorldToObj, isflipped(i));
+                                                              ObjToWorld,WorldToObj, isflipped(i), robust_quadrics);
       if(has_animation(i)) {
         entry = std::make_shared<AnimatedHitable>(entry, Animate);
       }
@@ -722,8 +918,19 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
     } else if (shape(i) == 15) {
       List temp_csg = csg_list(i);
       std::shared_ptr<ImplicitShape> shapes = parse_csg(temp_csg);
-      std::shared_ptr<hitable> entry = std::make_shared<csg>(tex, shapes,
+      std::shared_ptr<csg> csg_entry = std::make_shared<csg>(tex, shapes,
                                                              ObjToWorld,WorldToObj, isflipped(i));
+      List csg_bake = mesh_list(i);
+      int bake_resolution = as<int>(csg_bake["bake_resolution"]);
+      if(bake_resolution > 0) {
+        uint64_t key = HashCombine(hash_csg_description(temp_csg, 0), static_cast<uint64_t>(bake_resolution));
+        std::shared_ptr<sdf_cache>& field = baked_csg[key];
+        if(!field) {
+          field = bake_csg(*csg_entry, key, bake_resolution, mesh_cache_dir, numbercores);
+        }
+        csg_entry->baked = field;
+      }
+      std::shared_ptr<hitable> entry = csg_entry;
       if(has_animation(i)) {
         entry = std::make_shared<AnimatedHitable>(entry, Animate);
       }
@@ -732,11 +939,23 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<plymesh>(objfilename, objbasedirname, 
-                          tex,
-                          tempvector(prop_len+1),
-                          shutteropen, shutterclose, bvh_type, rng,
-                          ObjToWorld,WorldToObj, isflipped(i));
+      if(mesh_key_count[mesh_keys[i]] > 1) {
+        std::shared_ptr<hitable>& base = shared_meshes[mesh_keys[i]];
+        if(!base) {
+          base = std::make_shared<plymesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                                           tex,
+                                           tempvector(prop_len+1),
+                                           shutteropen, shutterclose, bvh_type, numbercores, rng,
+                                           IdentityTransform, IdentityTransform, isflipped(i));
+        }
+        entry = std::make_shared<instance>(base, tex, ObjToWorld, WorldToObj, isflipped(i));
+      } else {
+        entry = std::make_shared<plymesh>(objfilename, objbasedirname, mesh_cache_dir, 
+                            tex,
+                            tempvector(prop_len+1),
+                            shutteropen, shutterclose, bvh_type, numbercores, rng,
+                            ObjToWorld,WorldToObj, isflipped(i));
+      }
       if(entry == nullptr) {
         continue;
       }
@@ -750,9 +969,78 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       list.add(entry);
     } else if (shape(i) == 17) {
       List mesh_entry = mesh_list(i);
-      std::shared_ptr<hitable> entry = std::make_shared<mesh3d>(mesh_entry, tex,
-                                  shutteropen, shutterclose, bvh_type, rng,
-                                  ObjToWorld,WorldToObj, isflipped(i));
+      std::shared_ptr<hitable> entry;
+      if(mesh_entry.containsElementNamed("vb")) {
+        entry = std::make_shared<mesh3d>(mesh_entry, tex, bvh_type,
+                                         ObjToWorld,WorldToObj, isflipped(i));
+      } else {
+        entry = std::make_shared<mesh3d>(mesh_entry, tex,
+                                         shutteropen, shutterclose, bvh_type, rng,
+                                         ObjToWorld,WorldToObj, isflipped(i));
+      }
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 18) {
+      std::shared_ptr<hitable> entry;
+      std::string assetfilename = Rcpp::as<std::string>(fileinfo(i));
+      bool asset_materials = tempvector(prop_len+2) == 1;
+      if(mesh_key_count[mesh_keys[i]] > 1) {
+        std::shared_ptr<hitable>& base = shared_meshes[mesh_keys[i]];
+        if(!base) {
+          base = std::make_shared<mesh_asset>(assetfilename, tex, asset_materials,
+                                              tempvector(prop_len+1), bvh_type,
+                                              IdentityTransform, IdentityTransform, isflipped(i));
+        }
+        entry = std::make_shared<instance>(base, asset_materials ? nullptr : tex, 
+                                           ObjToWorld, WorldToObj, isflipped(i));
+      } else {
+        entry = std::make_shared<mesh_asset>(assetfilename, tex, asset_materials,
+                                             tempvector(prop_len+1), bvh_type,
+                                             ObjToWorld, WorldToObj, isflipped(i));
+      }
+      if(isvolume(i)) {
+        entry = std::make_shared<constant_medium>(entry, voldensity(i), 
+                                                  std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
+      }
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 19) {
+      List sphere_entry = mesh_list(i);
+      NumericMatrix spheres = as<NumericMatrix>(sphere_entry["spheres"]);
+      std::shared_ptr<hitable> entry = std::make_shared<sphere_set>(spheres.begin(), spheres.ncol(), tex, bvh_type,
+                                                                    ObjToWorld, WorldToObj, isflipped(i), robust_quadrics);
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 20) {
+      List heightfield_entry = mesh_list(i);
+      NumericMatrix heightmap = as<NumericMatrix>(heightfield_entry["heightmap"]);
+      std::shared_ptr<hitable> entry = std::make_shared<heightfield>(heightmap.begin(), heightmap.nrow(), heightmap.ncol(),
+                                                                     as<Float>(heightfield_entry["cell_size"]), tex,
+                                                                     ObjToWorld, WorldToObj, isflipped(i));
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 21) {
+      std::shared_ptr<hitable> entry = make_voxel_grid(mesh_list(i), tex, ObjToWorld, WorldToObj, isflipped(i));
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 22) {
+      std::shared_ptr<hitable> entry = make_curve_set(mesh_list(i), tex, bvh_type, ObjToWorld, WorldToObj, isflipped(i));
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 23) {
+      std::shared_ptr<hitable> entry = make_grid_medium(mesh_list(i), tempvector, ObjToWorld, WorldToObj);
       if(has_animation(i)) {
         entry = std::make_shared<AnimatedHitable>(entry, Animate);
       }
@@ -773,7 +1061,8 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
                           List& group_transform,
                           CharacterVector& fileinfo, CharacterVector& filebasedir,
                           TransformCache& transformCache,
-                          List& scale_list, List& mesh_list, int bvh_type, 
+                          List& scale_list, List& mesh_list, int bvh_type, bool robust_quadrics,
+                          std::string mesh_cache_dir, int numbercores,
                           List& animation_info, random_gen& rng) {
   NumericVector x = position_list["xvec"];
   NumericVector y = position_list["yvec"];
@@ -868,6 +1157,18 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     center = vec3f(x(i), y(i), z(i));
   } else if(shape(i) == 17) {
     center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 18) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 19) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 20) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 21) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 22) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 23) {
+    center = vec3f(x(i), y(i), z(i));
   }
   
   
@@ -893,7 +1194,7 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
   if(shape(i) == 1) {
     std::shared_ptr<hitable> entry;
     entry = std::make_shared<sphere>(vec3f(0,0,0), radius(i), tex, alpha,bump,
-                                     ObjToWorld,WorldToObj, false);
+                                     ObjToWorld,WorldToObj, false, robust_quadrics);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
     }
@@ -948,7 +1249,7 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     std::shared_ptr<hitable> entry;
     std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
     std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-    entry = std::make_shared<trimesh>(objfilename, objbasedirname,
+    entry = std::make_shared<trimesh>(objfilename, objbasedirname, mesh_cache_dir,
                         tempvector(prop_len+1),
                         shutteropen, shutterclose, bvh_type, rng, ObjToWorld,WorldToObj, false);
     if(has_animation(i)) {
@@ -986,7 +1287,7 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
   } else if (shape(i) == 13) {
     std::shared_ptr<hitable> entry = std::make_shared<cone>(radius(i), tempvector(prop_len+1), 
                                                             tex, alpha, bump, 
-                                                            ObjToWorld,WorldToObj, false);
+                                                            ObjToWorld,WorldToObj, false, robust_quadrics);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
     }
@@ -1017,20 +1318,73 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     std::shared_ptr<hitable> entry;
     std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
     std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-    entry = std::make_shared<plymesh>(objfilename, objbasedirname, 
+    entry = std::make_shared<plymesh>(objfilename, objbasedirname, mesh_cache_dir, 
                         tex,
                         tempvector(prop_len+1),
-                        shutteropen, shutterclose, bvh_type, rng, 
+                        shutteropen, shutterclose, bvh_type, numbercores, rng, 
                         ObjToWorld,WorldToObj, false);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
     }
     return(entry);
+  } else if (shape(i) == 18) {
+    std::shared_ptr<hitable> entry;
+    std::string assetfilename = Rcpp::as<std::string>(fileinfo(i));
+    entry = std::make_shared<mesh_asset>(assetfilename, tex, tempvector(prop_len+2) == 1,
+                                         tempvector(prop_len+1), bvh_type,
+                                         ObjToWorld,WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 19) {
+    List sphere_entry = mesh_list(i);
+    NumericMatrix spheres = as<NumericMatrix>(sphere_entry["spheres"]);
+    std::shared_ptr<hitable> entry = std::make_shared<sphere_set>(spheres.begin(), spheres.ncol(), tex, bvh_type,
+                                                                  ObjToWorld, WorldToObj, false, robust_quadrics);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 20) {
+    List heightfield_entry = mesh_list(i);
+    NumericMatrix heightmap = as<NumericMatrix>(heightfield_entry["heightmap"]);
+    std::shared_ptr<hitable> entry = std::make_shared<heightfield>(heightmap.begin(), heightmap.nrow(), heightmap.ncol(),
+                                                                   as<Float>(heightfield_entry["cell_size"]), tex,
+                                                                   ObjToWorld, WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 21) {
+    std::shared_ptr<hitable> entry = make_voxel_grid(mesh_list(i), tex, ObjToWorld, WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 22) {
+    std::shared_ptr<hitable> entry = make_curve_set(mesh_list(i), tex, bvh_type, ObjToWorld, WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 23) {
+    std::shared_ptr<hitable> entry = make_grid_medium(mesh_list(i), tempvector, ObjToWorld, WorldToObj);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
   } else {
     List mesh_entry = mesh_list(i);
-    std::shared_ptr<hitable> entry = std::make_shared<mesh3d>(mesh_entry, tex,
-                                shutteropen, shutterclose, bvh_type, rng, 
-                                ObjToWorld,WorldToObj, false);
+    std::shared_ptr<hitable> entry;
+    if(mesh_entry.containsElementNamed("vb")) {
+      entry = std::make_shared<mesh3d>(mesh_entry, tex, bvh_type,
+                                       ObjToWorld,WorldToObj, false);
+    } else {
+      entry = std::make_shared<mesh3d>(mesh_entry, tex,
+                                       shutteropen, shutterclose, bvh_type, rng, 
+                                       ObjToWorld,WorldToObj, false);
+    }
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
     }
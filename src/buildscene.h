@@ -19,12 +19,25 @@
 #include "cone.h"
 #include "curve.h"
 #include "csg.h"
+#include "sdfcache.h"
+#include "mappedfile.h"
 #include "plymesh.h"
 #include "mesh3d.h"
+#include "meshasset.h"
+#include "sphereset.h"
+#include "heightfield.h"
+#include "voxelgrid.h"
+#include "curveset.h"
+#include "gridmedium.h"
+#include "instance.h"
 #include "transform.h"
 #include "transformcache.h"
 #include <Rcpp.h>
 #include <memory>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
 using namespace Rcpp;
 
 
@@ -42,12 +55,12 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                                      NumericVector& noisephase, NumericVector& noiseintensity, List noisecolorlist,
                                      List& angle, 
                                      LogicalVector& isimage, LogicalVector has_alpha,
-                                     std::vector<Float* >& alpha_textures, std::vector<int* >& nveca,
-                                     std::vector<Float* >& textures, std::vector<int* >& nvec,
+                                     std::vector<std::shared_ptr<image_data> >& alpha_textures,
+                                     std::vector<std::shared_ptr<mipmap> >& textures,
                                      LogicalVector has_bump,
-                                     std::vector<Float* >& bump_textures, std::vector<int* >& nvecb,
+                                     std::vector<std::shared_ptr<image_data> >& bump_textures,
                                      NumericVector& bump_intensity,
-                                     std::vector<Float* >& roughness_textures,  std::vector<int* >& nvecr,
+                                     std::vector<std::shared_ptr<image_data> >& roughness_textures,
                                      LogicalVector has_roughness,
                                      NumericVector& lightintensity,
                                      LogicalVector& isflipped,
@@ -59,7 +72,8 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                                      List& scale_list, NumericVector& sigma,  List &glossyinfo,
                                      IntegerVector& shared_id_mat, LogicalVector& is_shared_mat,
                                      std::vector<std::shared_ptr<material> >* shared_materials, List& image_repeat_list,
-                                     List& csg_info, List& mesh_list, int bvh_type,
+                                     List& csg_info, List& mesh_list, int bvh_type, bool robust_quadrics,
+                                     std::string mesh_cache_dir, int numbercores,
                                      TransformCache &transformCache, List& animation_info,
                                      random_gen& rng);
 
@@ -73,7 +87,8 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
                                           List& group_transform,
                                           CharacterVector& fileinfo, CharacterVector& filebasedir,
                                           TransformCache& transformCache,
-                                          List& scale_list, List& mesh_list, int bvh_type, 
+                                          List& scale_list, List& mesh_list, int bvh_type, bool robust_quadrics,
+                                          std::string mesh_cache_dir, int numbercores,
                                           List& animation_info, random_gen& rng);
 
 #endif
@@ -1,4 +1,6 @@
 #include "bvh_node.h"
+#include "RcppThread.h"
+#include "bvhstats.h"
 
 
 #ifdef DEBUGBBOX
@@ -8,57 +10,140 @@ using namespace std;
 #endif
 
 
+//Number of shutter segments stored for nodes containing moving objects
+constexpr int nMotionSegments = 4;
+
+aabb motion_bounds::Bounds(Float t0, Float t1) const {
+  int n = static_cast<int>(boxes.size());
+  int first = static_cast<int>(std::floor((t0 - time0) / (time1 - time0) * n));
+  int last = static_cast<int>(std::ceil((t1 - time0) / (time1 - time0) * n)) - 1;
+  first = first < 0 ? 0 : (first >= n ? n - 1 : first);
+  last = last < first ? first : (last >= n ? n - 1 : last);
+  aabb b = boxes[first];
+  for(int i = first + 1; i <= last; i++) {
+    b = surrounding_box(b, boxes[i]);
+  }
+  return(b);
+}
+
+//A degenerate interval asks for the bounds over all time
 bool bvh_node::bounding_box(Float t0, Float t1, aabb& b) const {
-  b = box;
+  if(motion && t1 > t0) {
+    b = motion->Bounds(t0, t1);
+  } else {
+    b = box;
+  }
   return(true);
 }
 
+static bool has_motion(const hitable* object) {
+  const bvh_node* node = dynamic_cast<const bvh_node*>(object);
+  if(node) {
+    return(node->motion != nullptr);
+  }
+  return(dynamic_cast<const AnimatedHitable*>(object) != nullptr);
+}
+
+void bvh_node::update_motion_bounds(Float time0, Float time1) {
+  if(!(time1 > time0) || !(has_motion(left.get()) || has_motion(right.get()))) {
+    motion.reset();
+    return;
+  }
+  if(!motion) {
+    motion.reset(new motion_bounds);
+  }
+  motion->time0 = time0;
+  motion->time1 = time1;
+  motion->boxes.resize(nMotionSegments);
+  Float dt = (time1 - time0) / nMotionSegments;
+  for(int i = 0; i < nMotionSegments; i++) {
+    Float seg0 = time0 + i * dt;
+    Float seg1 = i == nMotionSegments - 1 ? time1 : seg0 + dt;
+    aabb box_left, box_right;
+    left->bounding_box(seg0, seg1, box_left);
+    right->bounding_box(seg0, seg1, box_right);
+    motion->boxes[i] = surrounding_box(box_left, box_right);
+  }
+}
+
 bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  if(hit_deferred(r, t_min, t_max, rec, rng)) {
+    finish_hit(r, rec);
+    return(true);
+  }
+  return(false);
+}
+
+bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  if(hit_deferred(r, t_min, t_max, rec, sampler)) {
+    finish_hit(r, rec);
+    return(true);
+  }
+  return(false);
+}
+
+bool bvh_node::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
 #ifndef DEBUGBVH
-  if(box.hit(r, t_min, t_max, rng)) {
-    if(left->hit(r,t_min,t_max,rec, rng)) {
-      right->hit(r,t_min,rec.t,rec, rng);
+  aabb& node_box = motion ? motion->BoxAt(r.time()) : box;
+  if(node_box.hit(r, t_min, t_max, rng)) {
+    if(TraversalStats::Counting()) {
+      TraversalStats::CountNode(left.get(), right.get());
+    }
+    if(left->hit_deferred(r,t_min,t_max,rec, rng)) {
+      right->hit_deferred(r,t_min,rec.t,rec, rng);
       return(true);
     } else {
-      return(right->hit(r,t_min,t_max,rec, rng));
+      return(right->hit_deferred(r,t_min,t_max,rec, rng));
     }
   }
   return(false);
 #endif
 #ifdef DEBUGBVH
-  if(box.hit(r, t_min, t_max, rng)) {
+  aabb& node_box = motion ? motion->BoxAt(r.time()) : box;
+  if(node_box.hit(r, t_min, t_max, rng)) {
+    if(TraversalStats::Counting()) {
+      TraversalStats::CountNode(left.get(), right.get());
+    }
     rec.bvh_nodes += 1.0;
-    if(left->hit(r,t_min,t_max,rec, rng)) {
-      right->hit(r,t_min,rec.t,rec, rng);
+    if(left->hit_deferred(r,t_min,t_max,rec, rng)) {
+      right->hit_deferred(r,t_min,rec.t,rec, rng);
       return(true);
     } else {
-      return(right->hit(r,t_min,t_max,rec, rng));
+      return(right->hit_deferred(r,t_min,t_max,rec, rng));
     }
   }
   return(false);
 #endif
 }
 
-bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+bool bvh_node::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
 #ifndef DEBUGBVH
-  if(box.hit(r, t_min, t_max, sampler)) {
-    if(left->hit(r,t_min,t_max,rec, sampler)) {
-      right->hit(r,t_min,rec.t,rec, sampler);
+  aabb& node_box = motion ? motion->BoxAt(r.time()) : box;
+  if(node_box.hit(r, t_min, t_max, sampler)) {
+    if(TraversalStats::Counting()) {
+      TraversalStats::CountNode(left.get(), right.get());
+    }
+    if(left->hit_deferred(r,t_min,t_max,rec, sampler)) {
+      right->hit_deferred(r,t_min,rec.t,rec, sampler);
       return(true);
     } else {
-      return(right->hit(r,t_min,t_max,rec, sampler));
+      return(right->hit_deferred(r,t_min,t_max,rec, sampler));
     }
   }
   return(false);
 #endif
 #ifdef DEBUGBVH
-  if(box.hit(r, t_min, t_max, sampler)) {
+  aabb& node_box = motion ? motion->BoxAt(r.time()) : box;
+  if(node_box.hit(r, t_min, t_max, sampler)) {
+    if(TraversalStats::Counting()) {
+      TraversalStats::CountNode(left.get(), right.get());
+    }
     rec.bvh_nodes += 1.0;
-    if(left->hit(r,t_min,t_max,rec, sampler)) {
-      right->hit(r,t_min,rec.t,rec, sampler);
+    if(left->hit_deferred(r,t_min,t_max,rec, sampler)) {
+      right->hit_deferred(r,t_min,rec.t,rec, sampler);
       return(true);
     } else {
-      return(right->hit(r,t_min,t_max,rec, sampler));
+      return(right->hit_deferred(r,t_min,t_max,rec, sampler));
     }
   }
   return(false);
@@ -263,9 +348,159 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
   if(!left->bounding_box(time0,time1,box_left) || !right->bounding_box(time0,time1,box_right)) {
   }
   box = surrounding_box(box_left,box_right);
+  update_motion_bounds(time0, time1);
 }
-  
-  
+
+bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
+                   size_t start, size_t end, Float time0, Float time1,
+                   const uint32_t*& splits, const uint32_t* splits_end) {
+  sah = false;
+#ifdef DEBUGBBOX
+  depth = 0;
+#endif
+  size_t n = end - start;
+  if(n == 0) {
+    throw std::runtime_error("BVH layout references an empty node");
+  }
+  if (n == 1) {
+    left = right = l[start];
+  } else if (n == 2) {
+    left = l[start];
+    right = l[start+1];
+  } else {
+    if(splits == splits_end) {
+      throw std::runtime_error("BVH layout ended early");
+    }
+    size_t left_count = *splits++;
+    if(left_count == 0 || left_count >= n) {
+      throw std::runtime_error("Invalid BVH layout split");
+    }
+    left = std::make_shared<bvh_node>(l, start, start + left_count, time0, time1, splits, splits_end);
+    right = std::make_shared<bvh_node>(l, start + left_count, end, time0, time1, splits, splits_end);
+  }
+  aabb box_left, box_right;
+  left->bounding_box(time0,time1,box_left);
+  right->bounding_box(time0,time1,box_right);
+  box = surrounding_box(box_left,box_right);
+  update_motion_bounds(time0, time1);
+}
+
+size_t bvh_node::export_layout(std::vector<const hitable*>& order, std::vector<uint32_t>& splits) const {
+  const bvh_node* left_node = dynamic_cast<const bvh_node*>(left.get());
+  const bvh_node* right_node = dynamic_cast<const bvh_node*>(right.get());
+  if(left_node && right_node) {
+    size_t split_index = splits.size();
+    splits.push_back(0);
+    size_t left_count = left_node->export_layout(order, splits);
+    splits[split_index] = static_cast<uint32_t>(left_count);
+    return(left_count + right_node->export_layout(order, splits));
+  }
+  order.push_back(left.get());
+  if(left == right) {
+    return(1);
+  }
+  order.push_back(right.get());
+  return(2);
+}
+
+//Refits `levels` levels of the tree below `node` (a negative value refits the whole subtree).
+//Nodes below that depth are assumed to already be up to date.
+static void refit_levels(bvh_node* node, Float time0, Float time1, int levels) {
+  if(levels == 0) {
+    return;
+  }
+  bvh_node* left_node = dynamic_cast<bvh_node*>(node->left.get());
+  bvh_node* right_node = dynamic_cast<bvh_node*>(node->right.get());
+  if(left_node) {
+    refit_levels(left_node, time0, time1, levels - 1);
+  }
+  if(right_node && right_node != left_node) {
+    refit_levels(right_node, time0, time1, levels - 1);
+  }
+  aabb box_left, box_right;
+  node->left->bounding_box(time0,time1,box_left);
+  node->right->bounding_box(time0,time1,box_right);
+  node->box = surrounding_box(box_left,box_right);
+  node->update_motion_bounds(time0, time1);
+}
+
+static void collect_subtrees(bvh_node* node, int levels, std::vector<bvh_node*>& subtrees) {
+  if(levels == 0) {
+    subtrees.push_back(node);
+    return;
+  }
+  bvh_node* left_node = dynamic_cast<bvh_node*>(node->left.get());
+  bvh_node* right_node = dynamic_cast<bvh_node*>(node->right.get());
+  if(left_node) {
+    collect_subtrees(left_node, levels - 1, subtrees);
+  }
+  if(right_node && right_node != left_node) {
+    collect_subtrees(right_node, levels - 1, subtrees);
+  }
+}
+
+void bvh_node::refit(Float time0, Float time1) {
+  refit_levels(this, time0, time1, -1);
+}
+
+void bvh_node::refit(Float time0, Float time1, int numbercores) {
+  if(numbercores <= 1) {
+    refit(time0, time1);
+    return;
+  }
+  //Split the tree into roughly four subtrees per thread to balance uneven subtree sizes
+  int levels = 0;
+  while((1 << levels) < 4 * numbercores && levels < 16) {
+    levels++;
+  }
+  std::vector<bvh_node*> subtrees;
+  collect_subtrees(this, levels, subtrees);
+  RcppThread::ThreadPool pool(numbercores);
+  for(size_t i = 0; i < subtrees.size(); i++) {
+    bvh_node* subtree = subtrees[i];
+    pool.push([subtree, time0, time1] () {
+      subtree->refit(time0, time1);
+    });
+  }
+  pool.join();
+  refit_levels(this, time0, time1, levels);
+}
+
+//Traversal and primitive intersection are weighted equally, as in the SAH builder
+static Float sah_node_cost(const bvh_node* node) {
+  Float area = node->box.surface_area();
+  Float cost = area;
+  const bvh_node* left_node = dynamic_cast<const bvh_node*>(node->left.get());
+  const bvh_node* right_node = dynamic_cast<const bvh_node*>(node->right.get());
+  cost += left_node ? sah_node_cost(left_node) : area;
+  if(node->right != node->left) {
+    cost += right_node ? sah_node_cost(right_node) : area;
+  }
+  return(cost);
+}
+
+Float bvh_node::sah_cost() const {
+  Float area = box.surface_area();
+  if(area <= 0) {
+    return(0);
+  }
+  return(sah_node_cost(this) / area);
+}
+
+void bvh_node::primitives(std::vector<std::shared_ptr<hitable> >& prims) const {
+  const bvh_node* left_node = dynamic_cast<const bvh_node*>(left.get());
+  const bvh_node* right_node = dynamic_cast<const bvh_node*>(right.get());
+  if(left_node && right_node) {
+    left_node->primitives(prims);
+    right_node->primitives(prims);
+    return;
+  }
+  prims.push_back(left);
+  if(left != right) {
+    prims.push_back(right);
+  }
+}
+
 Float bvh_node::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
   return(0.5*left->pdf_value(o,v, rng, time) + 0.5*right->pdf_value(o,v, rng, time));
 }
@@ -5,6 +5,22 @@
 #include "aabb.h"
 #include <Rcpp.h>
 #include "material.h"
+#include <memory>
+
+//Bounds of a node over equal segments of the shutter interval. Only nodes with moving objects
+//below them store these, so a ray only has to enter the bounds for the segment holding its time
+//rather than the union of the motion over the whole shutter.
+struct motion_bounds {
+  Float time0, time1;
+  std::vector<aabb> boxes;
+  aabb& BoxAt(Float time) {
+    int segment = static_cast<int>((time - time0) / (time1 - time0) * boxes.size());
+    segment = segment < 0 ? 0 : segment;
+    segment = segment >= static_cast<int>(boxes.size()) ? static_cast<int>(boxes.size()) - 1 : segment;
+    return(boxes[segment]);
+  }
+  aabb Bounds(Float t0, Float t1) const;
+};
 
 class bvh_node : public hitable {
   public:
@@ -31,9 +47,29 @@ class bvh_node : public hitable {
              size_t start, size_t end,
              Float time0, Float time1, int bvh_type, int depth, random_gen &rng);
 #endif
+    //Rebuilds a tree from a layout written by export_layout(): the primitives must already be in
+    //leaf order, and `splits` holds the left child count of every interior node in pre-order.
+    bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
+             size_t start, size_t end, Float time0, Float time1,
+             const uint32_t*& splits, const uint32_t* splits_end);
+    size_t export_layout(std::vector<const hitable*>& order, std::vector<uint32_t>& splits) const;
+
+    //Recomputes the bounds of every node over [time0, time1] bottom-up from the current bounds of
+    //the primitives, keeping the tree topology. The threaded version refits independent subtrees
+    //in parallel before updating the top of the tree.
+    void refit(Float time0, Float time1);
+    void refit(Float time0, Float time1, int numbercores);
+    //Surface area heuristic cost of the tree, relative to the surface area of the root
+    Float sah_cost() const;
+    //Collects the primitives referenced by the tree (used to rebuild a degraded tree)
+    void primitives(std::vector<std::shared_ptr<hitable> >& prims) const;
+    //Recomputes the per-segment bounds from the children (or drops them if nothing below moves)
+    void update_motion_bounds(Float time0, Float time1);
 
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
 
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
     
@@ -48,6 +84,7 @@ class bvh_node : public hitable {
     std::shared_ptr<hitable> left;
     std::shared_ptr<hitable> right;
     aabb box;
+    std::unique_ptr<motion_bounds> motion;
     bool sah;
 #ifdef DEBUGBBOX
     int depth;
@@ -0,0 +1,253 @@
+#include "bvhstats.h"
+#include "bvh_node.h"
+#include "hitablelist.h"
+#include "trimesh.h"
+#include "plymesh.h"
+#include "mesh3d.h"
+#include "meshasset.h"
+#include "sphereset.h"
+#include "heightfield.h"
+#include "voxelgrid.h"
+#include "curveset.h"
+#include "gridmedium.h"
+#include "instance.h"
+#include "constant.h"
+#include <unordered_set>
+
+bool TraversalStats::enabled = false;
+std::atomic<uint64_t> TraversalStats::rays(0);
+std::atomic<uint64_t> TraversalStats::nodes_visited(0);
+std::atomic<uint64_t> TraversalStats::primitives_tested(0);
+std::atomic<uint64_t> TraversalStats::grid_steps(0);
+thread_local int TraversalStats::paused = 0;
+
+void TraversalStats::Reset() {
+  rays.store(0);
+  nodes_visited.store(0);
+  primitives_tested.store(0);
+  grid_steps.store(0);
+}
+
+void TraversalStats::CountNode(const hitable* left, const hitable* right) {
+  nodes_visited.fetch_add(1, std::memory_order_relaxed);
+  uint64_t prims = dynamic_cast<const bvh_node*>(left) ? 0 : 1;
+  if(right != left && !dynamic_cast<const bvh_node*>(right)) {
+    prims++;
+  }
+  if(prims > 0) {
+    primitives_tested.fetch_add(prims, std::memory_order_relaxed);
+  }
+}
+
+struct BVHStatsAccumulator {
+  BVHStatsAccumulator() : nodes(0), leaves(0), primitives(0), max_depth(0),
+    overlap_sum(0), overlap_count(0), memory(0) {}
+  std::unordered_set<const hitable*> visited;
+  size_t nodes;
+  size_t leaves;
+  size_t primitives;
+  size_t max_depth;
+  std::vector<int> leaf_depths;
+  std::vector<int> leaf_sizes;
+  double overlap_sum;
+  size_t overlap_count;
+  size_t memory;
+};
+
+static void add_count(std::vector<int>& histogram, size_t index) {
+  if(histogram.size() <= index) {
+    histogram.resize(index + 1, 0);
+  }
+  histogram[index]++;
+}
+
+static Float overlap_area(const aabb& a, const aabb& b) {
+  point3f lo(std::fmax(a.min().x(), b.min().x()), std::fmax(a.min().y(), b.min().y()),
+             std::fmax(a.min().z(), b.min().z()));
+  point3f hi(std::fmin(a.max().x(), b.max().x()), std::fmin(a.max().y(), b.max().y()),
+             std::fmin(a.max().z(), b.max().z()));
+  if(lo.x() > hi.x() || lo.y() > hi.y() || lo.z() > hi.z()) {
+    return(0);
+  }
+  return(aabb(lo, hi).surface_area());
+}
+
+static void walk_node(const bvh_node* node, size_t depth, BVHStatsAccumulator& acc);
+
+//Walks a flat BVH of compact_bvh_node (compact meshes and sphere sets)
+static void walk_flat(const std::vector<compact_bvh_node>& nodes, uint32_t index, size_t depth,
+                      BVHStatsAccumulator& acc) {
+  const compact_bvh_node& node = nodes[index];
+  acc.nodes++;
+  acc.max_depth = std::max(acc.max_depth, depth);
+  if(node.count > 0) {
+    acc.leaves++;
+    acc.primitives += node.count;
+    add_count(acc.leaf_depths, depth);
+    add_count(acc.leaf_sizes, node.count);
+    return;
+  }
+  const compact_bvh_node& left = nodes[index + 1];
+  const compact_bvh_node& right = nodes[node.offset];
+  Float area = aabb(node.bounds[0], node.bounds[1]).surface_area();
+  if(area > 0) {
+    acc.overlap_sum += overlap_area(aabb(left.bounds[0], left.bounds[1]),
+                                    aabb(right.bounds[0], right.bounds[1])) / area;
+    acc.overlap_count++;
+  }
+  walk_flat(nodes, index + 1, depth + 1, acc);
+  walk_flat(nodes, node.offset, depth + 1, acc);
+}
+
+static void walk_compact(const compact_mesh* mesh, size_t depth, BVHStatsAccumulator& acc) {
+  if(!mesh || !acc.visited.insert(mesh).second) {
+    return;
+  }
+  acc.memory += sizeof(compact_mesh) + mesh->memory_bytes();
+  if(!mesh->nodes.empty()) {
+    walk_flat(mesh->nodes, 0, depth, acc);
+  }
+}
+
+static void walk_sphere_set(const sphere_set* set, size_t depth, BVHStatsAccumulator& acc) {
+  if(!set || !acc.visited.insert(set).second) {
+    return;
+  }
+  acc.memory += sizeof(sphere_set) + set->memory_bytes();
+  if(!set->nodes.empty()) {
+    walk_flat(set->nodes, 0, depth, acc);
+  }
+}
+
+static void walk_curve_set(const curve_set* set, size_t depth, BVHStatsAccumulator& acc) {
+  if(!set || !acc.visited.insert(set).second) {
+    return;
+  }
+  acc.memory += sizeof(curve_set) + set->memory_bytes();
+  if(!set->nodes.empty()) {
+    walk_flat(set->nodes, 0, depth, acc);
+  }
+}
+
+static void walk_hitable(const hitable* object, size_t depth, BVHStatsAccumulator& acc) {
+  if(!object) {
+    return;
+  }
+  if(const bvh_node* node = dynamic_cast<const bvh_node*>(object)) {
+    walk_node(node, depth, acc);
+  } else if(const trimesh* mesh = dynamic_cast<const trimesh*>(object)) {
+    if(mesh->compact_tri_mesh) {
+      walk_compact(mesh->compact_tri_mesh.get(), depth, acc);
+    } else {
+      walk_node(mesh->tri_mesh_bvh.get(), depth, acc);
+    }
+  } else if(const plymesh* mesh = dynamic_cast<const plymesh*>(object)) {
+    walk_compact(mesh->ply_mesh.get(), depth, acc);
+  } else if(const mesh_asset* mesh = dynamic_cast<const mesh_asset*>(object)) {
+    walk_compact(mesh->asset_mesh.get(), depth, acc);
+  } else if(const compact_mesh* mesh = dynamic_cast<const compact_mesh*>(object)) {
+    walk_compact(mesh, depth, acc);
+  } else if(const mesh3d* mesh = dynamic_cast<const mesh3d*>(object)) {
+    if(mesh->compact_mesh3d) {
+      walk_compact(mesh->compact_mesh3d.get(), depth, acc);
+    } else {
+      walk_node(mesh->mesh_bvh.get(), depth, acc);
+    }
+  } else if(const sphere_set* set = dynamic_cast<const sphere_set*>(object)) {
+    walk_sphere_set(set, depth, acc);
+  } else if(const curve_set* set = dynamic_cast<const curve_set*>(object)) {
+    walk_curve_set(set, depth, acc);
+  } else if(const heightfield* field = dynamic_cast<const heightfield*>(object)) {
+    if(acc.visited.insert(field).second) {
+      acc.memory += sizeof(heightfield) + field->memory_bytes();
+      acc.primitives++;
+    }
+  } else if(const voxel_grid* grid = dynamic_cast<const voxel_grid*>(object)) {
+    if(acc.visited.insert(grid).second) {
+      acc.memory += sizeof(voxel_grid) + grid->memory_bytes();
+      acc.primitives++;
+    }
+  } else if(const grid_medium* medium = dynamic_cast<const grid_medium*>(object)) {
+    if(acc.visited.insert(medium).second) {
+      acc.memory += sizeof(grid_medium) + medium->memory_bytes();
+      acc.primitives++;
+    }
+  } else if(const instance* inst = dynamic_cast<const instance*>(object)) {
+    walk_hitable(inst->object.get(), depth, acc);
+  } else if(const AnimatedHitable* animated = dynamic_cast<const AnimatedHitable*>(object)) {
+    walk_hitable(animated->primitive.get(), depth, acc);
+  } else if(const constant_medium* medium = dynamic_cast<const constant_medium*>(object)) {
+    walk_hitable(medium->boundary.get(), depth, acc);
+  } else if(const hitable_list* list = dynamic_cast<const hitable_list*>(object)) {
+    for(size_t i = 0; i < list->objects.size(); i++) {
+      walk_hitable(list->objects[i].get(), depth, acc);
+    }
+  } else {
+    acc.primitives++;
+  }
+}
+
+static void walk_node(const bvh_node* node, size_t depth, BVHStatsAccumulator& acc) {
+  if(!node || !acc.visited.insert(node).second) {
+    return;
+  }
+  acc.nodes++;
+  acc.memory += sizeof(bvh_node);
+  if(node->motion) {
+    acc.memory += sizeof(motion_bounds) + node->motion->boxes.size() * sizeof(aabb);
+  }
+  acc.max_depth = std::max(acc.max_depth, depth);
+  const bvh_node* left_node = dynamic_cast<const bvh_node*>(node->left.get());
+  const bvh_node* right_node = dynamic_cast<const bvh_node*>(node->right.get());
+  if(left_node && right_node) {
+    Float area = node->box.surface_area();
+    if(area > 0) {
+      acc.overlap_sum += overlap_area(left_node->box, right_node->box) / area;
+      acc.overlap_count++;
+    }
+    walk_node(left_node, depth + 1, acc);
+    walk_node(right_node, depth + 1, acc);
+    return;
+  }
+  acc.leaves++;
+  add_count(acc.leaf_depths, depth);
+  add_count(acc.leaf_sizes, node->left == node->right ? 1 : 2);
+  walk_hitable(node->left.get(), depth + 1, acc);
+  if(node->right != node->left) {
+    walk_hitable(node->right.get(), depth + 1, acc);
+  }
+}
+
+Rcpp::List BVHStatistics(const std::shared_ptr<hitable>& scene, const BVHBuildTimes& times) {
+  BVHStatsAccumulator acc;
+  walk_hitable(scene.get(), 0, acc);
+  const bvh_node* root = dynamic_cast<const bvh_node*>(scene.get());
+  
+  //Histograms are indexed from zero (depth) and one (leaf size)
+  Rcpp::IntegerVector leaf_depths(acc.leaf_depths.begin(), acc.leaf_depths.end());
+  Rcpp::IntegerVector leaf_sizes(acc.leaf_sizes.size() > 1 ? acc.leaf_sizes.begin() + 1 : acc.leaf_sizes.end(),
+                                 acc.leaf_sizes.end());
+  Rcpp::NumericVector build_time = Rcpp::NumericVector::create(Rcpp::_["scene"] = times.scene,
+                                                               Rcpp::_["importance_sampling"] = times.importance_sampling,
+                                                               Rcpp::_["render"] = times.render);
+  double rays = static_cast<double>(TraversalStats::rays.load());
+  double nodes_visited = static_cast<double>(TraversalStats::nodes_visited.load());
+  double primitives_tested = static_cast<double>(TraversalStats::primitives_tested.load());
+  Rcpp::List traversal = Rcpp::List::create(Rcpp::_["rays"] = rays,
+                                            Rcpp::_["nodes_visited"] = nodes_visited,
+                                            Rcpp::_["primitives_tested"] = primitives_tested,
+                                            Rcpp::_["grid_steps"] = static_cast<double>(TraversalStats::grid_steps.load()),
+                                            Rcpp::_["nodes_per_ray"] = rays > 0 ? nodes_visited / rays : 0.0,
+                                            Rcpp::_["primitives_per_ray"] = rays > 0 ? primitives_tested / rays : 0.0);
+  return(Rcpp::List::create(Rcpp::_["nodes"] = static_cast<double>(acc.nodes),
+                            Rcpp::_["leaves"] = static_cast<double>(acc.leaves),
+                            Rcpp::_["primitives"] = static_cast<double>(acc.primitives),
+                            Rcpp::_["max_depth"] = static_cast<int>(acc.max_depth),
+                            Rcpp::_["leaf_depth_histogram"] = leaf_depths,
+                            Rcpp::_["leaf_size_histogram"] = leaf_sizes,
+                            Rcpp::_["sah_cost"] = root ? static_cast<double>(root->sah_cost()) : 0.0,
+                            Rcpp::_["overlap_ratio"] = acc.overlap_count > 0 ? acc.overlap_sum / acc.overlap_count : 0.0,
+                            Rcpp::_["memory_bytes"] = static_cast<double>(acc.memory),
+                            Rcpp::_["build_time"] = build_time,
+                            Rcpp::_["traversal"] = traversal));
+}
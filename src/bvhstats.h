@@ -0,0 +1,53 @@
+#ifndef BVHSTATSH
+#define BVHSTATSH
+
+#include "hitable.h"
+#include <Rcpp.h>
+#include <atomic>
+#include <cstdint>
+
+//Traversal counters for render_scene(bvh_statistics = TRUE). They are only updated while
+//`enabled` is set, and use relaxed atomics since they are only read once rendering has finished.
+//Traversals made while evaluating light sampling pdfs are not counted (see Pause), so the per ray
+//figures describe the rays traced by the integrator.
+struct TraversalStats {
+  static bool enabled;
+  static std::atomic<uint64_t> rays;
+  static std::atomic<uint64_t> nodes_visited;
+  static std::atomic<uint64_t> primitives_tested;
+  //Bricks, voxels and density lookups visited by the voxel grid and volume grid DDAs, which are
+  //kept apart from the BVH counters
+  static std::atomic<uint64_t> grid_steps;
+  //Nesting depth of Pause objects on this thread
+  static thread_local int paused;
+  static void Reset();
+  static bool Counting() {
+    return(enabled && paused == 0);
+  }
+  //Stops counting on this thread for the lifetime of the object
+  struct Pause {
+    Pause() {paused++;}
+    ~Pause() {paused--;}
+  };
+  //Counts a BVH node whose box was hit, and the non-BVH children it is about to test
+  static void CountNode(const hitable* left, const hitable* right);
+  //Counts a ray cast into the scene by the integrator or a debug channel
+  static void CountRay() {
+    if(Counting()) {
+      rays.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+//Build timings (in seconds) recorded by render_scene_rcpp
+struct BVHBuildTimes {
+  double scene;
+  double importance_sampling;
+  double render;
+};
+
+//Walks the scene BVH (including the BVHs of meshes, instances, animated and volume objects, with
+//shared meshes counted once) and returns its statistics along with the traversal counters.
+Rcpp::List BVHStatistics(const std::shared_ptr<hitable>& scene, const BVHBuildTimes& times);
+
+#endif
@@ -1,6 +1,7 @@
 #include "color.h"
 #include "RcppThread.h"
 #include "mathinline.h"
+#include "bvhstats.h"
 
 // #include "fstream"
 // #define DEBUG
@@ -22,10 +23,14 @@ point3f color(const ray& r, hitable *world, hitable_list *hlist,
   for(size_t i = 0; i < max_depth; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
+      //Continuing rays start where this ray's cone leaves off
+      Float cone_width = SetTextureFootprint(r2, hrec);
       if(hrec.alpha_miss) {
         r2.A = hrec.p;
+        r2.cone_width = cone_width;
         continue;
       }
       emit_color = throughput * hrec.mat_ptr->emitted(r2, hrec, hrec.u, hrec.v, hrec.p, is_invisible);
@@ -33,6 +38,7 @@ point3f color(const ray& r, hitable *world, hitable_list *hlist,
       //If so, generate new ray with intersection point and continue ray
       if(is_invisible && !diffuse_bounce) {
         r2.A = OffsetRayOrigin(hrec.p, hrec.pError, hrec.normal, r2.direction());
+        r2.cone_width = cone_width;
         continue;
       }
       final_color += emit_color;
@@ -57,7 +63,11 @@ point3f color(const ray& r, hitable *world, hitable_list *hlist,
       //generates scatter record and sends out new ray, otherwise exits out with accumulated color
       if(hrec.mat_ptr->scatter(r2, hrec, srec, sampler)) { 
         if(srec.is_specular) { //returns specular ray
+          Float cone_spread = r2.cone_spread;
           r2 = srec.specular_ray;
+          //Surface curvature is ignored, so the cone keeps spreading at the same angle
+          r2.cone_width = cone_width;
+          r2.cone_spread = cone_spread;
           throughput *= srec.attenuation;
           continue;
         }
@@ -76,7 +86,10 @@ point3f color(const ray& r, hitable *world, hitable_list *hlist,
           dir = p.generate(rng, diffuse_bounce, r2.time()); //scatters a ray from hit point to random direction
         }
         
+        Float cone_spread = r2.cone_spread;
         r2 = ray(OffsetRayOrigin(hrec.p, hrec.pError, hrec.normal, dir), dir, r2.pri_stack, r2.time());
+        r2.cone_width = cone_width;
+        r2.cone_spread = cone_spread;
         
         pdf_val = p.value(dir, rng, r2.time()); //generates a pdf value based the intersection point and the mixture pdf
 
@@ -0,0 +1,144 @@
+#ifndef COMPACTBVHH
+#define COMPACTBVHH
+
+#include "aabb.h"
+#include "ray.h"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+//Node of a flat BVH (used by compact_mesh, sphere_set and curve_set). Interior nodes are followed
+//directly by their first child and store the index of the second; leaves store a contiguous range
+//of primitives.
+struct compact_bvh_node {
+  point3f bounds[2];
+  uint32_t offset; //Second child (interior nodes) or first primitive (leaves; compact_mesh
+                   //leaves refer to a triangle packet instead)
+  uint16_t count;  //Number of primitives, zero for interior nodes
+  uint16_t axis;   //Split axis, used to visit the nearer child first
+};
+
+//SAH splits below this depth fall back to median splits, which add at most 30 further levels for
+//32-bit primitive counts, so the tree always fits the traversal stack
+constexpr int kMaxSahDepth = 64;
+constexpr int kTraversalStackSize = 128;
+
+//Slab test of a ray (with origin `o`) against the bounds of a node
+inline bool node_hit(const compact_bvh_node& node, const ray& r, const point3f& o, Float tmin, Float tmax) {
+  Float txmin, txmax, tymin, tymax, tzmin, tzmax;
+  txmin = (node.bounds[  r.sign[0]].x()-o.x()) * r.inv_dir.x();
+  txmax = (node.bounds[1-r.sign[0]].x()-o.x()) * r.inv_dir_pad.x();
+  tymin = (node.bounds[  r.sign[1]].y()-o.y()) * r.inv_dir.y();
+  tymax = (node.bounds[1-r.sign[1]].y()-o.y()) * r.inv_dir_pad.y();
+  tzmin = (node.bounds[  r.sign[2]].z()-o.z()) * r.inv_dir.z();
+  tzmax = (node.bounds[1-r.sign[2]].z()-o.z()) * r.inv_dir_pad.z();
+  tmin = ffmax(tzmin, ffmax(tymin, ffmax(txmin, tmin)));
+  tmax = ffmin(tzmax, ffmin(tymax, ffmin(txmax, tmax)));
+  return(tmin <= tmax);
+}
+
+//Bounds and centroid bounds of the primitives in order[start, end), where `prim_bounds(i)` gives
+//the bounds of primitive i. Returns the axis of largest centroid extent.
+template<class Bounds>
+int CompactRangeBounds(const Bounds& prim_bounds, const std::vector<uint32_t>& order, size_t start, size_t end,
+                       aabb& bounds, aabb& centroid_bounds) {
+  for(size_t i = start; i < end; i++) {
+    aabb pb = prim_bounds(order[i]);
+    bounds = surrounding_box(bounds, pb);
+    centroid_bounds = surrounding_box(centroid_bounds, pb.centroid);
+  }
+  vec3f extent = centroid_bounds.max() - centroid_bounds.min();
+  int axis = extent.x() > extent.y() ? 0 : 1;
+  if(axis == 0) {
+    axis = extent.x() > extent.z() ? 0 : 2;
+  } else {
+    axis = extent.y() > extent.z() ? 1 : 2;
+  }
+  return(axis);
+}
+
+//Appends a depth-first BVH over order[start, end) to `nodes`, reordering `order` so each leaf
+//covers a contiguous range of at most `max_leaf` primitives. With `bvh_type` 1 nodes are split at
+//the cheapest of 12 SAH buckets, otherwise at the centroid median (rounded to whole leaves). If
+//`splits` is given, the size of each interior node's first child is appended in build order.
+//Returns the index of the root.
+template<class Bounds>
+uint32_t BuildCompactBVH(std::vector<compact_bvh_node>& nodes, std::vector<uint32_t>& order,
+                         size_t start, size_t end, size_t max_leaf, int bvh_type, int depth,
+                         const Bounds& prim_bounds, std::vector<uint32_t>* splits = nullptr) {
+  constexpr int nBuckets = 12;
+  uint32_t index = static_cast<uint32_t>(nodes.size());
+  nodes.push_back(compact_bvh_node());
+  aabb bounds, centroid_bounds;
+  int axis = CompactRangeBounds(prim_bounds, order, start, end, bounds, centroid_bounds);
+  nodes[index].bounds[0] = bounds.min();
+  nodes[index].bounds[1] = bounds.max();
+  nodes[index].axis = static_cast<uint16_t>(axis);
+  size_t n = end - start;
+  if(n <= max_leaf) {
+    nodes[index].offset = static_cast<uint32_t>(start);
+    nodes[index].count = static_cast<uint16_t>(n);
+    return(index);
+  }
+  nodes[index].count = 0;
+
+  Float cmin = centroid_bounds.min().e[axis];
+  Float extent = centroid_bounds.max().e[axis] - cmin;
+  size_t mid = start;
+  if(bvh_type == 1 && depth < kMaxSahDepth && extent > 0) {
+    auto bucket_of = [&](uint32_t prim) {
+      int b = static_cast<int>(nBuckets * (prim_bounds(prim).centroid.e[axis] - cmin) / extent);
+      return(b < 0 ? 0 : (b >= nBuckets ? nBuckets - 1 : b));
+    };
+    int counts[nBuckets] = {0};
+    aabb bucket_bounds[nBuckets];
+    for(size_t i = start; i < end; i++) {
+      int b = bucket_of(order[i]);
+      counts[b]++;
+      bucket_bounds[b] = surrounding_box(bucket_bounds[b], prim_bounds(order[i]));
+    }
+    int minCostSplitBucket = -1;
+    Float minCost = INFINITY;
+    for(int i = 0; i < nBuckets - 1; i++) {
+      aabb below, above;
+      int countBelow = 0, countAbove = 0;
+      for(int j = 0; j <= i; j++) {
+        below = surrounding_box(below, bucket_bounds[j]);
+        countBelow += counts[j];
+      }
+      for(int j = i + 1; j < nBuckets; j++) {
+        above = surrounding_box(above, bucket_bounds[j]);
+        countAbove += counts[j];
+      }
+      if(countBelow == 0 || countAbove == 0) {
+        continue;
+      }
+      Float cost = countBelow * below.surface_area() + countAbove * above.surface_area();
+      if(cost < minCost) {
+        minCost = cost;
+        minCostSplitBucket = i;
+      }
+    }
+    if(minCostSplitBucket >= 0) {
+      mid = std::partition(order.begin() + start, order.begin() + end,
+                           [&](uint32_t prim) {return(bucket_of(prim) <= minCostSplitBucket);}) - order.begin();
+    }
+  }
+  if(mid == start || mid == end) {
+    //Median splits are rounded to whole leaves, so equal-count trees have full leaves
+    mid = start + (n/2 + max_leaf - 1) / max_leaf * max_leaf;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                     [&](uint32_t a, uint32_t b) {
+                       return(prim_bounds(a).centroid.e[axis] < prim_bounds(b).centroid.e[axis]);
+                     });
+  }
+  if(splits) {
+    splits->push_back(static_cast<uint32_t>(mid - start));
+  }
+  BuildCompactBVH(nodes, order, start, mid, max_leaf, bvh_type, depth + 1, prim_bounds, splits);
+  uint32_t second = BuildCompactBVH(nodes, order, mid, end, max_leaf, bvh_type, depth + 1, prim_bounds, splits);
+  nodes[index].offset = second;
+  return(index);
+}
+
+#endif
@@ -0,0 +1,624 @@
+#include "compactmesh.h"
+#include "bvhstats.h"
+#include <algorithm>
+
+//Leaves hold up to this many faces. Both the builder and the layout replay use this rule, so only
+//interior nodes need to be recorded in a cached layout.
+constexpr size_t kMaxLeafFaces = 4;
+static_assert(kMaxLeafFaces <= kPacketWidth, "Leaves must fit in a triangle packet");
+//Distinguishes compact mesh layouts from bvh_node layouts in the mesh cache
+constexpr uint64_t kCompactLayoutTag = 0x636f6d706163746dULL;
+
+void compact_mesh::PrepareCache(MeshCache& cache) {
+  cache.AddParameter(kCompactLayoutTag);
+}
+
+compact_mesh::compact_mesh(std::vector<vec3f>& vertices_, std::vector<normal3f>& normals_,
+                           std::vector<uint32_t>& indices_, std::vector<uint32_t>& normal_indices_,
+                           std::vector<vec2f>& texcoords_, std::vector<uint32_t>& texcoord_indices_,
+                           std::vector<uint16_t>& material_ids_,
+                           const std::vector<std::shared_ptr<material> >& materials_,
+                           MeshCache& cache, int bvh_type,
+                           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                           bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), materials(materials_) {
+  take_buffers(vertices_, normals_, indices_, normal_indices_, texcoords_, texcoord_indices_, material_ids_);
+  build_tree(cache, bvh_type);
+}
+
+compact_mesh::compact_mesh(std::vector<vec3f>& vertices_, std::vector<normal3f>& normals_,
+                           std::vector<uint32_t>& indices_, std::vector<uint32_t>& normal_indices_,
+                           std::vector<vec2f>& texcoords_, std::vector<uint32_t>& texcoord_indices_,
+                           std::vector<uint16_t>& material_ids_,
+                           const std::vector<std::shared_ptr<material> >& materials_,
+                           std::vector<compact_bvh_node>& prebuilt, int bvh_type,
+                           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                           bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), materials(materials_) {
+  take_buffers(vertices_, normals_, indices_, normal_indices_, texcoords_, texcoord_indices_, material_ids_);
+  if(num_faces() == 0) {
+    return;
+  }
+  nodes.swap(prebuilt);
+  uint32_t next_node = 0;
+  uint32_t next_face = 0;
+  if(!nodes.empty() && adopt_node(0, 0, next_node, next_face) &&
+     next_node == nodes.size() && next_face == num_faces()) {
+    build_packets();
+    return;
+  }
+  nodes.clear();
+  MeshCache no_cache("", "", 1, bvh_type, Transform());
+  build_tree(no_cache, bvh_type);
+}
+
+compact_mesh::compact_mesh(std::vector<vec3f>& vertices_, std::vector<normal3f>& normals_,
+                           const int* external_indices_, size_t num_faces_, int index_base,
+                           const std::vector<std::shared_ptr<material> >& materials_,
+                           MeshCache& cache, int bvh_type,
+                           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                           bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), materials(materials_) {
+  std::vector<uint32_t> no_indices, no_normal_indices, no_texcoord_indices;
+  std::vector<vec2f> no_texcoords;
+  std::vector<uint16_t> no_material_ids;
+  take_buffers(vertices_, normals_, no_indices, no_normal_indices, no_texcoords, no_texcoord_indices,
+               no_material_ids);
+  if(!normals.empty() && normals.size() != vertices.size()) {
+    throw std::runtime_error("Compact mesh normals must be indexed like the vertices");
+  }
+  int64_t max_index = static_cast<int64_t>(index_base) + static_cast<int64_t>(vertices.size());
+  for(size_t i = 0; i < 3 * num_faces_; i++) {
+    if(external_indices_[i] < index_base || external_indices_[i] >= max_index) {
+      throw std::runtime_error("Invalid vertex index in mesh");
+    }
+  }
+  external_indices = external_indices_;
+  external_faces = num_faces_;
+  external_base = index_base;
+  build_tree(cache, bvh_type);
+}
+
+void compact_mesh::take_buffers(std::vector<vec3f>& vertices_, std::vector<normal3f>& normals_,
+                                std::vector<uint32_t>& indices_, std::vector<uint32_t>& normal_indices_,
+                                std::vector<vec2f>& texcoords_, std::vector<uint32_t>& texcoord_indices_,
+                                std::vector<uint16_t>& material_ids_) {
+  vertices.swap(vertices_);
+  normals.swap(normals_);
+  indices.swap(indices_);
+  normal_indices.swap(normal_indices_);
+  texcoords.swap(texcoords_);
+  texcoord_indices.swap(texcoord_indices_);
+  material_ids.swap(material_ids_);
+  if(materials.empty()) {
+    throw std::runtime_error("Compact mesh requires at least one material");
+  }
+  if(texcoord_indices.empty()) {
+    if(!texcoords.empty() && texcoords.size() != vertices.size()) {
+      throw std::runtime_error("Compact mesh texture coordinates must be indexed like the vertices");
+    }
+  } else {
+    if(texcoord_indices.size() != indices.size()) {
+      throw std::runtime_error("Compact mesh requires three texture coordinate indices per face");
+    }
+    for(size_t i = 0; i < texcoord_indices.size(); i++) {
+      if(texcoord_indices[i] >= texcoords.size() && texcoord_indices[i] != kNoNormal) {
+        throw std::runtime_error("Invalid texture coordinate index in mesh");
+      }
+    }
+  }
+  //Store the mesh in world space, as `triangle` does
+  for(size_t i = 0; i < vertices.size(); i++) {
+    vertices[i] = (*ObjectToWorld)(point3f(vertices[i].x(), vertices[i].y(), vertices[i].z()));
+  }
+  for(size_t i = 0; i < normals.size(); i++) {
+    normals[i] = (*ObjectToWorld)(normals[i]);
+  }
+}
+
+void compact_mesh::build_tree(MeshCache& cache, int bvh_type) {
+  size_t n = num_faces();
+  if(n == 0) {
+    return;
+  }
+  std::vector<uint32_t> faces;
+  if(cache.loaded() && cache.data.bvh_order.size() == n) {
+    faces = cache.data.bvh_order;
+    std::vector<bool> used(n, false);
+    bool valid_order = true;
+    for(size_t i = 0; i < n; i++) {
+      if(faces[i] >= n || used[faces[i]]) {
+        valid_order = false;
+        break;
+      }
+      used[faces[i]] = true;
+    }
+    if(valid_order) {
+      const uint32_t* splits = cache.data.bvh_splits.data();
+      const uint32_t* splits_end = splits + cache.data.bvh_splits.size();
+      try {
+        replay(faces, 0, n, 0, splits, splits_end);
+        if(splits == splits_end) {
+          reorder_faces(faces);
+          build_packets();
+          return;
+        }
+      } catch (std::runtime_error&) {
+        //Fall through and rebuild the BVH from scratch
+      }
+    }
+    nodes.clear();
+  }
+  faces.resize(n);
+  for(size_t i = 0; i < n; i++) {
+    faces[i] = static_cast<uint32_t>(i);
+  }
+  std::vector<uint32_t> splits;
+  BuildCompactBVH(nodes, faces, 0, n, kMaxLeafFaces, bvh_type, 0,
+                  [this](uint32_t face) {return(face_bounds(face));}, &splits);
+  cache.SaveLayout(faces, splits);
+  reorder_faces(faces);
+  build_packets();
+}
+
+aabb compact_mesh::face_bounds(uint32_t face) const {
+  const vec3f& a = vertices[vertex_index(face, 0)];
+  const vec3f& b = vertices[vertex_index(face, 1)];
+  const vec3f& c = vertices[vertex_index(face, 2)];
+  point3f min_v(fmin(fmin(a.x(), b.x()), c.x()),
+                fmin(fmin(a.y(), b.y()), c.y()),
+                fmin(fmin(a.z(), b.z()), c.z()));
+  point3f max_v(fmax(fmax(a.x(), b.x()), c.x()),
+                fmax(fmax(a.y(), b.y()), c.y()),
+                fmax(fmax(a.z(), b.z()), c.z()));
+
+  point3f difference = max_v + -min_v;
+
+  if (difference.x() < 1E-5) max_v.e[0] += 1E-5;
+  if (difference.y() < 1E-5) max_v.e[1] += 1E-5;
+  if (difference.z() < 1E-5) max_v.e[2] += 1E-5;
+  return(aabb(min_v, max_v));
+}
+
+uint32_t compact_mesh::replay(const std::vector<uint32_t>& faces, size_t start, size_t end, int depth,
+                              const uint32_t*& splits, const uint32_t* splits_end) {
+  uint32_t index = static_cast<uint32_t>(nodes.size());
+  nodes.push_back(compact_bvh_node());
+  aabb bounds, centroid_bounds;
+  int axis = CompactRangeBounds([this](uint32_t face) {return(face_bounds(face));},
+                                faces, start, end, bounds, centroid_bounds);
+  nodes[index].bounds[0] = bounds.min();
+  nodes[index].bounds[1] = bounds.max();
+  nodes[index].axis = static_cast<uint16_t>(axis);
+  size_t n = end - start;
+  if(n <= kMaxLeafFaces) {
+    nodes[index].offset = static_cast<uint32_t>(start);
+    nodes[index].count = static_cast<uint16_t>(n);
+    return(index);
+  }
+  nodes[index].count = 0;
+  if(splits == splits_end) {
+    throw std::runtime_error("BVH layout ended early");
+  }
+  size_t left_count = *splits++;
+  if(left_count == 0 || left_count >= n) {
+    throw std::runtime_error("Invalid BVH layout split");
+  }
+  if(depth + 1 >= kTraversalStackSize) {
+    throw std::runtime_error("BVH layout too deep");
+  }
+  replay(faces, start, start + left_count, depth + 1, splits, splits_end);
+  uint32_t second = replay(faces, start + left_count, end, depth + 1, splits, splits_end);
+  nodes[index].offset = second;
+  return(index);
+}
+
+//Checks that a prebuilt tree is laid out as the builder would (depth-first, leaves covering the
+//faces in order) and recomputes its bounds from the world-space vertices
+bool compact_mesh::adopt_node(uint32_t index, int depth, uint32_t& next_node, uint32_t& next_face) {
+  if(index != next_node || index >= nodes.size() || depth >= kTraversalStackSize || nodes[index].axis > 2) {
+    return(false);
+  }
+  next_node++;
+  compact_bvh_node& node = nodes[index];
+  aabb bounds;
+  if(node.count > 0) {
+    if(node.count > kMaxLeafFaces || node.offset != next_face || next_face + node.count > num_faces()) {
+      return(false);
+    }
+    for(uint32_t i = 0; i < node.count; i++) {
+      bounds = surrounding_box(bounds, face_bounds(next_face + i));
+    }
+    next_face += node.count;
+  } else {
+    uint32_t second = node.offset;
+    if(!adopt_node(index + 1, depth + 1, next_node, next_face) ||
+       !adopt_node(second, depth + 1, next_node, next_face)) {
+      return(false);
+    }
+    bounds = surrounding_box(aabb(nodes[index + 1].bounds[0], nodes[index + 1].bounds[1]),
+                             aabb(nodes[second].bounds[0], nodes[second].bounds[1]));
+  }
+  node.bounds[0] = bounds.min();
+  node.bounds[1] = bounds.max();
+  return(true);
+}
+
+std::vector<compact_bvh_node> compact_mesh::export_nodes() const {
+  std::vector<compact_bvh_node> exported(nodes);
+  for(size_t i = 0; i < exported.size(); i++) {
+    if(exported[i].count > 0) {
+      exported[i].offset = packets[exported[i].offset].first_face;
+    }
+  }
+  return(exported);
+}
+
+//Permutes the per-face buffers into BVH leaf order. External index buffers are left in place and
+//visited through `face_order` instead.
+void compact_mesh::reorder_faces(const std::vector<uint32_t>& order) {
+  std::vector<uint32_t> reordered(3 * order.size());
+  if(external_indices) {
+    face_order = order;
+  } else {
+    for(size_t i = 0; i < order.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        reordered[3*i+j] = indices[3*order[i]+j];
+      }
+    }
+    indices.swap(reordered);
+  }
+  if(!normal_indices.empty()) {
+    for(size_t i = 0; i < order.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        reordered[3*i+j] = normal_indices[3*order[i]+j];
+      }
+    }
+    normal_indices.swap(reordered);
+  }
+  if(!texcoord_indices.empty()) {
+    for(size_t i = 0; i < order.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        reordered[3*i+j] = texcoord_indices[3*order[i]+j];
+      }
+    }
+    texcoord_indices.swap(reordered);
+  }
+  if(!material_ids.empty()) {
+    std::vector<uint16_t> reordered_ids(material_ids.size());
+    for(size_t i = 0; i < order.size(); i++) {
+      reordered_ids[i] = material_ids[order[i]];
+    }
+    material_ids.swap(reordered_ids);
+  }
+}
+
+//Precomputes the vertex/edge packet for every leaf and points the leaf at it. Unused lanes are
+//left as degenerate triangles, which never pass the determinant test.
+void compact_mesh::build_packets() {
+  packets.clear();
+  for(size_t i = 0; i < nodes.size(); i++) {
+    compact_bvh_node& node = nodes[i];
+    if(node.count == 0) {
+      continue;
+    }
+    triangle_packet packet;
+    std::fill(&packet.v0[0][0], &packet.v0[0][0] + 3 * kPacketWidth, Float(0));
+    std::fill(&packet.e1[0][0], &packet.e1[0][0] + 3 * kPacketWidth, Float(0));
+    std::fill(&packet.e2[0][0], &packet.e2[0][0] + 3 * kPacketWidth, Float(0));
+    packet.first_face = node.offset;
+    for(uint32_t lane = 0; lane < node.count; lane++) {
+      uint32_t face = node.offset + lane;
+      const vec3f& a = vertices[vertex_index(face, 0)];
+      vec3f edge1 = vertices[vertex_index(face, 1)] - a;
+      vec3f edge2 = vertices[vertex_index(face, 2)] - a;
+      for(int j = 0; j < 3; j++) {
+        packet.v0[j][lane] = a.e[j];
+        packet.e1[j][lane] = edge1.e[j];
+        packet.e2[j][lane] = edge2.e[j];
+      }
+    }
+    node.offset = static_cast<uint32_t>(packets.size());
+    packets.push_back(packet);
+  }
+}
+
+//Moller-Trumbore test against every lane of a packet, with the same tolerances as
+//triangle::hit(). The lanes are evaluated without branches so the loop can be vectorized; returns
+//a bitmask of the lanes hit in [t_min, t_max].
+inline int compact_mesh::intersect_packet(const triangle_packet& packet, const point3f& o, const vec3f& d,
+                                          Float t_min, Float t_max, Float* t, Float* u, Float* v) const {
+  const Float dx = d.x(), dy = d.y(), dz = d.z();
+  const Float ox = o.x(), oy = o.y(), oz = o.z();
+  const Float eps = 1E-15, zero = 0, one = 1;
+  int mask[kPacketWidth];
+  for(int i = 0; i < kPacketWidth; i++) {
+    Float px = dy * packet.e2[2][i] - dz * packet.e2[1][i];
+    Float py = dz * packet.e2[0][i] - dx * packet.e2[2][i];
+    Float pz = dx * packet.e2[1][i] - dy * packet.e2[0][i];
+    Float det = px * packet.e1[0][i] + py * packet.e1[1][i] + pz * packet.e1[2][i];
+    Float invdet = one / det;
+    Float tx = ox - packet.v0[0][i];
+    Float ty = oy - packet.v0[1][i];
+    Float tz = oz - packet.v0[2][i];
+    Float uu = (px * tx + py * ty + pz * tz) * invdet;
+    Float qx = ty * packet.e1[2][i] - tz * packet.e1[1][i];
+    Float qy = tz * packet.e1[0][i] - tx * packet.e1[2][i];
+    Float qz = tx * packet.e1[1][i] - ty * packet.e1[0][i];
+    Float vv = (qx * dx + qy * dy + qz * dz) * invdet;
+    Float tt = (qx * packet.e2[0][i] + qy * packet.e2[1][i] + qz * packet.e2[2][i]) * invdet;
+    mask[i] = (std::fabs(det) >= eps) & (uu >= zero) & (uu <= one) & (vv >= zero) & (uu + vv <= one) &
+      (tt >= t_min) & (tt <= t_max);
+    t[i] = tt;
+    u[i] = uu;
+    v[i] = vv;
+  }
+  int hits = 0;
+  for(int i = 0; i < kPacketWidth; i++) {
+    hits |= mask[i] << i;
+  }
+  return(hits);
+}
+
+//Returns the closest face hit in [t_min, t_max], or kNoNormal if there is none
+uint32_t compact_mesh::closest_hit(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const {
+  uint32_t hit_face = kNoNormal;
+  if(nodes.empty()) {
+    return(hit_face);
+  }
+  uint32_t stack[kTraversalStackSize];
+  int stack_size = 0;
+  uint32_t current = 0;
+  point3f o = r.origin();
+  vec3f d = r.direction();
+  uint64_t nodes_visited = 0, faces_tested = 0;
+  while(true) {
+    const compact_bvh_node& node = nodes[current];
+    if(node_hit(node, r, o, t_min, t_max)) {
+      nodes_visited++;
+      if(node.count > 0) {
+        faces_tested += node.count;
+        const triangle_packet& packet = packets[node.offset];
+        Float lane_t[kPacketWidth], lane_u[kPacketWidth], lane_v[kPacketWidth];
+        int hits = intersect_packet(packet, o, d, t_min, t_max, lane_t, lane_u, lane_v);
+        for(int i = 0; hits != 0; i++, hits >>= 1) {
+          if((hits & 1) && lane_t[i] <= t_max) {
+            hit_face = packet.first_face + i;
+            t_max = lane_t[i];
+            t = lane_t[i];
+            u = lane_u[i];
+            v = lane_v[i];
+          }
+        }
+        if(stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else if(r.sign[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if(stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::nodes_visited.fetch_add(nodes_visited, std::memory_order_relaxed);
+    TraversalStats::primitives_tested.fetch_add(faces_tested, std::memory_order_relaxed);
+  }
+  return(hit_face);
+}
+
+normal3f compact_mesh::shading_normal(uint32_t face, Float u, Float v, bool& has_normal) const {
+  has_normal = false;
+  if(normals.empty()) {
+    return(normal3f(0,0,0));
+  }
+  normal3f n[3];
+  for(int i = 0; i < 3; i++) {
+    uint32_t ni = normal_indices.empty() ? vertex_index(face, i) : normal_indices[3*face+i];
+    if(ni == kNoNormal) {
+      return(normal3f(0,0,0));
+    }
+    n[i] = normals[ni];
+    if(n[i].x() == 0 && n[i].y() == 0 && n[i].z() == 0) {
+      return(normal3f(0,0,0));
+    }
+  }
+  has_normal = true;
+  Float w = 1 - u - v;
+  return(w * n[0] + u * n[1] + v * n[2]);
+}
+
+bool compact_mesh::face_texcoords(uint32_t face, vec2f uv[3]) const {
+  if(texcoords.empty()) {
+    return(false);
+  }
+  for(int i = 0; i < 3; i++) {
+    uint32_t ti = texcoord_indices.empty() ? vertex_index(face, i) : texcoord_indices[3*face+i];
+    if(ti == kNoNormal) {
+      return(false);
+    }
+    uv[i] = texcoords[ti];
+  }
+  return(true);
+}
+
+void compact_mesh::fill_record(uint32_t face, const ray& r, Float t, Float u, Float v, hit_record& rec) const {
+  rec.t = t;
+  rec.p = r.point_at_parameter(t);
+  rec.pError = vec3f(0,0,0);
+  rec.has_bump = false;
+  const vec3f& a = vertices[vertex_index(face, 0)];
+  vec3f edge1 = vertices[vertex_index(face, 1)] - a;
+  vec3f edge2 = vertices[vertex_index(face, 2)] - a;
+  vec3f geometric = cross(edge1, edge2);
+  geometric.make_unit_vector();
+  vec2f uv[3];
+  bool has_texcoords = face_texcoords(face, uv);
+  if(has_texcoords) {
+    Float w = 1 - u - v;
+    rec.u = w * uv[0].x() + u * uv[1].x() + v * uv[2].x();
+    rec.v = w * uv[0].y() + u * uv[1].y() + v * uv[2].y();
+    //Solve for the derivatives with respect to the texture coordinates, as `triangle` does for
+    //bump maps, falling back to an arbitrary frame if the face's texture coordinates are degenerate
+    vec2f duv02 = uv[0] - uv[2];
+    vec2f duv12 = uv[1] - uv[2];
+    vec3f dp02 = -edge2;
+    vec3f dp12 = edge1 - edge2;
+    Float determinant = DifferenceOfProducts(duv02[0], duv12[1], duv02[1], duv12[0]);
+    if(determinant == 0) {
+      onb uvw;
+      uvw.build_from_w(geometric);
+      rec.dpdu = uvw.u();
+      rec.dpdv = uvw.v();
+    } else {
+      Float invdet = 1 / determinant;
+      rec.dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+      rec.dpdv = (duv02[0] * dp12 - duv12[0] * dp02) * invdet;
+    }
+  } else {
+    //As in `triangle` without a bump map, the derivatives are taken with respect to the
+    //barycentric (u, v) stored in the record
+    rec.u = u;
+    rec.v = v;
+    rec.dpdu = edge1;
+    rec.dpdv = edge2;
+  }
+  bool has_normal;
+  normal3f n = shading_normal(face, u, v, has_normal);
+  rec.normal = has_normal ? n : normal3f(geometric);
+  uint16_t material_id = material_ids.empty() ? 0 : material_ids[face];
+  if(has_texcoords && material_id < bump_textures.size() && bump_textures[material_id]) {
+    point3f bvbu = bump_textures[material_id]->value(rec.u, rec.v, rec.p);
+    rec.bump_normal = dot(r.direction(), geometric) < 0 ?
+      rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv) :
+      rec.normal - normal3f(bvbu.x() * rec.dpdu - bvbu.y() * rec.dpdv);
+    rec.bump_normal.make_unit_vector();
+    rec.has_bump = true;
+  }
+  rec.mat_ptr = materials[material_id].get();
+  rec.alpha_miss = false;
+}
+
+bool compact_mesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  Float t, u, v;
+  uint32_t face = closest_hit(r, t_min, t_max, t, u, v);
+  if(face == kNoNormal) {
+    return(false);
+  }
+  fill_record(face, r, t, u, v, rec);
+  return(true);
+}
+
+bool compact_mesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  Float t, u, v;
+  uint32_t face = closest_hit(r, t_min, t_max, t, u, v);
+  if(face == kNoNormal) {
+    return(false);
+  }
+  fill_record(face, r, t, u, v, rec);
+  return(true);
+}
+
+bool compact_mesh::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(nodes.empty()) {
+    return(false);
+  }
+  box = aabb(nodes[0].bounds[0], nodes[0].bounds[1]);
+  return(true);
+}
+
+//Matches the pdf of a hitable_list of triangles: the mean of the per-face pdfs, where every face
+//along the ray contributes, found with a traversal that doesn't stop at the first hit.
+Float compact_mesh::face_pdf(const point3f& o, const vec3f& v) const {
+  if(nodes.empty()) {
+    return(0);
+  }
+  ray r(o, v);
+  uint32_t stack[kTraversalStackSize];
+  int stack_size = 0;
+  uint32_t current = 0;
+  Float sum = 0;
+  while(true) {
+    const compact_bvh_node& node = nodes[current];
+    if(node_hit(node, r, o, 0.001, FLT_MAX)) {
+      if(node.count > 0) {
+        const triangle_packet& packet = packets[node.offset];
+        Float lane_t[kPacketWidth], lane_u[kPacketWidth], lane_w[kPacketWidth];
+        int hits = intersect_packet(packet, o, v, 0.001, FLT_MAX, lane_t, lane_u, lane_w);
+        for(int lane = 0; hits != 0; lane++, hits >>= 1) {
+          if(hits & 1) {
+            uint32_t i = packet.first_face + lane;
+            Float t = lane_t[lane];
+            hit_record rec;
+            fill_record(i, r, t, lane_u[lane], lane_w[lane], rec);
+            const vec3f& a = vertices[vertex_index(i, 0)];
+            Float area = cross(vertices[vertex_index(i, 1)] - a, vertices[vertex_index(i, 2)] - a).length()/2;
+            Float distance = t * t * v.squared_length();
+            Float cosine = dot(v, rec.normal);
+            sum += distance / (cosine * area);
+          }
+        }
+        if(stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if(stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  return(sum / num_faces());
+}
+
+Float compact_mesh::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  return(face_pdf(o, v));
+}
+
+Float compact_mesh::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  return(face_pdf(o, v));
+}
+
+vec3f compact_mesh::sample_face(uint32_t face, const point3f& origin, Float r1, Float r2) const {
+  const vec3f& a = vertices[vertex_index(face, 0)];
+  const vec3f& b = vertices[vertex_index(face, 1)];
+  const vec3f& c = vertices[vertex_index(face, 2)];
+  Float sr1 = sqrt(r1);
+  point3f random_point((1.0 - sr1) * a + sr1 * (1.0 - r2) * b + sr1 * r2 * c);
+  return(random_point - origin);
+}
+
+vec3f compact_mesh::random(const point3f& origin, random_gen& rng, Float time) {
+  uint32_t face = static_cast<uint32_t>(rng.unif_rand() * num_faces() * 0.99999999);
+  Float r1 = rng.unif_rand();
+  Float r2 = rng.unif_rand();
+  return(sample_face(face, origin, r1, r2));
+}
+
+vec3f compact_mesh::random(const point3f& origin, Sampler* sampler, Float time) {
+  uint32_t face = static_cast<uint32_t>(sampler->Get1D() * num_faces() * 0.99999999);
+  vec2f u = sampler->Get2D();
+  return(sample_face(face, origin, u.x(), u.y()));
+}
+
+size_t compact_mesh::memory_bytes() const {
+  return(vertices.capacity() * sizeof(vec3f) + normals.capacity() * sizeof(normal3f) +
+         indices.capacity() * sizeof(uint32_t) + normal_indices.capacity() * sizeof(uint32_t) +
+         texcoords.capacity() * sizeof(vec2f) + texcoord_indices.capacity() * sizeof(uint32_t) +
+         face_order.capacity() * sizeof(uint32_t) +
+         material_ids.capacity() * sizeof(uint16_t) + nodes.capacity() * sizeof(compact_bvh_node) +
+         packets.capacity() * sizeof(triangle_packet));
+}
@@ -0,0 +1,133 @@
+#ifndef COMPACTMESHH
+#define COMPACTMESHH
+
+#include "hitable.h"
+#include "material.h"
+#include "meshcache.h"
+#include "compactbvh.h"
+#include <vector>
+#include <cstdint>
+#include <Rcpp.h>
+
+constexpr int kPacketWidth = 4;
+
+//The faces of one leaf in structure-of-arrays form (first vertex and two edges per lane), so a
+//leaf is intersected with a single pass over all of its triangles
+struct alignas(16) triangle_packet {
+  Float v0[3][kPacketWidth];
+  Float e1[3][kPacketWidth];
+  Float e2[3][kPacketWidth];
+  uint32_t first_face;
+};
+
+//Indexed triangle mesh: shared world-space vertex and normal buffers, 32-bit vertex indices and a
+//per-face material id, traversed with a flat BVH whose leaves reference ranges of faces. This
+//replaces a `triangle` object and a `bvh_node` per face, which cost several hundred bytes each.
+//Intersection matches `triangle` (interpolated or geometric normals). Faces with texture
+//coordinates report the interpolated (u, v) and derivatives with respect to it, so image and bump
+//textures apply; faces without report barycentric (u, v). Alpha textures aren't supported.
+class compact_mesh : public hitable {
+public:
+  //The buffers are moved into the mesh (the caller's vectors are left empty). `vertices` and
+  //`normals` are in object space. `normal_indices` holds three entries per face indexing `normals`
+  //(kNoNormal for faces without shading normals); if it is empty and `normals` is not, normals are
+  //indexed like the vertices. `texcoords` and `texcoord_indices` follow the same rules (kNoNormal
+  //marks faces without texture coordinates). `material_ids` may be empty when there is only one
+  //material.
+  compact_mesh(std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+               std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+               std::vector<vec2f>& texcoords, std::vector<uint32_t>& texcoord_indices,
+               std::vector<uint16_t>& material_ids, const std::vector<std::shared_ptr<material> >& materials,
+               MeshCache& cache, int bvh_type,
+               std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+               bool reverseOrientation);
+  //Uses a prebuilt BVH (e.g. one stored in a mesh asset) instead of building one. The nodes must
+  //be in depth-first order with leaf offsets giving the first face of each leaf, as returned by
+  //export_nodes(); their bounds are recomputed in world space. If the tree doesn't match the faces
+  //it is rebuilt with `bvh_type`.
+  compact_mesh(std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+               std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+               std::vector<vec2f>& texcoords, std::vector<uint32_t>& texcoord_indices,
+               std::vector<uint16_t>& material_ids, const std::vector<std::shared_ptr<material> >& materials,
+               std::vector<compact_bvh_node>& prebuilt, int bvh_type,
+               std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+               bool reverseOrientation);
+  //Uses an index buffer owned by the caller (three vertex indices per face, counted from
+  //`index_base`, e.g. the index matrix of an R `mesh3d` object) in place instead of copying it.
+  //The faces are visited in BVH order through a permutation, and the caller must keep the buffer
+  //alive for the lifetime of the mesh. `normals`, if given, are indexed like the vertices.
+  compact_mesh(std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+               const int* external_indices, size_t num_faces, int index_base,
+               const std::vector<std::shared_ptr<material> >& materials,
+               MeshCache& cache, int bvh_type,
+               std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+               bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+
+  virtual std::string GetName() const {
+    return(std::string("CompactMesh"));
+  }
+  size_t num_faces() const {return(external_indices ? external_faces : indices.size() / 3);}
+  uint32_t vertex_index(uint32_t face, int corner) const {
+    if(external_indices) {
+      size_t f = face_order.empty() ? face : face_order[face];
+      return(static_cast<uint32_t>(external_indices[3*f+corner] - external_base));
+    }
+    return(indices[3*face+corner]);
+  }
+  size_t memory_bytes() const;
+  //Must be called on a mesh cache before Load(), so compact layouts are keyed apart from the
+  //layouts of `bvh_node` trees over the same file
+  static void PrepareCache(MeshCache& cache);
+  aabb face_bounds(uint32_t face) const;
+  //Copy of the BVH with leaf offsets referring to faces rather than triangle packets
+  std::vector<compact_bvh_node> export_nodes() const;
+
+  static const uint32_t kNoNormal = 0xFFFFFFFF;
+  std::vector<vec3f> vertices;
+  std::vector<normal3f> normals;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> normal_indices;
+  std::vector<vec2f> texcoords;
+  std::vector<uint32_t> texcoord_indices;
+  std::vector<uint16_t> material_ids;
+  std::vector<std::shared_ptr<material> > materials;
+  //Optional bump map for each material, applied to faces with texture coordinates
+  std::vector<std::shared_ptr<bump_texture> > bump_textures;
+  std::vector<compact_bvh_node> nodes;
+  std::vector<triangle_packet> packets;
+  //Set instead of `indices` when the index buffer is owned by the caller
+  const int* external_indices = nullptr;
+  size_t external_faces = 0;
+  int external_base = 0;
+  std::vector<uint32_t> face_order;
+
+private:
+  void take_buffers(std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+                    std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+                    std::vector<vec2f>& texcoords, std::vector<uint32_t>& texcoord_indices,
+                    std::vector<uint16_t>& material_ids);
+  void build_tree(MeshCache& cache, int bvh_type);
+  bool adopt_node(uint32_t index, int depth, uint32_t& next_node, uint32_t& next_face);
+  uint32_t replay(const std::vector<uint32_t>& faces, size_t start, size_t end, int depth,
+                  const uint32_t*& splits, const uint32_t* splits_end);
+  void reorder_faces(const std::vector<uint32_t>& order);
+  void build_packets();
+  int intersect_packet(const triangle_packet& packet, const point3f& o, const vec3f& d,
+                       Float t_min, Float t_max, Float* t, Float* u, Float* v) const;
+  uint32_t closest_hit(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const;
+  void fill_record(uint32_t face, const ray& r, Float t, Float u, Float v, hit_record& rec) const;
+  normal3f shading_normal(uint32_t face, Float u, Float v, bool& has_normal) const;
+  bool face_texcoords(uint32_t face, vec2f uv[3]) const;
+  Float face_pdf(const point3f& o, const vec3f& v) const;
+  vec3f sample_face(uint32_t face, const point3f& origin, Float r1, Float r2) const;
+};
+
+#endif
@@ -1,8 +1,52 @@
 #include "cone.h"
 #include "efloat.h"
 
-bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  ray r2 = (*WorldToObject)(r);
+//Moves a point radially onto the side of the cone at its height, which leaves only a few roundings
+//of error in its coordinates
+point3f cone::reproject(point3f p) const {
+  Float hit_radius = std::sqrt(p.x() * p.x() + p.z() * p.z());
+  if(hit_radius > 0) {
+    Float scale = radius * std::fabs(height - p.y()) / (height * hit_radius);
+    p.e[0] *= scale;
+    p.e[2] *= scale;
+  }
+  return(p);
+}
+
+//With `robust_quadrics` set the roots carry the error of the transformed ray through EFloat
+//arithmetic (as in PBRT-v3), and are only accepted if their whole interval lies in the ray's extent.
+//The interval quadratic solve doesn't bound the error of its discriminant, so the hit points are
+//reprojected in both paths, and the robust path adds the error of evaluating the ray on top.
+bool cone::solve_side(const ray& r, ray& r2, side_root roots[2]) const {
+  if(robust_quadrics) {
+    vec3f oErr, dErr;
+    r2 = (*WorldToObject)(r, &oErr, &dErr);
+    EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
+    EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
+    EFloat k = EFloat(radius) / EFloat(height);
+    k = k * k;
+    EFloat ocy = oy - EFloat(height);
+    EFloat a = dx * dx + dz * dz - k * dy * dy;
+    EFloat b = 2 * (dx * ox + dz * oz - k * dy * ocy);
+    EFloat c = ox * ox + oz * oz - k * ocy * ocy;
+    EFloat t[2];
+    if(!Quadratic(a, b, c, &t[0], &t[1])) {
+      return(false);
+    }
+    for(int i = 0; i < 2; i++) {
+      EFloat px = ox + t[i] * dx;
+      EFloat py = oy + t[i] * dy;
+      EFloat pz = oz + t[i] * dz;
+      roots[i].t = (Float)t[i];
+      roots[i].low = t[i].LowerBound();
+      roots[i].high = t[i].UpperBound();
+      roots[i].p = reproject(point3f((Float)px, (Float)py, (Float)pz));
+      roots[i].pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(), pz.GetAbsoluteError()) +
+        vec3f(gamma(8) * Abs(roots[i].p));
+    }
+    return(true);
+  }
+  r2 = (*WorldToObject)(r);
   vec3f oc = r2.origin() - point3f(0,height, 0);
   Float k = radius / height;
   k = k*k;
@@ -10,10 +54,28 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
   Float a = dot(r2.direction(), r2.direction() * kvec);
   Float b = 2 * dot(oc, r2.direction() * kvec); 
   Float c = dot(oc,oc * kvec);
-  Float temp1, temp2;
-  if (!quadratic(a, b, c, &temp1, &temp2)) {
+  Float t[2];
+  if (!quadratic(a, b, c, &t[0], &t[1])) {
     return(false);
   }
+  for(int i = 0; i < 2; i++) {
+    point3f p = reproject(r2.point_at_parameter(t[i]));
+    roots[i].t = t[i];
+    roots[i].low = t[i];
+    roots[i].high = t[i];
+    roots[i].p = p;
+    roots[i].pError = gamma(8) * Abs(p);
+  }
+  return(true);
+}
+
+bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2;
+  side_root roots[2];
+  if(!solve_side(r, r2, roots)) {
+    return(false);
+  }
+  Float temp1 = roots[0].t, temp2 = roots[1].t;
   Float t_cyl = -r2.origin().y() / r2.direction().y();
   Float phi;
   // Float phi;
@@ -61,15 +123,15 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
   //     }
   //   }
   // }
-  point3f temp_point = r2.point_at_parameter(temp1);
-  point3f temp_point2 = r2.point_at_parameter(temp2);
+  point3f temp_point = roots[0].p;
+  point3f temp_point2 = roots[1].p;
   
   Float x = r2.origin().x() + t_cyl*r2.direction().x();
   Float z = r2.origin().z() + t_cyl*r2.direction().z();
   Float radHit2 = x*x + z*z;
-  bool hit_first  = temp1 < t_max && temp1 > t_min && 
+  bool hit_first  = roots[0].high < t_max && roots[0].low > t_min && 
     temp_point.y() > 0.0 && temp_point.y() < height;
-  bool hit_second = temp2 < t_max && temp2 > t_min && 
+  bool hit_second = roots[1].high < t_max && roots[1].low > t_min && 
     temp_point2.y() > 0.0 && temp_point2.y() < height;
   bool hit_base   = t_cyl < t_max && t_cyl > t_min && 
     radHit2 <= radius * radius;
@@ -102,11 +164,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
     //   rec.normal = -rec.normal;
     //   rec.bump_normal = -rec.bump_normal;
     // }
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = roots[0].pError;
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
@@ -145,11 +203,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
     //   rec.normal = -rec.normal;
     //   rec.bump_normal = -rec.bump_normal;
     // }
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = vec3f(0,0,0);
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
@@ -185,11 +239,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
     //   rec.normal = -rec.normal;
     //   rec.bump_normal = -rec.bump_normal;
     // }
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = roots[1].pError;
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
@@ -205,19 +255,12 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_g
 
 
 bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  ray r2 = (*WorldToObject)(r);
-  
-  vec3f oc = r2.origin() - point3f(0,height, 0);
-  Float k = radius / height;
-  k = k*k;
-  vec3f kvec = vec3f(1,-k,1);
-  Float a = dot(r2.direction(), r2.direction() * kvec);
-  Float b = 2 * dot(oc, r2.direction() * kvec); 
-  Float c = dot(oc,oc * kvec);
-  Float temp1, temp2;
-  if (!quadratic(a, b, c, &temp1, &temp2)) {
+  ray r2;
+  side_root roots[2];
+  if(!solve_side(r, r2, roots)) {
     return(false);
   }
+  Float temp1 = roots[0].t, temp2 = roots[1].t;
   Float t_cyl = -r2.origin().y() / r2.direction().y();
   Float phi;
   // Float phi;
@@ -265,15 +308,15 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
   //     }
   //   }
   // }
-  point3f temp_point = r2.point_at_parameter(temp1);
-  point3f temp_point2 = r2.point_at_parameter(temp2);
+  point3f temp_point = roots[0].p;
+  point3f temp_point2 = roots[1].p;
   
   Float x = r2.origin().x() + t_cyl*r2.direction().x();
   Float z = r2.origin().z() + t_cyl*r2.direction().z();
   Float radHit2 = x*x + z*z;
-  bool hit_first  = temp1 < t_max && temp1 > t_min && 
+  bool hit_first  = roots[0].high < t_max && roots[0].low > t_min && 
     temp_point.y() > 0.0 && temp_point.y() < height;
-  bool hit_second = temp2 < t_max && temp2 > t_min && 
+  bool hit_second = roots[1].high < t_max && roots[1].low > t_min && 
     temp_point2.y() > 0.0 && temp_point2.y() < height;
   bool hit_base   = t_cyl < t_max && t_cyl > t_min && 
     radHit2 <= radius * radius;
@@ -307,11 +350,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
     //   rec.bump_normal = -rec.bump_normal;
     // }
     
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = roots[0].pError;
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
@@ -350,11 +389,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
     //   rec.normal = -rec.normal;
     //   rec.bump_normal = -rec.bump_normal;
     // }
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = vec3f(0,0,0);
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
@@ -392,11 +427,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
     //   rec.normal = -rec.normal;
     //   rec.bump_normal = -rec.bump_normal;
     // }
-    EFloat px = r2.origin().x() + rec.t * r2.direction().x();
-    EFloat py = r2.origin().y() + rec.t * r2.direction().y();
-    EFloat pz = r2.origin().z() + rec.t * r2.direction().z();
-    rec.pError = vec3f(px.GetAbsoluteError(), py.GetAbsoluteError(),
-                       pz.GetAbsoluteError());
+    rec.pError = roots[1].pError;
     
     rec = (*ObjectToWorld)(rec);
     rec.normal *= reverseOrientation  ? -1 : 1;
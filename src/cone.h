@@ -11,9 +11,10 @@ public:
   ~cone() {}
   cone(Float r, Float h, std::shared_ptr<material>  mat, 
        std::shared_ptr<alpha_texture> alpha_mask, std::shared_ptr<bump_texture> bump_tex,
-       std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : 
+       std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+       bool robust_quadrics) : 
     hitable(ObjectToWorld, WorldToObject, reverseOrientation), 
-     radius(r), height(h), mat_ptr(mat), alpha_mask(alpha_mask), bump_tex(bump_tex) {};
+     radius(r), height(h), mat_ptr(mat), alpha_mask(alpha_mask), bump_tex(bump_tex), robust_quadrics(robust_quadrics) {};
   virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
@@ -31,6 +32,18 @@ public:
   std::shared_ptr<material> mat_ptr;
   std::shared_ptr<alpha_texture> alpha_mask;
   std::shared_ptr<bump_texture> bump_tex;
+  //Solve the side in EFloat interval arithmetic (render_scene(robust_quadrics = TRUE))
+  bool robust_quadrics;
+private:
+  //A root of the cone's side quadric with conservative bounds, and the hit point with its error
+  struct side_root {
+    Float t, low, high;
+    point3f p;
+    vec3f pError;
+  };
+  //Roots of the side for the world space ray `r`; `r2` is set to the object space ray
+  bool solve_side(const ray& r, ray& r2, side_root roots[2]) const;
+  point3f reproject(point3f p) const;
 };
 
 #endif
@@ -1,4 +1,50 @@
 #include "csg.h"
+#include "csgprogram.h"
+#include "sdfcache.h"
+
+void csg::compile_program() {
+  program = std::make_shared<csg_program>(shapes);
+  if(!program->valid()) {
+    program.reset();
+  }
+}
+
+Float csg::distance(const point3f& p) const {
+  return(program ? program->distance(p) : shapes->getDistance(p));
+}
+
+bool csg::bake(int resolution, int numbercores) {
+  aabb box;
+  if(!shapes->bbox(0, 1, box)) {
+    return(false);
+  }
+  vec3f extent = box.max() - box.min();
+  if(!std::isfinite(extent.x()) || !std::isfinite(extent.y()) || !std::isfinite(extent.z())) {
+    return(false);
+  }
+  baked = std::make_shared<sdf_cache>([this] (const point3f& p) { return(distance(p)); }, 
+                                      box, resolution, numbercores);
+  return(true);
+}
+
+Float csg::march_distance(const point3f& p) const {
+  Float bound;
+  if(baked && baked->lower_bound(p, bound)) {
+    return(bound);
+  }
+  return(std::fabs(distance(p)));
+}
+
+vec3f csg::normal(const point3f& p, Float delta) const {
+  if(program) {
+    return(program->gradient(p, delta));
+  }
+  return(vec3f( 
+    shapes->getDistance(p + vec3f(delta, 0, 0)) - shapes->getDistance(p + vec3f(-delta, 0, 0)), 
+    shapes->getDistance(p + vec3f(0, delta, 0)) - shapes->getDistance(p + vec3f(0, -delta, 0)), 
+    shapes->getDistance(p + vec3f(0, 0, delta)) - shapes->getDistance(p + vec3f(0, 0, -delta))
+  ));
+}
 
 bool csg::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
   ray r2 = (*WorldToObject)(r);
@@ -23,7 +69,7 @@ bool csg::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_ge
     point3f from = r2.origin() + t * dir; 
     
     //Need distance from interior edge to support dielectrics
-    float d =  std::fabs(shapes->getDistance(from)); 
+    float d = march_distance(from); 
     
     //Need to deal with refraction, often initial distance is too close to surface, so we offset
     if(first && d < threshold) {
@@ -39,11 +85,7 @@ bool csg::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_ge
     if (minDistance <= threshold) { 
       Float tval = t / r2.direction().length();
       if(tval > t_min && tval < t_max) {
-    rec.normal = vec3f( 
-          shapes->getDistance(from + vec3f(delta, 0, 0)) - shapes->getDistance(from + vec3f(-delta, 0, 0)), 
-          shapes->getDistance(from + vec3f(0, delta, 0)) - shapes->getDistance(from + vec3f(0, -delta, 0)), 
-          shapes->getDistance(from + vec3f(0, 0, delta)) - shapes->getDistance(from + vec3f(0, 0, -delta))
-        );
+    rec.normal = normal(from, delta);
         //Deal with degenerate case by setting directly at camera--not ideal, need better fix
         if(rec.normal.x() == 0 && rec.normal.y() == 0 && rec.normal.z() == 0) {
       rec.normal = -r2.direction();
@@ -91,7 +133,7 @@ bool csg::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
     point3f from = r2.origin() + t * dir; 
     
     //Need distance from interior edge to support dielectrics
-    float d =  std::fabs(shapes->getDistance(from)); 
+    float d = march_distance(from); 
     
     //Need to deal with refraction, often initial distance is too close to surface, so we offset
     if(first && d < threshold) {
@@ -107,11 +149,7 @@ bool csg::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
     if (minDistance <= threshold) { 
       Float tval = t / r2.direction().length();
       if(tval > t_min && tval < t_max) {
-    rec.normal = vec3f( 
-          shapes->getDistance(from + vec3f(delta, 0, 0)) - shapes->getDistance(from + vec3f(-delta, 0, 0)), 
-          shapes->getDistance(from + vec3f(0, delta, 0)) - shapes->getDistance(from + vec3f(0, -delta, 0)), 
-          shapes->getDistance(from + vec3f(0, 0, delta)) - shapes->getDistance(from + vec3f(0, 0, -delta))
-        );
+    rec.normal = normal(from, delta);
         //Deal with degenerate case by setting directly at camera--not ideal, need better fix
         if(rec.normal.x() == 0 && rec.normal.y() == 0 && rec.normal.z() == 0) {
       rec.normal = -r2.direction();
@@ -597,6 +597,9 @@ using Blend = CSG<blendFunc, float>;
 using BlendMinus = CSG<blendFuncMinus, float>;
 using Mix = CSG<mixFunc, float>;
 
+class csg_program;
+class sdf_cache;
+
 class csg: public hitable {
   public:
     csg() {}
@@ -614,6 +617,7 @@ class csg: public hitable {
         Rcpp::Rcout << "max: " << box.max() << "\n";
         throw std::runtime_error("error");
       }
+      compile_program();
     };
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
@@ -638,6 +642,21 @@ class csg: public hitable {
     std::shared_ptr<ImplicitShape> shapes;
     Float max_dist;
     vec3f last_intersection;
+    //Distance field baked into a sparse brick grid, used for the large steps of sphere tracing.
+    //Objects with identical trees can share one. Returns false, leaving the object unbaked, if its
+    //bounds aren't finite.
+    bool bake(int resolution, int numbercores);
+    std::shared_ptr<sdf_cache> baked;
+    
+  private:
+    void compile_program();
+    //Lower bound on the absolute distance for the next sphere tracing step: from the baked field
+    //when there is one and the point isn't close to the surface, otherwise exact
+    Float march_distance(const point3f& p) const;
+    //Distance and (unnormalized) normal, from the compiled program when the tree could be compiled
+    Float distance(const point3f& p) const;
+    vec3f normal(const point3f& p, Float delta) const;
+    std::shared_ptr<csg_program> program;
 };
 
 inline std::shared_ptr<ImplicitShape> parse_csg(Rcpp::List csg_info) {
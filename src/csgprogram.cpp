@@ -0,0 +1,481 @@
+#include "csgprogram.h"
+
+const int csg_program::kMaxStackDepth;
+
+enum csg_opcode : uint8_t {
+  CSG_NOP,
+  //Shapes: push the shape's distance at the current point
+  CSG_SPHERE, CSG_BOX, CSG_ROUNDED_BOX, CSG_TORUS, CSG_CAPSULE, CSG_CYLINDER, CSG_ELLIPSOID,
+  CSG_ROUNDED_CONE, CSG_CONE, CSG_PYRAMID, CSG_TRIANGLE, CSG_PLANE,
+  //Any other ImplicitShape, through its virtual getDistance()
+  CSG_GENERIC,
+  //Empty lists
+  CSG_INFINITY,
+  //Transforms: push the transformed point before the child, and pop it after
+  CSG_PUSH_TRANSLATE, CSG_PUSH_ROTATE, CSG_PUSH_SCALE, CSG_PUSH_ELONGATE, CSG_PUSH_ELONGATE_ROBUST,
+  CSG_POP, CSG_POP_SCALE, CSG_POP_ELONGATE_ROBUST,
+  //Unary operations on the top value
+  CSG_ROUND, CSG_ONION,
+  //Binary operations on the top two values
+  CSG_UNION, CSG_SUBTRACT, CSG_INTERSECT, CSG_BLEND, CSG_BLEND_MINUS, CSG_MIX,
+  //Skip the next operand if, at every point, it's outside its bounds by at least `margin` more
+  //than the top value (unions and blends), or `margin` less than its negation (subtractions)
+  CSG_SKIP_UNION, CSG_SKIP_SUBTRACT
+};
+
+csg_program::csg_program(std::shared_ptr<ImplicitShape> root_) : root(root_), is_valid(true) {
+  compile(root.get(), 0, 0);
+  if(!is_valid) {
+    code.clear();
+  }
+}
+
+size_t csg_program::emit(uint8_t op, const ImplicitShape* shape, Float param) {
+  instruction in;
+  in.op = op;
+  in.jump = 0;
+  in.param = param;
+  in.shape = shape;
+  code.push_back(in);
+  return(code.size() - 1);
+}
+
+void csg_program::compile_operand(const ImplicitShape* child, uint8_t skip, Float margin, uint8_t combine,
+                                  Float param, int point_depth, int value_depth) {
+  aabb box;
+  size_t skip_index = 0;
+  bool guarded = skip != CSG_NOP && bounds(child, box);
+  if(guarded) {
+    skip_index = emit(skip, nullptr, margin);
+    code[skip_index].bounds[0] = box.min();
+    code[skip_index].bounds[1] = box.max();
+  }
+  compile(child, point_depth, value_depth);
+  size_t combine_index = emit(combine, nullptr, param);
+  if(guarded) {
+    code[skip_index].jump = static_cast<uint32_t>(combine_index);
+  }
+}
+
+void csg_program::compile(const ImplicitShape* shape, int point_depth, int value_depth) {
+  if(!is_valid) {
+    return;
+  }
+  if(value_depth + 1 > kMaxStackDepth || point_depth + 1 > kMaxStackDepth) {
+    is_valid = false;
+    return;
+  }
+  if(dynamic_cast<const csg_sphere*>(shape)) {
+    emit(CSG_SPHERE, shape);
+  } else if(dynamic_cast<const csg_box*>(shape)) {
+    emit(CSG_BOX, shape);
+  } else if(dynamic_cast<const csg_rounded_box*>(shape)) {
+    emit(CSG_ROUNDED_BOX, shape);
+  } else if(dynamic_cast<const csg_torus*>(shape)) {
+    emit(CSG_TORUS, shape);
+  } else if(dynamic_cast<const csg_capsule*>(shape)) {
+    emit(CSG_CAPSULE, shape);
+  } else if(dynamic_cast<const csg_cylinder*>(shape)) {
+    emit(CSG_CYLINDER, shape);
+  } else if(dynamic_cast<const csg_ellipsoid*>(shape)) {
+    emit(CSG_ELLIPSOID, shape);
+  } else if(dynamic_cast<const csg_rounded_cone*>(shape)) {
+    emit(CSG_ROUNDED_CONE, shape);
+  } else if(dynamic_cast<const csg_cone*>(shape)) {
+    emit(CSG_CONE, shape);
+  } else if(dynamic_cast<const csg_pyramid*>(shape)) {
+    emit(CSG_PYRAMID, shape);
+  } else if(dynamic_cast<const csg_triangle*>(shape)) {
+    emit(CSG_TRIANGLE, shape);
+  } else if(dynamic_cast<const csg_plane*>(shape)) {
+    emit(CSG_PLANE, shape);
+  } else if(const csg_list* list = dynamic_cast<const csg_list*>(shape)) {
+    if(list->shapes.empty()) {
+      emit(CSG_INFINITY);
+      return;
+    }
+    compile(list->shapes[0].get(), point_depth, value_depth);
+    for(size_t i = 1; i < list->shapes.size(); i++) {
+      compile_operand(list->shapes[i].get(), CSG_SKIP_UNION, 0, CSG_UNION, 0, point_depth, value_depth + 1);
+    }
+  } else if(const csg_translate* node = dynamic_cast<const csg_translate*>(shape)) {
+    emit(CSG_PUSH_TRANSLATE, shape);
+    compile(node->shape.get(), point_depth + 1, value_depth);
+    emit(CSG_POP);
+  } else if(const csg_rotate* node = dynamic_cast<const csg_rotate*>(shape)) {
+    emit(CSG_PUSH_ROTATE, shape);
+    compile(node->shape.get(), point_depth + 1, value_depth);
+    emit(CSG_POP);
+  } else if(const csg_scale* node = dynamic_cast<const csg_scale*>(shape)) {
+    emit(CSG_PUSH_SCALE, shape);
+    compile(node->shape.get(), point_depth + 1, value_depth);
+    emit(CSG_POP_SCALE, shape);
+  } else if(const csg_elongate* node = dynamic_cast<const csg_elongate*>(shape)) {
+    emit(CSG_PUSH_ELONGATE, shape);
+    compile(node->shape.get(), point_depth + 1, value_depth);
+    emit(CSG_POP);
+  } else if(const csg_elongate_robust* node = dynamic_cast<const csg_elongate_robust*>(shape)) {
+    emit(CSG_PUSH_ELONGATE_ROBUST, shape);
+    compile(node->shape.get(), point_depth + 1, value_depth);
+    emit(CSG_POP_ELONGATE_ROBUST, shape);
+  } else if(const csg_round* node = dynamic_cast<const csg_round*>(shape)) {
+    compile(node->shape.get(), point_depth, value_depth);
+    emit(CSG_ROUND, nullptr, node->r);
+  } else if(const csg_onion* node = dynamic_cast<const csg_onion*>(shape)) {
+    compile(node->shape.get(), point_depth, value_depth);
+    emit(CSG_ONION, nullptr, node->thickness);
+  } else if(const Union* node = dynamic_cast<const Union*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_SKIP_UNION, 0, CSG_UNION, 0, point_depth, value_depth + 1);
+  } else if(const Subtract* node = dynamic_cast<const Subtract*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_SKIP_SUBTRACT, 0, CSG_SUBTRACT, 0, point_depth, value_depth + 1);
+  } else if(const Intersect* node = dynamic_cast<const Intersect*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_NOP, 0, CSG_INTERSECT, 0, point_depth, value_depth + 1);
+  } else if(const Blend* node = dynamic_cast<const Blend*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_SKIP_UNION, std::fmax(node->op.k, 0), CSG_BLEND, node->op.k,
+                    point_depth, value_depth + 1);
+  } else if(const BlendMinus* node = dynamic_cast<const BlendMinus*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_SKIP_SUBTRACT, std::fmax(node->op.k, 0), CSG_BLEND_MINUS, node->op.k,
+                    point_depth, value_depth + 1);
+  } else if(const Mix* node = dynamic_cast<const Mix*>(shape)) {
+    compile(node->shape1.get(), point_depth, value_depth);
+    compile_operand(node->shape2.get(), CSG_NOP, 0, CSG_MIX, node->op.t, point_depth, value_depth + 1);
+  } else {
+    emit(CSG_GENERIC, shape);
+  }
+}
+
+//These bound the solid (where the distance is negative) as well as the surface, since skipping an
+//operand the point is inside of would change the sign of the result. Some differ from bbox():
+//rounding and corner radii grow the shape, and the plane's solid is the unbounded column below it.
+bool csg_program::bounds(const ImplicitShape* shape, aabb& box) const {
+  if(dynamic_cast<const csg_sphere*>(shape) || dynamic_cast<const csg_box*>(shape) ||
+     dynamic_cast<const csg_torus*>(shape) || dynamic_cast<const csg_capsule*>(shape) ||
+     dynamic_cast<const csg_ellipsoid*>(shape) || dynamic_cast<const csg_rounded_cone*>(shape) ||
+     dynamic_cast<const csg_cone*>(shape) || dynamic_cast<const csg_pyramid*>(shape) ||
+     dynamic_cast<const csg_triangle*>(shape)) {
+    return(shape->bbox(0, 1, box));
+  } else if(const csg_rounded_box* node = dynamic_cast<const csg_rounded_box*>(shape)) {
+    node->bbox(0, 1, box);
+    box = Expand(box, std::fmax(node->radius, 0));
+    return(true);
+  } else if(const csg_cylinder* node = dynamic_cast<const csg_cylinder*>(shape)) {
+    node->bbox(0, 1, box);
+    box = Expand(box, std::fmax(node->corner_radius, 0));
+    return(true);
+  } else if(const csg_list* list = dynamic_cast<const csg_list*>(shape)) {
+    if(list->shapes.empty()) {
+      return(false);
+    }
+    aabb total, child;
+    for(const auto& s : list->shapes) {
+      if(!bounds(s.get(), child)) {
+        return(false);
+      }
+      total = surrounding_box(total, child);
+    }
+    box = total;
+    return(true);
+  } else if(const csg_translate* node = dynamic_cast<const csg_translate*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = aabb(box.min() + node->translate, box.max() + node->translate);
+    return(true);
+  } else if(const csg_rotate* node = dynamic_cast<const csg_rotate*>(shape)) {
+    aabb child;
+    if(!bounds(node->shape.get(), child)) {
+      return(false);
+    }
+    aabb total;
+    for(int i = 0; i < 8; i++) {
+      point3f corner(child.bounds[i & 1].x(), child.bounds[(i >> 1) & 1].y(), child.bounds[(i >> 2) & 1].z());
+      total = surrounding_box(total, point3f(node->axis.local_to_world(corner - node->pivot_point) +
+                                             vec3f(node->pivot_point)));
+    }
+    box = total;
+    return(true);
+  } else if(const csg_scale* node = dynamic_cast<const csg_scale*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = aabb(box.min() * node->scale, box.max() * node->scale);
+    return(true);
+  } else if(const csg_elongate* node = dynamic_cast<const csg_elongate*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = Expand(box, Abs(node->elongate));
+    return(true);
+  } else if(const csg_elongate_robust* node = dynamic_cast<const csg_elongate_robust*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = Expand(box, Abs(node->elongate));
+    return(true);
+  } else if(const csg_round* node = dynamic_cast<const csg_round*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = Expand(box, std::fmax(node->r, 0));
+    return(true);
+  } else if(const csg_onion* node = dynamic_cast<const csg_onion*>(shape)) {
+    if(!bounds(node->shape.get(), box)) {
+      return(false);
+    }
+    box = Expand(box, std::fmax(node->thickness, 0));
+    return(true);
+  } else if(const Union* node = dynamic_cast<const Union*>(shape)) {
+    aabb box2;
+    if(!bounds(node->shape1.get(), box) || !bounds(node->shape2.get(), box2)) {
+      return(false);
+    }
+    box = surrounding_box(box, box2);
+    return(true);
+  } else if(const Blend* node = dynamic_cast<const Blend*>(shape)) {
+    //The blend lowers the distance by at most k/4
+    aabb box2;
+    if(!bounds(node->shape1.get(), box) || !bounds(node->shape2.get(), box2)) {
+      return(false);
+    }
+    box = Expand(surrounding_box(box, box2), std::fmax(node->op.k, 0) / 4);
+    return(true);
+  } else if(const Mix* node = dynamic_cast<const Mix*>(shape)) {
+    //Outside both solids, only an interpolation (not an extrapolation) stays positive
+    aabb box2;
+    if(node->op.t < 0 || node->op.t > 1 ||
+       !bounds(node->shape1.get(), box) || !bounds(node->shape2.get(), box2)) {
+      return(false);
+    }
+    box = surrounding_box(box, box2);
+    return(true);
+  } else if(const Subtract* node = dynamic_cast<const Subtract*>(shape)) {
+    return(bounds(node->shape1.get(), box));
+  } else if(const BlendMinus* node = dynamic_cast<const BlendMinus*>(shape)) {
+    return(node->op.k >= 0 && bounds(node->shape1.get(), box));
+  } else if(const Intersect* node = dynamic_cast<const Intersect*>(shape)) {
+    aabb box1, box2;
+    bool has1 = bounds(node->shape1.get(), box1);
+    bool has2 = bounds(node->shape2.get(), box2);
+    if(has1 && has2) {
+      point3f lo = Max(box1.min(), box2.min());
+      point3f hi = Min(box1.max(), box2.max());
+      if(lo.x() <= hi.x() && lo.y() <= hi.y() && lo.z() <= hi.z()) {
+        box = aabb(lo, hi);
+      } else {
+        box = box1;
+      }
+    } else if(has1 || has2) {
+      box = has1 ? box1 : box2;
+    }
+    return(has1 || has2);
+  }
+  return(false);
+}
+
+static inline Float box_distance(const point3f& p, const point3f bounds[2]) {
+  Float dx = std::fmax(std::fmax(bounds[0].x() - p.x(), p.x() - bounds[1].x()), 0);
+  Float dy = std::fmax(std::fmax(bounds[0].y() - p.y(), p.y() - bounds[1].y()), 0);
+  Float dz = std::fmax(std::fmax(bounds[0].z() - p.z(), p.z() - bounds[1].z()), 0);
+  return(std::sqrt(dx * dx + dy * dy + dz * dz));
+}
+
+//Non-virtual call to the shape's own distance function
+template<class T>
+static inline Float leaf_distance(const ImplicitShape* shape, const point3f& p) {
+  return(static_cast<const T*>(shape)->T::getDistance(p));
+}
+
+template<int N>
+void csg_program::evaluate(const point3f* p, Float* out) const {
+  point3f points[kMaxStackDepth][N];
+  Float values[kMaxStackDepth][N];
+  int ps = 0, vs = -1;
+  for(int l = 0; l < N; l++) {
+    points[0][l] = p[l];
+  }
+  const size_t size = code.size();
+  size_t pc = 0;
+  while(pc < size) {
+    const instruction& in = code[pc];
+    switch(in.op) {
+#define CSG_LEAF(OP, T)                                               \
+      case OP: {                                                      \
+        vs++;                                                         \
+        for(int l = 0; l < N; l++) {                                  \
+          values[vs][l] = leaf_distance<T>(in.shape, points[ps][l]);  \
+        }                                                             \
+        break;                                                        \
+      }
+      CSG_LEAF(CSG_SPHERE, csg_sphere)
+      CSG_LEAF(CSG_BOX, csg_box)
+      CSG_LEAF(CSG_ROUNDED_BOX, csg_rounded_box)
+      CSG_LEAF(CSG_TORUS, csg_torus)
+      CSG_LEAF(CSG_CAPSULE, csg_capsule)
+      CSG_LEAF(CSG_CYLINDER, csg_cylinder)
+      CSG_LEAF(CSG_ELLIPSOID, csg_ellipsoid)
+      CSG_LEAF(CSG_ROUNDED_CONE, csg_rounded_cone)
+      CSG_LEAF(CSG_CONE, csg_cone)
+      CSG_LEAF(CSG_PYRAMID, csg_pyramid)
+      CSG_LEAF(CSG_TRIANGLE, csg_triangle)
+      CSG_LEAF(CSG_PLANE, csg_plane)
+#undef CSG_LEAF
+      case CSG_GENERIC: {
+        vs++;
+        for(int l = 0; l < N; l++) {
+          values[vs][l] = in.shape->getDistance(points[ps][l]);
+        }
+        break;
+      }
+      case CSG_INFINITY: {
+        vs++;
+        for(int l = 0; l < N; l++) {
+          values[vs][l] = INFINITY;
+        }
+        break;
+      }
+      case CSG_PUSH_TRANSLATE: {
+        const csg_translate* node = static_cast<const csg_translate*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          points[ps + 1][l] = points[ps][l] - node->translate;
+        }
+        ps++;
+        break;
+      }
+      case CSG_PUSH_ROTATE: {
+        const csg_rotate* node = static_cast<const csg_rotate*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          points[ps + 1][l] = node->axis.world_to_local(points[ps][l] - node->pivot_point) +
+            vec3f(node->pivot_point);
+        }
+        ps++;
+        break;
+      }
+      case CSG_PUSH_SCALE: {
+        const csg_scale* node = static_cast<const csg_scale*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          points[ps + 1][l] = points[ps][l] / node->scale;
+        }
+        ps++;
+        break;
+      }
+      case CSG_PUSH_ELONGATE: {
+        const csg_elongate* node = static_cast<const csg_elongate*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          vec3f from = points[ps][l] - node->center;
+          point3f q = from - clamp(from, -node->elongate, node->elongate);
+          points[ps + 1][l] = q + node->center;
+        }
+        ps++;
+        break;
+      }
+      case CSG_PUSH_ELONGATE_ROBUST: {
+        const csg_elongate_robust* node = static_cast<const csg_elongate_robust*>(in.shape);
+        const static vec3f zeros(0,0,0);
+        const static vec3f inf(INFINITY,INFINITY,INFINITY);
+        for(int l = 0; l < N; l++) {
+          vec3f from = points[ps][l] - node->center;
+          vec3f q = Abs(from) - node->elongate;
+          points[ps + 1][l] = sgn(from) * clamp(q, zeros, inf) + vec3f(node->center);
+        }
+        ps++;
+        break;
+      }
+      case CSG_POP: {
+        ps--;
+        break;
+      }
+      case CSG_POP_SCALE: {
+        const csg_scale* node = static_cast<const csg_scale*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          values[vs][l] *= node->scale;
+        }
+        ps--;
+        break;
+      }
+      case CSG_POP_ELONGATE_ROBUST: {
+        const csg_elongate_robust* node = static_cast<const csg_elongate_robust*>(in.shape);
+        for(int l = 0; l < N; l++) {
+          vec3f q = Abs(points[ps - 1][l] - node->center) - node->elongate;
+          values[vs][l] += std::fmin(MaxComponent(q), 0.0);
+        }
+        ps--;
+        break;
+      }
+      case CSG_ROUND: {
+        for(int l = 0; l < N; l++) {
+          values[vs][l] -= in.param;
+        }
+        break;
+      }
+      case CSG_ONION: {
+        for(int l = 0; l < N; l++) {
+          values[vs][l] = std::fabs(values[vs][l]) - in.param;
+        }
+        break;
+      }
+#define CSG_BINARY(OP, FUNC)                                          \
+      case OP: {                                                      \
+        const FUNC;                                                   \
+        vs--;                                                         \
+        for(int l = 0; l < N; l++) {                                  \
+          values[vs][l] = func(values[vs][l], values[vs + 1][l]);     \
+        }                                                             \
+        break;                                                        \
+      }
+      CSG_BINARY(CSG_UNION, unionFunc func)
+      CSG_BINARY(CSG_SUBTRACT, subtractFunc func)
+      CSG_BINARY(CSG_INTERSECT, intersectionFunc func)
+      CSG_BINARY(CSG_BLEND, blendFunc func(in.param))
+      CSG_BINARY(CSG_BLEND_MINUS, blendFuncMinus func(in.param))
+      CSG_BINARY(CSG_MIX, mixFunc func(in.param))
+#undef CSG_BINARY
+      case CSG_SKIP_UNION:
+      case CSG_SKIP_SUBTRACT: {
+        Float dist[N];
+        bool skip = true;
+        for(int l = 0; l < N; l++) {
+          dist[l] = box_distance(points[ps][l], in.bounds);
+          Float limit = in.op == CSG_SKIP_UNION ? values[vs][l] + in.param : in.param - values[vs][l];
+          skip = skip && dist[l] > 0 && dist[l] >= limit;
+        }
+        if(skip) {
+          vs++;
+          for(int l = 0; l < N; l++) {
+            values[vs][l] = dist[l];
+          }
+          pc = in.jump;
+          continue;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    pc++;
+  }
+  for(int l = 0; l < N; l++) {
+    out[l] = values[0][l];
+  }
+}
+
+Float csg_program::distance(const point3f& p) const {
+  Float d;
+  evaluate<1>(&p, &d);
+  return(d);
+}
+
+vec3f csg_program::gradient(const point3f& p, Float delta) const {
+  const vec3f k[4] = {vec3f(1,-1,-1), vec3f(-1,-1,1), vec3f(-1,1,-1), vec3f(1,1,1)};
+  point3f taps[4];
+  for(int i = 0; i < 4; i++) {
+    taps[i] = p + k[i] * delta;
+  }
+  Float d[4];
+  evaluate<4>(taps, d);
+  return(k[0] * d[0] + k[1] * d[1] + k[2] * d[2] + k[3] * d[3]);
+}
@@ -0,0 +1,60 @@
+#ifndef CSGPROGRAMH
+#define CSGPROGRAMH
+
+#include "csg.h"
+#include <vector>
+#include <cstdint>
+
+//A CSG tree compiled into a flat instruction stream, evaluated with a point stack (for the
+//transform nodes) and a value stack (for the operations) instead of virtual calls down the tree.
+//Shape instructions call the node's getDistance() directly, so the distance functions stay in
+//one place.
+//
+//The second operand of unions, lists, blends and subtractions is guarded by its bounding box: if
+//the current point is far enough outside the box that the operand can't change the result (further
+//than the distance accumulated so far for unions, plus the blend radius for blends), its
+//instructions are skipped and the box distance stands in for it. Programs are evaluated for one
+//point (sphere tracing) or four at once (the four taps of a tetrahedral gradient).
+class csg_program {
+public:
+  //Trees deeper than the fixed evaluation stacks can't be compiled; check valid()
+  csg_program(std::shared_ptr<ImplicitShape> root);
+  bool valid() const {
+    return(is_valid);
+  }
+  Float distance(const point3f& p) const;
+  //Unnormalized gradient from four evaluations at the corners of a tetrahedron of size `delta`
+  vec3f gradient(const point3f& p, Float delta) const;
+  size_t size() const {
+    return(code.size());
+  }
+
+  static const int kMaxStackDepth = 64;
+
+private:
+  struct instruction {
+    uint8_t op;
+    //Target of a skip: the instruction combining the skipped child
+    uint32_t jump;
+    //Blend radius (blends and skips), or mix factor
+    Float param;
+    const ImplicitShape* shape;
+    //Bounds of the skipped child
+    point3f bounds[2];
+  };
+  void compile(const ImplicitShape* shape, int point_depth, int value_depth);
+  //Compiles the second operand of a binary operation and the operation combining it with the
+  //first, guarded by `skip` (0 for none)
+  void compile_operand(const ImplicitShape* child, uint8_t skip, Float margin, uint8_t combine, Float param,
+                       int point_depth, int value_depth);
+  size_t emit(uint8_t op, const ImplicitShape* shape = nullptr, Float param = 0);
+  //Conservative bounds of the surface of `shape`, false if it can't be bounded
+  bool bounds(const ImplicitShape* shape, aabb& box) const;
+  template<int N> void evaluate(const point3f* p, Float* out) const;
+
+  std::shared_ptr<ImplicitShape> root;
+  std::vector<instruction> code;
+  bool is_valid;
+};
+
+#endif
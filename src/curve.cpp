@@ -1,6 +1,6 @@
 #include "curve.h"
 
-static point3f BlossomBezier(const point3f p[4], Float u0, Float u1, Float u2) {
+point3f BlossomBezier(const point3f p[4], Float u0, Float u1, Float u2) {
   point3f a[3] = { lerp(u0, p[0], p[1]),
                 lerp(u0, p[1], p[2]),
                 lerp(u0, p[2], p[3]) };
@@ -9,7 +9,7 @@ static point3f BlossomBezier(const point3f p[4], Float u0, Float u1, Float u2) {
 }
 
 
-static point3f EvalBezier(const point3f cp[4], Float u, vec3f *deriv = nullptr) {
+point3f EvalBezier(const point3f cp[4], Float u, vec3f *deriv) {
   point3f cp1[3] = {lerp(u, cp[0], cp[1]), lerp(u, cp[1], cp[2]),
                     lerp(u, cp[2], cp[3])};
   point3f cp2[2] = {lerp(u, cp1[0], cp1[1]), lerp(u, cp1[1], cp1[2])};
@@ -30,7 +30,7 @@ static point3f EvalBezier(const point3f cp[4], Float u, vec3f *deriv = nullptr)
 }
 
 
-inline void SubdivideBezier(const point3f cp[4], point3f cpSplit[7]) {
+void SubdivideBezier(const point3f cp[4], point3f cpSplit[7]) {
   cpSplit[0] = cp[0];
   cpSplit[1] = (cp[0] + cp[1]) / 2;
   cpSplit[2] = (cp[0] + 2 * cp[1] + cp[2]) / 4;
@@ -7,6 +7,11 @@
 
 enum class CurveType { Flat, Cylinder, Ribbon };
 
+//Bezier helpers shared with `curve_set`
+point3f BlossomBezier(const point3f p[4], Float u0, Float u1, Float u2);
+point3f EvalBezier(const point3f cp[4], Float u, vec3f *deriv = nullptr);
+void SubdivideBezier(const point3f cp[4], point3f cpSplit[7]);
+
 struct CurveCommon {
   CurveCommon(const vec3f c[4], Float w0, Float w1, CurveType type,
               const vec3f *norm);
@@ -0,0 +1,365 @@
+#include "curveset.h"
+#include "bvhstats.h"
+#include "onbh.h"
+#include <algorithm>
+
+constexpr size_t kMaxLeafSegments = kPacketWidth;
+//Refinement depth is capped as in `curve`; a depth-first refinement holds at most one pending
+//half per level
+constexpr int kMaxRefineDepth = 10;
+
+//Orthonormal frame looking down the ray, with the y axis perpendicular to the segment's chord so
+//the projected segment is thin in y (the frame `curve` builds with LookAt())
+struct ray_frame {
+  ray_frame(const point3f& origin, const vec3f& d, const point3f cp[4]) : o(origin) {
+    ez = unit_vector(d);
+    ey = cross(ez, cp[3] - cp[0]);
+    if(ey.squared_length() == 0) {
+      onb uvw;
+      uvw.build_from_w(ez);
+      ey = uvw.v();
+    } else {
+      ey.make_unit_vector();
+    }
+    ex = cross(ey, ez);
+  }
+  point3f to_ray(const point3f& p) const {
+    vec3f op = p - o;
+    return(point3f(dot(op, ex), dot(op, ey), dot(op, ez)));
+  }
+  point3f o;
+  vec3f ex, ey, ez;
+};
+
+static inline void segment_points(const curve_set::segment& s, point3f cp[4]) {
+  for(int i = 0; i < 4; i++) {
+    cp[i] = point3f(s.cp[i][0], s.cp[i][1], s.cp[i][2]);
+  }
+}
+
+static inline Float segment_width(const curve_set::segment& s, Float u) {
+  return(lerp((u - s.u[0]) / (s.u[1] - s.u[0]), (Float)s.width[0], (Float)s.width[1]));
+}
+
+//Whether the projected control points, widened by half of `width`, can reach the ray
+static inline bool overlaps_ray(const point3f cp[4], Float width, Float z_max) {
+  Float half = 0.5f * width;
+  for(int k = 0; k < 3; k++) {
+    Float lo = ffmin(ffmin(cp[0].e[k], cp[1].e[k]), ffmin(cp[2].e[k], cp[3].e[k]));
+    Float hi = ffmax(ffmax(cp[0].e[k], cp[1].e[k]), ffmax(cp[2].e[k], cp[3].e[k]));
+    if(hi + half < 0 || lo - half > (k == 2 ? z_max : 0)) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+curve_set::curve_set(const double* control_points, const double* widths, const double* normals, size_t num_curves,
+                     CurveType type_, int split_depth, std::shared_ptr<material> mat, int bvh_type,
+                     std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                     bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), mat_ptr(mat), type(type_) {
+  if(split_depth < 0 || split_depth > 8) {
+    throw std::runtime_error("Curve set split depth must be between 0 and 8");
+  }
+  size_t pieces = size_t(1) << split_depth;
+  segments.reserve(num_curves * pieces);
+  std::vector<aabb> bounds;
+  bounds.reserve(num_curves * pieces);
+  for(size_t i = 0; i < num_curves; i++) {
+    const double* c = control_points + 12 * i;
+    for(int j = 0; j < 12; j++) {
+      if(!std::isfinite(c[j])) {
+        throw std::runtime_error("Invalid control point in curve set (curve " + std::to_string(i + 1) + ")");
+      }
+    }
+    Float w0 = widths[2 * i], w1 = widths[2 * i + 1];
+    if(!(w0 >= 0) || !(w1 >= 0) || !std::isfinite(w0) || !std::isfinite(w1)) {
+      throw std::runtime_error("Invalid width in curve set (curve " + std::to_string(i + 1) + ")");
+    }
+    point3f cp[4];
+    for(int j = 0; j < 4; j++) {
+      cp[j] = point3f(c[3 * j], c[3 * j + 1], c[3 * j + 2]);
+    }
+    for(size_t k = 0; k < pieces; k++) {
+      Float u0 = static_cast<Float>(k) / pieces;
+      Float u1 = static_cast<Float>(k + 1) / pieces;
+      point3f scp[4] = {BlossomBezier(cp, u0, u0, u0), BlossomBezier(cp, u0, u0, u1),
+                        BlossomBezier(cp, u0, u1, u1), BlossomBezier(cp, u1, u1, u1)};
+      segment s;
+      for(int j = 0; j < 4; j++) {
+        for(int a = 0; a < 3; a++) {
+          s.cp[j][a] = static_cast<float>(scp[j].e[a]);
+        }
+      }
+      s.width[0] = static_cast<float>(lerp(u0, w0, w1));
+      s.width[1] = static_cast<float>(lerp(u1, w0, w1));
+      s.u[0] = static_cast<float>(u0);
+      s.u[1] = static_cast<float>(u1);
+      s.curve = static_cast<uint32_t>(i);
+      segments.push_back(s);
+      bounds.push_back(Expand(surrounding_box(aabb(scp[0], scp[1]), aabb(scp[2], scp[3])),
+                              std::fmax(s.width[0], s.width[1]) * 0.5f));
+    }
+  }
+  if(type == CurveType::Ribbon) {
+    ribbon_normals.resize(8 * num_curves);
+    for(size_t i = 0; i < num_curves; i++) {
+      const double* n = normals + 6 * i;
+      vec3f n0 = unit_vector(vec3f(n[0], n[1], n[2]));
+      vec3f n1 = unit_vector(vec3f(n[3], n[4], n[5]));
+      Float angle = std::acos(clamp(dot(n0, n1), 0, 1));
+      float* out = &ribbon_normals[8 * i];
+      for(int a = 0; a < 3; a++) {
+        out[a] = n0.e[a];
+        out[3 + a] = n1.e[a];
+      }
+      out[6] = angle;
+      out[7] = 1.0 / std::sin(angle);
+    }
+  }
+
+  size_t count = segments.size();
+  std::vector<uint32_t> order(count);
+  for(size_t i = 0; i < count; i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  if(count > 0) {
+    nodes.reserve(2 * count / kMaxLeafSegments + 1);
+    BuildCompactBVH(nodes, order, 0, count, kMaxLeafSegments, bvh_type, 0,
+                    [&bounds](uint32_t seg) {return(bounds[seg]);});
+    nodes.shrink_to_fit();
+  }
+  //Store the segments in leaf order
+  std::vector<segment> ordered(count);
+  for(size_t i = 0; i < count; i++) {
+    ordered[i] = segments[order[i]];
+  }
+  segments.swap(ordered);
+}
+
+normal3f curve_set::ribbon_normal(uint32_t curve, Float u) const {
+  const float* n = &ribbon_normals[8 * curve];
+  Float sin0 = std::sin((1 - u) * n[6]) * n[7];
+  Float sin1 = std::sin(u * n[6]) * n[7];
+  if(!std::isnan(sin0) && !std::isnan(sin1)) {
+    return(normal3f(sin0 * n[0] + sin1 * n[3], sin0 * n[1] + sin1 * n[4], sin0 * n[2] + sin1 * n[5]));
+  }
+  return(normal3f(n[0], n[1], n[2]));
+}
+
+//Refines the segment as `curve::recursiveIntersect` does, depth first with the nearer half of
+//each split visited first, keeping the closest hit in (t_min, t_max)
+bool curve_set::intersect_segment(uint32_t index, const ray& r, Float t_min, Float t_max, curve_hit& hit) const {
+  const segment& s = segments[index];
+  point3f obj[4];
+  segment_points(s, obj);
+  ray_frame frame(r.origin(), r.direction(), obj);
+  point3f cp[4] = {frame.to_ray(obj[0]), frame.to_ray(obj[1]), frame.to_ray(obj[2]), frame.to_ray(obj[3])};
+  Float ray_length = r.direction().length();
+  Float max_width = std::fmax(s.width[0], s.width[1]);
+  if(!overlaps_ray(cp, max_width, ray_length * t_max)) {
+    return(false);
+  }
+
+  //Refinement depth from the flatness of the projected segment, as in `curve`
+  Float L0 = 0;
+  for(int i = 0; i < 2; ++i) {
+    for(int k = 0; k < 3; k++) {
+      L0 = std::fmax(L0, std::fabs(cp[i].e[k] - 2 * cp[i + 1].e[k] + cp[i + 2].e[k]));
+    }
+  }
+  Float eps = max_width * .05f;
+  int max_depth = 0;
+  Float ratio = 1.41421356237f * 6.f * L0 / (8.f * eps);
+  if(ratio >= 1) {
+    max_depth = clamp(static_cast<int>(std::round(std::log2(ratio))) / 2, 0, kMaxRefineDepth);
+  }
+
+  struct pending {
+    point3f cp[4];
+    Float u0, u1;
+    int depth;
+  };
+  pending stack[kMaxRefineDepth + 2];
+  int stack_size = 0;
+  stack[stack_size++] = {{cp[0], cp[1], cp[2], cp[3]}, s.u[0], s.u[1], max_depth};
+  bool found = false;
+  while(stack_size > 0) {
+    pending p = stack[--stack_size];
+    Float width = std::fmax(segment_width(s, p.u0), segment_width(s, p.u1));
+    if(!overlaps_ray(p.cp, width, ray_length * t_max)) {
+      continue;
+    }
+    if(p.depth > 0) {
+      point3f split[7];
+      SubdivideBezier(p.cp, split);
+      Float u_mid = (p.u0 + p.u1) / 2;
+      pending halves[2] = {{{split[0], split[1], split[2], split[3]}, p.u0, u_mid, p.depth - 1},
+                           {{split[3], split[4], split[5], split[6]}, u_mid, p.u1, p.depth - 1}};
+      //The half starting nearer the ray origin is popped first
+      int near = halves[0].cp[0].z() <= halves[1].cp[3].z() ? 0 : 1;
+      stack[stack_size++] = halves[1 - near];
+      stack[stack_size++] = halves[near];
+      continue;
+    }
+    const point3f* c = p.cp;
+    //Test sample point against tangent perpendicular at curve start and end
+    if((c[1].y() - c[0].y()) * -c[0].y() + c[0].x() * (c[0].x() - c[1].x()) < 0) {
+      continue;
+    }
+    if((c[2].y() - c[3].y()) * -c[3].y() + c[3].x() * (c[3].x() - c[2].x()) < 0) {
+      continue;
+    }
+    //Line parameter of the point nearest the ray
+    Float sx = c[3].x() - c[0].x(), sy = c[3].y() - c[0].y();
+    Float denom = sx * sx + sy * sy;
+    if(denom == 0) {
+      continue;
+    }
+    Float w = (-c[0].x() * sx - c[0].y() * sy) / denom;
+    Float u = clamp(lerp(w, p.u0, p.u1), p.u0, p.u1);
+    Float hit_width = segment_width(s, u);
+    if(type == CurveType::Ribbon) {
+      hit_width *= AbsDot(ribbon_normal(s.curve, u), r.direction()) / ray_length;
+    }
+    vec3f dpcdw;
+    point3f pc = EvalBezier(c, clamp(w, 0, 1), &dpcdw);
+    Float dist2 = pc.x() * pc.x() + pc.y() * pc.y();
+    if(dist2 > hit_width * hit_width * .25f) {
+      continue;
+    }
+    Float t = pc.z() / ray_length;
+    if(pc.z() < 0 || t <= t_min || t >= t_max) {
+      continue;
+    }
+    Float dist = std::sqrt(dist2);
+    Float edge = dpcdw.x() * -pc.y() + pc.x() * dpcdw.y();
+    hit.segment = index;
+    hit.t = t;
+    hit.u = u;
+    hit.v = edge > 0 ? 0.5f + dist / hit_width : 0.5f - dist / hit_width;
+    hit.hit_width = hit_width;
+    t_max = t;
+    found = true;
+  }
+  return(found);
+}
+
+bool curve_set::closest_hit(const ray& r, Float t_min, Float t_max, curve_hit& hit) const {
+  if(nodes.empty()) {
+    return(false);
+  }
+  uint32_t stack[kTraversalStackSize];
+  int stack_size = 0;
+  uint32_t current = 0;
+  point3f o = r.origin();
+  bool found = false;
+  uint64_t nodes_visited = 0, segments_tested = 0;
+  while(true) {
+    const compact_bvh_node& node = nodes[current];
+    if(node_hit(node, r, o, t_min, t_max)) {
+      nodes_visited++;
+      if(node.count > 0) {
+        segments_tested += node.count;
+        for(uint32_t i = node.offset; i < node.offset + node.count; i++) {
+          if(intersect_segment(i, r, t_min, t_max, hit)) {
+            t_max = hit.t;
+            found = true;
+          }
+        }
+        if(stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else if(r.sign[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if(stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::nodes_visited.fetch_add(nodes_visited, std::memory_order_relaxed);
+    TraversalStats::primitives_tested.fetch_add(segments_tested, std::memory_order_relaxed);
+  }
+  return(found);
+}
+
+//Fills in the record as `curve` does for each curve type
+void curve_set::fill_record(const curve_hit& hit, const ray& r, hit_record& rec) const {
+  const segment& s = segments[hit.segment];
+  point3f cp[4];
+  segment_points(s, cp);
+  vec3f dpdu;
+  EvalBezier(cp, (hit.u - s.u[0]) / (s.u[1] - s.u[0]), &dpdu);
+  rec.t = hit.t;
+  rec.dpdu = dpdu;
+  if(type == CurveType::Cylinder) {
+    ray_frame frame(r.origin(), r.direction(), cp);
+    vec3f dpdu_plane(dot(dpdu, frame.ex), dot(dpdu, frame.ey), dot(dpdu, frame.ez));
+    vec3f dpdv_plane = unit_vector(vec3f(-dpdu_plane.y(), dpdu_plane.x(), 0)) * hit.hit_width;
+    Float theta = lerp(hit.v, -90.0, 90.0);
+    dpdv_plane = Rotate(theta, dpdu_plane)(dpdv_plane);
+    rec.dpdv = dpdv_plane.x() * frame.ex + dpdv_plane.y() * frame.ey + dpdv_plane.z() * frame.ez;
+    rec.normal = unit_vector(-cross(rec.dpdu, rec.dpdv));
+  } else if(type == CurveType::Ribbon) {
+    normal3f n = ribbon_normal(s.curve, hit.u);
+    rec.dpdv = unit_vector(cross(vec3f(n.x(), n.y(), n.z()), rec.dpdu)) * hit.hit_width;
+    rec.normal = dot(n, r.direction()) > 0 ? -n : n;
+  } else {
+    rec.dpdv = unit_vector(cross(rec.dpdu, -r.direction()));
+    rec.normal = unit_vector(-r.direction());
+  }
+  rec.dpdu.make_unit_vector();
+  rec.u = hit.u;
+  rec.v = hit.v;
+  rec.mat_ptr = mat_ptr.get();
+  rec.has_bump = false;
+  rec.pError = vec3f(hit.hit_width, hit.hit_width, hit.hit_width);
+  rec.p = r.point_at_parameter(hit.t);
+  rec.shape = this;
+  rec.alpha_miss = false;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation ? -1 : 1;
+}
+
+bool curve_set::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2 = (*WorldToObject)(r);
+  curve_hit hit;
+  if(!closest_hit(r2, t_min, t_max, hit)) {
+    return(false);
+  }
+  fill_record(hit, r2, rec);
+  return(true);
+}
+
+bool curve_set::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r2 = (*WorldToObject)(r);
+  curve_hit hit;
+  if(!closest_hit(r2, t_min, t_max, hit)) {
+    return(false);
+  }
+  fill_record(hit, r2, rec);
+  return(true);
+}
+
+bool curve_set::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(nodes.empty()) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(aabb(nodes[0].bounds[0], nodes[0].bounds[1]));
+  return(true);
+}
+
+size_t curve_set::memory_bytes() const {
+  return(segments.capacity() * sizeof(segment) + ribbon_normals.capacity() * sizeof(float) +
+         nodes.capacity() * sizeof(compact_bvh_node));
+}
@@ -0,0 +1,67 @@
+#ifndef CURVESETH
+#define CURVESETH
+
+#include "hitable.h"
+#include "material.h"
+#include "compactmesh.h"
+#include "curve.h"
+#include <vector>
+#include <cstdint>
+
+//Set of cubic Bezier curves (hair, fur, grass) sharing one material, curve type and transform.
+//Each curve is split into 2^split_depth segments when the set is built, so BVH leaves bound short,
+//nearly straight pieces of each strand instead of one loose box around a diagonal curve. Segments
+//are stored as floats (68 bytes each) in BVH order, and leaves hold up to four of them.
+//
+//Intersection follows `curve`: the segment is projected into a frame looking down the ray and
+//refined by subdivision until it is flat enough to test as a ribbon. The refinement uses an
+//explicit stack instead of recursion, keeps the closest hit rather than the first one found, and
+//the frame is built from dot products without the matrix inverse `curve` computes for every test.
+class curve_set : public hitable {
+public:
+  //`control_points` holds 12 values (four x, y, z control points) per curve, `widths` the widths at
+  //the start and end of each curve, and `normals` the normals at the start and end of each curve
+  //(six values per curve, ribbons only)
+  curve_set(const double* control_points, const double* widths, const double* normals, size_t num_curves,
+            CurveType type, int split_depth, std::shared_ptr<material> mat, int bvh_type,
+            std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+            bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("CurveSet"));
+  }
+  size_t num_segments() const {
+    return(segments.size());
+  }
+  //Bytes used by the segments, the ribbon normals and the BVH
+  size_t memory_bytes() const;
+
+  struct segment {
+    float cp[4][3];
+    float width[2];
+    //Curve parameters of the segment's ends
+    float u[2];
+    uint32_t curve;
+  };
+  std::vector<segment> segments;
+  std::vector<compact_bvh_node> nodes;
+  //Per curve: the normal at each end and the angle between them, with its inverse sine (ribbons only)
+  std::vector<float> ribbon_normals;
+  std::shared_ptr<material> mat_ptr;
+
+private:
+  //A point on a curve hit by a ray, as found by the ribbon test
+  struct curve_hit {
+    uint32_t segment;
+    Float t, u, v, hit_width;
+  };
+  bool intersect_segment(uint32_t index, const ray& r, Float t_min, Float t_max, curve_hit& hit) const;
+  bool closest_hit(const ray& r, Float t_min, Float t_max, curve_hit& hit) const;
+  normal3f ribbon_normal(uint32_t curve, Float u) const;
+  void fill_record(const curve_hit& hit, const ray& r, hit_record& rec) const;
+  CurveType type;
+};
+
+#endif
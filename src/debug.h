@@ -9,12 +9,14 @@
 #include "material.h"
 #include "RcppThread.h"
 #include "rng.h"
+#include "bvhstats.h"
 
 
 #ifdef DEBUGBVH
 inline Float debug_bvh(const ray& r, hitable *world, random_gen &rng) {
   hit_record hrec;
   hrec.bvh_nodes = 0.0;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     return(hrec.bvh_nodes);
   } else {
@@ -26,6 +28,7 @@ inline Float debug_bvh(const ray& r, hitable *world, random_gen &rng) {
 
 inline Float calculate_depth(const ray& r, hitable *world, random_gen &rng) {
   hit_record hrec;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     return((r.origin()-hrec.p).length());
   } else {
@@ -42,6 +45,7 @@ inline vec3f calculate_normals(const ray& r, hitable *world, size_t max_depth, r
   for(size_t i = 0; i < max_depth; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       //Some lights can be invisible until after diffuse bounce
@@ -90,6 +94,7 @@ inline vec3f calculate_normals(const ray& r, hitable *world, size_t max_depth, r
 
 inline vec3f calculate_uv(const ray& r, hitable *world, random_gen &rng) {
   hit_record hrec;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     return(vec3f(hrec.u,hrec.v,1-hrec.u-hrec.v));
   } else {
@@ -99,6 +104,7 @@ inline vec3f calculate_uv(const ray& r, hitable *world, random_gen &rng) {
 
 inline vec3f calculate_dpduv(const ray& r, hitable *world, random_gen &rng, bool u) {
   hit_record hrec;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     if(u) {
       return((unit_vector(hrec.dpdu) + 1)/2);
@@ -115,6 +121,7 @@ inline point3f calculate_color(const ray& r, hitable *world, random_gen &rng) {
   scatter_record srec;
   ray r2 = r;
   bool invisible = false;
+  TraversalStats::CountRay();
   if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) {
     point3f emit = hrec.mat_ptr->emitted(r2, hrec, hrec.u, hrec.v, hrec.p, invisible);
     if(emit.x() != 0 || emit.y() != 0 || emit.z() != 0) {
@@ -138,6 +145,7 @@ inline point3f quick_render(const ray& r, hitable *world, random_gen &rng, vec3f
   scatter_record srec;
   ray r2 = r;
   bool invisible = false;
+  TraversalStats::CountRay();
   if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) {
     point3f emit = hrec.mat_ptr->emitted(r2, hrec, hrec.u, hrec.v, hrec.p, invisible);
     if(emit.x() != 0 || emit.y() != 0 || emit.z() != 0) {
@@ -193,6 +201,7 @@ inline point3f calculate_position(const ray& r, hitable *world, hitable_list *hl
   for(size_t i = 0; i < max_depth; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       //Some lights can be invisible until after diffuse bounce
@@ -244,6 +253,7 @@ inline point3f calculate_bounce_dir(const ray& r, hitable *world, hitable_list *
   for(size_t i = 0; i < max_depth; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       //Some lights can be invisible until after diffuse bounce
@@ -289,6 +299,7 @@ inline point3f calculate_bounce_dir(const ray& r, hitable *world, hitable_list *
 inline Float calculate_time(const ray& r, hitable *world, hitable_list *hlist,
                                     size_t max_depth, random_gen& rng) {
   hit_record hrec;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     return(hrec.t);
   } else {
@@ -308,6 +319,7 @@ inline uint32_t hash32(uint32_t x) {
 inline point3f calculate_shape(const ray& r, hitable *world, hitable_list *hlist,
                             size_t max_depth, random_gen& rng) {
   hit_record hrec;
+  TraversalStats::CountRay();
   if(world->hit(r, 0.001, FLT_MAX, hrec, rng)) {
     uint32_t r =  reinterpret_type<material*, uint32_t>(hrec.mat_ptr) % 65536;
     uint32_t g = (reinterpret_type<material*, uint32_t>(hrec.mat_ptr) % 65536) + 1;
@@ -333,6 +345,7 @@ inline Float calculate_pdf(const ray& r, hitable *world, hitable_list *hlist,
   for(size_t i = 0; i < max_depth; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       //Some lights can be invisible until after diffuse bounce
@@ -383,6 +396,7 @@ inline Float calculate_error(const ray& r, hitable *world, hitable_list *hlist,
   for(size_t i = 0; i < 2; i++) {
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       //Some lights can be invisible until after diffuse bounce
@@ -426,6 +440,7 @@ inline Float calculate_bounces(const ray& r, hitable *world, hitable_list *hlist
     // RcppThread::Rcout << "Ray origin: " << r2.A << "\n";
     bool is_invisible = false;
     hit_record hrec;
+    TraversalStats::CountRay();
     if(world->hit(r2, 0.001, FLT_MAX, hrec, rng)) { //generated hit record, world space
       scatter_record srec;
       emit_color = throughput * hrec.mat_ptr->emitted(r2, hrec, hrec.u, hrec.v, hrec.p, is_invisible);
@@ -0,0 +1,409 @@
+#include "gridmedium.h"
+#include "bvhstats.h"
+#include "mappedfile.h"
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <sstream>
+
+const int grid_medium::kBrickSize;
+const size_t grid_medium::kBrickVoxels;
+const uint32_t grid_medium::kEmptyBrick;
+
+static inline int min_axis(const Float t[3]) {
+  return(t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2));
+}
+
+grid_medium::grid_medium(const float* density, const int dims_[3], Float voxel_size_, Float density_scale_,
+                         std::shared_ptr<texture> albedo,
+                         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject) :
+  hitable(ObjectToWorld, WorldToObject, false), voxel_size(voxel_size_), density_scale(density_scale_) {
+  if(!(voxel_size > 0)) {
+    throw std::runtime_error("Voxel size must be greater than zero");
+  }
+  if(!(density_scale >= 0) || !std::isfinite(density_scale)) {
+    throw std::runtime_error("Volume density scale must be finite and non-negative");
+  }
+  inv_voxel_size = 1 / voxel_size;
+  phase_function = std::make_shared<isotropic>(albedo);
+  size_t num_bricks = 1;
+  for(int k = 0; k < 3; k++) {
+    dims[k] = dims_[k];
+    if(dims[k] < 1) {
+      throw std::runtime_error("Volume grid dimensions must be at least one");
+    }
+    brick_dims[k] = (dims[k] + kBrickSize - 1) / kBrickSize;
+    num_bricks *= brick_dims[k];
+    grid_min[k] = -static_cast<Float>(dims[k]) * voxel_size / 2;
+  }
+  bricks.assign(num_bricks, kEmptyBrick);
+  majorants.assign(num_bricks, 0);
+  const int nx = dims[0], ny = dims[1], nz = dims[2];
+  for(int z = 0; z < nz; z++) {
+    for(int y = 0; y < ny; y++) {
+      for(int x = 0; x < nx; x++) {
+        float value = density[x + static_cast<size_t>(nx) * (y + static_cast<size_t>(ny) * z)];
+        if(!(value >= 0) || !std::isfinite(value)) {
+          throw std::runtime_error("Volume densities must be finite and non-negative");
+        }
+        if(value == 0) {
+          continue;
+        }
+        int v[3] = {x, y, z};
+        size_t b = x / kBrickSize + brick_dims[0] * (y / kBrickSize + static_cast<size_t>(brick_dims[1]) * (z / kBrickSize));
+        if(bricks[b] == kEmptyBrick) {
+          bricks[b] = static_cast<uint32_t>(brick_voxels.size() / kBrickVoxels);
+          brick_voxels.resize(brick_voxels.size() + kBrickVoxels, 0);
+        }
+        brick_voxels[bricks[b] * kBrickVoxels + (x % kBrickSize) +
+          kBrickSize * ((y % kBrickSize) + kBrickSize * (z % kBrickSize))] = value;
+        //Trilinear lookups reach one voxel past a brick's edges, so every brick within a voxel of
+        //this one has to bound it
+        int lo[3], hi[3];
+        for(int k = 0; k < 3; k++) {
+          lo[k] = std::max(v[k] - 1, 0) / kBrickSize;
+          hi[k] = std::min(v[k] + 1, dims[k] - 1) / kBrickSize;
+        }
+        for(int bz = lo[2]; bz <= hi[2]; bz++) {
+          for(int by = lo[1]; by <= hi[1]; by++) {
+            for(int bx = lo[0]; bx <= hi[0]; bx++) {
+              float& m = majorants[bx + brick_dims[0] * (by + static_cast<size_t>(brick_dims[1]) * bz)];
+              m = std::fmax(m, value * density_scale);
+            }
+          }
+        }
+      }
+    }
+  }
+  brick_voxels.shrink_to_fit();
+  //An empty grid gets inverted bounds, which every ray misses
+  int lo[3] = {brick_dims[0], brick_dims[1], brick_dims[2]};
+  int hi[3] = {-1, -1, -1};
+  for(int bz = 0; bz < brick_dims[2]; bz++) {
+    for(int by = 0; by < brick_dims[1]; by++) {
+      for(int bx = 0; bx < brick_dims[0]; bx++) {
+        if(majorants[bx + brick_dims[0] * (by + static_cast<size_t>(brick_dims[1]) * bz)] > 0) {
+          int b[3] = {bx, by, bz};
+          for(int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], b[k]);
+            hi[k] = std::max(hi[k], b[k]);
+          }
+        }
+      }
+    }
+  }
+  for(int k = 0; k < 3; k++) {
+    bounds[0][k] = grid_min[k] + lo[k] * kBrickSize * voxel_size;
+    bounds[1][k] = grid_min[k] + std::min((hi[k] + 1) * kBrickSize, dims[k]) * voxel_size;
+  }
+}
+
+Float grid_medium::voxel(int x, int y, int z) const {
+  if(x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] || z >= dims[2]) {
+    return(0);
+  }
+  uint32_t brick = bricks[x / kBrickSize + brick_dims[0] * (y / kBrickSize + static_cast<size_t>(brick_dims[1]) * (z / kBrickSize))];
+  if(brick == kEmptyBrick) {
+    return(0);
+  }
+  return(brick_voxels[brick * kBrickVoxels + (x % kBrickSize) +
+                      kBrickSize * ((y % kBrickSize) + kBrickSize * (z % kBrickSize))]);
+}
+
+Float grid_medium::density(const point3f& p) const {
+  int v[3];
+  Float t[3];
+  for(int k = 0; k < 3; k++) {
+    //Voxel values sit at the voxel centers
+    Float g = (p[k] - grid_min[k]) * inv_voxel_size - 0.5f;
+    Float f = std::floor(g);
+    v[k] = static_cast<int>(f);
+    t[k] = g - f;
+  }
+  Float x00 = lerp(t[0], voxel(v[0], v[1],     v[2]),     voxel(v[0] + 1, v[1],     v[2]));
+  Float x10 = lerp(t[0], voxel(v[0], v[1] + 1, v[2]),     voxel(v[0] + 1, v[1] + 1, v[2]));
+  Float x01 = lerp(t[0], voxel(v[0], v[1],     v[2] + 1), voxel(v[0] + 1, v[1],     v[2] + 1));
+  Float x11 = lerp(t[0], voxel(v[0], v[1] + 1, v[2] + 1), voxel(v[0] + 1, v[1] + 1, v[2] + 1));
+  return(density_scale * lerp(t[2], lerp(t[1], x00, x10), lerp(t[1], x01, x11)));
+}
+
+//Delta tracking through the majorant grid. `random` returns uniform numbers in [0, 1).
+template<class Random>
+bool grid_medium::track(const ray& r, Float t_min, Float t_max, Float& t, Random& random) const {
+  ray r2 = (*WorldToObject)(r);
+  const point3f o = r2.origin();
+  const vec3f d = r2.direction();
+  //Densities are per world-space unit, and the ray parameter is shared by both spaces
+  const Float world_length = r.direction().length();
+  Float t0 = t_min, t1 = t_max;
+  for(int k = 0; k < 3; k++) {
+    if(d[k] == 0) {
+      if(o[k] < bounds[0][k] || o[k] > bounds[1][k]) {
+        return(false);
+      }
+      continue;
+    }
+    Float tnear = (bounds[0][k] - o[k]) / d[k];
+    Float tfar  = (bounds[1][k] - o[k]) / d[k];
+    if(tnear > tfar) {
+      std::swap(tnear, tfar);
+    }
+    t0 = ffmax(t0, tnear);
+    t1 = ffmin(t1, tfar);
+  }
+  if(!(t0 < t1)) {
+    return(false);
+  }
+
+  const Float brick_size = voxel_size * kBrickSize;
+  int step[3], b[3];
+  Float brick_delta[3], brick_next[3];
+  point3f p = o + t0 * d;
+  for(int k = 0; k < 3; k++) {
+    step[k] = d[k] > 0 ? 1 : (d[k] < 0 ? -1 : 0);
+    b[k] = static_cast<int>(clamp(std::floor((p[k] - grid_min[k]) / brick_size), 0, brick_dims[k] - 1));
+    if(step[k] == 0) {
+      brick_delta[k] = INFINITY;
+      brick_next[k] = INFINITY;
+    } else {
+      brick_delta[k] = brick_size / std::fabs(d[k]);
+      brick_next[k] = (grid_min[k] + (b[k] + (step[k] > 0)) * brick_size - o[k]) / d[k];
+    }
+  }
+
+  Float t_enter = t0;
+  uint64_t bricks_visited = 0, lookups = 0;
+  bool found = false;
+  while(true) {
+    bricks_visited++;
+    Float majorant = majorants[b[0] + brick_dims[0] * (b[1] + static_cast<size_t>(brick_dims[1]) * b[2])];
+    Float t_leave = ffmin(t1, ffmin(brick_next[0], ffmin(brick_next[1], brick_next[2])));
+    if(majorant > 0) {
+      //Tentative collisions against the brick's majorant; the exponential distribution is
+      //memoryless, so tracking restarts at each brick boundary
+      const Float inv_majorant = 1 / (majorant * world_length);
+      Float ts = t_enter;
+      while(true) {
+        ts -= std::log(1 - random()) * inv_majorant;
+        if(!(ts < t_leave)) {
+          break;
+        }
+        lookups++;
+        if(random() * majorant < density(o + ts * d)) {
+          t = ts;
+          found = true;
+          break;
+        }
+      }
+      if(found) {
+        break;
+      }
+    }
+    int k = min_axis(brick_next);
+    if(brick_next[k] >= t1) {
+      break;
+    }
+    b[k] += step[k];
+    if(b[k] < 0 || b[k] >= brick_dims[k]) {
+      break;
+    }
+    t_enter = brick_next[k];
+    brick_next[k] += brick_delta[k];
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::grid_steps.fetch_add(bricks_visited + lookups, std::memory_order_relaxed);
+  }
+  return(found);
+}
+
+void grid_medium::fill_record(const ray& r, Float t, hit_record& rec) const {
+  rec.t = t;
+  rec.p = r.point_at_parameter(t);
+  rec.normal = normal3f(1, 0, 0);
+  rec.u = 0;
+  rec.v = 0;
+  rec.dpdu = vec3f(0, 1, 0);
+  rec.dpdv = vec3f(0, 0, 1);
+  rec.pError = vec3f(0, 0, 0);
+  rec.has_bump = false;
+  rec.shape = this;
+  rec.alpha_miss = false;
+  rec.mat_ptr = phase_function.get();
+}
+
+bool grid_medium::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  Float t;
+  auto random = [&rng]() -> Float {return(rng.unif_rand());};
+  if(!track(r, t_min, t_max, t, random)) {
+    return(false);
+  }
+  fill_record(r, t, rec);
+  return(true);
+}
+
+bool grid_medium::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  Float t;
+  auto random = [sampler]() -> Float {return(sampler->Get1D());};
+  if(!track(r, t_min, t_max, t, random)) {
+    return(false);
+  }
+  fill_record(r, t, rec);
+  return(true);
+}
+
+bool grid_medium::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(bounds[0].x() > bounds[1].x()) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(aabb(bounds[0], bounds[1]));
+  return(true);
+}
+
+size_t grid_medium::memory_bytes() const {
+  return(bricks.capacity() * sizeof(uint32_t) + majorants.capacity() * sizeof(float) +
+         brick_voxels.capacity() * sizeof(float));
+}
+
+enum class VolumeType {Uint8, Uint16, Float32};
+
+static VolumeType parse_volume_type(const std::string& type) {
+  if(type == "uint8" || type == "uchar" || type == "unsigned char" || type == "uint8_t") {
+    return(VolumeType::Uint8);
+  } else if(type == "uint16" || type == "ushort" || type == "unsigned short" ||
+            type == "unsigned short int" || type == "uint16_t") {
+    return(VolumeType::Uint16);
+  } else if(type == "float" || type == "float32") {
+    return(VolumeType::Float32);
+  }
+  throw std::runtime_error("Unsupported volume voxel type: " + type);
+}
+
+static std::string trim(const std::string& s) {
+  size_t start = s.find_first_not_of(" \t\r");
+  if(start == std::string::npos) {
+    return(std::string());
+  }
+  size_t end = s.find_last_not_of(" \t\r");
+  return(s.substr(start, end - start + 1));
+}
+
+void grid_medium::LoadVolume(const std::string& filename, const std::string& type, int dims[3],
+                             std::vector<float>& density) {
+  MappedFile file(filename);
+  if(!file.valid()) {
+    throw std::runtime_error("Couldn't read volume file " + filename);
+  }
+  const char* data = file.data();
+  size_t available = file.size();
+  VolumeType voxel_type;
+  bool file_little_endian = true;
+  std::unique_ptr<MappedFile> data_file;
+  if(available >= 4 && std::memcmp(data, "NRRD", 4) == 0) {
+    //NRRD header: "field: value" lines up to the first blank line, then the data (unless it's
+    //in a separate data file)
+    std::string type_field, encoding = "raw", endian = "little", data_filename;
+    int dimension = 0;
+    size_t pos = 0;
+    bool header_done = false;
+    bool first_line = true;
+    while(pos < available) {
+      const char* end = static_cast<const char*>(std::memchr(data + pos, '\n', available - pos));
+      size_t line_end = end ? static_cast<size_t>(end - data) : available;
+      std::string line = trim(std::string(data + pos, line_end - pos));
+      pos = line_end + 1;
+      if(first_line) {
+        first_line = false;
+        continue;
+      }
+      if(line.empty()) {
+        header_done = true;
+        break;
+      }
+      size_t colon = line.find(": ");
+      if(line[0] == '#' || colon == std::string::npos) {
+        continue;
+      }
+      std::string key = line.substr(0, colon);
+      std::string value = trim(line.substr(colon + 2));
+      if(key == "type") {
+        type_field = value;
+      } else if(key == "dimension") {
+        dimension = std::atoi(value.c_str());
+      } else if(key == "sizes") {
+        std::istringstream sizes(value);
+        sizes >> dims[0] >> dims[1] >> dims[2];
+      } else if(key == "encoding") {
+        encoding = value;
+      } else if(key == "endian") {
+        endian = value;
+      } else if(key == "data file" || key == "datafile") {
+        data_filename = value;
+      }
+    }
+    if(dimension != 3) {
+      throw std::runtime_error("Only three dimensional NRRD volumes are supported: " + filename);
+    }
+    if(encoding != "raw") {
+      throw std::runtime_error("Only raw NRRD encoding is supported: " + filename);
+    }
+    voxel_type = parse_volume_type(type_field);
+    file_little_endian = endian != "big";
+    if(!data_filename.empty()) {
+      //Detached data files are relative to the header
+      if(data_filename[0] != '/') {
+        size_t slash = filename.find_last_of("/\\");
+        if(slash != std::string::npos) {
+          data_filename = filename.substr(0, slash + 1) + data_filename;
+        }
+      }
+      data_file.reset(new MappedFile(data_filename));
+      if(!data_file->valid()) {
+        throw std::runtime_error("Couldn't read NRRD data file " + data_filename);
+      }
+      data = data_file->data();
+      available = data_file->size();
+    } else {
+      if(!header_done) {
+        throw std::runtime_error("NRRD file has no data: " + filename);
+      }
+      data += pos;
+      available -= pos;
+    }
+  } else {
+    voxel_type = parse_volume_type(type);
+  }
+  size_t count = 1;
+  for(int k = 0; k < 3; k++) {
+    if(dims[k] < 1) {
+      throw std::runtime_error("Volume dimensions must be given for raw volume file " + filename);
+    }
+    count *= dims[k];
+  }
+  size_t bytes_per_voxel = voxel_type == VolumeType::Uint8 ? 1 : (voxel_type == VolumeType::Uint16 ? 2 : 4);
+  if(available < count * bytes_per_voxel) {
+    throw std::runtime_error("Volume file is smaller than its dimensions: " + filename);
+  }
+  const uint16_t endian_check = 1;
+  bool swap = (*reinterpret_cast<const uint8_t*>(&endian_check) == 1) != file_little_endian;
+  density.resize(count);
+  const unsigned char* src = reinterpret_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < count; i++) {
+    unsigned char bytes[4];
+    std::memcpy(bytes, src + i * bytes_per_voxel, bytes_per_voxel);
+    if(swap) {
+      std::reverse(bytes, bytes + bytes_per_voxel);
+    }
+    if(voxel_type == VolumeType::Uint8) {
+      density[i] = bytes[0] / 255.0f;
+    } else if(voxel_type == VolumeType::Uint16) {
+      uint16_t value;
+      std::memcpy(&value, bytes, 2);
+      density[i] = value / 65535.0f;
+    } else {
+      float value;
+      std::memcpy(&value, bytes, 4);
+      density[i] = value;
+    }
+  }
+}
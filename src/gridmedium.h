@@ -0,0 +1,69 @@
+#ifndef GRIDMEDIUMH
+#define GRIDMEDIUMH
+
+#include "hitable.h"
+#include "material.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+//Participating medium with a spatially varying density, given at the centers of a grid of cubic
+//voxels and interpolated trilinearly (zero outside the grid). The grid is centered on the origin.
+//Voxels are stored in bricks of kBrickSize^3 floats, and bricks whose voxels are all zero are
+//omitted, so sparse volumes (smoke, clouds) only pay for their occupied regions.
+//
+//Scattering distances are sampled with delta tracking (Woodcock tracking) against a majorant
+//grid holding the largest density each brick's lookups can return. Rays march that grid with a
+//3D-DDA: bricks with a zero majorant are skipped in a single step, and inside the others tentative
+//collisions are drawn with the brick's majorant and accepted with probability density / majorant.
+//The hit record of an accepted collision scatters with an isotropic phase function.
+class grid_medium : public hitable {
+public:
+  //`density` holds dims[0] * dims[1] * dims[2] values, with x varying fastest. Densities are
+  //multiplied by `density_scale` and are per unit of world-space distance.
+  grid_medium(const float* density, const int dims[3], Float voxel_size, Float density_scale,
+              std::shared_ptr<texture> albedo,
+              std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("GridMedium"));
+  }
+  //Density at an object-space point, including `density_scale`
+  Float density(const point3f& p) const;
+  //Bytes used by the brick table, the majorant grid, and the voxels of occupied bricks
+  size_t memory_bytes() const;
+  size_t occupied_bricks() const {
+    return(brick_voxels.size() / kBrickVoxels);
+  }
+
+  //Reads a volume from a NRRD file (raw encoding, 8-bit, 16-bit or float voxels) or, if `dims`
+  //are given, from a headerless raw file of `type` "uint8", "uint16" or "float". Integer voxels are
+  //normalized to [0, 1]. Throws if the file can't be read.
+  static void LoadVolume(const std::string& filename, const std::string& type, int dims[3],
+                         std::vector<float>& density);
+
+  static const int kBrickSize = 8;
+  static const size_t kBrickVoxels = kBrickSize * kBrickSize * kBrickSize;
+  static const uint32_t kEmptyBrick = 0xFFFFFFFF;
+  std::shared_ptr<material> phase_function;
+
+private:
+  template<class Random> bool track(const ray& r, Float t_min, Float t_max, Float& t, Random& random) const;
+  void fill_record(const ray& r, Float t, hit_record& rec) const;
+  Float voxel(int x, int y, int z) const;
+  int dims[3];
+  int brick_dims[3];
+  Float voxel_size, inv_voxel_size, density_scale;
+  point3f grid_min;
+  //Index of each brick's voxels in `brick_voxels`, or kEmptyBrick
+  std::vector<uint32_t> bricks;
+  std::vector<float> brick_voxels;
+  //Largest scaled density any point inside each brick can take
+  std::vector<float> majorants;
+  //Bounds of the bricks with a non-zero majorant; rays are clipped to them before tracking
+  point3f bounds[2];
+};
+
+#endif
@@ -0,0 +1,309 @@
+#include "heightfield.h"
+#include "bvhstats.h"
+#include <cmath>
+
+//Each level pushes at most four blocks and pops one, and a 32-bit grid has fewer than 32 levels
+constexpr int kTraversalStackSize = 128;
+
+heightfield::heightfield(const double* elevation, size_t nx_, size_t nz_, Float cell_size_,
+                         std::shared_ptr<material> mat,
+                         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                         bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), mat_ptr(mat),
+  nx(nx_), nz(nz_), cell_size(cell_size_) {
+  if(nx < 2 || nz < 2) {
+    throw std::runtime_error("Heightfield must have at least two rows and two columns");
+  }
+  if(!(cell_size > 0)) {
+    throw std::runtime_error("Heightfield cell size must be greater than zero");
+  }
+  x0 = -static_cast<Float>(nx - 1) * cell_size / 2;
+  z0 = -static_cast<Float>(nz - 1) * cell_size / 2;
+  heights.resize(nx * nz);
+  for(size_t i = 0; i < nx * nz; i++) {
+    heights[i] = static_cast<float>(elevation[i]);
+  }
+
+  //Level 0: the elevation range of the corners of each block of cells. Missing samples are
+  //skipped, so a block with no samples has min > max and is never entered.
+  size_t cnx = nx - 1, cnz = nz - 1;
+  size_t bnx = (cnx + kBlockCells - 1) / kBlockCells;
+  size_t bnz = (cnz + kBlockCells - 1) / kBlockCells;
+  std::vector<float> base(2 * bnx * bnz);
+  for(size_t bz = 0; bz < bnz; bz++) {
+    for(size_t bx = 0; bx < bnx; bx++) {
+      float lo = INFINITY, hi = -INFINITY;
+      size_t i_end = std::min((bx + 1) * kBlockCells, cnx);
+      size_t j_end = std::min((bz + 1) * kBlockCells, cnz);
+      for(size_t j = bz * kBlockCells; j <= j_end; j++) {
+        for(size_t i = bx * kBlockCells; i <= i_end; i++) {
+          float h = heights[i + j * nx];
+          if(!std::isnan(h)) {
+            lo = std::fmin(lo, h);
+            hi = std::fmax(hi, h);
+          }
+        }
+      }
+      base[2 * (bx + bz * bnx)] = lo;
+      base[2 * (bx + bz * bnx) + 1] = hi;
+    }
+  }
+  levels.push_back(std::move(base));
+  level_nx.push_back(bnx);
+  level_nz.push_back(bnz);
+  //Each level above merges 2x2 blocks of the one below, up to a single root block
+  while(level_nx.back() > 1 || level_nz.back() > 1) {
+    const std::vector<float>& below = levels.back();
+    size_t below_nx = level_nx.back(), below_nz = level_nz.back();
+    size_t lnx = (below_nx + 1) / 2, lnz = (below_nz + 1) / 2;
+    std::vector<float> level(2 * lnx * lnz);
+    for(size_t bz = 0; bz < lnz; bz++) {
+      for(size_t bx = 0; bx < lnx; bx++) {
+        float lo = INFINITY, hi = -INFINITY;
+        for(size_t cz = 2 * bz; cz < std::min(2 * bz + 2, below_nz); cz++) {
+          for(size_t cx = 2 * bx; cx < std::min(2 * bx + 2, below_nx); cx++) {
+            lo = std::fmin(lo, below[2 * (cx + cz * below_nx)]);
+            hi = std::fmax(hi, below[2 * (cx + cz * below_nx) + 1]);
+          }
+        }
+        level[2 * (bx + bz * lnx)] = lo;
+        level[2 * (bx + bz * lnx) + 1] = hi;
+      }
+    }
+    levels.push_back(std::move(level));
+    level_nx.push_back(lnx);
+    level_nz.push_back(lnz);
+  }
+}
+
+bool heightfield::block_hit(int level, size_t bx, size_t bz, const ray& r, Float t_min, Float t_max) const {
+  const float* range = &levels[level][2 * (bx + bz * level_nx[level])];
+  if(range[0] > range[1]) {
+    return(false);
+  }
+  size_t span = kBlockCells << level;
+  point3f bounds[2] = {
+    point3f(x0 + bx * span * cell_size, range[0], z0 + bz * span * cell_size),
+    point3f(x0 + std::min((bx + 1) * span, nx - 1) * cell_size, range[1],
+            z0 + std::min((bz + 1) * span, nz - 1) * cell_size)
+  };
+  const point3f o = r.origin();
+  Float txmin = (bounds[  r.sign[0]].x()-o.x()) * r.inv_dir.x();
+  Float txmax = (bounds[1-r.sign[0]].x()-o.x()) * r.inv_dir_pad.x();
+  Float tymin = (bounds[  r.sign[1]].y()-o.y()) * r.inv_dir.y();
+  Float tymax = (bounds[1-r.sign[1]].y()-o.y()) * r.inv_dir_pad.y();
+  Float tzmin = (bounds[  r.sign[2]].z()-o.z()) * r.inv_dir.z();
+  Float tzmax = (bounds[1-r.sign[2]].z()-o.z()) * r.inv_dir_pad.z();
+  t_min = ffmax(tzmin, ffmax(tymin, ffmax(txmin, t_min)));
+  t_max = ffmin(tzmax, ffmin(tymax, ffmin(txmax, t_max)));
+  return(t_min <= t_max);
+}
+
+//Tests the two triangles of cell (i, j), (0,0)-(1,0)-(1,1) and (0,0)-(1,1)-(0,1), and returns the
+//nearer hit with its barycentric coordinates and which triangle it was in
+bool heightfield::cell_hit(size_t i, size_t j, const point3f& o, const vec3f& d, Float t_min, Float t_max,
+                           Float& t, Float& b1, Float& b2, bool& upper) const {
+  Float h00 = height(i, j), h10 = height(i + 1, j), h01 = height(i, j + 1), h11 = height(i + 1, j + 1);
+  if(std::isnan(h00) || std::isnan(h10) || std::isnan(h01) || std::isnan(h11)) {
+    return(false);
+  }
+  Float x = x0 + i * cell_size, z = z0 + j * cell_size;
+  point3f p00(x, h00, z);
+  point3f p11(x + cell_size, h11, z + cell_size);
+  point3f others[2] = {point3f(x + cell_size, h10, z), point3f(x, h01, z + cell_size)};
+  bool found = false;
+  for(int k = 0; k < 2; k++) {
+    //The lower triangle is (p00, p10, p11) and the upper (p00, p11, p01)
+    vec3f e1 = k == 0 ? others[0] - p00 : p11 - p00;
+    vec3f e2 = k == 0 ? p11 - p00 : others[1] - p00;
+    vec3f pvec = cross(d, e2);
+    Float det = dot(e1, pvec);
+    if(std::fabs(det) < 1e-12f) {
+      continue;
+    }
+    Float inv_det = 1 / det;
+    vec3f tvec = o - p00;
+    Float u = dot(tvec, pvec) * inv_det;
+    if(u < 0 || u > 1) {
+      continue;
+    }
+    vec3f qvec = cross(tvec, e1);
+    Float v = dot(d, qvec) * inv_det;
+    if(v < 0 || u + v > 1) {
+      continue;
+    }
+    Float tt = dot(e2, qvec) * inv_det;
+    if(tt > t_min && tt < t_max) {
+      t_max = tt;
+      t = tt;
+      b1 = u;
+      b2 = v;
+      upper = k == 1;
+      found = true;
+    }
+  }
+  return(found);
+}
+
+//Descends the quadtree front to back: the children of a block are pushed so the one on the side
+//of the ray origin is visited first, and blocks beyond the closest hit so far fail the box test.
+bool heightfield::closest_hit(const ray& r, Float t_min, Float t_max, Float& t, size_t& ci, size_t& cj,
+                              Float& b1, Float& b2, bool& upper) const {
+  struct block {
+    int level;
+    size_t bx, bz;
+  };
+  block stack[kTraversalStackSize];
+  int stack_size = 0;
+  stack[stack_size++] = {static_cast<int>(levels.size()) - 1, 0, 0};
+  const point3f o = r.origin();
+  const vec3f d = r.direction();
+  size_t near_x = d.x() < 0 ? 1 : 0;
+  size_t near_z = d.z() < 0 ? 1 : 0;
+  bool found = false;
+  uint64_t nodes_visited = 0, cells_tested = 0;
+  while(stack_size > 0) {
+    block current = stack[--stack_size];
+    if(!block_hit(current.level, current.bx, current.bz, r, t_min, t_max)) {
+      continue;
+    }
+    nodes_visited++;
+    if(current.level == 0) {
+      size_t i_end = std::min((current.bx + 1) * kBlockCells, nx - 1);
+      size_t j_end = std::min((current.bz + 1) * kBlockCells, nz - 1);
+      for(size_t j = current.bz * kBlockCells; j < j_end; j++) {
+        for(size_t i = current.bx * kBlockCells; i < i_end; i++) {
+          cells_tested++;
+          if(cell_hit(i, j, o, d, t_min, t_max, t, b1, b2, upper)) {
+            t_max = t;
+            ci = i;
+            cj = j;
+            found = true;
+          }
+        }
+      }
+      continue;
+    }
+    int child_level = current.level - 1;
+    size_t child_nx = level_nx[child_level], child_nz = level_nz[child_level];
+    //Far child first, near child last
+    const size_t order[4][2] = {{1 - near_x, 1 - near_z}, {near_x, 1 - near_z},
+                                {1 - near_x, near_z}, {near_x, near_z}};
+    for(int k = 0; k < 4; k++) {
+      size_t cx = 2 * current.bx + order[k][0];
+      size_t cz = 2 * current.bz + order[k][1];
+      if(cx < child_nx && cz < child_nz) {
+        stack[stack_size++] = {child_level, cx, cz};
+      }
+    }
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::nodes_visited.fetch_add(nodes_visited, std::memory_order_relaxed);
+    TraversalStats::primitives_tested.fetch_add(cells_tested, std::memory_order_relaxed);
+  }
+  return(found);
+}
+
+//Central differences (one-sided at the edges and next to missing samples)
+vec3f heightfield::vertex_normal(size_t i, size_t j) const {
+  Float h = height(i, j);
+  Float left  = i > 0      ? height(i - 1, j) : NAN;
+  Float right = i + 1 < nx ? height(i + 1, j) : NAN;
+  Float back  = j > 0      ? height(i, j - 1) : NAN;
+  Float front = j + 1 < nz ? height(i, j + 1) : NAN;
+  auto slope = [&](Float lo, Float hi) {
+    if(!std::isnan(lo) && !std::isnan(hi)) {
+      return((hi - lo) / (2 * cell_size));
+    } else if(!std::isnan(hi)) {
+      return((hi - h) / cell_size);
+    } else if(!std::isnan(lo)) {
+      return((h - lo) / cell_size);
+    }
+    return(static_cast<Float>(0));
+  };
+  vec3f n(-slope(left, right), 1, -slope(back, front));
+  n.make_unit_vector();
+  return(n);
+}
+
+void heightfield::fill_record(const ray& r, Float t, size_t i, size_t j, Float b1, Float b2, bool upper,
+                              hit_record& rec) const {
+  //Corners of the triangle hit, in the order used by cell_hit()
+  size_t ci[3] = {i, i + 1, upper ? i : i + 1};
+  size_t cj[3] = {j, upper ? j + 1 : j, j + 1};
+  Float b0 = 1 - b1 - b2;
+  Float w[3] = {b0, b1, b2};
+  point3f p(0, 0, 0);
+  vec3f n(0, 0, 0);
+  vec3f abs_sum(0, 0, 0);
+  for(int k = 0; k < 3; k++) {
+    point3f corner(x0 + ci[k] * cell_size, height(ci[k], cj[k]), z0 + cj[k] * cell_size);
+    p += w[k] * corner;
+    n += w[k] * vertex_normal(ci[k], cj[k]);
+    abs_sum += Abs(w[k] * vec3f(corner.x(), corner.y(), corner.z()));
+  }
+  //Slopes of the triangle's plane, for the partial derivatives
+  Float h00 = height(i, j), h10 = height(i + 1, j), h01 = height(i, j + 1), h11 = height(i + 1, j + 1);
+  Float dhdx = upper ? (h11 - h01) / cell_size : (h10 - h00) / cell_size;
+  Float dhdz = upper ? (h01 - h00) / cell_size : (h11 - h10) / cell_size;
+  Float span_x = (nx - 1) * cell_size, span_z = (nz - 1) * cell_size;
+
+  rec.t = t;
+  rec.p = p;
+  n.make_unit_vector();
+  rec.normal = normal3f(n.x(), n.y(), n.z());
+  rec.u = clamp((p.x() - x0) / span_x, 0, 1);
+  rec.v = clamp((p.z() - z0) / span_z, 0, 1);
+  rec.dpdu = vec3f(span_x, dhdx * span_x, 0);
+  rec.dpdv = vec3f(0, dhdz * span_z, span_z);
+  rec.has_bump = false;
+  rec.pError = gamma(7) * abs_sum;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation ? -1 : 1;
+  rec.normal.make_unit_vector();
+  rec.shape = this;
+  rec.alpha_miss = false;
+  rec.mat_ptr = mat_ptr.get();
+}
+
+bool heightfield::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2 = (*WorldToObject)(r);
+  Float t, b1, b2;
+  size_t i, j;
+  bool upper;
+  if(!closest_hit(r2, t_min, t_max, t, i, j, b1, b2, upper)) {
+    return(false);
+  }
+  fill_record(r2, t, i, j, b1, b2, upper, rec);
+  return(true);
+}
+
+bool heightfield::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r2 = (*WorldToObject)(r);
+  Float t, b1, b2;
+  size_t i, j;
+  bool upper;
+  if(!closest_hit(r2, t_min, t_max, t, i, j, b1, b2, upper)) {
+    return(false);
+  }
+  fill_record(r2, t, i, j, b1, b2, upper, rec);
+  return(true);
+}
+
+bool heightfield::bounding_box(Float t0, Float t1, aabb& box) const {
+  const std::vector<float>& root = levels.back();
+  if(root[0] > root[1]) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(aabb(point3f(x0, root[0], z0),
+                              point3f(-x0, std::fmax(root[1], root[0] + 1e-5f), -z0)));
+  return(true);
+}
+
+size_t heightfield::memory_bytes() const {
+  size_t bytes = heights.capacity() * sizeof(float);
+  for(size_t i = 0; i < levels.size(); i++) {
+    bytes += levels[i].capacity() * sizeof(float);
+  }
+  return(bytes);
+}
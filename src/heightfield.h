@@ -0,0 +1,59 @@
+#ifndef HEIGHTFIELDH
+#define HEIGHTFIELDH
+
+#include "hitable.h"
+#include "material.h"
+#include <vector>
+
+//Regular grid of elevations, intersected directly instead of being converted to triangles. Rows
+//of the elevation matrix run along the x axis and columns along the z axis, with samples
+//`cell_size` apart and the grid centered on the origin. Each cell is split into two triangles
+//along its (0,0)-(1,1) diagonal; cells with a missing (NaN) corner are holes.
+//
+//Elevations are stored as floats (4 bytes per sample). Rays are traversed through a min-max
+//quadtree (a maximum mipmap) whose leaves cover blocks of 4x4 cells, which adds about 0.7 bytes
+//per sample (8 bytes per leaf block, and a third more for the coarser levels). Shading normals
+//are interpolated from central differences of the grid, and u/v span the grid so image textures
+//can be draped over it.
+class heightfield : public hitable {
+public:
+  //`elevation` is column-major with `nx` rows and `nz` columns, as in an R matrix
+  heightfield(const double* elevation, size_t nx, size_t nz, Float cell_size,
+              std::shared_ptr<material> mat,
+              std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+              bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("Heightfield"));
+  }
+  //Bytes used by the elevations and the quadtree
+  size_t memory_bytes() const;
+
+  std::vector<float> heights;
+  //Interleaved (min, max) elevation of each block, one vector per level. Level 0 blocks cover
+  //kBlockCells x kBlockCells cells, and each level above halves the blocks along both axes.
+  std::vector<std::vector<float> > levels;
+  std::vector<size_t> level_nx, level_nz;
+  std::shared_ptr<material> mat_ptr;
+  static const size_t kBlockCells = 4;
+
+private:
+  Float height(size_t i, size_t j) const {
+    return(heights[i + j * nx]);
+  }
+  bool block_hit(int level, size_t bx, size_t bz, const ray& r, Float t_min, Float t_max) const;
+  bool cell_hit(size_t i, size_t j, const point3f& o, const vec3f& d, Float t_min, Float t_max,
+                Float& t, Float& b1, Float& b2, bool& upper) const;
+  bool closest_hit(const ray& r, Float t_min, Float t_max, Float& t, size_t& ci, size_t& cj,
+                   Float& b1, Float& b2, bool& upper) const;
+  vec3f vertex_normal(size_t i, size_t j) const;
+  void fill_record(const ray& r, Float t, size_t i, size_t j, Float b1, Float b2, bool upper,
+                   hit_record& rec) const;
+  size_t nx, nz;
+  Float cell_size;
+  Float x0, z0;
+};
+
+#endif
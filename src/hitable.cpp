@@ -47,9 +47,10 @@ std::string AnimatedHitable::GetName() const {
 
 
 
+//A degenerate interval asks for the bounds over the whole motion
 bool AnimatedHitable::bounding_box(Float t0, Float t1, aabb& box) const {
   primitive->bounding_box(t0, t1, box);
-  box = PrimitiveToWorld.MotionBounds(box);
+  box = t1 > t0 ? PrimitiveToWorld.MotionBounds(box, t0, t1) : PrimitiveToWorld.MotionBounds(box);
   return(true);
 }
 
@@ -27,6 +27,13 @@ class hitable {
       transformSwapsHandedness(ObjectToWorld->SwapsHandedness()) {}
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) = 0;
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler) = 0;
+    //Two-phase intersection used inside acceleration structures: hit_deferred() only needs to set
+    //t, u, v and alpha_miss, and if it leaves `rec.pending` pointing at the shape, the rest of the
+    //record is filled by compute_surface_interaction() once the closest hit is known (see
+    //finish_hit()). By default the full record is computed immediately.
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) {}
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const = 0;
     virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0) {
       return(0.0);
@@ -51,7 +58,7 @@ class hitable {
 
 
 struct hit_record {
-  hit_record() : has_bump(false), alpha_miss(false) {};
+  hit_record() : dpdu(0,0,0), dpdv(0,0,0), has_bump(false), alpha_miss(false) {};
   
   point3f p; //PBRT: In Interaction
   Float t; //PBRT: In Interaction
@@ -62,21 +69,66 @@ struct hit_record {
 #endif
   normal3f normal; //PBRT: In interaction
   vec3f dpdu, dpdv; //PBRT: In SurfaceInteraction
+  Float du = 0, dv = 0; //Ray cone footprint in (u, v) for texture filtering, see SetTextureFootprint()
   vec3f pError; //PBRT: In Interaction
   vec3f wo; //PBRT: In Interaction, negative ray direction
   normal3f bump_normal; 
   bool has_bump; 
   const hitable* shape = nullptr; //PBRT: In SurfaceInteraction, const Shape *shape
+  hitable* pending = nullptr; //Shape that still has to complete this record, see hit_deferred()
   material* mat_ptr; //PBRT: In SurfaceInteraction as bsdf or bssrdf
   bool alpha_miss;
   //Missing from PBRT: 
-  //mutable Float dudx, dvdx, dudy, dvdy (for texture sampling)
-  //mutable vec3 dpdx, dpdy
+  //mutable vec3 dpdx, dpdy (ray cones stand in for ray differentials)
   //const Shape *shape (recording the shape)
   //const Primitive *primitive (recording the primitive)
   //int faceIndex (for ptex lookups)
 };
 
+//Sets the texture footprint of `rec` from the ray cone of `r` and returns the cone's width at the
+//hit, which is where rays continuing from it start. The width is stretched by the angle to the
+//surface (up to 10x, past that the isotropic filter would blur the whole texture) and converted to
+//(u, v) with dpdu and dpdv; shapes that leave those zero get no filtering.
+inline Float SetTextureFootprint(const ray& r, hit_record& rec) {
+  Float dir_length = r.direction().length();
+  Float width = r.cone_width + r.cone_spread * rec.t * dir_length;
+  if(width <= 0) {
+    return(0);
+  }
+  Float cos_theta = std::fabs(dot(r.direction(), rec.normal)) / (dir_length * rec.normal.length());
+  Float surface_width = width / std::fmax(cos_theta, 0.1f);
+  Float dpdu_length = rec.dpdu.length();
+  Float dpdv_length = rec.dpdv.length();
+  rec.du = dpdu_length > 0 ? surface_width / dpdu_length : 0;
+  rec.dv = dpdv_length > 0 ? surface_width / dpdv_length : 0;
+  return(width);
+}
+
+inline bool hitable::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  if(hit(r, t_min, t_max, rec, rng)) {
+    rec.pending = nullptr;
+    return(true);
+  }
+  return(false);
+}
+
+inline bool hitable::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  if(hit(r, t_min, t_max, rec, sampler)) {
+    rec.pending = nullptr;
+    return(true);
+  }
+  return(false);
+}
+
+//Completes a record returned by hit_deferred()
+inline void finish_hit(const ray& r, hit_record& rec) {
+  if(rec.pending) {
+    hitable* shape = rec.pending;
+    rec.pending = nullptr;
+    shape->compute_surface_interaction(r, rec);
+  }
+}
+
 
 class AnimatedHitable: public hitable {
 public:
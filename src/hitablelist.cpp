@@ -2,37 +2,69 @@
 
 
 bool hitable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  hit_record temp_rec;
+  if(hit_deferred(r, t_min, t_max, rec, rng)) {
+    finish_hit(r, rec);
+    return(true);
+  }
+  return(false);
+}
+
+//Hits are written alternately into two scratch records, so a closer hit only swaps a pointer and
+//the winning record is copied out once
+bool hitable_list::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  hit_record temp_rec[2];
 #ifdef DEBUGBVH
-  temp_rec.bvh_nodes = rec.bvh_nodes;
+  temp_rec[0].bvh_nodes = rec.bvh_nodes;
+  temp_rec[1].bvh_nodes = rec.bvh_nodes;
 #endif
-  bool hit_anything = false;
+  hit_record* closest = nullptr;
+  hit_record* scratch = &temp_rec[0];
   double closest_so_far = t_max;
   for (const auto& object : objects) {
-    if (object->hit(r, t_min, closest_so_far, temp_rec, rng)) {
-      hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+    if (object->hit_deferred(r, t_min, closest_so_far, *scratch, rng)) {
+      closest_so_far = scratch->t;
+      closest = scratch;
+      scratch = scratch == &temp_rec[0] ? &temp_rec[1] : &temp_rec[0];
     }
   }
-  return(hit_anything);
+  if(closest) {
+    rec = *closest;
+    return(true);
+  }
+  return(false);
 }
 
 bool hitable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  hit_record temp_rec;
+  if(hit_deferred(r, t_min, t_max, rec, sampler)) {
+    finish_hit(r, rec);
+    return(true);
+  }
+  return(false);
+}
+
+//Hits are written alternately into two scratch records, so a closer hit only swaps a pointer and
+//the winning record is copied out once
+bool hitable_list::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  hit_record temp_rec[2];
 #ifdef DEBUGBVH
-  temp_rec.bvh_nodes = rec.bvh_nodes;
+  temp_rec[0].bvh_nodes = rec.bvh_nodes;
+  temp_rec[1].bvh_nodes = rec.bvh_nodes;
 #endif
-  bool hit_anything = false;
+  hit_record* closest = nullptr;
+  hit_record* scratch = &temp_rec[0];
   double closest_so_far = t_max;
   for (const auto& object : objects) {
-    if (object->hit(r, t_min, closest_so_far, temp_rec, sampler)) {
-      hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+    if (object->hit_deferred(r, t_min, closest_so_far, *scratch, sampler)) {
+      closest_so_far = scratch->t;
+      closest = scratch;
+      scratch = scratch == &temp_rec[0] ? &temp_rec[1] : &temp_rec[0];
     }
   }
-  return(hit_anything);
+  if(closest) {
+    rec = *closest;
+    return(true);
+  }
+  return(false);
 }
 
 bool hitable_list::bounding_box(Float t0, Float t1, aabb& box) const {
@@ -11,6 +11,8 @@ class hitable_list: public hitable {
     hitable_list(std::shared_ptr<hitable> object) {add(object);}
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+    virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
     
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
     virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
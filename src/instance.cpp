@@ -0,0 +1,83 @@
+#include "instance.h"
+
+instance::instance(std::shared_ptr<hitable> object, std::shared_ptr<material> mat,
+                   std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                   bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), object(object), mat_ptr(mat),
+  volume_scale(std::fabs(ObjectToWorld->Determinant())) {}
+
+bool instance::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2 = (*WorldToObject)(r);
+  if(!object->hit(r2, t_min, t_max, rec, rng)) {
+    return(false);
+  }
+  r.tMax = r2.tMax;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal.make_unit_vector();
+  if(rec.has_bump) {
+    rec.bump_normal.make_unit_vector();
+  }
+  if(mat_ptr) {
+    rec.mat_ptr = mat_ptr.get();
+  }
+  return(true);
+}
+
+bool instance::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r2 = (*WorldToObject)(r);
+  if(!object->hit(r2, t_min, t_max, rec, sampler)) {
+    return(false);
+  }
+  r.tMax = r2.tMax;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal.make_unit_vector();
+  if(rec.has_bump) {
+    rec.bump_normal.make_unit_vector();
+  }
+  if(mat_ptr) {
+    rec.mat_ptr = mat_ptr.get();
+  }
+  return(true);
+}
+
+bool instance::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(!object->bounding_box(t0, t1, box)) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(box);
+  return(true);
+}
+
+//The object's pdf is a density over unit object space directions. The linear part M of the
+//transform maps a unit direction w to M w / |M w|, which scales solid angle by |det M| / |M w|^3,
+//so for the unit world direction v (with w = M^-1 v / |M^-1 v|) the world space density is the
+//object's divided by |det M| |M^-1 v|^3. This holds for non-uniform scales and shears as well.
+Float instance::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  vec3f w = (*WorldToObject)(unit_vector(v));
+  Float length = w.length();
+  if(length == 0 || volume_scale == 0) {
+    return(0);
+  }
+  Float pdf = object->pdf_value((*WorldToObject)(o), w / length, rng, time);
+  return(pdf / (volume_scale * length * length * length));
+}
+
+Float instance::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  vec3f w = (*WorldToObject)(unit_vector(v));
+  Float length = w.length();
+  if(length == 0 || volume_scale == 0) {
+    return(0);
+  }
+  Float pdf = object->pdf_value((*WorldToObject)(o), w / length, sampler, time);
+  return(pdf / (volume_scale * length * length * length));
+}
+
+//The object samples a point on its surface and returns the vector to it, which maps to the vector
+//to the same point in world space
+vec3f instance::random(const point3f& o, random_gen& rng, Float time) {
+  return((*ObjectToWorld)(object->random((*WorldToObject)(o), rng, time)));
+}
+
+vec3f instance::random(const point3f& o, Sampler* sampler, Float time) {
+  return((*ObjectToWorld)(object->random((*WorldToObject)(o), sampler, time)));
+}
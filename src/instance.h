@@ -0,0 +1,39 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include "hitable.h"
+#include "material.h"
+#include <Rcpp.h>
+
+//An instance wraps a shared object-space primitive (e.g. a mesh and its BVH) and places it in the
+//scene with its own transform. Rays are transformed into object space at the instance boundary, so
+//any number of instances can reference the same bottom-level geometry.
+class instance : public hitable {
+public:
+  instance() {}
+  instance(std::shared_ptr<hitable> object, std::shared_ptr<material> mat,
+           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+           bool reverseOrientation);
+  ~instance() {}
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+
+  virtual std::string GetName() const {
+    return(std::string("Instance"));
+  }
+  std::shared_ptr<hitable> object;
+  //Optional material override (used when the shared mesh has a single user-supplied material)
+  std::shared_ptr<material> mat_ptr;
+
+private:
+  //|det| of the linear part of ObjectToWorld
+  Float volume_scale;
+};
+
+#endif
@@ -70,6 +70,17 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
   }
+  //Ray cones for texture filtering start out one pixel wide: perspective and environment cameras
+  //spread by the angle a pixel subtends, orthographic rays keep the pixel's width. Realistic
+  //cameras don't filter.
+  Float pixel_spread = 0, pixel_width = 0;
+  if(fov > 0 && fov < 360) {
+    pixel_spread = 2 * std::tan(fov * M_PI / 360) / ny;
+  } else if (fov == 0) {
+    pixel_width = ocam.vertical.length() / ny;
+  } else if (fov == 360) {
+    pixel_spread = M_PI / ny;
+  }
   for(size_t s = 0; s < static_cast<size_t>(ns); s++) {
     Rcpp::checkUserInterrupt();
     if(progress_bar) {
@@ -78,7 +89,7 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
     RcppThread::ThreadPool pool(numbercores);
     auto worker = [&adaptive_pixel_sampler,
                    nx, ny, s, sample_method,
-                   &rngs, fov, &samplers,
+                   &rngs, fov, &samplers, pixel_spread, pixel_width,
                    &cam, &ocam, &ecam, &rcam, &world, &hlist,
                    clampval, max_depth, roulette_active] (int k) {
                      // MitchellFilter fil(vec2f(1.0),1./3.,1./3.);
@@ -110,6 +121,8 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
                            weight = rcam.GenerateRay(samp, &r);
                          }
                          r.pri_stack = mat_stack;
+                         r.cone_width = pixel_width;
+                         r.cone_spread = pixel_spread;
                          point3f col = weight != 0 ? clamp_point(de_nan(color(r, &world, &hlist, max_depth, 
                                                        roulette_active, rngs[index], samplers[index].get())),
                                              0, clampval) * weight : 0;
@@ -0,0 +1,89 @@
+#include "mappedfile.h"
+#include <fstream>
+#include <cstring>
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define RAY_HAS_MMAP
+#endif
+
+MappedFile::MappedFile(const std::string& filename) : ptr(nullptr), length(0), 
+  is_valid(false), is_mapped(false) {
+#ifdef RAY_HAS_MMAP
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd != -1) {
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+      if(mapped != MAP_FAILED) {
+        ptr = static_cast<const char*>(mapped);
+        length = static_cast<size_t>(st.st_size);
+        is_valid = true;
+        is_mapped = true;
+      }
+    }
+    close(fd);
+  }
+  if(is_valid) {
+    return;
+  }
+#endif
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  if(!file) {
+    return;
+  }
+  std::streamoff file_size = file.tellg();
+  if(file_size <= 0) {
+    return;
+  }
+  buffer.resize(static_cast<size_t>(file_size));
+  file.seekg(0, std::ios::beg);
+  if(!file.read(buffer.data(), file_size)) {
+    buffer.clear();
+    return;
+  }
+  ptr = buffer.data();
+  length = buffer.size();
+  is_valid = true;
+}
+
+MappedFile::~MappedFile() {
+#ifdef RAY_HAS_MMAP
+  if(is_mapped) {
+    munmap(const_cast<char*>(ptr), length);
+  }
+#endif
+}
+
+uint64_t HashCombine(uint64_t seed, uint64_t value) {
+  seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+  return(seed);
+}
+
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return(h);
+}
+
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed) {
+  uint64_t h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+  size_t nwords = size / 8;
+  for(size_t i = 0; i < nwords; i++) {
+    uint64_t word;
+    std::memcpy(&word, data + 8*i, 8);
+    h = (h ^ mix64(word)) * 0x100000001b3ULL;
+  }
+  uint64_t tail = 0;
+  if(size > 8*nwords) {
+    std::memcpy(&tail, data + 8*nwords, size - 8*nwords);
+  }
+  h = (h ^ mix64(tail)) * 0x100000001b3ULL;
+  return(mix64(h));
+}
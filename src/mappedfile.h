@@ -0,0 +1,33 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+//Read-only view of a whole file. On POSIX systems the file is memory-mapped; elsewhere (or if
+//mapping fails) it is read into an owned buffer, so callers can always use data()/size().
+class MappedFile {
+public:
+  MappedFile(const std::string& filename);
+  ~MappedFile();
+  bool valid() const {return(is_valid);}
+  const char* data() const {return(ptr);}
+  size_t size() const {return(length);}
+  
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+  const char* ptr;
+  size_t length;
+  bool is_valid;
+  bool is_mapped;
+  std::vector<char> buffer;
+};
+
+//64-bit hash of a block of memory (not cryptographic, only used to detect changed files)
+uint64_t HashBytes(const char* data, size_t size, uint64_t seed = 0);
+uint64_t HashCombine(uint64_t seed, uint64_t value);
+
+#endif
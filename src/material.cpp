@@ -42,24 +42,24 @@ point3f lambertian::f(const ray& r_in, const hit_record& rec, const ray& scatter
   if(cosine < 0) {
     cosine = 0;
   }
-  return(G * albedo->value(rec.u, rec.v, rec.p) * cosine * M_1_PI);
+  return(G * albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) * cosine * M_1_PI);
 }
 
 bool lambertian::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new cosine_pdf(hrec.normal);
   return(true);
 }
 
 bool lambertian::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new cosine_pdf(hrec.normal);
   return(true);
 }
 point3f lambertian::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -77,7 +77,7 @@ bool metal::scatter(const ray& r_in, const hit_record& hrec, scatter_record& sre
   point3f offset_p = offset_ray(hrec.p-r_in.A, hrec.normal) + r_in.A;
   
   srec.specular_ray = ray(offset_p, reflected + fuzz * rng.random_in_unit_sphere(), r_in.pri_stack, r_in.time());
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p) * FrCond(cosine, eta, k);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv) * FrCond(cosine, eta, k);
   srec.is_specular = true;
   srec.pdf_ptr = 0;
   return(true);
@@ -94,14 +94,14 @@ bool metal::scatter(const ray& r_in, const hit_record& hrec, scatter_record& sre
   point3f offset_p = offset_ray(hrec.p-r_in.A, hrec.normal) + r_in.A;
   
   srec.specular_ray = ray(offset_p, reflected + fuzz * rand_to_unit(sampler->Get2D()), r_in.pri_stack, r_in.time());
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p) * FrCond(cosine, eta, k);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv) * FrCond(cosine, eta, k);
   srec.is_specular = true;
   srec.pdf_ptr = 0;
   return(true);
 }
 
 point3f metal::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -305,14 +305,14 @@ bool dielectric::scatter(const ray& r_in, const hit_record& hrec, scatter_record
 point3f diffuse_light::emitted(const ray& r_in, const hit_record& rec, Float u, Float v, const point3f& p, bool& is_invisible) {
   is_invisible = invisible;
   if(dot(rec.normal, r_in.direction()) < 0.0) {
-    return(emit->value(u,v,p) * intensity);
+    return(emit->filtered_value(u, v, p, rec.du, rec.dv) * intensity);
   } else {
     return(point3f(0,0,0));
   }
 }
 
 point3f diffuse_light::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(emit->value(rec.u, rec.v, rec.p));
+  return(emit->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -322,7 +322,7 @@ point3f diffuse_light::get_albedo(const ray& r_in, const hit_record& rec) const
 point3f spot_light::emitted(const ray& r_in, const hit_record& rec, Float u, Float v, const point3f& p, bool& is_invisible) {
   is_invisible = invisible;
   if(dot(rec.normal, r_in.direction()) < 0.0) {
-    return(falloff(r_in.origin() - rec.p) * emit->value(u,v,p) );
+    return(falloff(r_in.origin() - rec.p) * emit->filtered_value(u, v, p, rec.du, rec.dv));
   } else {
     return(vec3f(0,0,0));
   }
@@ -341,7 +341,7 @@ Float spot_light::falloff(const vec3f &w) const {
 }
 
 point3f spot_light::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(emit->value(rec.u, rec.v, rec.p));
+  return(emit->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -351,21 +351,21 @@ point3f spot_light::get_albedo(const ray& r_in, const hit_record& rec) const {
 bool isotropic::scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = true;
   srec.specular_ray = ray(rec.p, rng.random_in_unit_sphere(), r_in.pri_stack);
-  srec.attenuation = albedo->value(rec.u,rec.v,rec.p);
+  srec.attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv);
   return(true);
 }
 bool isotropic::scatter(const ray& r_in, const hit_record& rec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = true;
   srec.specular_ray = ray(rec.p, rand_to_sphere(1, 1, sampler->Get2D()), r_in.pri_stack);
-  srec.attenuation = albedo->value(rec.u,rec.v,rec.p);
+  srec.attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv);
   return(true);
 }
 
 point3f isotropic::f(const ray& r_in, const hit_record& rec, const ray& scattered) const {
-  return(albedo->value(rec.u,rec.v,rec.p) * 0.25 * M_1_PI);
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) * 0.25 * M_1_PI);
 }
 point3f isotropic::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -374,14 +374,14 @@ point3f isotropic::get_albedo(const ray& r_in, const hit_record& rec) const {
 
 bool orennayar::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new cosine_pdf(hrec.normal);
   return(true);
 }
 
 bool orennayar::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new cosine_pdf(hrec.normal);
   return(true);
 }
@@ -421,11 +421,11 @@ point3f orennayar::f(const ray& r_in, const hit_record& rec, const ray& scattere
     sinAlpha = sinThetaI;
     tanBeta = sinThetaO / AbsCosTheta(wo);
   }
-  return(albedo->value(rec.u, rec.v, rec.p) * (A + B * maxCos * sinAlpha * tanBeta ) * cosine * M_1_PI );
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) * (A + B * maxCos * sinAlpha * tanBeta ) * cosine * M_1_PI );
 }
 
 point3f orennayar::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -435,7 +435,7 @@ point3f orennayar::get_albedo(const ray& r_in, const hit_record& rec) const {
 
 bool MicrofacetReflection::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   if(!hrec.has_bump) {
     srec.pdf_ptr = new micro_pdf(hrec.normal, r_in.direction(), distribution, hrec.u, hrec.v);
   } else {
@@ -446,7 +446,7 @@ bool MicrofacetReflection::scatter(const ray& r_in, const hit_record& hrec, scat
 
 bool MicrofacetReflection::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   if(!hrec.has_bump) {
     srec.pdf_ptr = new micro_pdf(hrec.normal, r_in.direction(), distribution, hrec.u, hrec.v);
   } else {
@@ -477,11 +477,11 @@ point3f MicrofacetReflection::f(const ray& r_in, const hit_record& rec, const ra
   point3f F = FrCond(cosThetaO, eta, k);
   Float G = distribution->G(wo,wi,normal);
   Float D = distribution->D(normal, rec.u, rec.v);
-  return(albedo->value(rec.u, rec.v, rec.p) * F * G * D  * cosThetaI / (4 * CosTheta(wo) * CosTheta(wi) ));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) * F * G * D  * cosThetaI / (4 * CosTheta(wo) * CosTheta(wi) ));
 }
 
 point3f MicrofacetReflection::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 //
@@ -490,7 +490,7 @@ point3f MicrofacetReflection::get_albedo(const ray& r_in, const hit_record& rec)
 
 bool MicrofacetTransmission::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   if(!hrec.has_bump) {
     srec.pdf_ptr = new micro_transmission_pdf(hrec.normal, r_in.direction(), distribution, eta, hrec.u, hrec.v);
   } else {
@@ -501,7 +501,7 @@ bool MicrofacetTransmission::scatter(const ray& r_in, const hit_record& hrec, sc
 
 bool MicrofacetTransmission::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
 
   if(!hrec.has_bump) {
     srec.pdf_ptr = new micro_transmission_pdf(hrec.normal, r_in.direction(), distribution, eta, hrec.u, hrec.v);
@@ -554,7 +554,7 @@ point3f MicrofacetTransmission::f(const ray& r_in, const hit_record& rec, const
 
   Float sqrtDenom = dot(wi, wh)  + dot(wo, wh)* eta2 ;
   return ((1.0 - F) *
-          albedo->value(rec.u, rec.v, rec.p) * atten *
+          albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) * atten *
           D * G * AbsCosTheta(wo) *
         std::fabs(eta2 * eta2 *
        dot(wi, wh) * dot(wo, wh)) /
@@ -562,7 +562,7 @@ point3f MicrofacetTransmission::f(const ray& r_in, const hit_record& rec, const
 }
 
 point3f MicrofacetTransmission::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 point3f MicrofacetTransmission::SchlickFresnel(Float cosTheta) const {
@@ -577,14 +577,14 @@ point3f MicrofacetTransmission::SchlickFresnel(Float cosTheta) const {
 
 bool glossy::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, random_gen& rng) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new glossy_pdf(hrec.normal, r_in.direction(), distribution, hrec.u, hrec.v);
   return(true);
 }
 
 bool glossy::scatter(const ray& r_in, const hit_record& hrec, scatter_record& srec, Sampler* sampler) {
   srec.is_specular = false;
-  srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.p);
+  srec.attenuation = albedo->filtered_value(hrec.u, hrec.v, hrec.p, hrec.du, hrec.dv);
   srec.pdf_ptr = new glossy_pdf(hrec.normal, r_in.direction(), distribution, hrec.u, hrec.v);
   return(true);
 }
@@ -600,7 +600,7 @@ point3f glossy::f(const ray& r_in, const hit_record& rec, const ray& scattered)
   vec3f wo = unit_vector(uvw.world_to_local(scattered.direction()));
   
   auto pow5 = [](Float v) { return (v * v) * (v * v) * v; };
-  point3f diffuse = (28.0f/(23.0f*M_PI)) * albedo->value(rec.u, rec.v, rec.p) *
+  point3f diffuse = (28.0f/(23.0f*M_PI)) * albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv) *
     (point3f(1.0f) + -Rs) *
     (1.0 - pow5(1 - 0.5f * AbsCosTheta(wi))) *
     (1.0 - pow5(1 - 0.5f * AbsCosTheta(wo)));
@@ -625,7 +625,7 @@ point3f glossy::SchlickFresnel(Float cosTheta) const {
 }
 
 point3f glossy::get_albedo(const ray& r_in, const hit_record& rec) const {
-  return(albedo->value(rec.u, rec.v, rec.p));
+  return(albedo->filtered_value(rec.u, rec.v, rec.p, rec.du, rec.dv));
 }
 
 std::array<Float, pMax + 1> hair::ComputeApPdf(Float cosThetaO, Float h) const {
@@ -574,6 +574,60 @@ inline float NextFloatDown(float v) {
   return BitsToFloat(ui);
 }
 
+//IEEE half precision, rounding to nearest even. Values past the half range are clamped to the
+//largest finite half rather than becoming infinite.
+inline uint16_t FloatToHalf(float f) {
+  uint32_t ui = FloatToBits(f);
+  uint16_t sign = static_cast<uint16_t>((ui >> 16) & 0x8000);
+  ui &= 0x7fffffff;
+  if(ui > 0x7f800000) {
+    return(sign | 0x7e00);
+  }
+  if(ui >= 0x477fe000) {
+    return(sign | 0x7bff);
+  }
+  if(ui < 0x38800000) {
+    //Subnormal half (or zero)
+    if(ui < 0x33000000) {
+      return(sign);
+    }
+    uint32_t mantissa = (ui & 0x7fffff) | 0x800000;
+    int shift = 126 - static_cast<int>(ui >> 23);
+    uint32_t h = mantissa >> shift;
+    uint32_t rem = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if(rem > halfway || (rem == halfway && (h & 1))) {
+      h++;
+    }
+    return(sign | static_cast<uint16_t>(h));
+  }
+  uint32_t h = (ui - 0x38000000) >> 13;
+  uint32_t rem = ui & 0x1fff;
+  if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+    h++;
+  }
+  return(sign | static_cast<uint16_t>(h));
+}
+
+inline float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  if(exponent == 0) {
+    float f = static_cast<float>(mantissa) * 5.9604644775390625e-8f;
+    return(sign ? -f : f);
+  }
+  if(exponent == 0x1f) {
+    return(BitsToFloat(sign | 0x7f800000 | (mantissa << 13)));
+  }
+  return(BitsToFloat(sign | ((exponent + 112) << 23) | (mantissa << 13)));
+}
+
+//Whether FloatToHalf() represents `f` without clamping it (NaN counts as representable)
+inline bool FitsHalf(float f) {
+  return((FloatToBits(f) & 0x7fffffff) < 0x477fe000 || std::isnan(f));
+}
+
 constexpr Float origin() { return 1.0f / 32.0f; }
 constexpr Float float_scale() { return 1.0f / 65536.0f; }
 constexpr Float int_scale() { return 256.0f; }
@@ -15,13 +15,14 @@ mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat,
   Rcpp::NumericMatrix colors = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["color_vals"]);
   int colortype = Rcpp::as<int>(mesh_info["color_type"]);
   
-  int nx,ny,nn;
   bool has_texture = false;
+  std::shared_ptr<mipmap> mesh_mipmap;
   if(strlen(texture.c_str()) > 0) {
-    mesh_materials = stbi_loadf(texture.c_str(), &nx, &ny, &nn, 0);
     has_texture = true;
-  } else {
-    mesh_materials = nullptr;
+    mesh_mipmap = texture_registry::Texture(texture);
+    if(!mesh_mipmap) {
+      throw std::runtime_error("Could not read texture " + texture);
+    }
   }
   mat_ptr = mat;
   int number_faces = indices.nrow();
@@ -54,8 +55,7 @@ mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat,
       tx[2] = vec2f(txcoord(idx[2],0),txcoord(idx[2],1));
     }
     if(colortype == 1 && has_texcoords && has_texture) {
-      tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(mesh_materials,
-                                                      nx,ny,nn,
+      tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(mesh_mipmap,
                                                       tx[0].x(),tx[0].y(),
                                                       tx[1].x(),tx[1].y(),
                                                       tx[2].x(),tx[2].y()));
@@ -88,15 +88,117 @@ mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat,
   mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
 }
 
+mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat, int bvh_type,
+               std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
+  mat_ptr = mat;
+  //A single mesh3d color is applied as a diffuse material, as the per-face path does
+  if(mesh_info.containsElementNamed("color")) {
+    Rcpp::NumericVector color = Rcpp::as<Rcpp::NumericVector>(mesh_info["color"]);
+    mat_ptr = std::make_shared<lambertian>(std::make_shared<constant_texture>(point3f(color(0),color(1),color(2))));
+  }
+  Rcpp::NumericMatrix vb = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["vb"]);
+  Float scale_mesh = Rcpp::as<Float>(mesh_info["scale_mesh"]);
+  bool swap_yz = Rcpp::as<bool>(mesh_info["swap_yz"]);
+  bool reverse = Rcpp::as<bool>(mesh_info["reverse"]);
+  int rows = vb.nrow();
+  if(rows != 3 && rows != 4) {
+    throw std::runtime_error("mesh3d vertex matrix must have 3 or 4 rows");
+  }
+  int yc = swap_yz ? 2 : 1;
+  int zc = swap_yz ? 1 : 2;
+  
+  //The vertex matrix stores one vertex per column, so each vertex is contiguous in memory.
+  //Homogeneous coordinates are divided out here, once.
+  size_t nv = vb.ncol();
+  const double* vb_data = vb.begin();
+  std::vector<vec3f> vertices(nv);
+  for(size_t i = 0; i < nv; i++) {
+    const double* p = vb_data + rows * i;
+    Float w = rows == 4 ? p[3] : 1;
+    vertices[i] = vec3f(p[0], p[yc], p[zc]) * (scale_mesh / w);
+  }
+  std::vector<normal3f> normals;
+  Rcpp::RObject normal_obj = mesh_info["normals"];
+  if(!normal_obj.isNULL()) {
+    Rcpp::NumericMatrix norms = Rcpp::as<Rcpp::NumericMatrix>(normal_obj);
+    if(norms.nrow() >= 3 && static_cast<size_t>(norms.ncol()) == nv) {
+      int nrows = norms.nrow();
+      const double* n = norms.begin();
+      normals.resize(nv);
+      for(size_t i = 0; i < nv; i++) {
+        normals[i] = normal3f(n[nrows*i], n[nrows*i+yc], n[nrows*i+zc]);
+      }
+    }
+  }
+  
+  MeshCache no_cache("", "", 1, bvh_type, *ObjectToWorld);
+  std::vector<std::shared_ptr<material> > materials(1, mat_ptr);
+  Rcpp::RObject it = mesh_info["it"];
+  Rcpp::RObject ib = mesh_info["ib"];
+  if(!it.isNULL() && ib.isNULL() && !reverse && TYPEOF(it) == INTSXP && Rf_nrows(it) == 3) {
+    //Triangles only: index the R matrix (one 1-based triangle per column) in place
+    index_buffer = it;
+    compact_mesh3d = std::make_shared<compact_mesh>(vertices, normals, INTEGER(it), 
+                                                    static_cast<size_t>(Rf_ncols(it)), 1,
+                                                    materials, no_cache, bvh_type,
+                                                    ObjectToWorld, WorldToObject, reverseOrientation);
+    return;
+  }
+  //Quads, reversed faces or non-integer indices need an index buffer of their own. Quads are split
+  //into the triangles (1,2,4) and (2,3,4), as in `mesh3d_model()`.
+  std::vector<uint32_t> indices;
+  auto add_face = [&](double a, double b, double c) {
+    double corners[3] = {a, b, c};
+    if(reverse) {
+      std::swap(corners[0], corners[2]);
+    }
+    for(int j = 0; j < 3; j++) {
+      if(!(corners[j] >= 1) || corners[j] > static_cast<double>(nv)) {
+        throw std::runtime_error("Invalid vertex index in mesh3d object");
+      }
+      indices.push_back(static_cast<uint32_t>(corners[j]) - 1);
+    }
+  };
+  if(!it.isNULL()) {
+    Rcpp::NumericMatrix tris = Rcpp::as<Rcpp::NumericMatrix>(it);
+    for(int f = 0; f < tris.ncol(); f++) {
+      add_face(tris(0,f), tris(1,f), tris(2,f));
+    }
+  }
+  if(!ib.isNULL()) {
+    Rcpp::NumericMatrix quads = Rcpp::as<Rcpp::NumericMatrix>(ib);
+    for(int f = 0; f < quads.ncol(); f++) {
+      add_face(quads(0,f), quads(1,f), quads(3,f));
+      add_face(quads(1,f), quads(2,f), quads(3,f));
+    }
+  }
+  std::vector<uint32_t> normal_indices, texcoord_indices;
+  std::vector<vec2f> texcoords;
+  std::vector<uint16_t> material_ids;
+  compact_mesh3d = std::make_shared<compact_mesh>(vertices, normals, indices, normal_indices,
+                                                  texcoords, texcoord_indices, material_ids, materials, no_cache, bvh_type,
+                                                  ObjectToWorld, WorldToObject, reverseOrientation);
+}
+
 bool mesh3d::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  if(compact_mesh3d) {
+    return(compact_mesh3d->hit(r, t_min, t_max, rec, rng));
+  }
   return(mesh_bvh->hit(r, t_min, t_max, rec, rng));
 };
 
 
 bool mesh3d::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  if(compact_mesh3d) {
+    return(compact_mesh3d->hit(r, t_min, t_max, rec, sampler));
+  }
   return(mesh_bvh->hit(r, t_min, t_max, rec, sampler));
 };
 
 bool mesh3d::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(compact_mesh3d) {
+    return(compact_mesh3d->bounding_box(t0,t1,box));
+  }
   return(mesh_bvh->bounding_box(t0,t1,box));
 };
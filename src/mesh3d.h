@@ -3,6 +3,8 @@
 
 #include "triangle.h"
 #include "bvh_node.h"
+#include "compactmesh.h"
+#include "textureregistry.h"
 #ifndef STBIMAGEH
 #define STBIMAGEH
 #include "stb_image.h"
@@ -12,14 +14,12 @@
 class mesh3d : public hitable {
   public:
     mesh3d() {}
-    ~mesh3d() {
-      if(mesh_materials) {
-        stbi_image_free(mesh_materials);
-      }
-    }
     mesh3d(Rcpp::List mesh_info, std::shared_ptr<material>  mat, 
            Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
            std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+    //Single material meshes: reads the `vb`, `it`, `ib` and `normals` buffers of the R object directly
+    mesh3d(Rcpp::List mesh_info, std::shared_ptr<material>  mat, int bvh_type,
+           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
     
@@ -28,9 +28,12 @@ class mesh3d : public hitable {
       return(std::string("Mesh3d"));
     }
     std::shared_ptr<bvh_node> mesh_bvh;
+    //Used instead of `mesh_bvh` and `triangles` by the single material constructor, which keeps a
+    //reference to the R index matrix when the compact mesh indexes it in place
+    std::shared_ptr<compact_mesh> compact_mesh3d;
+    Rcpp::RObject index_buffer;
     std::shared_ptr<material>  mat_ptr;
     hitable_list triangles;
-    Float* mesh_materials;
 };
 
 
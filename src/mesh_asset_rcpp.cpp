@@ -0,0 +1,245 @@
+#include "meshasset.h"
+#include "plymesh.h"
+#include "trimesh.h"
+#include "tinyobj/tiny_obj_loader.h"
+#include <cmath>
+#include <cctype>
+using namespace Rcpp;
+// [[Rcpp::plugins(cpp11)]]
+
+static CachedMaterial default_asset_material() {
+  CachedMaterial mat;
+  mat.diffuse[0] = mat.diffuse[1] = mat.diffuse[2] = 1.0f;
+  mat.dissolve = 1.0f;
+  mat.ior = 1.0f;
+  mat.bump_multiplier = 1.0f;
+  return(mat);
+}
+
+//Drops faces with NaN vertices, as the mesh constructors do
+static void remove_nan_faces(const std::vector<vec3f>& vertices, std::vector<uint32_t>& indices,
+                             std::vector<uint32_t>& normal_indices, std::vector<uint32_t>& texcoord_indices,
+                             std::vector<uint16_t>& material_ids) {
+  size_t kept = 0;
+  for(size_t f = 0; f < indices.size() / 3; f++) {
+    bool is_nan = false;
+    for(size_t v = 0; v < 3; v++) {
+      const vec3f& p = vertices[indices[3*f+v]];
+      is_nan = is_nan || std::isnan(p.x()) || std::isnan(p.y()) || std::isnan(p.z());
+    }
+    if(is_nan) {
+      continue;
+    }
+    for(size_t v = 0; v < 3; v++) {
+      indices[3*kept+v] = indices[3*f+v];
+      if(!normal_indices.empty()) {
+        normal_indices[3*kept+v] = normal_indices[3*f+v];
+      }
+      if(!texcoord_indices.empty()) {
+        texcoord_indices[3*kept+v] = texcoord_indices[3*f+v];
+      }
+    }
+    if(!material_ids.empty()) {
+      material_ids[kept] = material_ids[f];
+    }
+    kept++;
+  }
+  indices.resize(3 * kept);
+  if(!normal_indices.empty()) {
+    normal_indices.resize(3 * kept);
+  }
+  if(!texcoord_indices.empty()) {
+    texcoord_indices.resize(3 * kept);
+  }
+  if(!material_ids.empty()) {
+    material_ids.resize(kept);
+  }
+}
+
+//Builds the BVH in object space and writes the asset. The mesh only needs material slots, not
+//materials, since it is never rendered.
+static void write_asset(std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+                        std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+                        std::vector<vec2f>& texcoords, std::vector<uint32_t>& texcoord_indices,
+                        std::vector<uint16_t>& material_ids, const std::vector<CachedMaterial>& table,
+                        std::string outputfile, bool quantize, bool include_bvh, int bvh_type) {
+  remove_nan_faces(vertices, indices, normal_indices, texcoord_indices, material_ids);
+  if(indices.empty()) {
+    throw std::runtime_error("No faces to write to " + outputfile);
+  }
+  std::shared_ptr<Transform> Identity = std::make_shared<Transform>();
+  MeshCache no_cache("", "", 1, bvh_type, *Identity);
+  std::vector<std::shared_ptr<material> > slots(table.size());
+  compact_mesh mesh(vertices, normals, indices, normal_indices, texcoords, texcoord_indices,
+                    material_ids, slots, no_cache, bvh_type, Identity, Identity, false);
+  std::string err;
+  if(!WriteMeshAsset(outputfile, mesh, table, quantize, include_bvh, err)) {
+    throw std::runtime_error(err);
+  }
+}
+
+static bool has_extension(const std::string& filename, const std::string& ext) {
+  if(filename.size() < ext.size()) {
+    return(false);
+  }
+  std::string tail = filename.substr(filename.size() - ext.size());
+  for(size_t i = 0; i < tail.size(); i++) {
+    tail[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(tail[i])));
+  }
+  return(tail == ext);
+}
+
+//OBJ files are read with tinyobjloader so per-face materials and the material library are kept;
+//PLY files use the same loader as `plymesh`. Texture paths are stored resolved against `basedir`.
+//Alpha textures, which compact meshes don't support, are dropped with a warning, as are the
+//textures of meshes without texture coordinates.
+// [[Rcpp::export]]
+void convert_mesh_asset_rcpp(std::string inputfile, std::string basedir, std::string outputfile,
+                             bool quantize, bool include_bvh, int bvh_type, int numbercores) {
+  std::vector<vec3f> vertices;
+  std::vector<normal3f> normals;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> normal_indices;
+  std::vector<vec2f> texcoords;
+  std::vector<uint32_t> texcoord_indices;
+  std::vector<uint16_t> material_ids;
+  std::vector<CachedMaterial> table;
+  if(has_extension(inputfile, ".ply")) {
+    std::string err;
+    if(!LoadPlyGeometry(inputfile, numbercores, vertices, indices, err)) {
+      throw std::runtime_error(err);
+    }
+    table.push_back(default_asset_material());
+  } else {
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn, err;
+    if(!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str())) {
+      throw std::runtime_error("Error reading " + inputfile + ": " + warn + err);
+    }
+    if(materials.size() >= 65536) {
+      throw std::runtime_error("Too many materials in " + inputfile);
+    }
+    bool has_texcoords = !attrib.texcoords.empty();
+    std::string prefix = basedir.empty() ? std::string() : basedir + separator();
+    table.resize(materials.size());
+    for(size_t i = 0; i < materials.size(); i++) {
+      CachedMaterial& mat = table[i];
+      for(int j = 0; j < 3; j++) {
+        mat.diffuse[j] = materials[i].diffuse[j];
+      }
+      mat.dissolve = materials[i].dissolve;
+      mat.ior = materials[i].ior;
+      mat.bump_multiplier = materials[i].bump_texopt.bump_multiplier;
+      bool has_textures = !materials[i].diffuse_texname.empty() || !materials[i].bump_texname.empty();
+      if(has_textures && !has_texcoords) {
+        Rcpp::warning("Textures of material `" + materials[i].name + "` dropped: " + inputfile +
+                      " has no texture coordinates");
+      } else {
+        if(!materials[i].diffuse_texname.empty()) {
+          mat.diffuse_texname = prefix + materials[i].diffuse_texname;
+        }
+        if(!materials[i].bump_texname.empty()) {
+          mat.bump_texname = prefix + materials[i].bump_texname;
+        }
+      }
+      if(!materials[i].alpha_texname.empty()) {
+        Rcpp::warning("Alpha texture of material `" + materials[i].name + "` dropped: mesh assets don't support alpha textures");
+      }
+    }
+    //Faces without a material use a white default, appended to the table
+    uint16_t default_id = static_cast<uint16_t>(table.size());
+    bool uses_default = false;
+    vertices.resize(attrib.vertices.size() / 3);
+    for(size_t i = 0; i < vertices.size(); i++) {
+      vertices[i] = vec3f(attrib.vertices[3*i], attrib.vertices[3*i+1], attrib.vertices[3*i+2]);
+    }
+    normals.resize(attrib.normals.size() / 3);
+    for(size_t i = 0; i < normals.size(); i++) {
+      normals[i] = normal3f(attrib.normals[3*i], attrib.normals[3*i+1], attrib.normals[3*i+2]);
+    }
+    texcoords.resize(attrib.texcoords.size() / 2);
+    for(size_t i = 0; i < texcoords.size(); i++) {
+      texcoords[i] = vec2f(attrib.texcoords[2*i], attrib.texcoords[2*i+1]);
+    }
+    for(size_t s = 0; s < shapes.size(); s++) {
+      const tinyobj::mesh_t& mesh = shapes[s].mesh;
+      for(size_t f = 0; f < mesh.num_face_vertices.size(); f++) {
+        for(size_t v = 0; v < 3; v++) {
+          const tinyobj::index_t& idx = mesh.indices[3*f+v];
+          if(idx.vertex_index < 0 || static_cast<size_t>(idx.vertex_index) >= vertices.size()) {
+            throw std::runtime_error("Invalid vertex index in OBJ file: " + inputfile);
+          }
+          indices.push_back(static_cast<uint32_t>(idx.vertex_index));
+          bool has_normal = idx.normal_index >= 0 && static_cast<size_t>(idx.normal_index) < normals.size();
+          normal_indices.push_back(has_normal ? static_cast<uint32_t>(idx.normal_index) : compact_mesh::kNoNormal);
+          bool has_texcoord = idx.texcoord_index >= 0 && static_cast<size_t>(idx.texcoord_index) < texcoords.size();
+          texcoord_indices.push_back(has_texcoord ? static_cast<uint32_t>(idx.texcoord_index) : compact_mesh::kNoNormal);
+        }
+        int material_num = mesh.material_ids[f];
+        if(material_num < 0 || static_cast<size_t>(material_num) >= materials.size()) {
+          material_ids.push_back(default_id);
+          uses_default = true;
+        } else {
+          material_ids.push_back(static_cast<uint16_t>(material_num));
+        }
+      }
+    }
+    if(uses_default) {
+      table.push_back(default_asset_material());
+    }
+    if(normals.empty()) {
+      normal_indices.clear();
+    }
+    if(texcoords.empty()) {
+      texcoord_indices.clear();
+    }
+    if(table.size() == 1) {
+      material_ids.clear();
+    }
+  }
+  write_asset(vertices, normals, indices, normal_indices, texcoords, texcoord_indices, material_ids, table,
+              outputfile, quantize, include_bvh, bvh_type);
+}
+
+//`vertices` and `normals` have one row per vertex, `indices` one row of zero-based indices per
+//triangle. `color` is the diffuse color stored in the asset's single material.
+// [[Rcpp::export]]
+void convert_mesh3d_asset_rcpp(NumericMatrix vertices, NumericMatrix indices, NumericMatrix normals,
+                               NumericVector color, std::string outputfile,
+                               bool quantize, bool include_bvh, int bvh_type) {
+  size_t nv = vertices.nrow();
+  std::vector<vec3f> mesh_vertices(nv);
+  for(size_t i = 0; i < nv; i++) {
+    mesh_vertices[i] = vec3f(vertices(i,0), vertices(i,1), vertices(i,2));
+  }
+  std::vector<normal3f> mesh_normals;
+  if(normals.ncol() == 3 && static_cast<size_t>(normals.nrow()) == nv) {
+    mesh_normals.resize(nv);
+    for(size_t i = 0; i < nv; i++) {
+      mesh_normals[i] = normal3f(normals(i,0), normals(i,1), normals(i,2));
+    }
+  }
+  std::vector<uint32_t> mesh_indices(3 * indices.nrow());
+  for(int f = 0; f < indices.nrow(); f++) {
+    for(int v = 0; v < 3; v++) {
+      double idx = indices(f,v);
+      if(!(idx >= 0) || idx >= static_cast<double>(nv)) {
+        throw std::runtime_error("Invalid vertex index in mesh3d object");
+      }
+      mesh_indices[3*f+v] = static_cast<uint32_t>(idx);
+    }
+  }
+  std::vector<uint32_t> normal_indices, texcoord_indices;
+  std::vector<vec2f> texcoords;
+  std::vector<uint16_t> material_ids;
+  std::vector<CachedMaterial> table(1, default_asset_material());
+  if(color.size() == 3) {
+    for(int j = 0; j < 3; j++) {
+      table[0].diffuse[j] = static_cast<float>(color(j));
+    }
+  }
+  write_asset(mesh_vertices, mesh_normals, mesh_indices, normal_indices, texcoords, texcoord_indices,
+              material_ids, table, outputfile, quantize, include_bvh, bvh_type);
+}
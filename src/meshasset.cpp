@@ -0,0 +1,531 @@
+#include "meshasset.h"
+#include "mappedfile.h"
+#include "texture.h"
+#include "textureregistry.h"
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+//Bump when the layout of the file changes
+static const uint32_t kMeshAssetVersion = 3;
+static const char kMeshAssetMagic[8] = {'R','A','Y','M','E','S','H','\0'};
+static const uint32_t kEndianCheck = 0x01020304;
+static const uint32_t kAssetQuantized = 1;
+static const size_t kSectionAlignment = 16;
+
+enum MeshAssetSection {
+  kVertexSection = 0,
+  kNormalSection,
+  kIndexSection,
+  kNormalIndexSection,
+  kMaterialIdSection,
+  kMaterialSection,
+  kNodeSection,
+  kTexcoordSection,
+  kTexcoordIndexSection,
+  kStringSection,
+  kNumSections
+};
+
+struct MeshAssetHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t flags;
+  uint32_t num_materials;
+  uint64_t num_vertices;
+  uint64_t num_normals;
+  uint64_t num_faces;
+  uint64_t num_nodes;
+  uint64_t num_texcoords;
+  uint64_t string_bytes;
+  //Range used to quantize the vertices
+  float bounds_min[3];
+  float bounds_max[3];
+  //Byte offset of each section from the start of the file, zero if the section is empty
+  uint64_t offsets[kNumSections];
+};
+
+//Texture paths are stored in the string section, referenced by offset and length
+struct MeshAssetMaterial {
+  float diffuse[3];
+  float dissolve;
+  float ior;
+  float bump_multiplier;
+  uint32_t diffuse_texname[2];
+  uint32_t bump_texname[2];
+};
+
+struct MeshAssetNode {
+  float bounds[6];
+  uint32_t offset;
+  uint16_t count;
+  uint16_t axis;
+};
+
+static inline size_t aligned_size(size_t bytes) {
+  return((bytes + kSectionAlignment - 1) & ~(kSectionAlignment - 1));
+}
+
+//Returns a pointer to a section holding `count` elements of `size` bytes, or nullptr if the
+//section doesn't fit in the file
+static const char* section(const MappedFile& file, const MeshAssetHeader& header, int index,
+                           uint64_t count, size_t size) {
+  uint64_t offset = header.offsets[index];
+  if(count == 0 || offset % kSectionAlignment != 0 || offset < sizeof(MeshAssetHeader) ||
+     offset > file.size() || count > (file.size() - offset) / size) {
+    return(nullptr);
+  }
+  return(file.data() + offset);
+}
+
+static bool read_string(const char* strings, uint64_t string_bytes, const uint32_t ref[2],
+                        std::string& out) {
+  if(static_cast<uint64_t>(ref[0]) + ref[1] > string_bytes) {
+    return(false);
+  }
+  out = ref[1] > 0 ? std::string(strings + ref[0], ref[1]) : std::string();
+  return(true);
+}
+
+bool ReadMeshAsset(const std::string& filename, MeshAssetData& asset, std::string& err) {
+  MappedFile file(filename);
+  if(!file.valid() || file.size() < sizeof(MeshAssetHeader)) {
+    err = "Could not read mesh asset " + filename;
+    return(false);
+  }
+  MeshAssetHeader header;
+  std::memcpy(&header, file.data(), sizeof(MeshAssetHeader));
+  if(std::memcmp(header.magic, kMeshAssetMagic, 8) != 0) {
+    err = filename + " is not a mesh asset";
+    return(false);
+  }
+  if(header.version != kMeshAssetVersion || header.endian != kEndianCheck) {
+    err = filename + " was written by an incompatible version of rayrender";
+    return(false);
+  }
+  err = "Mesh asset " + filename + " is truncated or corrupt";
+  if(header.num_faces == 0 || header.num_vertices == 0 || header.num_materials == 0 ||
+     header.num_vertices > 0xFFFFFFFFULL || header.num_normals > 0xFFFFFFFFULL ||
+     header.num_faces > 0xFFFFFFFFULL || header.num_nodes > 0xFFFFFFFFULL ||
+     header.num_texcoords > 0xFFFFFFFFULL || header.string_bytes > 0xFFFFFFFFULL) {
+    return(false);
+  }
+  size_t num_vertices = static_cast<size_t>(header.num_vertices);
+  size_t num_faces = static_cast<size_t>(header.num_faces);
+  bool quantized = header.flags & kAssetQuantized;
+
+  const char* p = section(file, header, kVertexSection, 3 * header.num_vertices,
+                          quantized ? sizeof(uint16_t) : sizeof(float));
+  if(!p) {
+    return(false);
+  }
+  asset.vertices.resize(num_vertices);
+  if(quantized) {
+    float scale[3];
+    for(int j = 0; j < 3; j++) {
+      scale[j] = (header.bounds_max[j] - header.bounds_min[j]) / 65535.0f;
+    }
+    const uint16_t* q = reinterpret_cast<const uint16_t*>(p);
+    for(size_t i = 0; i < num_vertices; i++) {
+      for(int j = 0; j < 3; j++) {
+        asset.vertices[i].e[j] = header.bounds_min[j] + q[3*i+j] * scale[j];
+      }
+    }
+  } else {
+    const float* v = reinterpret_cast<const float*>(p);
+    for(size_t i = 0; i < num_vertices; i++) {
+      asset.vertices[i] = vec3f(v[3*i], v[3*i+1], v[3*i+2]);
+    }
+  }
+
+  asset.normals.clear();
+  if(header.num_normals > 0) {
+    const float* n = reinterpret_cast<const float*>(section(file, header, kNormalSection,
+                                                            3 * header.num_normals, sizeof(float)));
+    if(!n) {
+      return(false);
+    }
+    asset.normals.resize(static_cast<size_t>(header.num_normals));
+    for(size_t i = 0; i < asset.normals.size(); i++) {
+      asset.normals[i] = normal3f(n[3*i], n[3*i+1], n[3*i+2]);
+    }
+  }
+
+  asset.texcoords.clear();
+  if(header.num_texcoords > 0) {
+    const float* uv = reinterpret_cast<const float*>(section(file, header, kTexcoordSection,
+                                                             2 * header.num_texcoords, sizeof(float)));
+    if(!uv) {
+      return(false);
+    }
+    asset.texcoords.resize(static_cast<size_t>(header.num_texcoords));
+    for(size_t i = 0; i < asset.texcoords.size(); i++) {
+      asset.texcoords[i] = vec2f(uv[2*i], uv[2*i+1]);
+    }
+  }
+
+  const uint32_t* idx = reinterpret_cast<const uint32_t*>(section(file, header, kIndexSection,
+                                                                  3 * header.num_faces, sizeof(uint32_t)));
+  if(!idx) {
+    return(false);
+  }
+  asset.indices.assign(idx, idx + 3 * num_faces);
+  for(size_t i = 0; i < asset.indices.size(); i++) {
+    if(asset.indices[i] >= num_vertices) {
+      return(false);
+    }
+  }
+
+  asset.normal_indices.clear();
+  if(header.offsets[kNormalIndexSection] != 0) {
+    const uint32_t* nidx = reinterpret_cast<const uint32_t*>(section(file, header, kNormalIndexSection,
+                                                                     3 * header.num_faces, sizeof(uint32_t)));
+    if(!nidx) {
+      return(false);
+    }
+    asset.normal_indices.assign(nidx, nidx + 3 * num_faces);
+    for(size_t i = 0; i < asset.normal_indices.size(); i++) {
+      if(asset.normal_indices[i] >= header.num_normals && asset.normal_indices[i] != compact_mesh::kNoNormal) {
+        return(false);
+      }
+    }
+  } else if(header.num_normals > 0 && header.num_normals != header.num_vertices) {
+    return(false);
+  }
+
+  asset.texcoord_indices.clear();
+  if(header.offsets[kTexcoordIndexSection] != 0) {
+    const uint32_t* tidx = reinterpret_cast<const uint32_t*>(section(file, header, kTexcoordIndexSection,
+                                                                     3 * header.num_faces, sizeof(uint32_t)));
+    if(!tidx) {
+      return(false);
+    }
+    asset.texcoord_indices.assign(tidx, tidx + 3 * num_faces);
+    for(size_t i = 0; i < asset.texcoord_indices.size(); i++) {
+      if(asset.texcoord_indices[i] >= header.num_texcoords && asset.texcoord_indices[i] != compact_mesh::kNoNormal) {
+        return(false);
+      }
+    }
+  } else if(header.num_texcoords > 0 && header.num_texcoords != header.num_vertices) {
+    return(false);
+  }
+
+  asset.material_ids.clear();
+  if(header.offsets[kMaterialIdSection] != 0) {
+    const uint16_t* ids = reinterpret_cast<const uint16_t*>(section(file, header, kMaterialIdSection,
+                                                                    header.num_faces, sizeof(uint16_t)));
+    if(!ids) {
+      return(false);
+    }
+    asset.material_ids.assign(ids, ids + num_faces);
+    for(size_t i = 0; i < asset.material_ids.size(); i++) {
+      if(asset.material_ids[i] >= header.num_materials) {
+        return(false);
+      }
+    }
+  }
+
+  const char* m = section(file, header, kMaterialSection, header.num_materials, sizeof(MeshAssetMaterial));
+  const char* strings = header.string_bytes > 0 ?
+    section(file, header, kStringSection, header.string_bytes, 1) : nullptr;
+  if(!m || (header.string_bytes > 0 && !strings)) {
+    return(false);
+  }
+  asset.materials.resize(header.num_materials);
+  for(size_t i = 0; i < asset.materials.size(); i++) {
+    MeshAssetMaterial stored;
+    std::memcpy(&stored, m + i * sizeof(MeshAssetMaterial), sizeof(MeshAssetMaterial));
+    CachedMaterial& mat = asset.materials[i];
+    std::memcpy(mat.diffuse, stored.diffuse, 3 * sizeof(float));
+    mat.dissolve = stored.dissolve;
+    mat.ior = stored.ior;
+    mat.bump_multiplier = stored.bump_multiplier;
+    if(!read_string(strings, header.string_bytes, stored.diffuse_texname, mat.diffuse_texname) ||
+       !read_string(strings, header.string_bytes, stored.bump_texname, mat.bump_texname)) {
+      return(false);
+    }
+  }
+
+  //The tree's structure is checked when the compact mesh adopts it
+  asset.nodes.clear();
+  if(header.num_nodes > 0) {
+    const char* nodes = section(file, header, kNodeSection, header.num_nodes, sizeof(MeshAssetNode));
+    if(!nodes) {
+      return(false);
+    }
+    asset.nodes.resize(static_cast<size_t>(header.num_nodes));
+    for(size_t i = 0; i < asset.nodes.size(); i++) {
+      MeshAssetNode stored;
+      std::memcpy(&stored, nodes + i * sizeof(MeshAssetNode), sizeof(MeshAssetNode));
+      compact_bvh_node& node = asset.nodes[i];
+      node.bounds[0] = point3f(stored.bounds[0], stored.bounds[1], stored.bounds[2]);
+      node.bounds[1] = point3f(stored.bounds[3], stored.bounds[4], stored.bounds[5]);
+      node.offset = stored.offset;
+      node.count = stored.count;
+      node.axis = stored.axis;
+    }
+  }
+  err.clear();
+  return(true);
+}
+
+//Writes a section at the next aligned offset and records where it starts
+static void write_section(FILE* f, const void* data, size_t bytes, uint64_t& offset, uint64_t& position) {
+  static const char zeros[kSectionAlignment] = {0};
+  if(bytes == 0) {
+    offset = 0;
+    return;
+  }
+  offset = position;
+  fwrite(data, 1, bytes, f);
+  fwrite(zeros, 1, aligned_size(bytes) - bytes, f);
+  position += aligned_size(bytes);
+}
+
+bool WriteMeshAsset(const std::string& filename, const compact_mesh& mesh,
+                    const std::vector<CachedMaterial>& materials, bool quantize, bool include_bvh,
+                    std::string& err) {
+  if(mesh.num_faces() == 0 || mesh.vertices.empty()) {
+    err = "Mesh has no faces";
+    return(false);
+  }
+  if(materials.empty() || materials.size() > 65536) {
+    err = "Mesh assets require between 1 and 65536 materials";
+    return(false);
+  }
+  MeshAssetHeader header;
+  std::memset(&header, 0, sizeof(MeshAssetHeader));
+  std::memcpy(header.magic, kMeshAssetMagic, 8);
+  header.version = kMeshAssetVersion;
+  header.endian = kEndianCheck;
+  header.flags = quantize ? kAssetQuantized : 0;
+  header.num_materials = static_cast<uint32_t>(materials.size());
+  header.num_vertices = mesh.vertices.size();
+  header.num_normals = mesh.normals.size();
+  header.num_texcoords = mesh.texcoords.size();
+  header.num_faces = mesh.num_faces();
+
+  for(int j = 0; j < 3; j++) {
+    header.bounds_min[j] = mesh.vertices[0].e[j];
+    header.bounds_max[j] = mesh.vertices[0].e[j];
+  }
+  for(size_t i = 1; i < mesh.vertices.size(); i++) {
+    for(int j = 0; j < 3; j++) {
+      header.bounds_min[j] = std::fmin(header.bounds_min[j], static_cast<float>(mesh.vertices[i].e[j]));
+      header.bounds_max[j] = std::fmax(header.bounds_max[j], static_cast<float>(mesh.vertices[i].e[j]));
+    }
+  }
+  std::vector<float> vertices;
+  std::vector<uint16_t> quantized;
+  if(quantize) {
+    quantized.resize(3 * mesh.vertices.size());
+    for(size_t i = 0; i < mesh.vertices.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        float extent = header.bounds_max[j] - header.bounds_min[j];
+        float x = extent > 0 ? (mesh.vertices[i].e[j] - header.bounds_min[j]) / extent : 0.0f;
+        quantized[3*i+j] = static_cast<uint16_t>(std::fmin(std::fmax(x, 0.0f), 1.0f) * 65535.0f + 0.5f);
+      }
+    }
+  } else {
+    vertices.resize(3 * mesh.vertices.size());
+    for(size_t i = 0; i < mesh.vertices.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        vertices[3*i+j] = mesh.vertices[i].e[j];
+      }
+    }
+  }
+  std::vector<float> normals(3 * mesh.normals.size());
+  for(size_t i = 0; i < mesh.normals.size(); i++) {
+    for(int j = 0; j < 3; j++) {
+      normals[3*i+j] = mesh.normals[i].e[j];
+    }
+  }
+
+  std::vector<float> texcoords(2 * mesh.texcoords.size());
+  for(size_t i = 0; i < mesh.texcoords.size(); i++) {
+    texcoords[2*i] = mesh.texcoords[i].x();
+    texcoords[2*i+1] = mesh.texcoords[i].y();
+  }
+
+  std::vector<uint32_t> indices(3 * mesh.num_faces());
+  for(size_t i = 0; i < mesh.num_faces(); i++) {
+    for(int j = 0; j < 3; j++) {
+      indices[3*i+j] = mesh.vertex_index(static_cast<uint32_t>(i), j);
+    }
+  }
+
+  std::string strings;
+  std::vector<MeshAssetMaterial> stored_materials(materials.size());
+  for(size_t i = 0; i < materials.size(); i++) {
+    MeshAssetMaterial& stored = stored_materials[i];
+    std::memcpy(stored.diffuse, materials[i].diffuse, 3 * sizeof(float));
+    stored.dissolve = materials[i].dissolve;
+    stored.ior = materials[i].ior;
+    stored.bump_multiplier = materials[i].bump_multiplier;
+    stored.diffuse_texname[0] = static_cast<uint32_t>(strings.size());
+    stored.diffuse_texname[1] = static_cast<uint32_t>(materials[i].diffuse_texname.size());
+    strings += materials[i].diffuse_texname;
+    stored.bump_texname[0] = static_cast<uint32_t>(strings.size());
+    stored.bump_texname[1] = static_cast<uint32_t>(materials[i].bump_texname.size());
+    strings += materials[i].bump_texname;
+  }
+  header.string_bytes = strings.size();
+
+  std::vector<MeshAssetNode> stored_nodes;
+  if(include_bvh) {
+    std::vector<compact_bvh_node> nodes = mesh.export_nodes();
+    stored_nodes.resize(nodes.size());
+    for(size_t i = 0; i < nodes.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        stored_nodes[i].bounds[j] = nodes[i].bounds[0].e[j];
+        stored_nodes[i].bounds[3+j] = nodes[i].bounds[1].e[j];
+      }
+      stored_nodes[i].offset = nodes[i].offset;
+      stored_nodes[i].count = nodes[i].count;
+      stored_nodes[i].axis = nodes[i].axis;
+    }
+    header.num_nodes = stored_nodes.size();
+  }
+
+  //As with the mesh cache, write to a temporary file and rename it into place so jobs reading
+  //the asset never see a partial file
+  std::ostringstream temp_name;
+  temp_name << filename << ".tmp" << std::hex << reinterpret_cast<uintptr_t>(&mesh);
+  FILE* f = fopen(temp_name.str().c_str(), "wb");
+  if(!f) {
+    err = "Could not open " + filename + " for writing";
+    return(false);
+  }
+  static const char zeros[kSectionAlignment] = {0};
+  uint64_t position = aligned_size(sizeof(MeshAssetHeader));
+  fwrite(&header, sizeof(MeshAssetHeader), 1, f);
+  fwrite(zeros, 1, position - sizeof(MeshAssetHeader), f);
+  if(quantize) {
+    write_section(f, quantized.data(), quantized.size() * sizeof(uint16_t), header.offsets[kVertexSection], position);
+  } else {
+    write_section(f, vertices.data(), vertices.size() * sizeof(float), header.offsets[kVertexSection], position);
+  }
+  write_section(f, normals.data(), normals.size() * sizeof(float), header.offsets[kNormalSection], position);
+  write_section(f, indices.data(), indices.size() * sizeof(uint32_t), header.offsets[kIndexSection], position);
+  write_section(f, mesh.normal_indices.data(), mesh.normal_indices.size() * sizeof(uint32_t),
+                header.offsets[kNormalIndexSection], position);
+  write_section(f, mesh.material_ids.data(), mesh.material_ids.size() * sizeof(uint16_t),
+                header.offsets[kMaterialIdSection], position);
+  write_section(f, stored_materials.data(), stored_materials.size() * sizeof(MeshAssetMaterial),
+                header.offsets[kMaterialSection], position);
+  write_section(f, stored_nodes.data(), stored_nodes.size() * sizeof(MeshAssetNode),
+                header.offsets[kNodeSection], position);
+  write_section(f, texcoords.data(), texcoords.size() * sizeof(float), header.offsets[kTexcoordSection], position);
+  write_section(f, mesh.texcoord_indices.data(), mesh.texcoord_indices.size() * sizeof(uint32_t),
+                header.offsets[kTexcoordIndexSection], position);
+  write_section(f, strings.data(), strings.size(), header.offsets[kStringSection], position);
+  //Rewrite the header now that the section offsets are known
+  fseek(f, 0, SEEK_SET);
+  fwrite(&header, sizeof(MeshAssetHeader), 1, f);
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if(!ok || std::rename(temp_name.str().c_str(), filename.c_str()) != 0) {
+    std::remove(temp_name.str().c_str());
+    err = "Could not write " + filename;
+    return(false);
+  }
+  return(true);
+}
+
+//Texture paths are stored as they resolved when the asset was written. If the asset has been moved
+//along with its textures since, the texture is looked for next to the asset instead.
+static std::string texture_path(const std::string& texname, const std::string& assetfile) {
+  FILE* f = fopen(texname.c_str(), "rb");
+  if(f) {
+    fclose(f);
+    return(texname);
+  }
+  size_t name_start = texname.find_last_of("/\\");
+  std::string name = name_start == std::string::npos ? texname : texname.substr(name_start + 1);
+  size_t dir_end = assetfile.find_last_of("/\\");
+  return(dir_end == std::string::npos ? name : assetfile.substr(0, dir_end + 1) + name);
+}
+
+mesh_asset::mesh_asset(std::string inputfile, std::shared_ptr<material> mat, bool asset_materials,
+                       Float scale, int bvh_type,
+                       std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                       bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), mat_ptr(mat) {
+  MeshAssetData asset;
+  std::string err;
+  if(!ReadMeshAsset(inputfile, asset, err)) {
+    throw std::runtime_error(err);
+  }
+  std::vector<std::shared_ptr<material> > materials;
+  std::vector<std::shared_ptr<bump_texture> > bump_textures;
+  if(asset_materials) {
+    materials.reserve(asset.materials.size());
+    bump_textures.resize(asset.materials.size());
+    for(size_t i = 0; i < asset.materials.size(); i++) {
+      const CachedMaterial& m = asset.materials[i];
+      vec3f diffuse(m.diffuse[0], m.diffuse[1], m.diffuse[2]);
+      if(m.dissolve < 1) {
+        materials.push_back(std::make_shared<dielectric>(diffuse, m.ior, vec3f(0,0,0), 0));
+      } else if(!m.diffuse_texname.empty()) {
+        std::shared_ptr<mipmap> mip = texture_registry::Texture(texture_path(m.diffuse_texname, inputfile));
+        if(!mip) {
+          throw std::runtime_error("Could not find " + m.diffuse_texname);
+        }
+        materials.push_back(std::make_shared<lambertian>(std::make_shared<image_texture>(mip, 1, 1, 1)));
+      } else {
+        materials.push_back(std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse)));
+      }
+      if(!m.bump_texname.empty()) {
+        std::shared_ptr<image_data> image = texture_registry::Decode(texture_path(m.bump_texname, inputfile),
+                                                                     texture_registry::kColorGamma);
+        if(!image) {
+          throw std::runtime_error("Could not find " + m.bump_texname);
+        }
+        bump_textures[i] = std::make_shared<bump_texture>(image, m.bump_multiplier);
+      }
+    }
+  } else {
+    materials.push_back(mat_ptr);
+    asset.material_ids.clear();
+  }
+  if(scale != 1) {
+    for(size_t i = 0; i < asset.vertices.size(); i++) {
+      asset.vertices[i] *= scale;
+    }
+  }
+  asset_mesh = std::make_shared<compact_mesh>(asset.vertices, asset.normals, asset.indices, asset.normal_indices,
+                                              asset.texcoords, asset.texcoord_indices,
+                                              asset.material_ids, materials, asset.nodes, bvh_type,
+                                              ObjectToWorld, WorldToObject, reverseOrientation);
+  asset_mesh->bump_textures.swap(bump_textures);
+}
+
+bool mesh_asset::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  return(asset_mesh->hit(r, t_min, t_max, rec, rng));
+}
+
+bool mesh_asset::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(asset_mesh->hit(r, t_min, t_max, rec, sampler));
+}
+
+Float mesh_asset::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  return(asset_mesh->pdf_value(o, v, rng, time));
+}
+
+Float mesh_asset::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  return(asset_mesh->pdf_value(o, v, sampler, time));
+}
+
+vec3f mesh_asset::random(const point3f& o, random_gen& rng, Float time) {
+  return(asset_mesh->random(o, rng, time));
+}
+
+vec3f mesh_asset::random(const point3f& o, Sampler* sampler, Float time) {
+  return(asset_mesh->random(o, sampler, time));
+}
+
+bool mesh_asset::bounding_box(Float t0, Float t1, aabb& box) const {
+  return(asset_mesh->bounding_box(t0, t1, box));
+}
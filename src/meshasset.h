@@ -0,0 +1,69 @@
+#ifndef MESHASSETH
+#define MESHASSETH
+
+#include "compactmesh.h"
+#include "meshcache.h"
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <Rcpp.h>
+
+//Contents of a mesh asset file (`.rmesh`): a versioned, little-endian binary format holding a
+//triangle mesh in the layout `compact_mesh` uses, so it can be loaded without parsing. Every
+//section starts on a 16-byte boundary of the file, so the streams can be read straight out of a
+//memory-mapped view. Vertices are stored as floats or, optionally, as 16-bit integers quantized to
+//the bounds of the mesh. Texture coordinates have their own index stream, like the normals. The
+//material table holds the diffuse color, dissolve, index of refraction and bump multiplier of each
+//OBJ material, along with the paths of its diffuse and bump textures.
+struct MeshAssetData {
+  std::vector<vec3f> vertices;
+  std::vector<normal3f> normals;
+  std::vector<vec2f> texcoords;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> normal_indices;
+  std::vector<uint32_t> texcoord_indices;
+  std::vector<uint16_t> material_ids;
+  std::vector<CachedMaterial> materials;
+  //Depth-first BVH with leaf offsets referring to faces (empty if the asset has none)
+  std::vector<compact_bvh_node> nodes;
+};
+
+//Reads a mesh asset, validating the header and every index. Returns false and sets `err` if the
+//file can't be read, was written by another version, or is malformed.
+bool ReadMeshAsset(const std::string& filename, MeshAssetData& asset, std::string& err);
+
+//Writes `mesh` (which must have been built with an identity transform) and its material table.
+//If `include_bvh` is set, the mesh's BVH is stored so loading skips the build.
+bool WriteMeshAsset(const std::string& filename, const compact_mesh& mesh,
+                    const std::vector<CachedMaterial>& materials, bool quantize, bool include_bvh,
+                    std::string& err);
+
+//Mesh loaded from a mesh asset. With `asset_materials` each face uses a material built from the
+//asset's material table (diffuse color or texture, or a dielectric for transparent materials) and
+//the material's bump map; otherwise every face uses `mat`. Textures that aren't at their stored
+//path are looked for in the asset's directory.
+class mesh_asset : public hitable {
+public:
+  mesh_asset() {}
+  ~mesh_asset() {}
+  mesh_asset(std::string inputfile, std::shared_ptr<material> mat, bool asset_materials,
+             Float scale, int bvh_type,
+             std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+             bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("MeshAsset"));
+  }
+  std::shared_ptr<compact_mesh> asset_mesh;
+  std::shared_ptr<material> mat_ptr;
+};
+
+#endif
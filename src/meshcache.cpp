@@ -0,0 +1,287 @@
+#include "meshcache.h"
+#include "mappedfile.h"
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <unordered_map>
+
+//Bump when the layout of the cache file or the BVH builder changes
+static const uint32_t kMeshCacheVersion = 1;
+static const char kMeshCacheMagic[8] = {'R','A','Y','B','V','H','C','\0'};
+static const uint32_t kEndianCheck = 0x01020304;
+
+struct MeshCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t key;
+  uint64_t float_size;
+  //vertices, normals, texcoords, colors, indices, material_ids, bvh_order, bvh_splits, materials
+  uint64_t counts[9];
+};
+
+static inline char cache_separator() {
+#if defined _WIN32 || defined __CYGWIN__
+  return '\\';
+#else
+  return '/';
+#endif
+}
+
+static inline size_t padded_size(size_t bytes) {
+  return((bytes + 7) & ~static_cast<size_t>(7));
+}
+
+MeshCache::MeshCache(const std::string& cache_dir, const std::string& source_file,
+                     Float scale, int bvh_type, const Transform& ObjectToWorld) :
+  cache_dir(cache_dir), key(0), is_enabled(false), is_loaded(false) {
+  if(cache_dir.empty()) {
+    return;
+  }
+  MappedFile source(source_file);
+  if(!source.valid()) {
+    return;
+  }
+  key = HashBytes(source.data(), source.size(), kMeshCacheVersion);
+  key = HashCombine(key, HashBytes(reinterpret_cast<const char*>(&scale), sizeof(Float)));
+  key = HashCombine(key, static_cast<uint64_t>(bvh_type));
+  const Matrix4x4& m = ObjectToWorld.GetMatrix();
+  key = HashCombine(key, HashBytes(reinterpret_cast<const char*>(m.m), sizeof(m.m)));
+  is_enabled = true;
+}
+
+void MeshCache::AddSource(const std::string& filename) {
+  if(!is_enabled) {
+    return;
+  }
+  MappedFile source(filename);
+  if(source.valid()) {
+    key = HashCombine(key, HashBytes(source.data(), source.size()));
+  }
+}
+
+void MeshCache::AddParameter(uint64_t value) {
+  if(is_enabled) {
+    key = HashCombine(key, value);
+  }
+}
+
+std::string MeshCache::Filename() const {
+  std::ostringstream name;
+  name << cache_dir;
+  if(cache_dir.back() != '/' && cache_dir.back() != '\\') {
+    name << cache_separator();
+  }
+  name << std::hex << std::setw(16) << std::setfill('0') << key << ".rbvh";
+  return(name.str());
+}
+
+template<class T> static bool read_section(const char*& p, const char* end, uint64_t count,
+                                           std::vector<T>& out) {
+  size_t bytes = static_cast<size_t>(count) * sizeof(T);
+  if(static_cast<size_t>(end - p) < padded_size(bytes)) {
+    return(false);
+  }
+  out.resize(static_cast<size_t>(count));
+  if(bytes > 0) {
+    std::memcpy(out.data(), p, bytes);
+  }
+  p += padded_size(bytes);
+  return(true);
+}
+
+static bool read_string(const char*& p, const char* end, std::string& out) {
+  uint32_t len;
+  if(static_cast<size_t>(end - p) < sizeof(uint32_t)) {
+    return(false);
+  }
+  std::memcpy(&len, p, sizeof(uint32_t));
+  p += sizeof(uint32_t);
+  if(static_cast<size_t>(end - p) < len) {
+    return(false);
+  }
+  out.assign(p, len);
+  p += len;
+  return(true);
+}
+
+bool MeshCache::Load() {
+  if(!is_enabled) {
+    return(false);
+  }
+  MappedFile file(Filename());
+  if(!file.valid() || file.size() < sizeof(MeshCacheHeader)) {
+    return(false);
+  }
+  MeshCacheHeader header;
+  std::memcpy(&header, file.data(), sizeof(MeshCacheHeader));
+  if(std::memcmp(header.magic, kMeshCacheMagic, 8) != 0 || header.version != kMeshCacheVersion ||
+     header.endian != kEndianCheck || header.key != key || header.float_size != sizeof(float)) {
+    return(false);
+  }
+  const char* p = file.data() + sizeof(MeshCacheHeader);
+  const char* end = file.data() + file.size();
+  MeshCacheData cached;
+  bool ok = read_section(p, end, header.counts[0], cached.vertices) &&
+    read_section(p, end, header.counts[1], cached.normals) &&
+    read_section(p, end, header.counts[2], cached.texcoords) &&
+    read_section(p, end, header.counts[3], cached.colors) &&
+    read_section(p, end, header.counts[4], cached.indices) &&
+    read_section(p, end, header.counts[5], cached.material_ids) &&
+    read_section(p, end, header.counts[6], cached.bvh_order) &&
+    read_section(p, end, header.counts[7], cached.bvh_splits);
+  if(!ok) {
+    return(false);
+  }
+  cached.materials.resize(static_cast<size_t>(header.counts[8]));
+  for(size_t i = 0; i < cached.materials.size(); i++) {
+    CachedMaterial& mat = cached.materials[i];
+    if(static_cast<size_t>(end - p) < 6 * sizeof(float)) {
+      return(false);
+    }
+    std::memcpy(mat.diffuse, p, 3 * sizeof(float));
+    std::memcpy(&mat.dissolve, p + 3 * sizeof(float), sizeof(float));
+    std::memcpy(&mat.ior, p + 4 * sizeof(float), sizeof(float));
+    std::memcpy(&mat.bump_multiplier, p + 5 * sizeof(float), sizeof(float));
+    p += 6 * sizeof(float);
+    if(!read_string(p, end, mat.diffuse_texname) || !read_string(p, end, mat.bump_texname)) {
+      return(false);
+    }
+  }
+  data = cached;
+  is_loaded = true;
+  return(true);
+}
+
+template<class T> static void write_section(FILE* f, const std::vector<T>& in) {
+  static const char zeros[8] = {0};
+  size_t bytes = in.size() * sizeof(T);
+  if(bytes > 0) {
+    fwrite(in.data(), 1, bytes, f);
+  }
+  fwrite(zeros, 1, padded_size(bytes) - bytes, f);
+}
+
+static void write_string(FILE* f, const std::string& s) {
+  uint32_t len = static_cast<uint32_t>(s.size());
+  fwrite(&len, sizeof(uint32_t), 1, f);
+  fwrite(s.data(), 1, s.size(), f);
+}
+
+void MeshCache::Save() const {
+  if(!is_enabled) {
+    return;
+  }
+  MeshCacheHeader header;
+  std::memcpy(header.magic, kMeshCacheMagic, 8);
+  header.version = kMeshCacheVersion;
+  header.endian = kEndianCheck;
+  header.key = key;
+  header.float_size = sizeof(float);
+  header.counts[0] = data.vertices.size();
+  header.counts[1] = data.normals.size();
+  header.counts[2] = data.texcoords.size();
+  header.counts[3] = data.colors.size();
+  header.counts[4] = data.indices.size();
+  header.counts[5] = data.material_ids.size();
+  header.counts[6] = data.bvh_order.size();
+  header.counts[7] = data.bvh_splits.size();
+  header.counts[8] = data.materials.size();
+
+  //Write to a temporary file and rename it into place, so concurrent renders never see a
+  //partially written cache entry.
+  std::string filename = Filename();
+  std::ostringstream temp_name;
+  temp_name << filename << ".tmp" << std::hex << reinterpret_cast<uintptr_t>(this);
+  FILE* f = fopen(temp_name.str().c_str(), "wb");
+  if(!f) {
+    return;
+  }
+  fwrite(&header, sizeof(MeshCacheHeader), 1, f);
+  write_section(f, data.vertices);
+  write_section(f, data.normals);
+  write_section(f, data.texcoords);
+  write_section(f, data.colors);
+  write_section(f, data.indices);
+  write_section(f, data.material_ids);
+  write_section(f, data.bvh_order);
+  write_section(f, data.bvh_splits);
+  for(size_t i = 0; i < data.materials.size(); i++) {
+    const CachedMaterial& mat = data.materials[i];
+    fwrite(mat.diffuse, sizeof(float), 3, f);
+    fwrite(&mat.dissolve, sizeof(float), 1, f);
+    fwrite(&mat.ior, sizeof(float), 1, f);
+    fwrite(&mat.bump_multiplier, sizeof(float), 1, f);
+    write_string(f, mat.diffuse_texname);
+    write_string(f, mat.bump_texname);
+  }
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if(!ok || std::rename(temp_name.str().c_str(), filename.c_str()) != 0) {
+    std::remove(temp_name.str().c_str());
+  }
+}
+
+void MeshCache::SaveLayout(const std::vector<uint32_t>& order, const std::vector<uint32_t>& splits) {
+  if(!is_enabled) {
+    return;
+  }
+  data.bvh_order = order;
+  data.bvh_splits = splits;
+  Save();
+}
+
+std::shared_ptr<bvh_node> MeshCache::BuildBVH(hitable_list& primitives, Float shutteropen, Float shutterclose,
+                                              int bvh_type, random_gen& rng) {
+  std::vector<std::shared_ptr<hitable> >& objects = primitives.objects;
+  size_t n = objects.size();
+  if(is_loaded && data.bvh_order.size() == n && n > 0) {
+    std::vector<std::shared_ptr<hitable> > ordered(n);
+    std::vector<bool> used(n, false);
+    bool valid_order = true;
+    for(size_t i = 0; i < n; i++) {
+      uint32_t idx = data.bvh_order[i];
+      if(idx >= n || used[idx]) {
+        valid_order = false;
+        break;
+      }
+      used[idx] = true;
+      ordered[i] = objects[idx];
+    }
+    if(valid_order) {
+      const uint32_t* splits = data.bvh_splits.data();
+      const uint32_t* splits_end = splits + data.bvh_splits.size();
+      try {
+        std::shared_ptr<bvh_node> tree = std::make_shared<bvh_node>(ordered, 0, n, shutteropen, shutterclose,
+                                                                    splits, splits_end);
+        if(splits == splits_end) {
+          objects.swap(ordered);
+          return(tree);
+        }
+      } catch (std::runtime_error&) {
+        //Fall through and rebuild the BVH from scratch
+      }
+    }
+  }
+  if(!is_enabled || n == 0) {
+    return(std::make_shared<bvh_node>(primitives, shutteropen, shutterclose, bvh_type, rng));
+  }
+  std::unordered_map<const hitable*, uint32_t> original_index;
+  original_index.reserve(n);
+  for(size_t i = 0; i < n; i++) {
+    original_index[objects[i].get()] = static_cast<uint32_t>(i);
+  }
+  std::shared_ptr<bvh_node> tree = std::make_shared<bvh_node>(primitives, shutteropen, shutterclose, bvh_type, rng);
+  std::vector<const hitable*> order;
+  order.reserve(n);
+  data.bvh_order.clear();
+  data.bvh_splits.clear();
+  tree->export_layout(order, data.bvh_splits);
+  data.bvh_order.resize(order.size());
+  for(size_t i = 0; i < order.size(); i++) {
+    data.bvh_order[i] = original_index[order[i]];
+  }
+  Save();
+  return(tree);
+}
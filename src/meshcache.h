@@ -0,0 +1,70 @@
+#ifndef MESHCACHEH
+#define MESHCACHEH
+
+#include "hitablelist.h"
+#include "bvh_node.h"
+#include "transform.h"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Material parameters read from an OBJ material library that the mesh constructors use
+struct CachedMaterial {
+  float diffuse[3];
+  float dissolve;
+  float ior;
+  float bump_multiplier;
+  std::string diffuse_texname;
+  std::string bump_texname;
+};
+
+//Parsed mesh data and the layout of its BVH, as stored in a cache file
+struct MeshCacheData {
+  std::vector<float> vertices;
+  std::vector<float> normals;
+  std::vector<float> texcoords;
+  std::vector<float> colors;
+  std::vector<int> indices;
+  std::vector<int> material_ids;
+  std::vector<CachedMaterial> materials;
+  std::vector<uint32_t> bvh_order;
+  std::vector<uint32_t> bvh_splits;
+};
+
+//On-disk cache of parsed meshes and their BVHs. Entries are keyed by a hash of the source file
+//contents (plus any extra sources, e.g. material libraries) and the build parameters (scale,
+//BVH type and object-to-world transform), and are stored as versioned binary files in `cache_dir`.
+//An empty `cache_dir` disables the cache.
+class MeshCache {
+public:
+  MeshCache(const std::string& cache_dir, const std::string& source_file,
+            Float scale, int bvh_type, const Transform& ObjectToWorld);
+  bool enabled() const {return(is_enabled);}
+  bool loaded() const {return(is_loaded);}
+
+  //Adds the contents of another file (e.g. a material library) to the cache key. Must be called
+  //before Load().
+  void AddSource(const std::string& filename);
+  //Adds a build parameter to the cache key (e.g. to keep layouts from different BVH builders
+  //apart). Must be called before Load().
+  void AddParameter(uint64_t value);
+  bool Load();
+
+  //Rebuilds the BVH from the cached layout if one was loaded, otherwise builds it with the usual
+  //builder and (if the cache is enabled) writes the geometry and layout to disk.
+  std::shared_ptr<bvh_node> BuildBVH(hitable_list& primitives, Float shutteropen, Float shutterclose,
+                                     int bvh_type, random_gen& rng);
+  //Stores a BVH layout built outside of BuildBVH() and (if the cache is enabled) writes the entry.
+  void SaveLayout(const std::vector<uint32_t>& order, const std::vector<uint32_t>& splits);
+  MeshCacheData data;
+
+private:
+  void Save() const;
+  std::string Filename() const;
+  std::string cache_dir;
+  uint64_t key;
+  bool is_enabled;
+  bool is_loaded;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "mipmap.h"
+#include <algorithm>
+
+mipmap::mipmap(std::shared_ptr<image_data> image, bool build_levels) : storage_bytes(0), decoded(image) {
+  int nx = image->nx;
+  int ny = image->ny;
+  level base = {image.get(), nx, ny, image->channels};
+  pyramid.push_back(base);
+  //Coarser levels only keep the channels lookups read
+  const int stored_channels = image->channels >= 3 ? 3 : 1;
+  std::vector<Float> coarse;
+  while(build_levels && (nx > 1 || ny > 1)) {
+    const image_data* fine = pyramid.back().image;
+    int cx = std::max(nx / 2, 1);
+    int cy = std::max(ny / 2, 1);
+    coarse.resize(static_cast<size_t>(cx) * cy * stored_channels);
+    Downsample([fine](int x, int y, int c) { return(fine->value(x, y, c)); },
+               nx, ny, coarse.data(), cx, cy, stored_channels);
+    storage.push_back(std::unique_ptr<image_data>(new image_data(coarse.data(), cx, cy, stored_channels)));
+    storage_bytes += storage.back()->memory_bytes();
+    level next = {storage.back().get(), cx, cy, stored_channels};
+    pyramid.push_back(next);
+    nx = cx;
+    ny = cy;
+  }
+}
+
+mipmap::mipmap(std::shared_ptr<tiled_image> image) : storage_bytes(0), tiled(image) {
+  for(int i = 0; i < image->levels(); i++) {
+    level l = {nullptr, image->width(i), image->height(i), image->channels()};
+    pyramid.push_back(l);
+  }
+}
+
+point3f mipmap::texel(int lvl, int x, int y) const {
+  const level& l = pyramid[lvl];
+  x %= l.nx;
+  y %= l.ny;
+  if(x < 0) x += l.nx;
+  if(y < 0) y += l.ny;
+  if(tiled) {
+    return(tiled->texel(lvl, x, y));
+  }
+  if(l.channels >= 3) {
+    return(point3f(l.image->value(x, y, 0), l.image->value(x, y, 1), l.image->value(x, y, 2)));
+  }
+  Float gray = l.image->value(x, y, 0);
+  return(point3f(gray, gray, gray));
+}
+
+point3f mipmap::bilerp(int lvl, Float s, Float t) const {
+  const level& l = pyramid[lvl];
+  s -= std::floor(s);
+  t -= std::floor(t);
+  //Rows are stored top to bottom
+  Float x = s * l.nx - 0.5f;
+  Float y = (1 - t) * l.ny - 0.5f;
+  Float fx0 = std::floor(x);
+  Float fy0 = std::floor(y);
+  int x0 = static_cast<int>(fx0);
+  int y0 = static_cast<int>(fy0);
+  Float dx = x - fx0;
+  Float dy = y - fy0;
+  return((1 - dx) * (1 - dy) * texel(lvl, x0, y0) + dx * (1 - dy) * texel(lvl, x0 + 1, y0) +
+         (1 - dx) * dy * texel(lvl, x0, y0 + 1) + dx * dy * texel(lvl, x0 + 1, y0 + 1));
+}
+
+point3f mipmap::lookup(Float s, Float t, Float ds, Float dt) const {
+  //Footprint in level zero texels; the isotropic filter covers its longer side
+  Float width = std::fmax(ds * pyramid[0].nx, dt * pyramid[0].ny);
+  if(!(width > 1)) {
+    return(bilerp(0, s, t));
+  }
+  Float lvl = std::log2(width);
+  int coarsest = levels() - 1;
+  if(lvl >= coarsest) {
+    return(bilerp(coarsest, s, t));
+  }
+  int l0 = static_cast<int>(lvl);
+  Float delta = lvl - l0;
+  return((1 - delta) * bilerp(l0, s, t) + delta * bilerp(l0 + 1, s, t));
+}
+
+size_t mipmap::memory_bytes() const {
+  return(storage_bytes);
+}
@@ -0,0 +1,95 @@
+#ifndef MIPMAPH
+#define MIPMAPH
+
+#include "point3.h"
+#include "mathinline.h"
+#include "texturecache.h"
+#include "textureregistry.h"
+#include <vector>
+#include <memory>
+
+//Image pyramid for filtered texture lookups. Level zero is the decoded image itself, shared rather
+//than copied; each coarser level halves the resolution with a box filter, down to a single texel,
+//and is stored as half floats. Texture coordinates follow image_texture: s runs left to right, t
+//bottom to top, and both wrap.
+//
+//lookup() picks the two levels whose texel size brackets the footprint and blends bilinear
+//lookups on each (trilinear filtering), so distant or minified surfaces read a few texels of a
+//small level instead of aliasing against the full-resolution image.
+//
+//With the texture cache enabled the pyramid is a tiled_image instead, whose texels are paged in
+//on demand.
+class mipmap {
+public:
+  //Without `build_levels` only level zero exists and every lookup reads it
+  mipmap(std::shared_ptr<image_data> image, bool build_levels = true);
+  mipmap(std::shared_ptr<tiled_image> image);
+
+  //Filtered RGB at (s, t) for a footprint `ds` by `dt` wide in texture coordinates
+  point3f lookup(Float s, Float t, Float ds, Float dt) const;
+  point3f bilerp(int level, Float s, Float t) const;
+  //RGB of a texel, with x and y wrapped onto the level. Images with fewer than three channels are
+  //read as gray.
+  point3f texel(int level, int x, int y) const;
+
+  int levels() const {
+    return(static_cast<int>(pyramid.size()));
+  }
+  int width(int level = 0) const {
+    return(pyramid[level].nx);
+  }
+  int height(int level = 0) const {
+    return(pyramid[level].ny);
+  }
+  int channels() const {
+    return(pyramid[0].channels);
+  }
+  //Decoded image level zero reads, or nullptr for a tiled pyramid
+  const std::shared_ptr<image_data>& image() const {
+    return(decoded);
+  }
+  //Bytes used by the downsampled levels (level zero is shared with the image)
+  size_t memory_bytes() const;
+
+  //Box filters a `fine` image into `coarse` (cx by cy texels, at most `fine` in size), averaging
+  //the first `coarse_channels` channels of the fine texels each coarse texel covers. `fine(x, y, c)`
+  //returns channel c of fine texel (x, y).
+  template<class Fine>
+  static void Downsample(const Fine& fine, int fx, int fy,
+                         Float* coarse, int cx, int cy, int coarse_channels) {
+    for(int y = 0; y < cy; y++) {
+      int y0 = y * fy / cy;
+      int y1 = (y + 1) * fy / cy;
+      for(int x = 0; x < cx; x++) {
+        int x0 = x * fx / cx;
+        int x1 = (x + 1) * fx / cx;
+        Float sum[3] = {0, 0, 0};
+        for(int j = y0; j < y1; j++) {
+          for(int i = x0; i < x1; i++) {
+            for(int c = 0; c < coarse_channels; c++) {
+              sum[c] += fine(i, j, c);
+            }
+          }
+        }
+        Float inv_count = 1 / static_cast<Float>((x1 - x0) * (y1 - y0));
+        Float* out = coarse + coarse_channels * (x + static_cast<size_t>(cx) * y);
+        for(int c = 0; c < coarse_channels; c++) {
+          out[c] = sum[c] * inv_count;
+        }
+      }
+    }
+  }
+
+private:
+  struct level {
+    const image_data* image;
+    int nx, ny, channels;
+  };
+  std::vector<level> pyramid;
+  std::vector<std::unique_ptr<image_data> > storage;
+  size_t storage_bytes;
+  std::shared_ptr<tiled_image> tiled;
+  std::shared_ptr<image_data> decoded;
+};
+
+#endif
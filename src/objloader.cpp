@@ -0,0 +1,334 @@
+#include "objloader.h"
+#include "compactmesh.h"
+#include "mappedfile.h"
+#include "RcppThread.h"
+#include <cstring>
+#include <cmath>
+#include <climits>
+
+//Chunks smaller than this aren't worth a task of their own
+constexpr size_t kMinChunkSize = 1 << 20;
+constexpr int32_t kMissingIndex = INT32_MIN;
+
+//Geometry parsed from one line-aligned chunk of the file. Positive OBJ indices are stored as
+//absolute zero-based indices; negative (relative) ones are stored relative to the chunk's first
+//vertex/normal and listed in `relative_vertices`/`relative_normals`, to be resolved once the number
+//of vertices in the preceding chunks is known.
+struct ObjChunk {
+  ObjChunk() : begin(nullptr), end(nullptr), vertex_offset(0), normal_offset(0), face_offset(0), valid(true) {}
+  const char* begin;
+  const char* end;
+  std::vector<vec3f> vertices;
+  std::vector<normal3f> normals;
+  std::vector<int32_t> vertex_indices;
+  std::vector<int32_t> normal_indices;
+  std::vector<size_t> relative_vertices;
+  std::vector<size_t> relative_normals;
+  size_t vertex_offset;
+  size_t normal_offset;
+  size_t face_offset;
+  bool valid;
+};
+
+static inline bool is_space(char c) {
+  return(c == ' ' || c == '\t' || c == '\r');
+}
+
+static inline bool is_digit(char c) {
+  return(c >= '0' && c <= '9');
+}
+
+static bool parse_int(const char*& p, const char* end, int32_t& value) {
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  if(p == end || !is_digit(*p)) {
+    return(false);
+  }
+  int64_t result = 0;
+  while(p < end && is_digit(*p)) {
+    result = result * 10 + (*p - '0');
+    if(result > INT32_MAX) {
+      return(false);
+    }
+    p++;
+  }
+  value = static_cast<int32_t>(negative ? -result : result);
+  return(true);
+}
+
+static bool parse_float(const char*& p, const char* end, float& value) {
+  static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  while(p < end && is_space(*p)) {
+    p++;
+  }
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  double mantissa = 0;
+  int exponent = 0;
+  bool has_digits = false;
+  while(p < end && is_digit(*p)) {
+    mantissa = mantissa * 10 + (*p - '0');
+    has_digits = true;
+    p++;
+  }
+  if(p < end && *p == '.') {
+    p++;
+    while(p < end && is_digit(*p)) {
+      mantissa = mantissa * 10 + (*p - '0');
+      exponent--;
+      has_digits = true;
+      p++;
+    }
+  }
+  if(!has_digits) {
+    //Non-numeric values such as "nan" are kept as NaN, so the face is skipped by the mesh builder
+    if(p < end && !is_space(*p) && *p != '\n') {
+      while(p < end && !is_space(*p) && *p != '\n') {
+        p++;
+      }
+      value = NAN;
+      return(true);
+    }
+    return(false);
+  }
+  if(p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int32_t exp_value;
+    if(!parse_int(p, end, exp_value)) {
+      return(false);
+    }
+    exponent += exp_value;
+  }
+  double scale = exponent >= -22 && exponent <= 22 ? powers[exponent < 0 ? -exponent : exponent] :
+    std::pow(10.0, std::abs(exponent));
+  double result = exponent < 0 ? mantissa / scale : mantissa * scale;
+  value = static_cast<float>(negative ? -result : result);
+  return(true);
+}
+
+//Parses one face vertex (`v`, `v/vt`, `v//vn` or `v/vt/vn`)
+static bool parse_face_vertex(const char*& p, const char* end, int32_t& v, int32_t& vn) {
+  vn = 0;
+  if(!parse_int(p, end, v)) {
+    return(false);
+  }
+  if(p < end && *p == '/') {
+    p++;
+    int32_t vt;
+    if(p < end && *p != '/') {
+      if(!parse_int(p, end, vt)) {
+        return(false);
+      }
+    }
+    if(p < end && *p == '/') {
+      p++;
+      if(!parse_int(p, end, vn)) {
+        return(false);
+      }
+    }
+  }
+  return(true);
+}
+
+//Converts a one-based (or negative, relative) OBJ index into the chunk representation
+static inline int32_t chunk_index(int32_t index, size_t local_count, size_t position,
+                                  std::vector<size_t>& relative) {
+  if(index > 0) {
+    return(index - 1);
+  }
+  relative.push_back(position);
+  return(static_cast<int32_t>(static_cast<int64_t>(local_count) + index));
+}
+
+static void parse_chunk(ObjChunk& chunk) {
+  const char* p = chunk.begin;
+  const char* end = chunk.end;
+  std::vector<int32_t> face_v, face_vn;
+  while(p < end) {
+    const char* line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if(!line_end) {
+      line_end = end;
+    }
+    while(p < line_end && is_space(*p)) {
+      p++;
+    }
+    if(line_end - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      p += 2;
+      float xyz[3];
+      if(parse_float(p, line_end, xyz[0]) && parse_float(p, line_end, xyz[1]) && parse_float(p, line_end, xyz[2])) {
+        chunk.vertices.push_back(vec3f(xyz[0], xyz[1], xyz[2]));
+      } else {
+        chunk.valid = false;
+        return;
+      }
+    } else if(line_end - p > 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+      p += 3;
+      float xyz[3];
+      if(parse_float(p, line_end, xyz[0]) && parse_float(p, line_end, xyz[1]) && parse_float(p, line_end, xyz[2])) {
+        chunk.normals.push_back(normal3f(xyz[0], xyz[1], xyz[2]));
+      } else {
+        chunk.valid = false;
+        return;
+      }
+    } else if(line_end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      p += 2;
+      face_v.clear();
+      face_vn.clear();
+      while(true) {
+        while(p < line_end && is_space(*p)) {
+          p++;
+        }
+        int32_t v, vn;
+        if(p == line_end || !parse_face_vertex(p, line_end, v, vn)) {
+          break;
+        }
+        face_v.push_back(v);
+        face_vn.push_back(vn);
+      }
+      for(size_t k = 1; k + 1 < face_v.size(); k++) {
+        size_t corners[3] = {0, k, k + 1};
+        for(int j = 0; j < 3; j++) {
+          int32_t v = face_v[corners[j]];
+          int32_t vn = face_vn[corners[j]];
+          if(v == 0) {
+            chunk.valid = false;
+            return;
+          }
+          size_t position = chunk.vertex_indices.size();
+          chunk.vertex_indices.push_back(chunk_index(v, chunk.vertices.size(), position,
+                                                     chunk.relative_vertices));
+          chunk.normal_indices.push_back(vn == 0 ? kMissingIndex :
+                                           chunk_index(vn, chunk.normals.size(), position,
+                                                       chunk.relative_normals));
+        }
+      }
+    }
+    p = line_end + 1;
+  }
+}
+
+//Copies a parsed chunk into its slice of the mesh buffers, resolving relative indices
+static void gather_chunk(ObjChunk& chunk, std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+                         std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices) {
+  std::copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + chunk.vertex_offset);
+  std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + chunk.normal_offset);
+  std::vector<vec3f>().swap(chunk.vertices);
+  std::vector<normal3f>().swap(chunk.normals);
+  for(size_t i = 0; i < chunk.relative_vertices.size(); i++) {
+    chunk.vertex_indices[chunk.relative_vertices[i]] += static_cast<int32_t>(chunk.vertex_offset);
+  }
+  for(size_t i = 0; i < chunk.relative_normals.size(); i++) {
+    chunk.normal_indices[chunk.relative_normals[i]] += static_cast<int32_t>(chunk.normal_offset);
+  }
+  size_t first = 3 * chunk.face_offset;
+  for(size_t i = 0; i < chunk.vertex_indices.size(); i++) {
+    int32_t v = chunk.vertex_indices[i];
+    int32_t vn = chunk.normal_indices[i];
+    if(v < 0 || static_cast<size_t>(v) >= vertices.size() ||
+       (vn != kMissingIndex && (vn < 0 || static_cast<size_t>(vn) >= normals.size()))) {
+      chunk.valid = false;
+      return;
+    }
+    indices[first + i] = static_cast<uint32_t>(v);
+    normal_indices[first + i] = vn == kMissingIndex ? compact_mesh::kNoNormal : static_cast<uint32_t>(vn);
+  }
+  std::vector<int32_t>().swap(chunk.vertex_indices);
+  std::vector<int32_t>().swap(chunk.normal_indices);
+}
+
+bool LoadObjGeometry(const std::string& filename, int numbercores,
+                     std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+                     std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+                     std::string& err) {
+  MappedFile file(filename);
+  if(!file.valid()) {
+    err = "Cannot open file " + filename;
+    return(false);
+  }
+  if(numbercores < 1) {
+    numbercores = 1;
+  }
+  const char* data = file.data();
+  const char* data_end = data + file.size();
+
+  //Split into roughly four chunks per thread, moving each boundary to the start of a line
+  size_t number_chunks = numbercores == 1 ? 1 : 4 * static_cast<size_t>(numbercores);
+  number_chunks = std::max(static_cast<size_t>(1), std::min(number_chunks, file.size() / kMinChunkSize));
+  std::vector<ObjChunk> chunks(number_chunks);
+  const char* start = data;
+  for(size_t i = 0; i < number_chunks; i++) {
+    const char* stop = i + 1 == number_chunks ? data_end : data + (i + 1) * (file.size() / number_chunks);
+    if(stop < start) {
+      stop = start;
+    }
+    if(stop < data_end) {
+      const char* newline = static_cast<const char*>(std::memchr(stop, '\n', data_end - stop));
+      stop = newline ? newline + 1 : data_end;
+    }
+    chunks[i].begin = start;
+    chunks[i].end = stop;
+    start = stop;
+  }
+
+  if(number_chunks == 1) {
+    parse_chunk(chunks[0]);
+  } else {
+    RcppThread::ThreadPool pool(numbercores);
+    for(size_t i = 0; i < number_chunks; i++) {
+      ObjChunk* chunk = &chunks[i];
+      pool.push([chunk] () {
+        parse_chunk(*chunk);
+      });
+    }
+    pool.join();
+  }
+
+  size_t number_vertices = 0, number_normals = 0, number_faces = 0;
+  for(size_t i = 0; i < number_chunks; i++) {
+    if(!chunks[i].valid) {
+      err = "Malformed vertex or face in " + filename;
+      return(false);
+    }
+    chunks[i].vertex_offset = number_vertices;
+    chunks[i].normal_offset = number_normals;
+    chunks[i].face_offset = number_faces;
+    number_vertices += chunks[i].vertices.size();
+    number_normals += chunks[i].normals.size();
+    number_faces += chunks[i].vertex_indices.size() / 3;
+  }
+  if(number_vertices > UINT32_MAX || 3 * number_faces > UINT32_MAX) {
+    err = "Too many vertices or faces in " + filename;
+    return(false);
+  }
+  vertices.resize(number_vertices);
+  normals.resize(number_normals);
+  indices.resize(3 * number_faces);
+  normal_indices.resize(3 * number_faces);
+
+  if(number_chunks == 1) {
+    gather_chunk(chunks[0], vertices, normals, indices, normal_indices);
+  } else {
+    RcppThread::ThreadPool pool(numbercores);
+    for(size_t i = 0; i < number_chunks; i++) {
+      ObjChunk* chunk = &chunks[i];
+      pool.push([chunk, &vertices, &normals, &indices, &normal_indices] () {
+        gather_chunk(*chunk, vertices, normals, indices, normal_indices);
+      });
+    }
+    pool.join();
+  }
+  for(size_t i = 0; i < number_chunks; i++) {
+    if(!chunks[i].valid) {
+      err = "Face references a missing vertex or normal in " + filename;
+      return(false);
+    }
+  }
+  return(true);
+}
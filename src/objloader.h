@@ -0,0 +1,20 @@
+#ifndef OBJLOADERH
+#define OBJLOADERH
+
+#include "vec3.h"
+#include "normal.h"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+//Parses the geometry of an OBJ file (`v`, `vn` and `f` statements) straight into the shared
+//buffers used by `compact_mesh`. The file is memory-mapped and split into line-aligned chunks that
+//are parsed on `numbercores` threads. Polygons are triangulated as fans; faces without a normal
+//index get `compact_mesh::kNoNormal`. Texture coordinates, groups and materials are ignored.
+//Returns false and sets `err` if the file can't be read or references missing vertices.
+bool LoadObjGeometry(const std::string& filename, int numbercores,
+                     std::vector<vec3f>& vertices, std::vector<normal3f>& normals,
+                     std::vector<uint32_t>& indices, std::vector<uint32_t>& normal_indices,
+                     std::string& err);
+
+#endif
@@ -1,5 +1,6 @@
 #include "pdf.h"
 #include "mathinline.h"
+#include "bvhstats.h"
 
 
 inline bool Refract(const vec3f &wi, const normal3f &n, Float eta, vec3f *wt) {
@@ -196,9 +197,11 @@ vec3f glossy_pdf::generate(Sampler* sampler, bool& diffuse_bounce, Float time) {
 }
 
 Float hitable_pdf::value(const vec3f& direction, random_gen& rng, Float time) {
+  TraversalStats::Pause pause;
   return(ptr->pdf_value(o, direction, rng, time));
 }
 Float hitable_pdf::value(const vec3f& direction, Sampler* sampler, Float time) {
+  TraversalStats::Pause pause;
   return(ptr->pdf_value(o, direction, sampler, time));
 }
 vec3f hitable_pdf::generate(random_gen& rng, bool& diffuse_bounce, Float time) {
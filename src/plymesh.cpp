@@ -2,6 +2,11 @@
 
 #include "miniply.h"
 #include "plymesh.h"
+#include "mappedfile.h"
+#include "RcppThread.h"
+#include <algorithm>
+#include <cstring>
+#include <sstream>
 
 inline char separator_ply() {
 #if defined _WIN32 || defined __CYGWIN__
@@ -112,85 +117,433 @@ static TriMesh* parse_file_with_miniply(const char* filename, bool assumeTriangl
 }
 
 
-plymesh::plymesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-            Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
+//Binary little-endian PLY files are read directly from a memory-mapped view of the file into the
+//mesh buffers, without miniply's intermediate element and TriMesh arrays. Other encodings (and
+//layouts this reader doesn't handle) return false and are loaded with miniply instead.
+enum class PlyType {Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid};
+
+struct PlyProperty {
+  std::string name;
+  PlyType type;
+  PlyType count_type; //Invalid unless this is a list property
+};
+
+struct PlyElement {
+  std::string name;
+  size_t count;
+  std::vector<PlyProperty> properties;
+};
+
+static PlyType ply_type(const std::string& name) {
+  if(name == "char" || name == "int8") return(PlyType::Int8);
+  if(name == "uchar" || name == "uint8") return(PlyType::UInt8);
+  if(name == "short" || name == "int16") return(PlyType::Int16);
+  if(name == "ushort" || name == "uint16") return(PlyType::UInt16);
+  if(name == "int" || name == "int32") return(PlyType::Int32);
+  if(name == "uint" || name == "uint32") return(PlyType::UInt32);
+  if(name == "float" || name == "float32") return(PlyType::Float32);
+  if(name == "double" || name == "float64") return(PlyType::Float64);
+  return(PlyType::Invalid);
+}
+
+static size_t ply_size(PlyType type) {
+  switch(type) {
+    case PlyType::Int8: case PlyType::UInt8: return(1);
+    case PlyType::Int16: case PlyType::UInt16: return(2);
+    case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return(4);
+    case PlyType::Float64: return(8);
+    default: return(0);
+  }
+}
+
+template<class T> static inline T read_unaligned(const char* p) {
+  T value;
+  std::memcpy(&value, p, sizeof(T));
+  return(value);
+}
+
+static inline double ply_value(const char* p, PlyType type) {
+  switch(type) {
+    case PlyType::Int8: return(read_unaligned<int8_t>(p));
+    case PlyType::UInt8: return(read_unaligned<uint8_t>(p));
+    case PlyType::Int16: return(read_unaligned<int16_t>(p));
+    case PlyType::UInt16: return(read_unaligned<uint16_t>(p));
+    case PlyType::Int32: return(read_unaligned<int32_t>(p));
+    case PlyType::UInt32: return(read_unaligned<uint32_t>(p));
+    case PlyType::Float32: return(read_unaligned<float>(p));
+    case PlyType::Float64: return(read_unaligned<double>(p));
+    default: return(0);
+  }
+}
+
+//Returns the size in bytes of one row of an element starting at `p`, or 0 if it runs past `end`
+static size_t ply_row_size(const PlyElement& element, const char* p, const char* end) {
+  size_t size = 0;
+  for(size_t i = 0; i < element.properties.size(); i++) {
+    const PlyProperty& prop = element.properties[i];
+    if(prop.count_type == PlyType::Invalid) {
+      size += ply_size(prop.type);
+    } else {
+      size_t count_size = ply_size(prop.count_type);
+      if(p + size + count_size > end) {
+        return(0);
+      }
+      double count = ply_value(p + size, prop.count_type);
+      if(count < 0) {
+        return(0);
+      }
+      size += count_size + static_cast<size_t>(count) * ply_size(prop.type);
+    }
+  }
+  return(p + size > end ? 0 : size);
+}
+
+static bool load_binary_ply(const std::string& filename, int numbercores, std::vector<vec3f>& vertices,
+                            std::vector<uint32_t>& indices) {
+  const uint16_t endian_test = 1;
+  uint8_t first_byte;
+  std::memcpy(&first_byte, &endian_test, 1);
+  if(first_byte != 1) {
+    return(false);
+  }
+  MappedFile file(filename);
+  if(!file.valid()) {
+    return(false);
+  }
+  const char* data = file.data();
+  const char* data_end = data + file.size();
+  const char header_end[] = "end_header";
+  const char* header_stop = std::search(data, data_end, header_end, header_end + 10);
+  if(header_stop == data_end) {
+    return(false);
+  }
+  const char* body = static_cast<const char*>(std::memchr(header_stop, '\n', data_end - header_stop));
+  if(!body) {
+    return(false);
+  }
+  body++;
+
+  std::istringstream header(std::string(data, header_stop));
+  std::string line;
+  std::vector<PlyElement> elements;
+  bool binary_le = false;
+  while(std::getline(header, line)) {
+    std::istringstream tokens(line);
+    std::string keyword;
+    tokens >> keyword;
+    if(keyword == "format") {
+      std::string format;
+      tokens >> format;
+      binary_le = format == "binary_little_endian";
+    } else if(keyword == "element") {
+      PlyElement element;
+      tokens >> element.name >> element.count;
+      elements.push_back(element);
+    } else if(keyword == "property") {
+      if(elements.empty()) {
+        return(false);
+      }
+      PlyProperty prop;
+      std::string type;
+      tokens >> type;
+      if(type == "list") {
+        std::string count_type, item_type;
+        tokens >> count_type >> item_type;
+        prop.count_type = ply_type(count_type);
+        prop.type = ply_type(item_type);
+        if(prop.count_type == PlyType::Invalid) {
+          return(false);
+        }
+      } else {
+        prop.type = ply_type(type);
+        prop.count_type = PlyType::Invalid;
+      }
+      if(prop.type == PlyType::Invalid) {
+        return(false);
+      }
+      tokens >> prop.name;
+      elements.back().properties.push_back(prop);
+    }
+  }
+  if(!binary_le) {
+    return(false);
+  }
+
+  //Locate the vertex and face elements; rows of elements with list properties are walked to
+  //find where the next element starts
+  const char* vertex_data = nullptr;
+  const char* face_data = nullptr;
+  const PlyElement* vertex_element = nullptr;
+  const PlyElement* face_element = nullptr;
+  const char* p = body;
+  for(size_t e = 0; e < elements.size(); e++) {
+    const PlyElement& element = elements[e];
+    if(element.name == "vertex") {
+      vertex_element = &element;
+      vertex_data = p;
+    } else if(element.name == "face") {
+      face_element = &element;
+      face_data = p;
+    }
+    bool fixed = true;
+    size_t row = 0;
+    for(size_t i = 0; i < element.properties.size(); i++) {
+      fixed = fixed && element.properties[i].count_type == PlyType::Invalid;
+      row += ply_size(element.properties[i].type);
+    }
+    if(fixed) {
+      if(static_cast<size_t>(data_end - p) / (row > 0 ? row : 1) < element.count) {
+        return(false);
+      }
+      p += row * element.count;
+    } else if(&element != face_element) {
+      for(size_t r = 0; r < element.count; r++) {
+        size_t size = ply_row_size(element, p, data_end);
+        if(size == 0) {
+          return(false);
+        }
+        p += size;
+      }
+    } else {
+      //The face rows are walked below, while splitting them into chunks
+      break;
+    }
+  }
+  if(!vertex_element || !face_element) {
+    return(false);
+  }
+  int x_prop = -1, y_prop = -1, z_prop = -1, index_prop = -1;
+  std::vector<size_t> vertex_offsets(vertex_element->properties.size());
+  size_t vertex_row = 0;
+  for(size_t i = 0; i < vertex_element->properties.size(); i++) {
+    const PlyProperty& prop = vertex_element->properties[i];
+    if(prop.count_type != PlyType::Invalid) {
+      return(false);
+    }
+    vertex_offsets[i] = vertex_row;
+    vertex_row += ply_size(prop.type);
+    if(prop.name == "x") x_prop = static_cast<int>(i);
+    if(prop.name == "y") y_prop = static_cast<int>(i);
+    if(prop.name == "z") z_prop = static_cast<int>(i);
+  }
+  size_t index_offset = 0;
+  for(size_t i = 0; i < face_element->properties.size(); i++) {
+    const PlyProperty& prop = face_element->properties[i];
+    if(prop.name == "vertex_indices" || prop.name == "vertex_index") {
+      if(prop.count_type == PlyType::Invalid) {
+        return(false);
+      }
+      index_prop = static_cast<int>(i);
+      break;
+    }
+    if(prop.count_type != PlyType::Invalid) {
+      return(false);
+    }
+    index_offset += ply_size(prop.type);
+  }
+  if(x_prop < 0 || y_prop < 0 || z_prop < 0 || index_prop < 0) {
+    return(false);
+  }
+  if(numbercores < 1) {
+    numbercores = 1;
+  }
+  size_t number_vertices = vertex_element->count;
+  size_t number_faces = face_element->count;
+  if(number_vertices > UINT32_MAX) {
+    return(false);
+  }
+
+  //Walk the face rows once, recording where each chunk starts and how many triangles precede it
+  const PlyProperty& index_property = face_element->properties[index_prop];
+  size_t count_size = ply_size(index_property.count_type);
+  size_t item_size = ply_size(index_property.type);
+  size_t number_chunks = std::max(static_cast<size_t>(1),
+                                  std::min(4 * static_cast<size_t>(numbercores), number_faces / 65536));
+  size_t faces_per_chunk = (number_faces + number_chunks - 1) / number_chunks;
+  std::vector<const char*> chunk_start(number_chunks + 1, nullptr);
+  std::vector<size_t> chunk_triangles(number_chunks + 1, 0);
+  p = face_data;
+  size_t triangles = 0;
+  for(size_t f = 0; f < number_faces; f++) {
+    if(f % faces_per_chunk == 0) {
+      chunk_start[f / faces_per_chunk] = p;
+      chunk_triangles[f / faces_per_chunk] = triangles;
+    }
+    size_t size = ply_row_size(*face_element, p, data_end);
+    if(size == 0) {
+      return(false);
+    }
+    size_t count = static_cast<size_t>(ply_value(p + index_offset, index_property.count_type));
+    triangles += count >= 3 ? count - 2 : 0;
+    p += size;
+  }
+  if(3 * triangles > UINT32_MAX) {
+    return(false);
+  }
+
+  vertices.resize(number_vertices);
+  indices.resize(3 * triangles);
+  std::vector<char> chunk_valid(number_chunks, 1);
+  const PlyProperty* vertex_props = vertex_element->properties.data();
+  size_t offsets[3] = {vertex_offsets[x_prop], vertex_offsets[y_prop], vertex_offsets[z_prop]};
+  PlyType types[3] = {vertex_props[x_prop].type, vertex_props[y_prop].type, vertex_props[z_prop].type};
+  bool float_xyz = types[0] == PlyType::Float32 && types[1] == PlyType::Float32 && types[2] == PlyType::Float32;
+
+  auto read_vertices = [&](size_t begin, size_t end) {
+    const char* row = vertex_data + begin * vertex_row;
+    for(size_t i = begin; i < end; i++, row += vertex_row) {
+      if(float_xyz) {
+        vertices[i] = vec3f(read_unaligned<float>(row + offsets[0]), read_unaligned<float>(row + offsets[1]),
+                            read_unaligned<float>(row + offsets[2]));
+      } else {
+        vertices[i] = vec3f(ply_value(row + offsets[0], types[0]), ply_value(row + offsets[1], types[1]),
+                            ply_value(row + offsets[2], types[2]));
+      }
+    }
+  };
+  //Fan-triangulates the faces of one chunk into its slice of `indices`
+  auto read_faces = [&](size_t chunk) {
+    size_t first = chunk * faces_per_chunk;
+    size_t last = std::min(number_faces, first + faces_per_chunk);
+    const char* row = chunk_start[chunk];
+    uint32_t* out = indices.data() + 3 * chunk_triangles[chunk];
+    for(size_t f = first; f < last; f++) {
+      const char* list = row + index_offset;
+      size_t count = static_cast<size_t>(ply_value(list, index_property.count_type));
+      const char* items = list + count_size;
+      double v0 = ply_value(items, index_property.type);
+      double v_prev = count > 1 ? ply_value(items + item_size, index_property.type) : 0;
+      for(size_t k = 2; k < count; k++) {
+        double v_next = ply_value(items + k * item_size, index_property.type);
+        if(v0 < 0 || v_prev < 0 || v_next < 0 ||
+           v0 >= number_vertices || v_prev >= number_vertices || v_next >= number_vertices) {
+          chunk_valid[chunk] = 0;
+          return;
+        }
+        *out++ = static_cast<uint32_t>(v0);
+        *out++ = static_cast<uint32_t>(v_prev);
+        *out++ = static_cast<uint32_t>(v_next);
+        v_prev = v_next;
+      }
+      row += ply_row_size(*face_element, row, data_end);
+    }
+  };
+  if(number_chunks == 1) {
+    read_vertices(0, number_vertices);
+    read_faces(0);
+  } else {
+    RcppThread::ThreadPool pool(numbercores);
+    size_t vertices_per_chunk = (number_vertices + number_chunks - 1) / number_chunks;
+    for(size_t c = 0; c < number_chunks; c++) {
+      size_t begin = std::min(number_vertices, c * vertices_per_chunk);
+      size_t end = std::min(number_vertices, begin + vertices_per_chunk);
+      pool.push([&read_vertices, &read_faces, begin, end, c] () {
+        read_vertices(begin, end);
+        read_faces(c);
+      });
+    }
+    pool.join();
+  }
+  for(size_t c = 0; c < number_chunks; c++) {
+    if(!chunk_valid[c]) {
+      throw std::runtime_error("Invalid vertex index in PLY file: " + filename);
+    }
+  }
+  return(true);
+}
+
+
+bool LoadPlyGeometry(const std::string& filename, int numbercores, std::vector<vec3f>& vertices,
+                     std::vector<uint32_t>& indices, std::string& err) {
+  if(load_binary_ply(filename, numbercores, vertices, indices)) {
+    return(true);
+  }
+  TriMesh* tri = parse_file_with_miniply(filename.c_str(), false);
+  if(tri == nullptr) {
+    err = "No mesh loaded: " + filename;
+    return(false);
+  }
+  vertices.resize(tri->numVerts);
+  for(size_t i = 0; i < vertices.size(); i++) {
+    vertices[i] = vec3f(tri->pos[3*i], tri->pos[3*i+1], tri->pos[3*i+2]);
+  }
+  indices.resize(tri->numIndices - tri->numIndices % 3);
+  for(size_t i = 0; i < indices.size(); i++) {
+    if(tri->indices[i] < 0 || static_cast<size_t>(tri->indices[i]) >= vertices.size()) {
+      delete tri;
+      err = "Invalid vertex index in PLY file: " + filename;
+      return(false);
+    }
+    indices[i] = static_cast<uint32_t>(tri->indices[i]);
+  }
+  delete tri;
+  return(true);
+}
+
+plymesh::plymesh(std::string inputfile, std::string basedir, std::string cache_dir, std::shared_ptr<material> mat, 
+            Float scale, Float shutteropen, Float shutterclose, int bvh_type, int numbercores, random_gen rng,
             std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
   hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
-  TriMesh* tri = parse_file_with_miniply(inputfile.c_str(), false);
+  MeshCache cache(cache_dir, inputfile, scale, bvh_type, *ObjectToWorld);
+  compact_mesh::PrepareCache(cache);
   mat_ptr = mat;
   
-  if(tri == nullptr) {
-    std::string err = inputfile;
-    throw std::runtime_error("No mesh loaded: " + err);
+  //Shared vertex buffers, indexed by the faces
+  std::vector<vec3f> vertices;
+  std::vector<uint32_t> face_indices;
+  if(cache.Load()) {
+    const MeshCacheData& data = cache.data;
+    vertices.resize(data.vertices.size() / 3);
+    for(size_t i = 0; i < vertices.size(); i++) {
+      vertices[i] = vec3f(data.vertices[3*i], data.vertices[3*i+1], data.vertices[3*i+2]);
+    }
+    face_indices.resize(data.indices.size() - data.indices.size() % 3);
+    for(size_t i = 0; i < face_indices.size(); i++) {
+      if(data.indices[i] < 0 || static_cast<size_t>(data.indices[i]) >= vertices.size()) {
+        throw std::runtime_error("Invalid vertex index in PLY file: " + inputfile);
+      }
+      face_indices[i] = static_cast<uint32_t>(data.indices[i]);
+    }
+  } else {
+    std::string err;
+    if(!LoadPlyGeometry(inputfile, numbercores, vertices, face_indices, err)) {
+      throw std::runtime_error(err);
+    }
   }
-  bool has_normals = false;
-  if(tri->normal != nullptr) {
-    has_normals = true;
+  if(cache.enabled() && !cache.loaded()) {
+    MeshCacheData& data = cache.data;
+    data.vertices.resize(3 * vertices.size());
+    for(size_t i = 0; i < vertices.size(); i++) {
+      for(int j = 0; j < 3; j++) {
+        data.vertices[3*i+j] = vertices[i].e[j];
+      }
+    }
+    data.indices.assign(face_indices.begin(), face_indices.end());
   }
-  
-  bool has_uv = false;
-  if(tri->uv != nullptr) {
-    has_uv = true;
+  for(size_t i = 0; i < vertices.size(); i++) {
+    vertices[i] *= scale;
   }
-  int number_faces = tri->numIndices / 3;
   
-  vec3f tris[3];
-  vec3f normals[3];
-  for (int i = 0; i < number_faces; i++) {
-    bool tempnormal = false;
-    int idx = 3*i;
-    tris[0] = vec3f(tri->pos[3*tri->indices[idx  ]+0],
-                   tri->pos[3*tri->indices[idx  ]+1],
-                           tri->pos[3*tri->indices[idx  ]+2])*scale;
-    tris[1] = vec3f(tri->pos[3*tri->indices[idx+1]+0],
-                   tri->pos[3*tri->indices[idx+1]+1],
-                           tri->pos[3*tri->indices[idx+1]+2])*scale;
-    tris[2] = vec3f(tri->pos[3*tri->indices[idx+2]+0],
-                   tri->pos[3*tri->indices[idx+2]+1],
-                           tri->pos[3*tri->indices[idx+2]+2])*scale;
-    if(has_normals) {
-      tempnormal = true;
-      normals[0] = vec3f(tri->normal[3*tri->indices[idx  ]+0],
-                        tri->normal[3*tri->indices[idx  ]+1],
-                                   tri->normal[3*tri->indices[idx  ]+2]);
-      normals[1] = vec3f(tri->normal[3*tri->indices[idx+1]+0],
-                        tri->normal[3*tri->indices[idx+1]+1],
-                                   tri->normal[3*tri->indices[idx+1]+2]);
-      normals[2] = vec3f(tri->normal[3*tri->indices[idx+2]+0],
-                        tri->normal[3*tri->indices[idx+2]+1],
-                                   tri->normal[3*tri->indices[idx+2]+2]);
-    }
-    if((normals[0].x() == 0 && normals[0].y() == 0 && normals[0].z() == 0) ||
-       (normals[1].x() == 0 && normals[1].y() == 0 && normals[1].z() == 0) ||
-       (normals[2].x() == 0 && normals[2].y() == 0 && normals[2].z() == 0)) {
-      tempnormal = false;
-    }
-    
-    if(has_normals && tempnormal) {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2],
-                                       normals[0],normals[1],normals[2],
-                                                                    false,
-                                                                    mat_ptr, nullptr,  nullptr, 
-                                                                    ObjectToWorld, WorldToObject, reverseOrientation));
-    } else {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], false, mat_ptr, nullptr, nullptr, 
-                                               ObjectToWorld, WorldToObject, reverseOrientation));
-    }
-  }
-  ply_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  delete tri;
+  std::vector<normal3f> normals;
+  std::vector<uint32_t> normal_indices, texcoord_indices;
+  std::vector<vec2f> texcoords;
+  std::vector<uint16_t> material_ids;
+  std::vector<std::shared_ptr<material> > materials(1, mat_ptr);
+  ply_mesh = std::make_shared<compact_mesh>(vertices, normals, face_indices, normal_indices,
+                                            texcoords, texcoord_indices, material_ids, materials, cache, bvh_type,
+                                            ObjectToWorld, WorldToObject, reverseOrientation);
 };
 
 
 bool plymesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  return(ply_mesh_bvh->hit(r, t_min, t_max, rec, rng));
+  return(ply_mesh->hit(r, t_min, t_max, rec, rng));
 };
 
 bool plymesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  return(ply_mesh_bvh->hit(r, t_min, t_max, rec, sampler));
+  return(ply_mesh->hit(r, t_min, t_max, rec, sampler));
 };
 
 bool plymesh::bounding_box(Float t0, Float t1, aabb& box) const {
-  return(ply_mesh_bvh->bounding_box(t0,t1,box));
+  return(ply_mesh->bounding_box(t0,t1,box));
 };
 
@@ -1,20 +1,26 @@
 #ifndef PLYMESHH
 #define PLYMESHH
 
-#include "triangle.h"
-#include "bvh_node.h"
+#include "compactmesh.h"
+#include "meshcache.h"
 #include <Rcpp.h>
 
 
 enum class Topology;
 struct TriMesh;
 
+//Reads the vertex positions and triangulated faces of a PLY file: binary little-endian files are
+//read from a memory-mapped view on `numbercores` threads, other encodings with miniply. Returns
+//false and sets `err` if the file can't be read or references missing vertices.
+bool LoadPlyGeometry(const std::string& filename, int numbercores, std::vector<vec3f>& vertices,
+                     std::vector<uint32_t>& indices, std::string& err);
+
 class plymesh : public hitable {
   public:
     plymesh() {}
    ~plymesh() {}
-  plymesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-          Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
+  plymesh(std::string inputfile, std::string basedir, std::string cache_dir, std::shared_ptr<material> mat, 
+          Float scale, Float shutteropen, Float shutterclose, int bvh_type, int numbercores, random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
@@ -23,9 +29,8 @@ class plymesh : public hitable {
   virtual std::string GetName() const {
     return(std::string("Plymesh"));
   }
-  std::shared_ptr<bvh_node> ply_mesh_bvh;
+  std::shared_ptr<compact_mesh> ply_mesh;
   std::shared_ptr<material> mat_ptr;
-  hitable_list triangles;
 };
 
 
@@ -69,6 +69,10 @@ class ray {
     Float _time;
     mutable Float tMax;
     std::vector<dielectric*> *pri_stack;
+    //Ray cone for texture filtering: at distance d from the origin the ray covers a footprint
+    //cone_width + cone_spread * d wide. Set from the pixel size for camera rays and carried
+    //through bounces by the integrator; zero disables filtering.
+    Float cone_width = 0, cone_spread = 0;
 };
 
 #endif
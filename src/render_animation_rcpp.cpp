@@ -6,6 +6,7 @@
 #include "camera.h"
 #include "float.h"
 #include "buildscene.h"
+#include "textureregistry.h"
 #include "RProgress.h"
 #include "rng.h"
 #include "tonemap.h"
@@ -84,6 +85,7 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   List mesh_list = as<List>(scene_info["mesh_list"]);
   List roughness_list = as<List>(scene_info["roughness_list"]);
   List animation_info = as<List>(scene_info["animation_info"]);
+  std::string mesh_cache_dir = as<std::string>(scene_info["mesh_cache_dir"]);
   
   
   auto startfirst = std::chrono::high_resolution_clock::now();
@@ -120,6 +122,17 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   NumericVector cam_orthox   = as<NumericVector>(camera_movement["orthox"]);
   NumericVector cam_orthoy   = as<NumericVector>(camera_movement["orthoy"]);
   int n_frames = cam_x.size();
+  bool has_frame_shutter = camera_movement.containsElementNamed("shutteropen") &&
+    camera_movement.containsElementNamed("shutterclose");
+  NumericVector cam_shutteropen, cam_shutterclose;
+  if(has_frame_shutter) {
+    cam_shutteropen  = as<NumericVector>(camera_movement["shutteropen"]);
+    cam_shutterclose = as<NumericVector>(camera_movement["shutterclose"]);
+  }
+  Float bvh_rebuild_threshold = as<Float>(scene_info["bvh_rebuild_threshold"]);
+  bool robust_quadrics = as<bool>(scene_info["robust_quadrics"]);
+  texture_cache::Configure(static_cast<size_t>(as<double>(scene_info["texture_memory"]) * 1024 * 1024),
+                           as<std::string>(scene_info["texture_cache_dir"]));
   
   vec3f backgroundhigh(bghigh[0],bghigh[1],bghigh[2]);
   vec3f backgroundlow(bglow[0],bglow[1],bglow[2]);
@@ -136,76 +149,68 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   RcppThread::ThreadPool pool(numbercores);
   GetRNGstate();
   random_gen rng(unif_rand() * std::pow(2,32));
-  int nx1, ny1, nn1;
+  int nx1, ny1;
   auto start = std::chrono::high_resolution_clock::now();
   if(verbose) {
     Rcpp::Rcout << "Building BVH: ";
   }
   
-  std::vector<Float* > textures;
-  std::vector<int* > nx_ny_nn;
-  
-  std::vector<Float* > alpha_textures;
-  std::vector<int* > nx_ny_nn_alpha;
-  
-  std::vector<Float* > bump_textures;
-  std::vector<int* > nx_ny_nn_bump;
-  
-  std::vector<Float* > roughness_textures;
-  std::vector<int* > nx_ny_nn_roughness;
   //Shared material vector
   std::vector<std::shared_ptr<material> >* shared_materials = new std::vector<std::shared_ptr<material> >;
   
+  //Decode every referenced image on the thread pool before building the scene. Images are shared
+  //through the texture registry, so a file used by several objects is decoded once.
+  std::vector<std::shared_ptr<mipmap> > texture_maps(n);
+  std::vector<std::shared_ptr<image_data> > alpha_textures(n);
+  std::vector<std::shared_ptr<image_data> > bump_textures(n);
+  std::vector<std::shared_ptr<image_data> > roughness_textures(n);
+  std::shared_ptr<image_data> background_image;
+  //File names are read from the R objects here, since the workers can't touch them
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      int nx, ny, nn;
-      Float* tex_data = stbi_loadf(filelocation(i), &nx, &ny, &nn, 0);
-      textures.push_back(tex_data);
-      nx_ny_nn.push_back(new int[3]);
-      nx_ny_nn[i][0] = nx;
-      nx_ny_nn[i][1] = ny;
-      nx_ny_nn[i][2] = nn;
-    } else {
-      textures.push_back(nullptr);
-      nx_ny_nn.push_back(nullptr);
+      std::string filename = as<std::string>(filelocation(i));
+      pool.push([&texture_maps, filename, i]() {
+        texture_maps[i] = texture_registry::Texture(filename);
+      });
     }
     if(has_alpha(i)) {
-      stbi_ldr_to_hdr_gamma(1.0f);
-      int nxa, nya, nna;
-      Float* tex_data_alpha = stbi_loadf(alpha_files(i), &nxa, &nya, &nna, 0);
-      alpha_textures.push_back(tex_data_alpha);
-      nx_ny_nn_alpha.push_back(new int[3]);
-      nx_ny_nn_alpha[i][0] = nxa;
-      nx_ny_nn_alpha[i][1] = nya;
-      nx_ny_nn_alpha[i][2] = nna;
-      stbi_ldr_to_hdr_gamma(2.2f);
-    } else {
-      alpha_textures.push_back(nullptr);
-      nx_ny_nn_alpha.push_back(nullptr);
+      std::string filename = as<std::string>(alpha_files(i));
+      pool.push([&alpha_textures, filename, i]() {
+        alpha_textures[i] = texture_registry::Decode(filename, 1.0f);
+      });
     }
     if(has_bump(i)) {
-      int nxb, nyb, nnb;
-      Float* tex_data_bump = stbi_loadf(bump_files(i), &nxb, &nyb, &nnb, 0);
-      bump_textures.push_back(tex_data_bump);
-      nx_ny_nn_bump.push_back(new int[3]);
-      nx_ny_nn_bump[i][0] = nxb;
-      nx_ny_nn_bump[i][1] = nyb;
-      nx_ny_nn_bump[i][2] = nnb;
-    } else {
-      bump_textures.push_back(nullptr);
-      nx_ny_nn_bump.push_back(nullptr);
+      std::string filename = as<std::string>(bump_files(i));
+      pool.push([&bump_textures, filename, i]() {
+        bump_textures[i] = texture_registry::Decode(filename, texture_registry::kColorGamma);
+      });
     }
     if(has_roughness(i)) {
-      int nxr, nyr, nnr;
-      Float* tex_data_roughness = stbi_loadf(roughness_files(i), &nxr, &nyr, &nnr, 0);
-      roughness_textures.push_back(tex_data_roughness);
-      nx_ny_nn_roughness.push_back(new int[3]);
-      nx_ny_nn_roughness[i][0] = nxr;
-      nx_ny_nn_roughness[i][1] = nyr;
-      nx_ny_nn_roughness[i][2] = nnr;
-    } else {
-      roughness_textures.push_back(nullptr);
-      nx_ny_nn_roughness.push_back(nullptr);
+      std::string filename = as<std::string>(roughness_files(i));
+      pool.push([&roughness_textures, filename, i]() {
+        roughness_textures[i] = texture_registry::Decode(filename, texture_registry::kColorGamma);
+      });
+    }
+  }
+  if(hasbackground) {
+    std::string filename = as<std::string>(background[0]);
+    pool.push([&background_image, filename]() {
+      background_image = texture_registry::Decode(filename, texture_registry::kColorGamma);
+    });
+  }
+  pool.wait();
+  for(int i = 0; i < n; i++) {
+    if(isimage(i) && !texture_maps[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(filelocation(i)));
+    }
+    if(has_alpha(i) && !alpha_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(alpha_files(i)));
+    }
+    if(has_bump(i) && !bump_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(bump_files(i)));
+    }
+    if(has_roughness(i) && !roughness_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(roughness_files(i)));
     }
   }
   
@@ -219,10 +224,10 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                                                   gradient_info,
                                                   noise, isnoise, noisephase, noiseintensity, noisecolorlist,
                                                   angle, 
-                                                  isimage, has_alpha, alpha_textures, nx_ny_nn_alpha,
-                                                  textures, nx_ny_nn, has_bump, bump_textures, nx_ny_nn_bump,
+                                                  isimage, has_alpha, alpha_textures,
+                                                  texture_maps, has_bump, bump_textures,
                                                   bump_intensity,
-                                                  roughness_textures, nx_ny_nn_roughness, has_roughness,
+                                                  roughness_textures, has_roughness,
                                                   lightintensity, isflipped,
                                                   isvolume, voldensity, order_rotation_list, 
                                                   isgrouped, group_transform,
@@ -230,13 +235,17 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                                                   fileinfo, filebasedir, 
                                                   scale_list, sigmavec, glossyinfo,
                                                   shared_id_mat, is_shared_mat, shared_materials,
-                                                  image_repeat, csg_info, mesh_list, bvh_type, transformCache, 
+                                                  image_repeat, csg_info, mesh_list, bvh_type, robust_quadrics, mesh_cache_dir, numbercores, transformCache, 
                                                   animation_info, rng);
   auto finish = std::chrono::high_resolution_clock::now();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
   }
+  if(verbose && texture_registry::images_requested > 0) {
+    Rcpp::Rcout << "Decoded " << texture_registry::images_loaded << " images for " <<
+      texture_registry::images_requested << " texture references" << "\n";
+  }
   
   //Calculate world bounds
   aabb bounding_box_world;
@@ -256,7 +265,6 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   std::shared_ptr<texture> background_texture = nullptr;
   std::shared_ptr<material> background_material = nullptr;
   std::shared_ptr<hitable> background_sphere = nullptr;
-  Float *background_texture_data = nullptr;
   Matrix4x4 Identity;
   Transform BackgroundAngle(Identity);
   if(rotate_env != 0) {
@@ -268,8 +276,13 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   std::shared_ptr<Transform> BackgroundTransformInv = transformCache.Lookup(BackgroundAngle.GetInverseMatrix());
   
   if(hasbackground) {
-    background_texture_data = stbi_loadf(background[0], &nx1, &ny1, &nn1, 0);
-    background_texture = std::make_shared<image_texture>(background_texture_data, nx1, ny1, nn1, 1, 1, intensity_env);
+    if(!background_image) {
+      throw std::runtime_error("Could not read background image " + as<std::string>(background[0]));
+    }
+    nx1 = background_image->nx;
+    ny1 = background_image->ny;
+    background_texture = std::make_shared<image_texture>(std::make_shared<mipmap>(background_image, false),
+                                                         1, 1, intensity_env);
     background_material = std::make_shared<diffuse_light>(background_texture, 1.0, false);
     background_sphere = std::make_shared<InfiniteAreaLight>(nx1, ny1, world_radius*2, world_center,
                                                             background_texture, background_material, BackgroundTransform,
@@ -327,7 +340,7 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                                  angle, i, order_rotation_list,
                                  isgrouped, group_transform,
                                  fileinfo, filebasedir,transformCache, scale_list, 
-                                 mesh_list,bvh_type,  animation_info,
+                                 mesh_list,bvh_type, robust_quadrics, mesh_cache_dir, numbercores, animation_info,
                                  rng));
     }
   }
@@ -343,6 +356,37 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   if(verbose && !progress_bar) {
     Rcpp::Rcout << "Starting Raytracing:\n ";
   }
+  //When frames have their own shutter intervals, the scene BVH is refit to each interval instead of
+  //rebuilding the scene. The top level is only rebuilt (from its existing primitives) once the SAH
+  //cost of the refit tree exceeds `bvh_rebuild_threshold` times its cost when it was last built.
+  //A fresh build of the current frame would be the better reference, but measuring it is the
+  //rebuild the refit avoids; the cost is normalized by the root's area, so it tracks how much the
+  //refit has loosened the tree rather than how far the scene has moved.
+  std::shared_ptr<bvh_node> world_tree = std::dynamic_pointer_cast<bvh_node>(worldbvh);
+  Float built_sah_cost = world_tree ? world_tree->sah_cost() : 0;
+  auto update_world_bvh = [&](Float frame_open, Float frame_close) {
+    if(!world_tree) {
+      return;
+    }
+    auto refit_start = std::chrono::high_resolution_clock::now();
+    world_tree->refit(frame_open, frame_close, numbercores);
+    Float refit_sah_cost = world_tree->sah_cost();
+    bool rebuilt = false;
+    if(refit_sah_cost > bvh_rebuild_threshold * built_sah_cost) {
+      hitable_list prims;
+      world_tree->primitives(prims.objects);
+      world_tree = std::make_shared<bvh_node>(prims, frame_open, frame_close, bvh_type, rng);
+      built_sah_cost = world_tree->sah_cost();
+      world.objects[0] = world_tree;
+      rebuilt = true;
+    }
+    if(verbose) {
+      std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - refit_start;
+      Rcpp::Rcout << (rebuilt ? "Rebuilt" : "Refit") << " BVH (SAH cost " << refit_sah_cost << "): " <<
+        elapsed.count() << " seconds" << "\n";
+    }
+  };
+  
   RProgress::RProgress pb_sampler("Generating Samples [:bar] :percent%");
   pb_sampler.set_width(70);
   RProgress::RProgress pb("Adaptive Raytracing [:bar] :percent%");
@@ -366,6 +410,11 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
       if(progress_bar) {
         pb_frames.tick();
       }
+      if(has_frame_shutter) {
+        shutteropen = cam_shutteropen(i);
+        shutterclose = cam_shutterclose(i);
+        update_world_bvh(shutteropen, shutterclose);
+      }
       vec3f lookfrom = vec3f(cam_x(i),cam_y(i),cam_z(i));
       vec3f lookat = vec3f(cam_dx(i),cam_dy(i),cam_dz(i));
       Float fov = cam_fov(i);
@@ -431,6 +480,11 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
       if(progress_bar) {
         pb_frames.tick();
       }
+      if(has_frame_shutter) {
+        shutteropen = cam_shutteropen(i);
+        shutterclose = cam_shutterclose(i);
+        update_world_bvh(shutteropen, shutterclose);
+      }
       vec3f lookfrom = vec3f(cam_x(i),cam_y(i),cam_z(i));
       vec3f lookat = vec3f(cam_dx(i),cam_dy(i),cam_dz(i));
       vec3f camera_up = vec3f(cam_upx(i),cam_upy(i),cam_upz(i));
@@ -488,27 +542,16 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
     }
   }
   
+  if(verbose && texture_cache::enabled()) {
+    Rcpp::Rcout << "Texture cache: " << texture_cache::tile_reads << " tiles read, peak of " << 
+      static_cast<double>(texture_cache::peak_bytes) / (1024 * 1024) << " MB resident" << "\n";
+  }
   if(verbose) {
     Rcpp::Rcout << "Cleaning up memory..." << "\n";
   }
-  if(hasbackground) {
-    stbi_image_free(background_texture_data);
-  }
-  for(int i = 0; i < n; i++) {
-    if(isimage(i)) {
-      stbi_image_free(textures[i]);
-      delete nx_ny_nn[i];
-    } 
-    if(has_alpha(i)) {
-      stbi_image_free(alpha_textures[i]);
-      delete nx_ny_nn_alpha[i];
-    }
-    if(has_bump(i)) {
-      stbi_image_free(bump_textures[i]);
-      delete nx_ny_nn_bump[i];
-    }
-  }
   delete shared_materials;
+  texture_registry::Clear();
+  texture_cache::Clear();
   PutRNGstate();
   finish = std::chrono::high_resolution_clock::now();
   if(verbose) {
@@ -1,6 +1,9 @@
 #ifndef STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION 
 #endif
+//Images are decoded on several threads, and stb_image records failure reasons in a global that
+//nothing reads
+#define STBI_NO_FAILURE_STRINGS
 
 #ifndef FLOATDEF
 #define FLOATDEF
@@ -22,6 +25,7 @@ typedef float Float;
 #include "camera.h"
 #include "float.h"
 #include "buildscene.h"
+#include "textureregistry.h"
 #include "RProgress.h"
 #include "rng.h"
 #include "tonemap.h"
@@ -31,6 +35,7 @@ typedef float Float;
 #include "color.h"
 #include "integrator.h"
 #include "debug.h"
+#include "bvhstats.h"
 using namespace Rcpp;
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::depends(RcppThread)]]
@@ -104,6 +109,12 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   List mesh_list = as<List>(scene_info["mesh_list"]);
   List roughness_list = as<List>(scene_info["roughness_list"]);
   List animation_info = as<List>(scene_info["animation_info"]);
+  std::string mesh_cache_dir = as<std::string>(scene_info["mesh_cache_dir"]);
+  bool bvh_statistics = as<bool>(scene_info["bvh_statistics"]);
+  bool robust_quadrics = as<bool>(scene_info["robust_quadrics"]);
+  texture_cache::Configure(static_cast<size_t>(as<double>(scene_info["texture_memory"]) * 1024 * 1024),
+                           as<std::string>(scene_info["texture_cache_dir"]));
+  BVHBuildTimes build_times;
   
 
   
@@ -189,112 +200,71 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   
   environment_camera ecam(lookfrom, lookat, vec3f(camera_up(0),camera_up(1),camera_up(2)),
                           shutteropen, shutterclose);
-  int nx1, ny1, nn1;
+  int nx1, ny1;
   auto start = std::chrono::high_resolution_clock::now();
   if(verbose) {
     Rcpp::Rcout << "Building BVH: ";
   }
   
-  std::vector<Float* > textures;
-  std::vector<int* > nx_ny_nn;
-  
-  std::vector<Float* > alpha_textures;
-  std::vector<int* > nx_ny_nn_alpha;
-  
-  std::vector<Float* > bump_textures;
-  std::vector<int* > nx_ny_nn_bump;
-  
-  std::vector<Float* > roughness_textures;
-  std::vector<int* > nx_ny_nn_roughness;
   //Shared material vector
   std::vector<std::shared_ptr<material> >* shared_materials = new std::vector<std::shared_ptr<material> >;
   
+  //Decode every referenced image on the thread pool before building the scene. Images are shared
+  //through the texture registry, so a file used by several objects is decoded once.
+  std::vector<std::shared_ptr<mipmap> > texture_maps(n);
+  std::vector<std::shared_ptr<image_data> > alpha_textures(n);
+  std::vector<std::shared_ptr<image_data> > bump_textures(n);
+  std::vector<std::shared_ptr<image_data> > roughness_textures(n);
+  std::shared_ptr<image_data> background_image;
+  //File names are read from the R objects here, since the workers can't touch them
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      int nx, ny, nn;
-      Float* tex_data = stbi_loadf(filelocation(i), &nx, &ny, &nn, 0);
-      textures.push_back(tex_data);
-      nx_ny_nn.push_back(new int[3]);
-      nx_ny_nn[i][0] = nx;
-      nx_ny_nn[i][1] = ny;
-      nx_ny_nn[i][2] = nn;
-    } else {
-      textures.push_back(nullptr);
-      nx_ny_nn.push_back(nullptr);
+      std::string filename = as<std::string>(filelocation(i));
+      pool.push([&texture_maps, filename, i]() {
+        texture_maps[i] = texture_registry::Texture(filename);
+      });
     }
     if(has_alpha(i)) {
-      stbi_ldr_to_hdr_gamma(1.0f);
-      int nxa, nya, nna;
-      Float* tex_data_alpha = stbi_loadf(alpha_files(i), &nxa, &nya, &nna, 0);
-      alpha_textures.push_back(tex_data_alpha);
-      nx_ny_nn_alpha.push_back(new int[3]);
-      nx_ny_nn_alpha[i][0] = nxa;
-      nx_ny_nn_alpha[i][1] = nya;
-      nx_ny_nn_alpha[i][2] = nna;
-      stbi_ldr_to_hdr_gamma(2.2f);
-    } else {
-      alpha_textures.push_back(nullptr);
-      nx_ny_nn_alpha.push_back(nullptr);
+      std::string filename = as<std::string>(alpha_files(i));
+      pool.push([&alpha_textures, filename, i]() {
+        alpha_textures[i] = texture_registry::Decode(filename, 1.0f);
+      });
     }
     if(has_bump(i)) {
-      int nxb, nyb, nnb;
-      Float* tex_data_bump = stbi_loadf(bump_files(i), &nxb, &nyb, &nnb, 0);
-      bump_textures.push_back(tex_data_bump);
-      nx_ny_nn_bump.push_back(new int[3]);
-      nx_ny_nn_bump[i][0] = nxb;
-      nx_ny_nn_bump[i][1] = nyb;
-      nx_ny_nn_bump[i][2] = nnb;
-    } else {
-      bump_textures.push_back(nullptr);
-      nx_ny_nn_bump.push_back(nullptr);
+      std::string filename = as<std::string>(bump_files(i));
+      pool.push([&bump_textures, filename, i]() {
+        bump_textures[i] = texture_registry::Decode(filename, texture_registry::kColorGamma);
+      });
     }
     if(has_roughness(i)) {
+      std::string filename = as<std::string>(roughness_files(i));
       NumericVector temp_glossy = as<NumericVector>(glossyinfo(i));
-      int nxr, nyr, nnr;
-      Float* tex_data_roughness = stbi_loadf(roughness_files(i), &nxr, &nyr, &nnr, 0);
       Float min = temp_glossy(9), max = temp_glossy(10);
-      Float rough_range = max-min;
-      Float maxr = 0, minr = 1;
-      for(int ii = 0; ii < nxr; ii++) {
-        for(int jj = 0; jj < nyr; jj++) {
-          Float temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj];
-          maxr = maxr < temp_rough ? temp_rough : maxr;
-          minr = minr > temp_rough ? temp_rough : minr;
-          if(nnr > 1) {
-            temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj+1];
-            maxr = maxr < temp_rough ? temp_rough : maxr;
-            minr = minr > temp_rough ? temp_rough : minr;
-          }
-        }
-      }
-      Float data_range = maxr-minr;
-      for(int ii = 0; ii < nxr; ii++) {
-        for(int jj = 0; jj < nyr; jj++) {
-          if(!temp_glossy(11)) {
-            tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
-              (tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range * rough_range + min;
-            if(nnr > 1) {
-              tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
-                (tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range * rough_range + min;
-            }
-          } else {
-            tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
-              (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range) * rough_range + min;
-            if(nnr > 1) {
-              tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
-                (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range) * rough_range + min;
-            }
-          }
-        }
-      }
-      roughness_textures.push_back(tex_data_roughness);
-      nx_ny_nn_roughness.push_back(new int[3]);
-      nx_ny_nn_roughness[i][0] = nxr;
-      nx_ny_nn_roughness[i][1] = nyr;
-      nx_ny_nn_roughness[i][2] = nnr;
-    } else {
-      roughness_textures.push_back(nullptr);
-      nx_ny_nn_roughness.push_back(nullptr);
+      bool invert = temp_glossy(11);
+      pool.push([&roughness_textures, filename, min, max, invert, i]() {
+        roughness_textures[i] = texture_registry::Roughness(filename, min, max, invert);
+      });
+    }
+  }
+  if(hasbackground) {
+    std::string filename = as<std::string>(background[0]);
+    pool.push([&background_image, filename]() {
+      background_image = texture_registry::Decode(filename, texture_registry::kColorGamma);
+    });
+  }
+  pool.wait();
+  for(int i = 0; i < n; i++) {
+    if(isimage(i) && !texture_maps[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(filelocation(i)));
+    }
+    if(has_alpha(i) && !alpha_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(alpha_files(i)));
+    }
+    if(has_bump(i) && !bump_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(bump_files(i)));
+    }
+    if(has_roughness(i) && !roughness_textures[i]) {
+      throw std::runtime_error("Could not read texture " + as<std::string>(roughness_files(i)));
     }
   }
   
@@ -306,10 +276,10 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                                 gradient_info,
                                 noise, isnoise, noisephase, noiseintensity, noisecolorlist,
                                 angle, 
-                                isimage, has_alpha, alpha_textures, nx_ny_nn_alpha,
-                                textures, nx_ny_nn, has_bump, bump_textures, nx_ny_nn_bump,
+                                isimage, has_alpha, alpha_textures,
+                                texture_maps, has_bump, bump_textures,
                                 bump_intensity,
-                                roughness_textures, nx_ny_nn_roughness, has_roughness,
+                                roughness_textures, has_roughness,
                                 lightintensity, isflipped,
                                 isvolume, voldensity, order_rotation_list, 
                                 isgrouped, group_transform,
@@ -317,13 +287,18 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                                 fileinfo, filebasedir, 
                                 scale_list, sigmavec, glossyinfo,
                                 shared_id_mat, is_shared_mat, shared_materials,
-                                image_repeat, csg_info, mesh_list, bvh_type, transformCache, 
+                                image_repeat, csg_info, mesh_list, bvh_type, robust_quadrics, mesh_cache_dir, numbercores, transformCache, 
                                 animation_info, rng);
   auto finish = std::chrono::high_resolution_clock::now();
+  build_times.scene = std::chrono::duration<double>(finish - start).count();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
   }
+  if(verbose && texture_registry::images_requested > 0) {
+    Rcpp::Rcout << "Decoded " << texture_registry::images_loaded << " images for " <<
+      texture_registry::images_requested << " texture references" << "\n";
+  }
   
   //Calculate world bounds and ensure camera is inside infinite area light
   aabb bounding_box_world;
@@ -345,7 +320,6 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   std::shared_ptr<texture> background_texture = nullptr;
   std::shared_ptr<material> background_material = nullptr;
   std::shared_ptr<hitable> background_sphere = nullptr;
-  Float *background_texture_data = nullptr;
   
   //Background rotation
   Matrix4x4 Identity;
@@ -359,8 +333,13 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   std::shared_ptr<Transform> BackgroundTransformInv = transformCache.Lookup(BackgroundAngle.GetInverseMatrix());
   
   if(hasbackground) {
-    background_texture_data = stbi_loadf(background[0], &nx1, &ny1, &nn1, 0);
-    background_texture = std::make_shared<image_texture>(background_texture_data, nx1, ny1, nn1, 1, 1, intensity_env);
+    if(!background_image) {
+      throw std::runtime_error("Could not read background image " + as<std::string>(background[0]));
+    }
+    nx1 = background_image->nx;
+    ny1 = background_image->ny;
+    background_texture = std::make_shared<image_texture>(std::make_shared<mipmap>(background_image, false),
+                                                         1, 1, intensity_env);
     background_material = std::make_shared<diffuse_light>(background_texture, 1.0, false);
     background_sphere = std::make_shared<InfiniteAreaLight>(nx1, ny1, world_radius*2, vec3f(0.f),
                                               background_texture, background_material, 
@@ -421,10 +400,11 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                                isgrouped, group_transform,
                                fileinfo, filebasedir,
                                transformCache ,scale_list, 
-                               mesh_list,bvh_type, animation_info,  rng));
+                               mesh_list,bvh_type, robust_quadrics, mesh_cache_dir, numbercores, animation_info,  rng));
     }
   }
   finish = std::chrono::high_resolution_clock::now();
+  build_times.importance_sampling = std::chrono::duration<double>(finish - start).count();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
@@ -449,6 +429,11 @@ List render_scene_rcpp(List camera_info, List scene_info) {
     min_adaptive_size = 1;
     min_variance = 10E-8;
   }
+  if(bvh_statistics) {
+    TraversalStats::Reset();
+    TraversalStats::enabled = true;
+  }
+  start = std::chrono::high_resolution_clock::now();
   if(debug_channel != 0) {
     debug_scene(numbercores, nx, ny, ns, debug_channel,
                 min_variance, min_adaptive_size, 
@@ -467,37 +452,28 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                world, hlist,
                clampval, max_depth, roulette_active);
   }
+  TraversalStats::enabled = false;
+  build_times.render = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
 
+  if(verbose && texture_cache::enabled()) {
+    Rcpp::Rcout << "Texture cache: " << texture_cache::tile_reads << " tiles read, peak of " << 
+      static_cast<double>(texture_cache::peak_bytes) / (1024 * 1024) << " MB resident" << "\n";
+  }
   if(verbose) {
     Rcpp::Rcout << "Cleaning up memory..." << "\n";
   }
-  if(hasbackground) {
-    stbi_image_free(background_texture_data);
-  }
-  for(int i = 0; i < n; i++) {
-    if(isimage(i)) {
-      stbi_image_free(textures[i]);
-      delete nx_ny_nn[i];
-    } 
-    if(has_alpha(i)) {
-      stbi_image_free(alpha_textures[i]);
-      delete nx_ny_nn_alpha[i];
-    }
-    if(has_bump(i)) {
-      stbi_image_free(bump_textures[i]);
-      delete nx_ny_nn_bump[i];
-    }
-    if(has_roughness(i)) {
-      stbi_image_free(roughness_textures[i]);
-      delete nx_ny_nn_roughness[i];
-    }
-  }
   delete shared_materials;
+  texture_registry::Clear();
+  texture_cache::Clear();
   PutRNGstate();
   finish = std::chrono::high_resolution_clock::now();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - startfirst;
     Rcpp::Rcout << "Total time elapsed: " << elapsed.count() << " seconds" << "\n";
   }
+  if(bvh_statistics) {
+    return(List::create(_["r"] = routput, _["g"] = goutput, _["b"] = boutput,
+                        _["bvh_statistics"] = BVHStatistics(worldbvh, build_times)));
+  }
   return(List::create(_["r"] = routput, _["g"] = goutput, _["b"] = boutput));
 }
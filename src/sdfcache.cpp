@@ -0,0 +1,202 @@
+#include "sdfcache.h"
+#include "mappedfile.h"
+#include "RcppThread.h"
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+const int sdf_cache::kBrickSize;
+const size_t sdf_cache::kBrickSamples;
+const uint32_t sdf_cache::kFarBrick;
+
+//Bump when the layout of the file changes
+static const uint32_t kSdfCacheVersion = 1;
+static const char kSdfCacheMagic[8] = {'R','A','Y','S','D','F','C','\0'};
+static const uint32_t kEndianCheck = 0x01020304;
+
+struct SdfCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t key;
+  uint64_t float_size;
+  float origin[3];
+  float cell_size;
+  int32_t cells[3];
+  int32_t pad;
+  //center_distance, brick_index, samples
+  uint64_t counts[3];
+};
+
+void sdf_cache::init_grid(const aabb& bounds, int resolution) {
+  if(resolution < 1) {
+    throw std::runtime_error("SDF bake resolution must be at least one");
+  }
+  vec3f extent = bounds.max() - bounds.min();
+  Float longest = std::fmax(std::fmax(extent.x(), extent.y()), extent.z());
+  if(!std::isfinite(longest)) {
+    throw std::runtime_error("Can't bake the distance field of an unbounded CSG object");
+  }
+  cell_size = std::fmax(longest, 1e-3) / resolution;
+  inv_cell_size = 1 / cell_size;
+  //Pad the grid by two cells on each side, so lookups just outside the bounds still hit it
+  origin = bounds.min() - vec3f(2 * cell_size, 2 * cell_size, 2 * cell_size);
+  for(int k = 0; k < 3; k++) {
+    cells[k] = static_cast<int>(std::ceil(extent[k] * inv_cell_size)) + 4;
+    brick_dims[k] = (cells[k] + kBrickSize - 1) / kBrickSize;
+  }
+  cell_diagonal = std::sqrt(static_cast<Float>(3)) * cell_size;
+  interpolation_error = cell_diagonal / 2;
+  exact_distance = interpolation_error;
+}
+
+sdf_cache::sdf_cache(const std::function<Float(const point3f&)>& distance, const aabb& bounds, int resolution,
+                     int numbercores) {
+  init_grid(bounds, resolution);
+  const size_t num_bricks = static_cast<size_t>(brick_dims[0]) * brick_dims[1] * brick_dims[2];
+  center_distance.resize(num_bricks);
+  brick_index.assign(num_bricks, kFarBrick);
+
+  const Float brick_size = kBrickSize * cell_size;
+  const int bx = brick_dims[0], by = brick_dims[1], bz = brick_dims[2];
+  {
+    RcppThread::ThreadPool pool(numbercores);
+    for(int z = 0; z < bz; z++) {
+      pool.push([this, &distance, brick_size, bx, by, z] () {
+        for(int y = 0; y < by; y++) {
+          for(int x = 0; x < bx; x++) {
+            point3f c = origin + vec3f((x + 0.5f) * brick_size, (y + 0.5f) * brick_size, (z + 0.5f) * brick_size);
+            center_distance[x + bx * (y + static_cast<size_t>(by) * z)] = std::fabs(distance(c));
+          }
+        }
+      });
+    }
+    pool.join();
+  }
+
+  //Bricks the surface might pass through (with a cell of slack) get corner samples
+  const Float half_diagonal = std::sqrt(static_cast<Float>(3)) * brick_size / 2;
+  std::vector<size_t> surface;
+  for(size_t i = 0; i < num_bricks; i++) {
+    if(center_distance[i] <= half_diagonal + cell_diagonal) {
+      brick_index[i] = static_cast<uint32_t>(surface.size());
+      surface.push_back(i);
+    }
+  }
+  samples.resize(surface.size() * kBrickSamples);
+  {
+    const int n = kBrickSize + 1;
+    RcppThread::ThreadPool pool(numbercores);
+    for(size_t j = 0; j < surface.size(); j++) {
+      size_t brick = surface[j];
+      pool.push([this, &distance, brick, j, bx, by, n] () {
+        int x0 = static_cast<int>(brick % bx) * kBrickSize;
+        int y0 = static_cast<int>((brick / bx) % by) * kBrickSize;
+        int z0 = static_cast<int>(brick / (static_cast<size_t>(bx) * by)) * kBrickSize;
+        float* s = &samples[j * kBrickSamples];
+        for(int z = 0; z < n; z++) {
+          for(int y = 0; y < n; y++) {
+            for(int x = 0; x < n; x++) {
+              point3f p = origin + vec3f((x0 + x) * cell_size, (y0 + y) * cell_size, (z0 + z) * cell_size);
+              s[x + n * (y + n * z)] = distance(p);
+            }
+          }
+        }
+      });
+    }
+    pool.join();
+  }
+}
+
+size_t sdf_cache::memory_bytes() const {
+  return(center_distance.capacity() * sizeof(float) + brick_index.capacity() * sizeof(uint32_t) +
+         samples.capacity() * sizeof(float));
+}
+
+std::shared_ptr<sdf_cache> sdf_cache::Load(const std::string& filename, uint64_t key) {
+  MappedFile file(filename);
+  if(!file.valid() || file.size() < sizeof(SdfCacheHeader)) {
+    return(nullptr);
+  }
+  SdfCacheHeader header;
+  std::memcpy(&header, file.data(), sizeof(SdfCacheHeader));
+  if(std::memcmp(header.magic, kSdfCacheMagic, 8) != 0 || header.version != kSdfCacheVersion ||
+     header.endian != kEndianCheck || header.key != key || header.float_size != sizeof(float)) {
+    return(nullptr);
+  }
+  std::shared_ptr<sdf_cache> cache(new sdf_cache());
+  cache->origin = point3f(header.origin[0], header.origin[1], header.origin[2]);
+  cache->cell_size = header.cell_size;
+  cache->inv_cell_size = 1 / cache->cell_size;
+  cache->cell_diagonal = std::sqrt(static_cast<Float>(3)) * cache->cell_size;
+  cache->interpolation_error = cache->cell_diagonal / 2;
+  cache->exact_distance = cache->interpolation_error;
+  size_t num_bricks = 1;
+  for(int k = 0; k < 3; k++) {
+    cache->cells[k] = header.cells[k];
+    cache->brick_dims[k] = (header.cells[k] + kBrickSize - 1) / kBrickSize;
+    num_bricks *= cache->brick_dims[k];
+  }
+  if(header.counts[0] != num_bricks || header.counts[1] != num_bricks ||
+     header.counts[2] % kBrickSamples != 0) {
+    return(nullptr);
+  }
+  size_t bytes = sizeof(SdfCacheHeader) + static_cast<size_t>(header.counts[0]) * sizeof(float) +
+    static_cast<size_t>(header.counts[1]) * sizeof(uint32_t) + static_cast<size_t>(header.counts[2]) * sizeof(float);
+  if(file.size() < bytes) {
+    return(nullptr);
+  }
+  const char* p = file.data() + sizeof(SdfCacheHeader);
+  cache->center_distance.resize(num_bricks);
+  std::memcpy(cache->center_distance.data(), p, num_bricks * sizeof(float));
+  p += num_bricks * sizeof(float);
+  cache->brick_index.resize(num_bricks);
+  std::memcpy(cache->brick_index.data(), p, num_bricks * sizeof(uint32_t));
+  p += num_bricks * sizeof(uint32_t);
+  cache->samples.resize(static_cast<size_t>(header.counts[2]));
+  std::memcpy(cache->samples.data(), p, cache->samples.size() * sizeof(float));
+  size_t num_surface = cache->samples.size() / kBrickSamples;
+  for(size_t i = 0; i < num_bricks; i++) {
+    if(cache->brick_index[i] != kFarBrick && cache->brick_index[i] >= num_surface) {
+      return(nullptr);
+    }
+  }
+  return(cache);
+}
+
+bool sdf_cache::Save(const std::string& filename, uint64_t key) const {
+  SdfCacheHeader header;
+  std::memset(&header, 0, sizeof(SdfCacheHeader));
+  std::memcpy(header.magic, kSdfCacheMagic, 8);
+  header.version = kSdfCacheVersion;
+  header.endian = kEndianCheck;
+  header.key = key;
+  header.float_size = sizeof(float);
+  for(int k = 0; k < 3; k++) {
+    header.origin[k] = origin[k];
+    header.cells[k] = cells[k];
+  }
+  header.cell_size = cell_size;
+  header.counts[0] = center_distance.size();
+  header.counts[1] = brick_index.size();
+  header.counts[2] = samples.size();
+
+  //Write to a temporary file and rename it into place, as with the mesh cache
+  std::ostringstream temp_name;
+  temp_name << filename << ".tmp" << std::hex << reinterpret_cast<uintptr_t>(this);
+  FILE* f = fopen(temp_name.str().c_str(), "wb");
+  if(!f) {
+    return(false);
+  }
+  fwrite(&header, sizeof(SdfCacheHeader), 1, f);
+  fwrite(center_distance.data(), sizeof(float), center_distance.size(), f);
+  fwrite(brick_index.data(), sizeof(uint32_t), brick_index.size(), f);
+  fwrite(samples.data(), sizeof(float), samples.size(), f);
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if(!ok || std::rename(temp_name.str().c_str(), filename.c_str()) != 0) {
+    std::remove(temp_name.str().c_str());
+    return(false);
+  }
+  return(true);
+}
@@ -0,0 +1,99 @@
+#ifndef SDFCACHEH
+#define SDFCACHEH
+
+#include "aabb.h"
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstdint>
+
+//Signed distance field baked into a sparse grid of bricks of kBrickSize^3 cells. Every brick
+//stores the distance at its center; bricks the surface may pass through also store the distance
+//at their (kBrickSize + 1)^3 corner samples for trilinear lookups. Bricks far from the surface
+//cost four bytes.
+//
+//The cache only returns lower bounds on the absolute distance, assuming the field grows no faster
+//than the distance to the surface (as sphere tracing already does): the brick center distance
+//minus the distance to the center, or the interpolated distance minus half the cell diagonal (the
+//largest trilinear weighted distance to the corners). Within a cell or so of the surface no bound is
+//returned and the caller evaluates the field exactly.
+class sdf_cache {
+public:
+  //Bakes `distance` over `bounds` with `resolution` cells along its longest axis
+  sdf_cache(const std::function<Float(const point3f&)>& distance, const aabb& bounds, int resolution,
+            int numbercores);
+  //Loads a baked field from `filename`, returning nullptr if it's missing or was baked with a different key
+  static std::shared_ptr<sdf_cache> Load(const std::string& filename, uint64_t key);
+  //Returns false if the file couldn't be written
+  bool Save(const std::string& filename, uint64_t key) const;
+
+  //Lower bound on the absolute distance at `p`, if `p` is inside the grid and not close to the surface
+  bool lower_bound(const point3f& p, Float& bound) const {
+    Float g[3];
+    for(int k = 0; k < 3; k++) {
+      g[k] = (p[k] - origin[k]) * inv_cell_size;
+      if(!(g[k] >= 0 && g[k] < cells[k])) {
+        return(false);
+      }
+    }
+    int b[3];
+    for(int k = 0; k < 3; k++) {
+      b[k] = static_cast<int>(g[k]) / kBrickSize;
+    }
+    size_t brick = b[0] + brick_dims[0] * (b[1] + static_cast<size_t>(brick_dims[1]) * b[2]);
+    uint32_t index = brick_index[brick];
+    Float d;
+    if(index == kFarBrick) {
+      vec3f offset((g[0] - (b[0] + 0.5f) * kBrickSize) * cell_size,
+                   (g[1] - (b[1] + 0.5f) * kBrickSize) * cell_size,
+                   (g[2] - (b[2] + 0.5f) * kBrickSize) * cell_size);
+      d = center_distance[brick] - offset.length();
+    } else {
+      const float* s = &samples[static_cast<size_t>(index) * kBrickSamples];
+      int c[3];
+      Float t[3];
+      for(int k = 0; k < 3; k++) {
+        Float local = g[k] - b[k] * kBrickSize;
+        c[k] = std::min(static_cast<int>(local), kBrickSize - 1);
+        t[k] = local - c[k];
+      }
+      const int sy = kBrickSize + 1, sz = sy * sy;
+      const float* s0 = s + c[0] + sy * c[1] + sz * c[2];
+      Float x00 = s0[0]       + t[0] * (s0[1]           - s0[0]);
+      Float x10 = s0[sy]      + t[0] * (s0[sy + 1]      - s0[sy]);
+      Float x01 = s0[sz]      + t[0] * (s0[sz + 1]      - s0[sz]);
+      Float x11 = s0[sy + sz] + t[0] * (s0[sy + sz + 1] - s0[sy + sz]);
+      Float y0 = x00 + t[1] * (x10 - x00);
+      Float y1 = x01 + t[1] * (x11 - x01);
+      d = std::fabs(y0 + t[2] * (y1 - y0)) - interpolation_error;
+    }
+    if(d < exact_distance) {
+      return(false);
+    }
+    bound = d;
+    return(true);
+  }
+  size_t memory_bytes() const;
+  size_t surface_bricks() const {
+    return(samples.size() / kBrickSamples);
+  }
+
+  static const int kBrickSize = 8;
+  static const size_t kBrickSamples = (kBrickSize + 1) * (kBrickSize + 1) * (kBrickSize + 1);
+  static const uint32_t kFarBrick = 0xFFFFFFFF;
+
+private:
+  sdf_cache() {}
+  void init_grid(const aabb& bounds, int resolution);
+  point3f origin;
+  Float cell_size, inv_cell_size, cell_diagonal, interpolation_error, exact_distance;
+  int cells[3];
+  int brick_dims[3];
+  //Absolute distance at each brick's center
+  std::vector<float> center_distance;
+  //Index of each brick's corner samples in `samples`, or kFarBrick
+  std::vector<uint32_t> brick_index;
+  std::vector<float> samples;
+};
+
+#endif
@@ -2,21 +2,62 @@
 
 // #include "RcppThread.h"
 
+//The fast path follows PBRT-v4: the discriminant is computed from the distance between the center
+//and the ray's closest approach, which avoids the cancellation in b^2 - 4ac for rays far from the
+//sphere, and the roots are compared to the ray's extent directly. Either way the hit point is
+//reprojected onto the sphere, so its error is bounded by gamma(5) * |p| without tracking the root's.
+bool sphere::solve_quadric(const ray& r, Float t_min, Float t_max, ray& r2, Float& t0, Float& t1,
+                           bool& t0_in_range, bool& t1_in_range) const {
+  if(robust_quadrics) {
+    vec3f oErr, dErr;
+    r2 = (*WorldToObject)(r, &oErr, &dErr);
+    // Initialize _EFloat_ ray coordinate values
+    EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
+    EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
+    EFloat a = dx * dx + dy * dy + dz * dz;
+    EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
+    EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
+    
+    // Solve quadratic equation for _t_ values
+    EFloat temp1, temp2;
+    if (!Quadratic(a, b, c, &temp1, &temp2)) {
+      return(false);
+    }
+    t0 = (Float)temp1;
+    t1 = (Float)temp2;
+    t0_in_range = temp1 < t_max && temp1 > t_min;
+    t1_in_range = temp2 < t_max && temp2 > t_min;
+    return(true);
+  }
+  r2 = (*WorldToObject)(r);
+  const vec3f o(r2.origin().x(), r2.origin().y(), r2.origin().z());
+  const vec3f d = r2.direction();
+  Float a = d.squared_length();
+  Float b = 2 * dot(d, o);
+  Float c = o.squared_length() - radius * radius;
+  //4a(r^2 - |o - (b / 2a) d|^2) == b^2 - 4ac
+  Float closest = (o - (b / (2 * a)) * d).length();
+  Float discrim = 4 * a * (radius + closest) * (radius - closest);
+  if(discrim < 0) {
+    return(false);
+  }
+  Float root_discrim = std::sqrt(discrim);
+  Float q = b < 0 ? -0.5f * (b - root_discrim) : -0.5f * (b + root_discrim);
+  t0 = q / a;
+  t1 = c / q;
+  if(t0 > t1) {
+    std::swap(t0, t1);
+  }
+  t0_in_range = t0 < t_max && t0 > t_min;
+  t1_in_range = t1 < t_max && t1 > t_min;
+  return(true);
+}
+
 bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  vec3f oErr, dErr;
-  ray r2 = (*WorldToObject)(r, &oErr, &dErr);
-  // Compute quadratic sphere coefficients
-  
-  // Initialize _EFloat_ ray coordinate values
-  EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
-  EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
-  EFloat a = dx * dx + dy * dy + dz * dz;
-  EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
-  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
-  
-  // Solve quadratic equation for _t_ values
-  EFloat temp1, temp2;
-  if (!Quadratic(a, b, c, &temp1, &temp2)) {
+  ray r2;
+  Float temp1, temp2;
+  bool first_in_range, second_in_range;
+  if(!solve_quadric(r, t_min, t_max, r2, temp1, temp2, first_in_range, second_in_range)) {
     return(false);
   }
   bool is_hit = true;
@@ -26,8 +67,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
   if(alpha_mask) {
     Float u;
     Float v;
-    if(temp1 < t_max && temp1 > t_min) {
-      point3f p1 = r2.point_at_parameter((Float)temp1);
+    if(first_in_range) {
+      point3f p1 = r2.point_at_parameter(temp1);
       p1 *= radius / p1.length(); 
       vec3f normal = (p1 - center) / radius;
       get_sphere_uv(normal, u, v);
@@ -35,8 +76,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
         is_hit = false;
       }
     }
-    if(temp2 < t_max && temp2 > t_min) {
-      point3f p2 = r2.point_at_parameter((Float)temp2);
+    if(second_in_range) {
+      point3f p2 = r2.point_at_parameter(temp2);
       p2 *= radius / p2.length(); 
       vec3f normal = (p2 - center) / radius;
       get_sphere_uv(normal, u, v);
@@ -48,8 +89,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
       } 
     }
   }
-  if(temp1 < t_max && temp1 > t_min && is_hit) {
-    rec.t = (Float)temp1;
+  if(first_in_range && is_hit) {
+    rec.t = temp1;
     rec.p = r2.point_at_parameter(rec.t);
     rec.p *= radius / rec.p.length(); 
     rec.normal = (rec.p - center) / radius;
@@ -81,8 +122,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
     rec.mat_ptr = mat_ptr.get();
     return(true);
   }
-  if(temp2 < t_max && temp2 > t_min && second_is_hit) {
-    rec.t = (Float)temp2;
+  if(second_in_range && second_is_hit) {
+    rec.t = temp2;
     rec.p = r2.point_at_parameter(rec.t);
     rec.p *= radius / rec.p.length();
     rec.normal = (rec.p - center) / radius;
@@ -125,20 +166,10 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
 
 
 bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  vec3f oErr, dErr;
-  ray r2 = (*WorldToObject)(r, &oErr, &dErr);
-  // Compute quadratic sphere coefficients
-  
-  // Initialize _EFloat_ ray coordinate values
-  EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
-  EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
-  EFloat a = dx * dx + dy * dy + dz * dz;
-  EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
-  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
-  
-  // Solve quadratic equation for _t_ values
-  EFloat temp1, temp2;
-  if (!Quadratic(a, b, c, &temp1, &temp2)) {
+  ray r2;
+  Float temp1, temp2;
+  bool first_in_range, second_in_range;
+  if(!solve_quadric(r, t_min, t_max, r2, temp1, temp2, first_in_range, second_in_range)) {
     return(false);
   }
   bool is_hit = true;
@@ -147,8 +178,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sample
   if(alpha_mask) {
     Float u;
     Float v;
-    if(temp1 < t_max && temp1 > t_min) {
-      point3f p1 = r2.point_at_parameter((Float)temp1);
+    if(first_in_range) {
+      point3f p1 = r2.point_at_parameter(temp1);
       p1 *= radius / p1.length(); 
       vec3f normal = (p1 - center) / radius;
       get_sphere_uv(normal, u, v);
@@ -156,8 +187,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sample
         is_hit = false;
       }
     }
-    if(temp2 < t_max && temp2 > t_min) {
-      point3f p2 = r2.point_at_parameter((Float)temp2);
+    if(second_in_range) {
+      point3f p2 = r2.point_at_parameter(temp2);
       p2 *= radius / p2.length(); 
       vec3f normal = (p2 - center) / radius;
       get_sphere_uv(normal, u, v);
@@ -169,8 +200,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sample
       } 
     }
   }
-  if(temp1 < t_max && temp1 > t_min && is_hit) {
-    rec.t = (Float)temp1;
+  if(first_in_range && is_hit) {
+    rec.t = temp1;
     rec.p = r2.point_at_parameter(rec.t);
     rec.p *= radius / rec.p.length(); 
     rec.normal = (rec.p - center) / radius;
@@ -203,8 +234,8 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sample
     rec.mat_ptr = mat_ptr.get();
     return(true);
   }
-  if(temp2 < t_max && temp2 > t_min && second_is_hit) {
-    rec.t = (Float)temp2;
+  if(second_in_range && second_is_hit) {
+    rec.t = temp2;
     rec.p = r2.point_at_parameter(rec.t);
     rec.p *= radius / rec.p.length();
     rec.normal = (rec.p - center) / radius;
@@ -14,10 +14,11 @@ class sphere: public hitable {
     ~sphere() {}
     sphere(vec3f cen, Float r, std::shared_ptr<material> mat, 
            std::shared_ptr<alpha_texture> alpha_mask, std::shared_ptr<bump_texture> bump_tex,
-           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : 
+           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+           bool robust_quadrics) : 
             hitable(ObjectToWorld, WorldToObject, reverseOrientation), 
             center(cen), radius(r), 
-            mat_ptr(mat), alpha_mask(alpha_mask), bump_tex(bump_tex) {};
+            mat_ptr(mat), alpha_mask(alpha_mask), bump_tex(bump_tex), robust_quadrics(robust_quadrics) {};
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
     
@@ -35,6 +36,14 @@ class sphere: public hitable {
     std::shared_ptr<material> mat_ptr;
     std::shared_ptr<alpha_texture> alpha_mask;
     std::shared_ptr<bump_texture> bump_tex;
+    //Solve the quadric in EFloat interval arithmetic, which also carries the error of transforming
+    //the ray into object space (render_scene(robust_quadrics = TRUE))
+    bool robust_quadrics;
+  private:
+    //Roots of the sphere's quadric for the world space ray `r`, and whether each lies in
+    //(t_min, t_max). `r2` is set to the object space ray.
+    bool solve_quadric(const ray& r, Float t_min, Float t_max, ray& r2, Float& t0, Float& t1,
+                       bool& t0_in_range, bool& t1_in_range) const;
 };
 
 #endif
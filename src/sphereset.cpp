@@ -0,0 +1,349 @@
+#include "sphereset.h"
+#include "bvhstats.h"
+#include "efloat.h"
+#include <algorithm>
+
+constexpr size_t kMaxLeafSpheres = kPacketWidth;
+
+sphere_set::sphere_set(const double* spheres, size_t num_spheres, std::shared_ptr<material> mat, int bvh_type,
+                       std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                       bool reverseOrientation, bool robust_quadrics) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), mat_ptr(mat), robust_quadrics(robust_quadrics),
+  count(num_spheres) {
+  std::vector<aabb> bounds(count);
+  for(size_t i = 0; i < count; i++) {
+    const double* s = spheres + 4 * i;
+    if(!std::isfinite(s[0]) || !std::isfinite(s[1]) || !std::isfinite(s[2]) || !(s[3] > 0) || !std::isfinite(s[3])) {
+      throw std::runtime_error("Invalid center or radius in sphere set (sphere " + std::to_string(i + 1) + ")");
+    }
+    vec3f r(s[3], s[3], s[3]);
+    bounds[i] = aabb(point3f(s[0], s[1], s[2]) - r, point3f(s[0], s[1], s[2]) + r);
+  }
+  std::vector<uint32_t> order(count);
+  for(size_t i = 0; i < count; i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  if(count > 0) {
+    nodes.reserve(2 * count / kMaxLeafSpheres + 1);
+    BuildCompactBVH(nodes, order, 0, count, kMaxLeafSpheres, bvh_type, 0,
+                    [&bounds](uint32_t sphere) {return(bounds[sphere]);});
+    nodes.shrink_to_fit();
+  }
+  //Store the spheres in leaf order, with three trailing lanes so the last leaf can be read whole
+  size_t padded = count + kPacketWidth - 1;
+  cx.assign(padded, 0);
+  cy.assign(padded, 0);
+  cz.assign(padded, 0);
+  radius.assign(padded, 0);
+  for(size_t i = 0; i < count; i++) {
+    const double* s = spheres + 4 * order[i];
+    cx[i] = static_cast<float>(s[0]);
+    cy[i] = static_cast<float>(s[1]);
+    cz[i] = static_cast<float>(s[2]);
+    radius[i] = static_cast<float>(s[3]);
+  }
+  Float sx = (*ObjectToWorld)(vec3f(1,0,0)).length();
+  Float sy = (*ObjectToWorld)(vec3f(0,1,0)).length();
+  Float sz = (*ObjectToWorld)(vec3f(0,0,1)).length();
+  radius_scale = std::cbrt(sx * sy * sz);
+}
+
+//Intersects all four lanes of a leaf at once and returns a bit mask of the spheres hit in
+//(t_min, t_max), with the nearer valid root of each in `t`. The discriminant is computed from the
+//distance between the center and the ray, which loses less precision than b^2 - 4ac for distant
+//or small spheres.
+int sphere_set::intersect_leaf(const compact_bvh_node& node, const point3f& o, const vec3f& d,
+                               Float t_min, Float t_max, Float* t) const {
+  const uint32_t first = node.offset;
+  const Float a = dot(d, d);
+  const Float inv_a = 1 / a;
+  int mask = 0;
+  for(int i = 0; i < kPacketWidth; i++) {
+    Float fx = o.x() - cx[first + i];
+    Float fy = o.y() - cy[first + i];
+    Float fz = o.z() - cz[first + i];
+    Float r2 = radius[first + i] * radius[first + i];
+    Float h = fx * d.x() + fy * d.y() + fz * d.z();
+    Float lx = fx - h * inv_a * d.x();
+    Float ly = fy - h * inv_a * d.y();
+    Float lz = fz - h * inv_a * d.z();
+    Float disc = a * (r2 - (lx * lx + ly * ly + lz * lz));
+    Float c = fx * fx + fy * fy + fz * fz - r2;
+    Float sq = std::sqrt(ffmax(disc, (Float)0));
+    Float q = h > 0 ? -(h + sq) : -(h - sq);
+    Float t0 = c / q;
+    Float t1 = q * inv_a;
+    if(t0 > t1) {
+      std::swap(t0, t1);
+    }
+    Float th = t0 > t_min ? t0 : t1;
+    t[i] = th;
+    bool hit = i < node.count && disc >= 0 && th > t_min && th < t_max;
+    mask |= static_cast<int>(hit) << i;
+  }
+  return(mask);
+}
+
+//The leaf test of `sphere`'s robust path: the quadratic is solved in EFloat with the error of the
+//object space ray, relative to each center, and a root is only accepted if its whole interval lies
+//in (t_min, t_max).
+int sphere_set::intersect_leaf_robust(const compact_bvh_node& node, const point3f& o, const vec3f& d,
+                                      const vec3f& oErr, const vec3f& dErr,
+                                      Float t_min, Float t_max, Float* t) const {
+  const uint32_t first = node.offset;
+  EFloat dx(d.x(), dErr.x()), dy(d.y(), dErr.y()), dz(d.z(), dErr.z());
+  EFloat a = dx * dx + dy * dy + dz * dz;
+  int mask = 0;
+  for(int i = 0; i < node.count; i++) {
+    EFloat fx = EFloat(o.x(), oErr.x()) - EFloat(cx[first + i]);
+    EFloat fy = EFloat(o.y(), oErr.y()) - EFloat(cy[first + i]);
+    EFloat fz = EFloat(o.z(), oErr.z()) - EFloat(cz[first + i]);
+    EFloat b = 2 * (dx * fx + dy * fy + dz * fz);
+    EFloat c = fx * fx + fy * fy + fz * fz - EFloat(radius[first + i]) * EFloat(radius[first + i]);
+    EFloat t0, t1;
+    if(!Quadratic(a, b, c, &t0, &t1)) {
+      continue;
+    }
+    if(t0 < t_max && t0 > t_min) {
+      t[i] = (Float)t0;
+    } else if(t1 < t_max && t1 > t_min) {
+      t[i] = (Float)t1;
+    } else {
+      continue;
+    }
+    mask |= 1 << i;
+  }
+  return(mask);
+}
+
+//Returns the index of the closest sphere hit in (t_min, t_max) by the object space ray `r`, or
+//`count` if there is none. `oErr` and `dErr` bound the error of `r`, and are only used with
+//`robust_quadrics`.
+uint32_t sphere_set::closest_hit(const ray& r, const vec3f& oErr, const vec3f& dErr,
+                                 Float t_min, Float t_max, Float& t) const {
+  uint32_t hit_sphere = static_cast<uint32_t>(count);
+  if(nodes.empty()) {
+    return(hit_sphere);
+  }
+  uint32_t stack[kTraversalStackSize];
+  int stack_size = 0;
+  uint32_t current = 0;
+  point3f o = r.origin();
+  vec3f d = r.direction();
+  uint64_t nodes_visited = 0, spheres_tested = 0;
+  while(true) {
+    const compact_bvh_node& node = nodes[current];
+    if(node_hit(node, r, o, t_min, t_max)) {
+      nodes_visited++;
+      if(node.count > 0) {
+        spheres_tested += node.count;
+        Float lane_t[kPacketWidth];
+        int hits = robust_quadrics ? intersect_leaf_robust(node, o, d, oErr, dErr, t_min, t_max, lane_t) :
+          intersect_leaf(node, o, d, t_min, t_max, lane_t);
+        for(int i = 0; hits != 0; i++, hits >>= 1) {
+          if((hits & 1) && lane_t[i] < t_max) {
+            hit_sphere = node.offset + i;
+            t_max = lane_t[i];
+            t = lane_t[i];
+          }
+        }
+        if(stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else if(r.sign[node.axis]) {
+        stack[stack_size++] = current + 1;
+        current = node.offset;
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if(stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::nodes_visited.fetch_add(nodes_visited, std::memory_order_relaxed);
+    TraversalStats::primitives_tested.fetch_add(spheres_tested, std::memory_order_relaxed);
+  }
+  return(hit_sphere);
+}
+
+//Fills in the record as `sphere` does, relative to the center of the sphere hit
+void sphere_set::fill_record(uint32_t index, const ray& r, Float t, hit_record& rec) const {
+  point3f center(cx[index], cy[index], cz[index]);
+  Float rad = radius[index];
+  vec3f offset = r.point_at_parameter(t) - center;
+  offset *= rad / offset.length();
+  rec.t = t;
+  rec.p = center + offset;
+  rec.normal = normal3f(offset / rad);
+
+  Float zRadius = std::sqrt(offset.x() * offset.x() + offset.z() * offset.z());
+  Float invZRadius = 1 / zRadius;
+  Float cosPhi = offset.x() * invZRadius;
+  Float sinPhi = offset.z() * invZRadius;
+  Float theta = std::acos(clamp(offset.z() / rad, -1, 1));
+  rec.dpdu = 2 * M_PI * vec3f(-offset.z(), 0, offset.x());
+  rec.dpdv = 2 * M_PI * vec3f(offset.z() * cosPhi, offset.z() * sinPhi, -rad * std::sin(theta));
+  get_sphere_uv(rec.normal, rec.u, rec.v);
+  rec.has_bump = false;
+  rec.pError = gamma(5) * (Abs(offset) + Abs(vec3f(center.x(), center.y(), center.z())));
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation ? -1 : 1;
+  rec.normal.make_unit_vector();
+  rec.shape = this;
+  rec.alpha_miss = false;
+  rec.mat_ptr = mat_ptr.get();
+}
+
+//Transforms the world space ray `r` into object space (with its error when `robust_quadrics` is
+//set) as `r2`, and returns the closest sphere it hits
+uint32_t sphere_set::transform_and_hit(const ray& r, Float t_min, Float t_max, ray& r2, Float& t) const {
+  vec3f oErr, dErr;
+  if(robust_quadrics) {
+    r2 = (*WorldToObject)(r, &oErr, &dErr);
+  } else {
+    r2 = (*WorldToObject)(r);
+  }
+  return(closest_hit(r2, oErr, dErr, t_min, t_max, t));
+}
+
+bool sphere_set::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2;
+  Float t;
+  uint32_t index = transform_and_hit(r, t_min, t_max, r2, t);
+  if(index == count) {
+    return(false);
+  }
+  fill_record(index, r2, t, rec);
+  return(true);
+}
+
+bool sphere_set::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r2;
+  Float t;
+  uint32_t index = transform_and_hit(r, t_min, t_max, r2, t);
+  if(index == count) {
+    return(false);
+  }
+  fill_record(index, r2, t, rec);
+  return(true);
+}
+
+bool sphere_set::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(nodes.empty()) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(aabb(nodes[0].bounds[0], nodes[0].bounds[1]));
+  return(true);
+}
+
+//Spheres are sampled by picking one uniformly and then a direction in the cone it subtends, as
+//`sphere` does, so the pdf is the mean of the cone pdfs of every sphere the ray passes through.
+Float sphere_set::set_pdf(const point3f& o, const vec3f& v) const {
+  if(nodes.empty()) {
+    return(0);
+  }
+  ray r2 = (*WorldToObject)(ray(o, v));
+  point3f o2 = r2.origin();
+  vec3f d2 = r2.direction();
+  Float a = dot(d2, d2);
+  uint32_t stack[kTraversalStackSize];
+  int stack_size = 0;
+  uint32_t current = 0;
+  Float sum = 0;
+  while(true) {
+    const compact_bvh_node& node = nodes[current];
+    if(node_hit(node, r2, o2, 0.001, FLT_MAX)) {
+      if(node.count > 0) {
+        for(uint32_t i = node.offset; i < node.offset + node.count; i++) {
+          vec3f f = o2 - point3f(cx[i], cy[i], cz[i]);
+          Float h = dot(f, d2);
+          Float disc = h * h - a * (dot(f, f) - radius[i] * radius[i]);
+          if(disc < 0 || (-h + std::sqrt(disc)) / a <= 0.001) {
+            continue;
+          }
+          point3f center = (*ObjectToWorld)(point3f(cx[i], cy[i], cz[i]));
+          Float world_radius = radius[i] * radius_scale;
+          Float sinThetaMax2 = world_radius * world_radius / DistanceSquared(o, center);
+          Float cosThetaMax = std::sqrt(std::fmax((Float)0, 1 - sinThetaMax2));
+          sum += UniformConePdf(cosThetaMax);
+        }
+        if(stack_size == 0) {
+          break;
+        }
+        current = stack[--stack_size];
+      } else {
+        stack[stack_size++] = node.offset;
+        current = current + 1;
+      }
+    } else {
+      if(stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+  return(sum / count);
+}
+
+Float sphere_set::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  return(set_pdf(o, v));
+}
+
+Float sphere_set::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  return(set_pdf(o, v));
+}
+
+vec3f sphere_set::sample_sphere(const point3f& o, Float r0, Float r1, Float r2) const {
+  uint32_t index = static_cast<uint32_t>(r0 * count * 0.99999999);
+  point3f pCenter = (*ObjectToWorld)(point3f(cx[index], cy[index], cz[index]));
+  Float world_radius = radius[index] * radius_scale;
+  vec3f wc = pCenter - o;
+  Float dc = wc.length();
+  Float invDc = 1 / dc;
+  wc *= invDc;
+
+  onb uvw;
+  uvw.build_from_w(wc);
+
+  Float sinThetaMax = world_radius * invDc;
+  Float sinThetaMax2 = sinThetaMax * sinThetaMax;
+  Float invSinThetaMax = 1 / sinThetaMax;
+  Float cosThetaMax = std::sqrt(std::fmax((Float)0.f, 1 - sinThetaMax2));
+  Float cosTheta  = (cosThetaMax - 1) * r1 + 1;
+  Float sinTheta2 = 1 - cosTheta * cosTheta;
+  if (sinThetaMax2 < 0.00068523f /* sin^2(1.5 deg) */) {
+    sinTheta2 = sinThetaMax2 * r1;
+    cosTheta = std::sqrt(1 - sinTheta2);
+  }
+  Float cosAlpha = sinTheta2 * invSinThetaMax +
+    cosTheta * std::sqrt(std::fmax((Float)0.f, 1.f - sinTheta2 * invSinThetaMax * invSinThetaMax));
+  Float sinAlpha = std::sqrt(std::fmax((Float)0.f, 1.f - cosAlpha*cosAlpha));
+  Float phi = r2 * 2 * M_PI;
+  vec3f nWorld = SphericalDirection(sinAlpha, cosAlpha, phi, -uvw.u(), -uvw.v(), -uvw.w());
+  point3f pWorld = pCenter + world_radius * point3f(nWorld.x(), nWorld.y(), nWorld.z());
+  return(pWorld - o);
+}
+
+vec3f sphere_set::random(const point3f& o, random_gen& rng, Float time) {
+  Float r0 = rng.unif_rand();
+  Float r1 = rng.unif_rand();
+  Float r2 = rng.unif_rand();
+  return(sample_sphere(o, r0, r1, r2));
+}
+
+vec3f sphere_set::random(const point3f& o, Sampler* sampler, Float time) {
+  Float r0 = sampler->Get1D();
+  vec2f u = sampler->Get2D();
+  return(sample_sphere(o, r0, u.x(), u.y()));
+}
+
+size_t sphere_set::memory_bytes() const {
+  return((cx.capacity() + cy.capacity() + cz.capacity() + radius.capacity()) * sizeof(float) +
+         nodes.capacity() * sizeof(compact_bvh_node));
+}
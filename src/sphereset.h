@@ -0,0 +1,61 @@
+#ifndef SPHERESETH
+#define SPHERESETH
+
+#include "hitable.h"
+#include "material.h"
+#include "compactmesh.h"
+#include <vector>
+#include <cstdint>
+
+//Set of spheres sharing one material and transform, for particle systems and point clouds. The
+//centers and radii are stored as structure-of-arrays floats (16 bytes per sphere) in BVH order, and
+//are traversed with a flat BVH whose leaves hold up to four spheres. A `sphere` object costs a
+//hitable, a material pointer and a BVH node per sphere instead. Intersection matches `sphere`
+//(spherical u/v, outward normals, the same EFloat path with `robust_quadrics`), without alpha or
+//bump textures.
+class sphere_set : public hitable {
+public:
+  //`spheres` holds four values (x, y, z and radius) per sphere, in object space
+  sphere_set(const double* spheres, size_t num_spheres, std::shared_ptr<material> mat, int bvh_type,
+             std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+             bool reverseOrientation, bool robust_quadrics);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+
+  virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  virtual Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  virtual vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  virtual vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+  virtual std::string GetName() const {
+    return(std::string("SphereSet"));
+  }
+  size_t num_spheres() const {
+    return(count);
+  }
+  //Bytes used by the sphere arrays and the BVH
+  size_t memory_bytes() const;
+
+  //Padded to a multiple of the leaf width, so a leaf can always be read as four lanes
+  std::vector<float> cx, cy, cz, radius;
+  std::vector<compact_bvh_node> nodes;
+  std::shared_ptr<material> mat_ptr;
+  bool robust_quadrics;
+
+private:
+  int intersect_leaf(const compact_bvh_node& node, const point3f& o, const vec3f& d,
+                     Float t_min, Float t_max, Float* t) const;
+  int intersect_leaf_robust(const compact_bvh_node& node, const point3f& o, const vec3f& d,
+                            const vec3f& oErr, const vec3f& dErr, Float t_min, Float t_max, Float* t) const;
+  uint32_t closest_hit(const ray& r, const vec3f& oErr, const vec3f& dErr,
+                       Float t_min, Float t_max, Float& t) const;
+  uint32_t transform_and_hit(const ray& r, Float t_min, Float t_max, ray& r2, Float& t) const;
+  void fill_record(uint32_t index, const ray& r, Float t, hit_record& rec) const;
+  Float set_pdf(const point3f& o, const vec3f& v) const;
+  vec3f sample_sphere(const point3f& o, Float r0, Float r1, Float r2) const;
+  size_t count;
+  //Factor converting object space radii to world space, assuming a uniform scale
+  Float radius_scale;
+};
+
+#endif
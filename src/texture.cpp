@@ -3,18 +3,20 @@
 point3f image_texture::value(Float u, Float v, const point3f& p) const {
   u = fmod(u * repeatu,1);
   v = fmod(v * repeatv,1);
+  int nx = mip->width();
+  int ny = mip->height();
   int i = u * nx;
   int j = (1-v) * ny;
   if (i < 0) i = 0;
   if (j < 0) j = 0;
   if (i > nx-1) i = nx-1;
   if (j > ny-1) j = ny-1;
-  Float r = data[channels*i + channels*nx*j] * intensity;
-  Float g = data[channels*i + channels*nx*j+1] * intensity;
-  Float b = data[channels*i + channels*nx*j+2] * intensity;
-  return(point3f(r,g,b));
+  return(mip->texel(0, i, j) * intensity);
 }
 
+point3f image_texture::filtered_value(Float u, Float v, const point3f& p, Float du, Float dv) const {
+  return(mip->lookup(u * repeatu, v * repeatv, du * repeatu, dv * repeatv) * intensity);
+}
 
 point3f triangle_image_texture::value(Float u, Float v, const point3f& p) const {
   Float uu = ((1 - u - v) * a_u + u * b_u + v * c_u);
@@ -23,16 +25,24 @@ point3f triangle_image_texture::value(Float u, Float v, const point3f& p) const
   while(vv < 0) vv += 1;
   while(uu > 1) uu -= 1;
   while(vv > 1) vv -= 1;
+  int nx = mip->width();
+  int ny = mip->height();
   int i = uu * nx;
   int j = (1-vv) * ny;
   if (i < 0) i = 0;
   if (j < 0) j = 0;
   if (i > nx-1) i = nx-1;
   if (j > ny-1) j = ny-1;
-  Float r = data[channels*i + channels*nx*j];
-  Float g = data[channels*i + channels*nx*j+1];
-  Float b = data[channels*i + channels*nx*j+2];
-  return(point3f(r,g,b));
+  return(mip->texel(0, i, j));
+}
+
+//(u, v) are barycentric, so the footprint is mapped through the triangle's texture coordinates
+point3f triangle_image_texture::filtered_value(Float u, Float v, const point3f& p, Float du, Float dv) const {
+  Float uu = ((1 - u - v) * a_u + u * b_u + v * c_u);
+  Float vv = ((1 - u - v) * a_v + u * b_v + v * c_v);
+  Float duu = std::fabs(b_u - a_u) * du + std::fabs(c_u - a_u) * dv;
+  Float dvv = std::fabs(b_v - a_v) * du + std::fabs(c_v - a_v) * dv;
+  return(mip->lookup(uu, vv, duu, dvv));
 }
 
 
@@ -43,7 +53,7 @@ point3f alpha_texture::value(Float u, Float v, const point3f& p) const {
   if (j < 0) j = 0;
   if (i > nx-1) i = nx-1;
   if (j > ny-1) j = ny-1;
-  Float r = data[channels*i + channels*nx*j];
+  Float r = image->value(i, j, 0);
   return(point3f(r,r,r));
 }
 
@@ -60,7 +70,7 @@ Float alpha_texture::channel_value(Float u, Float v, const point3f& p) const {
   if (j < 0) j = 0;
   if (i > nx-1) i = nx-1;
   if (j > ny-1) j = ny-1;
-  return(data[channels*i + channels*nx*j + 3]);
+  return(image->value(i, j, 3));
 }
 
 
@@ -75,8 +85,8 @@ point3f bump_texture::value(Float u, Float v, const point3f& p) const {
   if (j < 1) j = 1;
   if (i > nx-2) i = nx-2;
   if (j > ny-2) j = ny-2;
-  Float bu = (data[channels*(i+1) + channels*nx*j] - data[channels*(i-1) + channels*nx*j])/2;
-  Float bv = (data[channels*i + channels*nx*(j+1)] - data[channels*i + channels*nx*(j-1)])/2;
+  Float bu = (image->value(i+1, j, 0) - image->value(i-1, j, 0))/2;
+  Float bv = (image->value(i, j+1, 0) - image->value(i, j-1, 0))/2;
   return(point3f(intensity*bu,intensity*bv,0));
 }
 
@@ -93,8 +103,8 @@ point3f bump_texture::mesh_value(Float u, Float v, const point3f& p) const {
   if (j < 1) j = 1;
   if (i > nx-2) i = nx-2;
   if (j > ny-2) j = ny-2;
-  Float bu = (data[channels*(i+1) + channels*nx*j] - data[channels*(i-1) + channels*nx*j])/2;
-  Float bv = (data[channels*i + channels*nx*(j+1)] - data[channels*i + channels*nx*(j-1)])/2;
+  Float bu = (image->value(i+1, j, 0) - image->value(i-1, j, 0))/2;
+  Float bv = (image->value(i, j+1, 0) - image->value(i, j-1, 0))/2;
   return(point3f(intensity*bu,intensity*bv,0));
 }
 
@@ -105,8 +115,8 @@ point2f roughness_texture::value(Float u, Float v) const {
   if (j < 0) j = 0;
   if (i > nx-1) i = nx-1;
   if (j > ny-1) j = ny-1;
-  Float alphax = RoughnessToAlpha(data[channels*i + channels*nx*j]);
-  Float alphay = channels > 1 ? RoughnessToAlpha(data[channels*i + channels*nx*j+1]) : alphax;
+  Float alphax = RoughnessToAlpha(image->value(i, j, 0));
+  Float alphay = channels > 1 ? RoughnessToAlpha(image->value(i, j, 1)) : alphax;
   return(point2f(alphax * alphax, alphay * alphay));
 }
 
@@ -5,11 +5,17 @@
 #include "Rcpp.h"
 #include "point3.h"
 #include "mathinline.h"
+#include "mipmap.h"
 #include <memory>
 
 class texture {
 public: 
   virtual point3f value(Float u, Float v, const point3f& p) const = 0;
+  //Value averaged over a footprint `du` by `dv` wide in (u, v) around the lookup, for textures that
+  //can filter (see hit_record::du). Others ignore the footprint.
+  virtual point3f filtered_value(Float u, Float v, const point3f& p, Float du, Float dv) const {
+    return(value(u, v, p));
+  }
   virtual ~texture() {};
 };
 
@@ -100,11 +106,11 @@ public:
 class image_texture : public texture {
 public:
   image_texture() {}
-  image_texture(Float *pixels, int A, int B, int nn, Float repeatu, Float repeatv, Float intensity) : 
-    data(pixels), nx(A), ny(B), channels(nn), repeatu(repeatu), repeatv(repeatv), intensity(intensity) {}
+  image_texture(std::shared_ptr<mipmap> mip, Float repeatu, Float repeatv, Float intensity) : 
+    mip(mip), repeatu(repeatu), repeatv(repeatv), intensity(intensity) {}
   virtual point3f value(Float u, Float v, const point3f& p) const;
-  Float *data;
-  int nx, ny, channels;
+  virtual point3f filtered_value(Float u, Float v, const point3f& p, Float du, Float dv) const;
+  std::shared_ptr<mipmap> mip;
   Float repeatu, repeatv;
   Float intensity;
 };
@@ -124,17 +130,18 @@ class triangle_image_texture : public texture {
 public:
   triangle_image_texture() {}
   ~triangle_image_texture() {}
-  triangle_image_texture(Float *pixels, int A, int B, int nn,
+  //The pyramid is shared by all the triangles using the image
+  triangle_image_texture(std::shared_ptr<mipmap> mip,
                          Float tex_u_a, Float tex_v_a,
                          Float tex_u_b, Float tex_v_b,
-                         Float tex_u_c, Float tex_v_c) : data(pixels),  nx(A), ny(B), channels(nn),
+                         Float tex_u_c, Float tex_v_c) : mip(mip),
                          a_u(tex_u_a), a_v(tex_v_a), 
                          b_u(tex_u_b), b_v(tex_v_b), 
                          c_u(tex_u_c), c_v(tex_v_c) {}
   virtual point3f value(Float u, Float v, const point3f& p) const;
+  virtual point3f filtered_value(Float u, Float v, const point3f& p, Float du, Float dv) const;
   
-  Float *data;
-  int nx, ny, channels;
+  std::shared_ptr<mipmap> mip;
   Float a_u, a_v, b_u, b_v, c_u, c_v;
 };
 
@@ -159,15 +166,16 @@ public:
 class alpha_texture {
 public:
   alpha_texture() {}
-  alpha_texture(Float *pixels, int A, int B, int nn) : data(pixels), nx(A), ny(B), channels(nn) {
+  alpha_texture(std::shared_ptr<image_data> image) : image(image), nx(image->nx), ny(image->ny), 
+    channels(image->channels) {
     u_vec = vec3f(0,1,0);
     v_vec = vec3f(0,0,1);
   }
-  alpha_texture(Float *pixels, int A, int B, int nn, vec3f u, vec3f v) : 
-                data(pixels), nx(A), ny(B), channels(nn), u_vec(u), v_vec(v) {}
+  alpha_texture(std::shared_ptr<image_data> image, vec3f u, vec3f v) : 
+                image(image), nx(image->nx), ny(image->ny), channels(image->channels), u_vec(u), v_vec(v) {}
   point3f value(Float u, Float v, const point3f& p) const;
   Float channel_value(Float u, Float v, const point3f& p) const;
-  Float *data;
+  std::shared_ptr<image_data> image;
   int nx, ny, channels;
   vec3f u_vec, v_vec;
 };
@@ -176,16 +184,17 @@ public:
 class bump_texture {
 public:
   bump_texture() {}
-  bump_texture(Float *pixels, int A, int B, int nn, Float intensity) : 
-    data(pixels), nx(A), ny(B), channels(nn), intensity(intensity) { 
+  bump_texture(std::shared_ptr<image_data> image, Float intensity) : 
+    image(image), nx(image->nx), ny(image->ny), channels(image->channels), intensity(intensity) { 
     u_vec = vec3f(0,1,0);
     v_vec = vec3f(0,0,1);
   }
-  bump_texture(Float *pixels, int A, int B, int nn, vec3f u, vec3f v, Float intensity) : 
-    data(pixels), nx(A), ny(B), channels(nn), u_vec(u), v_vec(v), intensity(intensity) {}
+  bump_texture(std::shared_ptr<image_data> image, vec3f u, vec3f v, Float intensity) : 
+    image(image), nx(image->nx), ny(image->ny), channels(image->channels), u_vec(u), v_vec(v), 
+    intensity(intensity) {}
   point3f value(Float u, Float v, const point3f& p) const;
   point3f mesh_value(Float u, Float v, const point3f& p) const;
-  Float *data;
+  std::shared_ptr<image_data> image;
   int nx, ny, channels;
   vec3f u_vec, v_vec;
   Float intensity;
@@ -194,10 +203,11 @@ public:
 class roughness_texture {
 public:
   roughness_texture() {}
-  roughness_texture(Float *pixels, int A, int B, int nn) : data(pixels), nx(A), ny(B), channels(nn) {};
+  roughness_texture(std::shared_ptr<image_data> image) : image(image), nx(image->nx), ny(image->ny), 
+    channels(image->channels) {};
   point2f value(Float u, Float v) const;
   static Float RoughnessToAlpha(Float roughness);
-  Float *data;
+  std::shared_ptr<image_data> image;
   int nx, ny, channels;
   vec3f u_vec, v_vec;
 };
@@ -0,0 +1,445 @@
+#include "texturecache.h"
+#include "mipmap.h"
+#include "mappedfile.h"
+#include "stb_image.h"
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define RAY_HAS_PREAD
+#endif
+
+const int tiled_image::kTileSize;
+
+size_t texture_cache::budget = 0;
+std::string texture_cache::directory;
+std::atomic<uint64_t> texture_cache::next_id(1);
+std::atomic<uint64_t> texture_cache::resident_bytes(0);
+std::atomic<uint64_t> texture_cache::pinned_bytes(0);
+std::atomic<uint64_t> texture_cache::tile_reads(0);
+std::atomic<uint64_t> texture_cache::peak_bytes(0);
+
+//Bump when the layout of the tile files changes
+static const uint32_t kTileFileVersion = 2;
+static const char kTileFileMagic[8] = {'R','A','Y','T','I','L','E','\0'};
+
+struct TileFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t value_size;
+  uint64_t key;
+  int32_t nx, ny, channels, tile_size;
+};
+
+namespace {
+
+struct cached_tile {
+  uint64_t key;
+  uint64_t image_id;
+  size_t bytes;
+  std::unique_ptr<char[]> data;
+};
+
+struct cache_shard {
+  std::mutex mutex;
+  std::list<cached_tile> lru;
+  std::unordered_map<uint64_t, std::list<cached_tile>::iterator> index;
+  size_t bytes = 0;
+};
+
+const size_t kShards = 16;
+cache_shard shards[kShards];
+
+void RemoveTile(cache_shard& shard, std::list<cached_tile>::iterator it) {
+  shard.bytes -= it->bytes;
+  shard.index.erase(it->key);
+  shard.lru.erase(it);
+}
+
+}
+
+tiled_image::tiled_image(const std::string& filename) : filename(filename), fd(-1) {
+  int nx, ny, nn;
+  if(!stbi_info(filename.c_str(), &nx, &ny, &nn) || nx <= 0 || ny <= 0) {
+    throw std::runtime_error("Could not read texture " + filename);
+  }
+  stored_channels = nn >= 3 ? 3 : 1;
+  tile_values = static_cast<size_t>(kTileSize) * kTileSize * stored_channels;
+  value_size = sizeof(uint16_t);
+  num_tiles = 0;
+  while(true) {
+    level l;
+    l.nx = nx;
+    l.ny = ny;
+    l.tiles_x = (nx + kTileSize - 1) / kTileSize;
+    l.tiles_y = (ny + kTileSize - 1) / kTileSize;
+    l.first_tile = num_tiles;
+    num_tiles += static_cast<size_t>(l.tiles_x) * l.tiles_y;
+    level_info.push_back(l);
+    if(nx == 1 && ny == 1) {
+      break;
+    }
+    nx = std::max(nx / 2, 1);
+    ny = std::max(ny / 2, 1);
+  }
+  id = texture_cache::next_id++;
+}
+
+tiled_image::~tiled_image() {
+  texture_cache::Evict(this);
+  close_tiles();
+  if(!pinned.empty()) {
+    const size_t bytes = pinned.size();
+    texture_cache::pinned_bytes.fetch_sub(bytes);
+    texture_cache::resident_bytes.fetch_sub(bytes);
+  }
+}
+
+point3f tiled_image::texel(int lvl, int x, int y) {
+  const level& l = level_info[lvl];
+  size_t tile = l.first_tile + x / kTileSize + static_cast<size_t>(l.tiles_x) * (y / kTileSize);
+  size_t offset = stored_channels * (x % kTileSize + static_cast<size_t>(kTileSize) * (y % kTileSize));
+  float c[3];
+  if(!pinned.empty()) {
+    for(int i = 0; i < stored_channels; i++) {
+      c[i] = tile_value(&pinned[tile * tile_bytes()], offset + i);
+    }
+  } else {
+    texture_cache::Fetch(this, tile, offset, stored_channels, c);
+  }
+  if(stored_channels == 3) {
+    return(point3f(c[0], c[1], c[2]));
+  }
+  return(point3f(c[0], c[0], c[0]));
+}
+
+static inline void StoreTileValue(float f, uint16_t& out) {
+  out = FloatToHalf(f);
+}
+
+static inline void StoreTileValue(float f, float& out) {
+  out = f;
+}
+
+//Cuts every level of the pyramid built from `pixels` into tiles of `T` values (padded with zeros
+//past the image edge) and passes them to `sink` in file order
+template<class T, class Sink>
+static void BuildTiles(const float* pixels, int nx, int ny, int nn, int channels, Sink& sink) {
+  const int ts = tiled_image::kTileSize;
+  std::vector<T> tile(static_cast<size_t>(ts) * ts * channels);
+  std::vector<float> current, coarser;
+  const float* data = pixels;
+  int data_channels = nn;
+  while(true) {
+    for(int ty = 0; ty < (ny + ts - 1) / ts; ty++) {
+      for(int tx = 0; tx < (nx + ts - 1) / ts; tx++) {
+        std::fill(tile.begin(), tile.end(), 0);
+        for(int y = 0; y < ts && ty * ts + y < ny; y++) {
+          for(int x = 0; x < ts && tx * ts + x < nx; x++) {
+            const float* f = data + data_channels * (tx * ts + x + static_cast<size_t>(nx) * (ty * ts + y));
+            for(int c = 0; c < channels; c++) {
+              StoreTileValue(f[c], tile[channels * (x + static_cast<size_t>(ts) * y) + c]);
+            }
+          }
+        }
+        sink(reinterpret_cast<const char*>(tile.data()), tile.size() * sizeof(T));
+      }
+    }
+    if(nx == 1 && ny == 1) {
+      break;
+    }
+    int cx = std::max(nx / 2, 1);
+    int cy = std::max(ny / 2, 1);
+    coarser.resize(static_cast<size_t>(cx) * cy * channels);
+    const int fine_nx = nx, fine_channels = data_channels;
+    mipmap::Downsample([data, fine_nx, fine_channels](int x, int y, int c) {
+                         return(data[fine_channels * (x + static_cast<size_t>(fine_nx) * y) + c]);
+                       }, nx, ny, coarser.data(), cx, cy, channels);
+    current.swap(coarser);
+    data = current.data();
+    data_channels = channels;
+    nx = cx;
+    ny = cy;
+  }
+}
+
+struct TileFileSink {
+  FILE* f;
+  void operator()(const char* tile, size_t bytes) {
+    fwrite(tile, 1, bytes, f);
+  }
+};
+
+struct TileMemorySink {
+  std::vector<char>* tiles;
+  void operator()(const char* tile, size_t bytes) {
+    tiles->insert(tiles->end(), tile, tile + bytes);
+  }
+};
+
+template<class Sink>
+static void BuildTiles(const float* pixels, int nx, int ny, int nn, int channels, size_t value_size, Sink& sink) {
+  if(value_size == sizeof(uint16_t)) {
+    BuildTiles<uint16_t>(pixels, nx, ny, nn, channels, sink);
+  } else {
+    BuildTiles<float>(pixels, nx, ny, nn, channels, sink);
+  }
+}
+
+void tiled_image::convert() {
+  uint64_t key = kTileFileVersion;
+  {
+    MappedFile source(filename);
+    if(source.valid()) {
+      key = HashCombine(HashBytes(source.data(), source.size()), kTileFileVersion);
+    }
+  }
+  std::ostringstream tile_name;
+  tile_name << texture_cache::directory << "/texture_" << std::hex << key << ".tiles";
+  if(open_tiles(tile_name.str(), key)) {
+    return;
+  }
+  int nx, ny, nn;
+  float* pixels = stbi_loadf(filename.c_str(), &nx, &ny, &nn, 0);
+  if(!pixels || nx != level_info[0].nx || ny != level_info[0].ny) {
+    //The file changed or broke since its header was read
+    if(pixels) {
+      stbi_image_free(pixels);
+    }
+    throw std::runtime_error("Could not decode texture " + filename);
+  }
+  //Coarser levels are averages, so they fit in halves whenever the full image does
+  value_size = sizeof(uint16_t);
+  for(size_t i = 0; i < static_cast<size_t>(nx) * ny * nn; i++) {
+    if(!FitsHalf(pixels[i])) {
+      value_size = sizeof(float);
+      break;
+    }
+  }
+  if(write_tiles(tile_name.str(), key, pixels, nn) && open_tiles(tile_name.str(), key)) {
+    stbi_image_free(pixels);
+    return;
+  }
+  //No usable cache directory: keep the tiles in memory, as long as they fit in the budget
+  const size_t bytes = num_tiles * tile_bytes();
+  const uint64_t pinned_total = texture_cache::pinned_bytes.fetch_add(bytes) + bytes;
+  if(pinned_total > texture_cache::budget) {
+    texture_cache::pinned_bytes.fetch_sub(bytes);
+    stbi_image_free(pixels);
+    std::ostringstream message;
+    message << "Could not write the tiles of texture " << filename << " to " << texture_cache::directory <<
+      ", and keeping them in memory would exceed `texture_memory` (" <<
+      pinned_total / (1024.0 * 1024.0) << " MB needed)";
+    throw std::runtime_error(message.str());
+  }
+  pinned.reserve(bytes);
+  TileMemorySink sink = {&pinned};
+  BuildTiles(pixels, nx, ny, nn, stored_channels, value_size, sink);
+  stbi_image_free(pixels);
+  uint64_t resident = texture_cache::resident_bytes.fetch_add(bytes) + bytes;
+  uint64_t peak = texture_cache::peak_bytes.load(std::memory_order_relaxed);
+  while(resident > peak && !texture_cache::peak_bytes.compare_exchange_weak(peak, resident, std::memory_order_relaxed)) {}
+}
+
+bool tiled_image::write_tiles(const std::string& tile_filename, uint64_t key, const float* pixels, int nn) {
+  TileFileHeader header;
+  std::memset(&header, 0, sizeof(TileFileHeader));
+  std::memcpy(header.magic, kTileFileMagic, 8);
+  header.version = kTileFileVersion;
+  header.value_size = static_cast<uint32_t>(value_size);
+  header.key = key;
+  header.nx = level_info[0].nx;
+  header.ny = level_info[0].ny;
+  header.channels = stored_channels;
+  header.tile_size = kTileSize;
+  //Write to a temporary file and rename it into place, as with the mesh cache
+  std::ostringstream temp_name;
+  temp_name << tile_filename << ".tmp" << std::hex << reinterpret_cast<uintptr_t>(this);
+  FILE* f = fopen(temp_name.str().c_str(), "wb");
+  if(!f) {
+    return(false);
+  }
+  fwrite(&header, sizeof(TileFileHeader), 1, f);
+  TileFileSink sink = {f};
+  BuildTiles(pixels, level_info[0].nx, level_info[0].ny, nn, stored_channels, value_size, sink);
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if(!ok || std::rename(temp_name.str().c_str(), tile_filename.c_str()) != 0) {
+    std::remove(temp_name.str().c_str());
+    //Another process may have renamed the same tiles into place first
+    return(false);
+  }
+  return(true);
+}
+
+bool tiled_image::open_tiles(const std::string& tile_filename, uint64_t key) {
+  uint64_t size;
+#ifdef RAY_HAS_PREAD
+  fd = open(tile_filename.c_str(), O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) != 0) {
+    close_tiles();
+    return(false);
+  }
+  size = static_cast<uint64_t>(st.st_size);
+#else
+  file.open(tile_filename.c_str(), std::ios::binary | std::ios::ate);
+  if(!file) {
+    file.clear();
+    return(false);
+  }
+  size = static_cast<uint64_t>(file.tellg());
+#endif
+  TileFileHeader header;
+  bool ok = read_at(0, reinterpret_cast<char*>(&header), sizeof(TileFileHeader)) &&
+    std::memcmp(header.magic, kTileFileMagic, 8) == 0 && header.version == kTileFileVersion &&
+    (header.value_size == sizeof(uint16_t) || header.value_size == sizeof(float)) && header.key == key &&
+    header.nx == level_info[0].nx && header.ny == level_info[0].ny &&
+    header.channels == stored_channels && header.tile_size == kTileSize &&
+    size == sizeof(TileFileHeader) + num_tiles * tile_values * header.value_size;
+  if(!ok) {
+    close_tiles();
+    return(false);
+  }
+  value_size = header.value_size;
+  return(true);
+}
+
+void tiled_image::close_tiles() {
+#ifdef RAY_HAS_PREAD
+  if(fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+#else
+  file.close();
+  file.clear();
+#endif
+}
+
+bool tiled_image::read_at(uint64_t offset, char* out, size_t size) {
+#ifdef RAY_HAS_PREAD
+  while(size > 0) {
+    ssize_t n = pread(fd, out, size, static_cast<off_t>(offset));
+    if(n <= 0) {
+      return(false);
+    }
+    out += n;
+    offset += static_cast<uint64_t>(n);
+    size -= static_cast<size_t>(n);
+  }
+  return(true);
+#else
+  std::lock_guard<std::mutex> lock(file_mutex);
+  file.seekg(static_cast<std::streamoff>(offset));
+  if(!file.read(out, static_cast<std::streamsize>(size))) {
+    file.clear();
+    return(false);
+  }
+  return(true);
+#endif
+}
+
+void tiled_image::read_tile(size_t tile, char* out) {
+  const uint64_t offset = sizeof(TileFileHeader) + static_cast<uint64_t>(tile) * tile_bytes();
+  if(!read_at(offset, out, tile_bytes())) {
+    std::fill(out, out + tile_bytes(), 0);
+  }
+}
+
+void texture_cache::Configure(size_t budget_bytes, const std::string& dir) {
+  budget = budget_bytes;
+  directory = dir;
+  tile_reads = 0;
+  peak_bytes = resident_bytes.load();
+}
+
+std::shared_ptr<tiled_image> texture_cache::Open(const std::string& filename) {
+  std::shared_ptr<tiled_image> image = std::make_shared<tiled_image>(filename);
+  image->convert();
+  return(image);
+}
+
+void texture_cache::Clear() {
+  for(size_t i = 0; i < kShards; i++) {
+    std::lock_guard<std::mutex> lock(shards[i].mutex);
+    shards[i].lru.clear();
+    shards[i].index.clear();
+    shards[i].bytes = 0;
+  }
+  //Pinned tiles belong to their images and are released with them
+  resident_bytes = pinned_bytes.load();
+  budget = 0;
+}
+
+void texture_cache::Fetch(tiled_image* image, size_t tile, size_t offset, int count, float* out) {
+  const uint64_t key = (image->id << 40) | tile;
+  cache_shard& shard = shards[HashCombine(0, key) % kShards];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if(it != shard.index.end()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      for(int i = 0; i < count; i++) {
+        out[i] = image->tile_value(it->second->data.get(), offset + i);
+      }
+      return;
+    }
+  }
+  //Read outside the shard lock, so other threads' hits aren't held up by the disk
+  std::unique_ptr<char[]> data(new char[image->tile_bytes()]);
+  image->read_tile(tile, data.get());
+  for(int i = 0; i < count; i++) {
+    out[i] = image->tile_value(data.get(), offset + i);
+  }
+  tile_reads.fetch_add(1, std::memory_order_relaxed);
+
+  const size_t bytes = image->tile_bytes();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if(shard.index.find(key) != shard.index.end()) {
+    return;
+  }
+  cached_tile entry;
+  entry.key = key;
+  entry.image_id = image->id;
+  entry.bytes = bytes;
+  entry.data = std::move(data);
+  shard.lru.push_front(std::move(entry));
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += bytes;
+  uint64_t resident = resident_bytes.fetch_add(bytes) + bytes;
+  //Pinned tiles take their share of the budget first, and every shard keeps at least the tile
+  //just read
+  const size_t pinned = std::min<size_t>(pinned_bytes.load(std::memory_order_relaxed), budget);
+  const size_t shard_budget = std::max((budget - pinned) / kShards, bytes);
+  while(shard.bytes > shard_budget && shard.lru.size() > 1) {
+    auto last = std::prev(shard.lru.end());
+    resident_bytes.fetch_sub(last->bytes);
+    resident -= last->bytes;
+    RemoveTile(shard, last);
+  }
+  uint64_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while(resident > peak && !peak_bytes.compare_exchange_weak(peak, resident, std::memory_order_relaxed)) {}
+}
+
+void texture_cache::Evict(const tiled_image* image) {
+  for(size_t i = 0; i < kShards; i++) {
+    cache_shard& shard = shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for(auto it = shard.lru.begin(); it != shard.lru.end();) {
+      auto next = std::next(it);
+      if(it->image_id == image->id) {
+        resident_bytes.fetch_sub(it->bytes);
+        RemoveTile(shard, it);
+      }
+      it = next;
+    }
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef TEXTURECACHEH
+#define TEXTURECACHEH
+
+#include "point3.h"
+#include "mathinline.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+//Image whose mip pyramid lives on disk as fixed-size tiles of half floats (or floats, for high
+//dynamic range images with values past the half range), paged into memory
+//through texture_cache. texture_cache::Open() decodes the file, builds the pyramid (box filtered,
+//as in mipmap) and writes its tiles to the cache directory, after which the decoded image is
+//released and only tile reads happen during rendering. Tile files are keyed by the contents of
+//the source file, so later renders with the same directory skip the decode.
+class tiled_image {
+public:
+  //Throws if the image's header can't be read
+  tiled_image(const std::string& filename);
+  ~tiled_image();
+
+  //RGB of a texel (x and y must be within the level); single-channel images are read as gray
+  point3f texel(int level, int x, int y);
+  int levels() const {
+    return(static_cast<int>(level_info.size()));
+  }
+  int width(int level) const {
+    return(level_info[level].nx);
+  }
+  int height(int level) const {
+    return(level_info[level].ny);
+  }
+  //Channels kept per texel: three for color images, one for gray ones
+  int channels() const {
+    return(stored_channels);
+  }
+
+  static const int kTileSize = 64;
+
+private:
+  friend class texture_cache;
+  tiled_image(const tiled_image&);
+  tiled_image& operator=(const tiled_image&);
+  void convert();
+  bool write_tiles(const std::string& tile_filename, uint64_t key, const float* pixels, int nn);
+  bool open_tiles(const std::string& tile_filename, uint64_t key);
+  //Reads a tile into `out` (tile_bytes() bytes)
+  void read_tile(size_t tile, char* out);
+  //Reads `size` bytes at `offset` in the tile file
+  bool read_at(uint64_t offset, char* out, size_t size);
+  void close_tiles();
+
+  size_t tile_bytes() const {
+    return(tile_values * value_size);
+  }
+  //Value `i` of a tile read by read_tile()
+  float tile_value(const char* tile, size_t i) const {
+    if(value_size == sizeof(uint16_t)) {
+      uint16_t h;
+      std::memcpy(&h, tile + i * sizeof(uint16_t), sizeof(uint16_t));
+      return(HalfToFloat(h));
+    }
+    float f;
+    std::memcpy(&f, tile + i * sizeof(float), sizeof(float));
+    return(f);
+  }
+
+  struct level {
+    int nx, ny, tiles_x, tiles_y;
+    size_t first_tile;
+  };
+  std::string filename;
+  std::vector<level> level_info;
+  int stored_channels;
+  size_t tile_values;
+  //Bytes per stored value: two for halves, four for floats
+  size_t value_size;
+  size_t num_tiles;
+  uint64_t id;
+  //Tile file. Where pread() is available the descriptor is shared by all threads, so misses on
+  //different tiles are read concurrently; elsewhere reads go through one stream under a lock.
+  int fd;
+  std::mutex file_mutex;
+  std::ifstream file;
+  //Tiles kept in memory when the tile file couldn't be written, counted against the budget
+  std::vector<char> pinned;
+};
+
+//Process-wide cache of tiled_image tiles, split into shards with their own lock and
+//least-recently-used list so render threads rarely contend. Each shard holds at most its share
+//of the memory budget, evicting its least recently used tiles as new ones are read.
+class texture_cache {
+public:
+  //A zero budget disables the cache, in which case textures are decoded eagerly into memory
+  static void Configure(size_t budget_bytes, const std::string& directory);
+  static bool enabled() {
+    return(budget > 0);
+  }
+  //Opens and converts an image. This is the slow part (a full decode the first time a file is
+  //seen), so it's called while the scene is set up rather than from render threads. Throws if the
+  //image can't be decoded, or if its tiles can't be written and holding them in memory instead
+  //would exceed the budget.
+  static std::shared_ptr<tiled_image> Open(const std::string& filename);
+  //Drops all resident tiles and disables the cache
+  static void Clear();
+
+  static std::atomic<uint64_t> tile_reads;
+  static std::atomic<uint64_t> peak_bytes;
+
+private:
+  friend class tiled_image;
+  //Converts `count` values starting at `offset` from a tile of `image` into `out`, reading the
+  //tile if it isn't resident
+  static void Fetch(tiled_image* image, size_t tile, size_t offset, int count, float* out);
+  static void Evict(const tiled_image* image);
+  static size_t budget;
+  static std::string directory;
+  static std::atomic<uint64_t> next_id;
+  static std::atomic<uint64_t> resident_bytes;
+  static std::atomic<uint64_t> pinned_bytes;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "textureregistry.h"
+#include "mipmap.h"
+#include "stb_image.h"
+#include <unordered_map>
+#include <mutex>
+#include <future>
+#include <sstream>
+#include <vector>
+
+image_data::image_data(unsigned char* pixels, int nx, int ny, int channels, Float gamma) :
+  nx(nx), ny(ny), channels(channels), bytes(pixels), halves(nullptr), floats(nullptr) {
+  alpha_channel = channels % 2 == 0 ? channels - 1 : -1;
+  //The same conversions stbi_loadf() applies
+  for(int i = 0; i < 256; i++) {
+    lut[0][i] = std::pow(i / 255.0f, gamma);
+    lut[1][i] = i / 255.0f;
+  }
+}
+
+image_data::image_data(const Float* pixels, int nx, int ny, int channels) :
+  nx(nx), ny(ny), channels(channels), bytes(nullptr), halves(nullptr), floats(nullptr), alpha_channel(-1) {
+  size_t count = static_cast<size_t>(nx) * ny * channels;
+  bool fits_half = true;
+  for(size_t i = 0; i < count && fits_half; i++) {
+    fits_half = FitsHalf(pixels[i]);
+  }
+  if(!fits_half) {
+    floats = static_cast<float*>(malloc(count * sizeof(float)));
+    for(size_t i = 0; i < count; i++) {
+      floats[i] = pixels[i];
+    }
+    return;
+  }
+  halves = static_cast<uint16_t*>(malloc(count * sizeof(uint16_t)));
+  for(size_t i = 0; i < count; i++) {
+    halves[i] = FloatToHalf(pixels[i]);
+  }
+}
+
+image_data::~image_data() {
+  free(bytes);
+  free(halves);
+  free(floats);
+}
+
+size_t image_data::memory_bytes() const {
+  size_t count = static_cast<size_t>(nx) * ny * channels;
+  return(bytes ? count : count * (halves ? sizeof(uint16_t) : sizeof(float)));
+}
+
+constexpr Float texture_registry::kColorGamma;
+std::atomic<size_t> texture_registry::images_loaded(0);
+std::atomic<size_t> texture_registry::images_requested(0);
+
+namespace {
+
+//Entries that are ready, and the ones some thread is loading
+template<class Key, class T>
+struct entry_table {
+  std::unordered_map<Key, std::weak_ptr<T> > ready;
+  std::unordered_map<Key, std::shared_future<std::shared_ptr<T> > > loading;
+};
+
+std::mutex registry_mutex;
+entry_table<std::string, image_data> decoded;
+entry_table<std::string, mipmap> tiled;
+entry_table<const image_data*, mipmap> pyramids;
+
+//Absolute path with links and relative components resolved, so different spellings of a
+//path share an entry
+std::string CanonicalPath(const std::string& filename) {
+#ifdef _WIN32
+  char full[_MAX_PATH];
+  if(_fullpath(full, filename.c_str(), _MAX_PATH)) {
+    return(std::string(full));
+  }
+#else
+  char* full = realpath(filename.c_str(), nullptr);
+  if(full) {
+    std::string path(full);
+    free(full);
+    return(path);
+  }
+#endif
+  return(filename);
+}
+
+//Returns the entry for `key`, calling `load()` to create it unless it exists. Loading happens
+//outside the registry lock, so different images decode concurrently, while threads asking for an
+//image that's being loaded wait for that load instead of repeating it.
+template<class Key, class T, class Load>
+std::shared_ptr<T> FindOrLoad(entry_table<Key, T>& table, const Key& key, Load load) {
+  std::unique_lock<std::mutex> lock(registry_mutex);
+  auto it = table.ready.find(key);
+  if(it != table.ready.end()) {
+    std::shared_ptr<T> entry = it->second.lock();
+    if(entry) {
+      return(entry);
+    }
+  }
+  auto pending = table.loading.find(key);
+  if(pending != table.loading.end()) {
+    std::shared_future<std::shared_ptr<T> > result = pending->second;
+    lock.unlock();
+    return(result.get());
+  }
+  std::promise<std::shared_ptr<T> > promise;
+  table.loading[key] = promise.get_future().share();
+  lock.unlock();
+  std::shared_ptr<T> entry;
+  try {
+    entry = load();
+  } catch(...) {
+    lock.lock();
+    table.loading.erase(key);
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+  lock.lock();
+  table.loading.erase(key);
+  if(entry) {
+    table.ready[key] = entry;
+  }
+  promise.set_value(entry);
+  return(entry);
+}
+
+std::shared_ptr<image_data> LoadImage(const std::string& filename, Float gamma) {
+  std::ostringstream key;
+  key << CanonicalPath(filename) << "|gamma=" << gamma;
+  return(FindOrLoad(decoded, key.str(), [&filename, gamma]() -> std::shared_ptr<image_data> {
+    int nx, ny, nn;
+    std::shared_ptr<image_data> image;
+    if(stbi_is_hdr(filename.c_str())) {
+      Float* data = stbi_loadf(filename.c_str(), &nx, &ny, &nn, 0);
+      if(!data) {
+        return(nullptr);
+      }
+      image = std::make_shared<image_data>(data, nx, ny, nn);
+      stbi_image_free(data);
+    } else {
+      //Decoding 8-bit images directly keeps their bytes, and leaves stb_image's global gamma
+      //alone so images can be decoded on several threads
+      unsigned char* data = stbi_load(filename.c_str(), &nx, &ny, &nn, 0);
+      if(!data) {
+        return(nullptr);
+      }
+      image = std::make_shared<image_data>(data, nx, ny, nn, gamma);
+    }
+    texture_registry::images_loaded++;
+    return(image);
+  }));
+}
+
+}
+
+std::shared_ptr<image_data> texture_registry::Decode(const std::string& filename, Float gamma) {
+  images_requested++;
+  return(LoadImage(filename, gamma));
+}
+
+std::shared_ptr<image_data> texture_registry::Roughness(const std::string& filename, Float min, Float max,
+                                                        bool invert) {
+  images_requested++;
+  std::ostringstream key;
+  key << CanonicalPath(filename) << "|roughness=" << min << "," << max << "," << invert;
+  return(FindOrLoad(decoded, key.str(), [&filename, min, max, invert]() -> std::shared_ptr<image_data> {
+    std::shared_ptr<image_data> source = LoadImage(filename, kColorGamma);
+    if(!source) {
+      return(nullptr);
+    }
+    //Rescale a copy, since the decoded image may be shared with other textures
+    const int nx = source->nx, ny = source->ny, nn = source->channels;
+    std::vector<Float> data(static_cast<size_t>(nx) * ny * nn);
+    for(int y = 0; y < ny; y++) {
+      for(int x = 0; x < nx; x++) {
+        for(int c = 0; c < nn; c++) {
+          data[nn * (x + static_cast<size_t>(nx) * y) + c] = source->value(x, y, c);
+        }
+      }
+    }
+    //The first two channels hold the roughness along u and v
+    const int used_channels = nn > 1 ? 2 : 1;
+    Float maxr = 0, minr = 1;
+    for(size_t i = 0; i < data.size(); i += nn) {
+      for(int c = 0; c < used_channels; c++) {
+        maxr = maxr < data[i+c] ? data[i+c] : maxr;
+        minr = minr > data[i+c] ? data[i+c] : minr;
+      }
+    }
+    Float rough_range = max - min;
+    Float data_range = maxr - minr;
+    for(size_t i = 0; i < data.size(); i += nn) {
+      for(int c = 0; c < used_channels; c++) {
+        if(!invert) {
+          data[i+c] = (data[i+c] - minr) / data_range * rough_range + min;
+        } else {
+          data[i+c] = (1.0 - (data[i+c] - minr) / data_range) * rough_range + min;
+        }
+      }
+    }
+    return(std::make_shared<image_data>(data.data(), nx, ny, nn));
+  }));
+}
+
+std::shared_ptr<mipmap> texture_registry::Texture(const std::string& filename) {
+  if(!texture_cache::enabled()) {
+    std::shared_ptr<image_data> image = Decode(filename, kColorGamma);
+    return(image ? Pyramid(image) : nullptr);
+  }
+  images_requested++;
+  return(FindOrLoad(tiled, CanonicalPath(filename), [&filename]() -> std::shared_ptr<mipmap> {
+    int nx, ny, nn;
+    if(!stbi_info(filename.c_str(), &nx, &ny, &nn)) {
+      return(nullptr);
+    }
+    images_loaded++;
+    return(std::make_shared<mipmap>(texture_cache::Open(filename)));
+  }));
+}
+
+std::shared_ptr<mipmap> texture_registry::Pyramid(std::shared_ptr<image_data> image) {
+  const image_data* key = image.get();
+  return(FindOrLoad(pyramids, key, [&image]() {
+    return(std::make_shared<mipmap>(image));
+  }));
+}
+
+void texture_registry::Clear() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  decoded.ready.clear();
+  tiled.ready.clear();
+  pyramids.ready.clear();
+  images_loaded = 0;
+  images_requested = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef TEXTUREREGISTRYH
+#define TEXTUREREGISTRYH
+
+#include "mathinline.h"
+#include <string>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <atomic>
+
+class mipmap;
+
+//Decoded image kept in its native precision: 8-bit images keep their bytes and are converted
+//through a lookup table, high dynamic range (and computed) images are stored as half floats, or
+//as floats if they hold values past the half range (e.g. the sun in an environment map).
+//value() returns linear floats either way, matching what stbi_loadf() would have produced.
+class image_data {
+public:
+  //Takes ownership of 8-bit `pixels` from stbi_load(). Color channels are linearized with
+  //`gamma`; the alpha channel of two and four channel images is read linearly.
+  image_data(unsigned char* pixels, int nx, int ny, int channels, Float gamma);
+  //Copies `pixels` as half floats, or as floats if any value doesn't fit in a half
+  image_data(const Float* pixels, int nx, int ny, int channels);
+  ~image_data();
+
+  //Linear value of channel `c` of texel (x, y); x and y must be within the image
+  Float value(int x, int y, int c) const {
+    size_t i = channels * (x + static_cast<size_t>(nx) * y) + c;
+    if(bytes) {
+      return(lut[c == alpha_channel][bytes[i]]);
+    }
+    if(halves) {
+      return(HalfToFloat(halves[i]));
+    }
+    return(floats[i]);
+  }
+  size_t memory_bytes() const;
+
+  int nx, ny, channels;
+
+private:
+  image_data(const image_data&);
+  image_data& operator=(const image_data&);
+  unsigned char* bytes;
+  uint16_t* halves;
+  float* floats;
+  int alpha_channel;
+  //Conversions for color channels and alpha
+  Float lut[2][256];
+};
+
+//Hands out shared decoded images and mip pyramids, so a file referenced by many objects or
+//materials is decoded (and its pyramid built) once. Images are keyed by their canonical path and
+//the parameters they're decoded with; the registry only keeps weak references, so images are
+//released with the scene that uses them. All functions are safe to call from several threads: an
+//image is decoded once however many threads ask for it, and different images decode in parallel.
+class texture_registry {
+public:
+  //Gamma stb_image applies when converting 8-bit images to float for color textures
+  static constexpr Float kColorGamma = 2.2f;
+  //Pixels of `filename` with 8-bit color values linearized by `gamma` (high dynamic range images
+  //are already linear), or nullptr if it can't be read
+  static std::shared_ptr<image_data> Decode(const std::string& filename, Float gamma);
+  //Roughness map with values rescaled from their range in the image to [`min`, `max`] (reversed
+  //if `invert`), or nullptr if it can't be read
+  static std::shared_ptr<image_data> Roughness(const std::string& filename, Float min, Float max, bool invert);
+  //Pyramid of a color texture: a tiled_image when the texture cache is enabled, otherwise built
+  //over Decode(filename, kColorGamma). Returns nullptr if the file can't be read.
+  static std::shared_ptr<mipmap> Texture(const std::string& filename);
+  //Pyramid built over an already decoded image
+  static std::shared_ptr<mipmap> Pyramid(std::shared_ptr<image_data> image);
+  //Drops the registry's references and resets its counts
+  static void Clear();
+
+  //Images decoded or tiled, and the number of requests for them
+  static std::atomic<size_t> images_loaded;
+  static std::atomic<size_t> images_requested;
+};
+
+#endif
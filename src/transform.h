@@ -34,6 +34,8 @@ Transform() { }
   const Matrix4x4& GetInverseMatrix() const;
   bool HasScale() const;
   bool SwapsHandedness() const;
+  //Determinant of the linear (upper-left 3x3) part
+  Float Determinant() const;
   
   //Transformations
   aabb operator()(const aabb &b) const;
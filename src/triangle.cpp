@@ -1,145 +1,99 @@
 #include "triangle.h"
 
 
-bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+bool triangle::intersect(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const {
   vec3f pvec = cross(r.direction(), edge2);
   Float det = dot(pvec, edge1);
   
-  bool alpha_miss = false;
   // no culling
   if (std::fabs(det) < 1E-15) {
     return(false);
   }
   Float invdet = 1.0 / det;
   vec3f tvec = vec3f(r.origin()) - a;
-  Float u = dot(pvec, tvec) * invdet;
+  u = dot(pvec, tvec) * invdet;
   if (u < 0.0 || u > 1.0) {
     return(false);
   }
   
   vec3f qvec = cross(tvec, edge1);
-  Float v = dot(qvec, r.direction()) * invdet;
+  v = dot(qvec, r.direction()) * invdet;
   if (v < 0 || u + v > 1.0) {
     return(false);
   }
-  Float t = dot(qvec, edge2) * invdet; 
+  t = dot(qvec, edge2) * invdet; 
   
-  if (t < t_min || t > t_max) {
+  return(t >= t_min && t <= t_max);
+}
+
+bool triangle::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  Float t, u, v;
+  if(!intersect(r, t_min, t_max, t, u, v)) {
     return(false);
   }
+  bool alpha_miss = false;
   if(alpha_mask) {
     if(alpha_mask->channel_value(u, v, rec.p) < rng.unif_rand()) {
       alpha_miss = true;
     }
   }
-  Float w = 1 - u - v;
   rec.t = t;
-  rec.p = r.point_at_parameter(t);
   rec.u = u;
   rec.v = v;
-  
-  //Add error calc
-  rec.pError = vec3f(0,0,0);
-  
-  rec.has_bump = false;
-  
-  if(bump_tex) {
-    //Get UV values + calculate dpdu/dpdv
-    vec3f u_val, v_val;
-    vec2f uv[3];
-    u_val = bump_tex->u_vec;
-    v_val = bump_tex->v_vec;
-    uv[0] = vec2f(u_val.x(), v_val.x());
-    uv[1] = vec2f(u_val.y(), v_val.y());
-    uv[2] = vec2f(u_val.z(), v_val.z());
-    vec2f duv02 = uv[0] - uv[2];
-    vec2f duv12 = uv[1] - uv[2];
-    vec3f dp02 = edge1;
-    vec3f dp12 = edge2;
-    
-    Float determinant = DifferenceOfProducts(duv02[0],duv12[1],duv02[1],duv12[0]);
-    if (determinant == 0) {
-      onb uvw;
-      uvw.build_from_w(cross(edge2,edge1));
-      rec.dpdu = uvw.u();
-      rec.dpdv = uvw.v();
-    } else {
-      Float invdet = 1 / determinant;
-      rec.dpdu = -( duv12[1] * dp02 - duv02[1] * dp12) * invdet;
-      rec.dpdv = -(-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
-    }
-  } else {
-    rec.dpdu = vec3f(0,0,0);
-    rec.dpdv = vec3f(0,0,0);
-  }
-  // Use that to calculate normals
-  if(normals_provided) {
-    normal3f normal_temp = w * na + u * nb + v * nc;
-    if(alpha_mask) {
-      rec.normal = dot(r.direction(), normal_temp) < 0 ? normal_temp : -normal_temp;
-    } else {
-      rec.normal = normal_temp;
-    }
-  } else {
-    if(alpha_mask) {
-      rec.normal = dot(r.direction(), normal) < 0 ? normal : -normal;
-    } else {
-      rec.normal = normal;
-    }
-  }
-  if(bump_tex) {
-    point3f bvbu = bump_tex->mesh_value(rec.u, rec.v, rec.p);
-    rec.bump_normal = dot(r.direction(), normal) < 0 ? 
-    rec.normal + normal3f( bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv) :
-      rec.normal -  normal3f(bvbu.x() * rec.dpdu - bvbu.y() * rec.dpdv);
-    rec.bump_normal.make_unit_vector();
-    rec.has_bump = true;
-  }
-  rec.mat_ptr = mp.get();
   rec.alpha_miss = alpha_miss;
+  rec.pending = this;
   return(true);
 }
 
-
-bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  vec3f pvec = cross(r.direction(), edge2);
-  Float det = dot(pvec, edge1);
-  bool alpha_miss = false;
-  
-  // no culling
-  if (std::fabs(det) < 1E-15) {
-    return(false);
-  }
-  Float invdet = 1.0 / det;
-  vec3f tvec = vec3f(r.origin()) - a;
-  Float u = dot(pvec, tvec) * invdet;
-  if (u < 0.0 || u > 1.0) {
-    return(false);
-  }
-  
-  vec3f qvec = cross(tvec, edge1);
-  Float v = dot(qvec, r.direction()) * invdet;
-  if (v < 0 || u + v > 1.0) {
-    return(false);
-  }
-  Float t = dot(qvec, edge2) * invdet; 
-  
-  if (t < t_min || t > t_max) {
+bool triangle::hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  Float t, u, v;
+  if(!intersect(r, t_min, t_max, t, u, v)) {
     return(false);
   }
+  bool alpha_miss = false;
   if(alpha_mask) {
     if(alpha_mask->channel_value(u, v, rec.p) < sampler->Get1D()) {
       alpha_miss = true;
     }
   }
-  Float w = 1 - u - v;
   rec.t = t;
-  rec.p = r.point_at_parameter(t);
   rec.u = u;
   rec.v = v;
-  rec.has_bump = false;
+  rec.alpha_miss = alpha_miss;
+  rec.pending = this;
+  return(true);
+}
+
+bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  if(!hit_deferred(r, t_min, t_max, rec, rng)) {
+    return(false);
+  }
+  rec.pending = nullptr;
+  compute_surface_interaction(r, rec);
+  return(true);
+}
+
+bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  if(!hit_deferred(r, t_min, t_max, rec, sampler)) {
+    return(false);
+  }
+  rec.pending = nullptr;
+  compute_surface_interaction(r, rec);
+  return(true);
+}
+
+//Fills in everything but t, u, v and alpha_miss, which were set by hit_deferred()
+void triangle::compute_surface_interaction(const ray& r, hit_record& rec) {
+  Float u = rec.u;
+  Float v = rec.v;
+  Float w = 1 - u - v;
+  rec.p = r.point_at_parameter(rec.t);
+  
+  //Add error calc
   rec.pError = vec3f(0,0,0);
   
+  rec.has_bump = false;
+  
   if(bump_tex) {
     //Get UV values + calculate dpdu/dpdv
     vec3f u_val, v_val;
@@ -166,8 +120,9 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Samp
       rec.dpdv = -(-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
     }
   } else {
-    rec.dpdu = vec3f(0,0,0);
-    rec.dpdv = vec3f(0,0,0);
+    //Derivatives with respect to the barycentric (u, v) stored in the record
+    rec.dpdu = edge1;
+    rec.dpdv = edge2;
   }
   // Use that to calculate normals
   if(normals_provided) {
@@ -193,9 +148,6 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Samp
     rec.has_bump = true;
   }
   rec.mat_ptr = mp.get();
-  rec.alpha_miss = alpha_miss;
-  
-  return(true);
 }
 
 bool triangle::bounding_box(Float t0, Float t1, aabb& box) const {
@@ -36,6 +36,9 @@ public:
   };
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit_deferred(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual void compute_surface_interaction(const ray& r, hit_record& rec);
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
@@ -56,6 +59,8 @@ public:
   std::shared_ptr<material> mp;
   std::shared_ptr<alpha_texture> alpha_mask;
   std::shared_ptr<bump_texture> bump_tex;
+private:
+  bool intersect(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const;
 };
 
 #endif
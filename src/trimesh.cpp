@@ -1,10 +1,111 @@
 #include "trimesh.h"
+#include "mappedfile.h"
+#include "objloader.h"
+#include <algorithm>
+#include <sstream>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tinyobj/tiny_obj_loader.h"
 
+//Adds the material libraries referenced by `mtllib` statements to the cache key, so editing a
+//.mtl file invalidates cached entries for the OBJ files that use it.
+static void AddMaterialLibraries(MeshCache& cache, const std::string& inputfile, const std::string& basedir) {
+  MappedFile obj(inputfile);
+  if(!obj.valid()) {
+    return;
+  }
+  const char* begin = obj.data();
+  const char* end = begin + obj.size();
+  const char keyword[] = "mtllib";
+  const char* p = begin;
+  while((p = std::search(p, end, keyword, keyword + 6)) != end) {
+    bool line_start = p == begin || p[-1] == '\n' || p[-1] == '\r';
+    p += 6;
+    if(!line_start || p == end || (*p != ' ' && *p != '\t')) {
+      continue;
+    }
+    const char* line_end = std::find(p, end, '\n');
+    std::istringstream names(std::string(p, line_end));
+    std::string name;
+    while(names >> name) {
+      cache.AddSource(basedir.empty() ? name : basedir + separator() + name);
+    }
+    p = line_end;
+  }
+}
+
+//Loads an OBJ file, using the parsed geometry and materials from the mesh cache when available.
+//Otherwise the file is parsed with tinyobj and the results are stored for the cache to write out.
+static bool LoadObjCached(MeshCache& cache, tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+                          std::vector<tinyobj::material_t>* materials, std::string* warn, std::string* err,
+                          const std::string& inputfile, const std::string& basedir) {
+  if(cache.enabled()) {
+    AddMaterialLibraries(cache, inputfile, basedir);
+    if(cache.Load()) {
+      MeshCacheData& data = cache.data;
+      attrib->vertices = data.vertices;
+      attrib->normals = data.normals;
+      attrib->texcoords = data.texcoords;
+      attrib->colors = data.colors;
+      shapes->resize(1);
+      tinyobj::mesh_t& mesh = (*shapes)[0].mesh;
+      mesh.indices.resize(data.indices.size() / 3);
+      for(size_t i = 0; i < mesh.indices.size(); i++) {
+        mesh.indices[i].vertex_index   = data.indices[3*i];
+        mesh.indices[i].normal_index   = data.indices[3*i+1];
+        mesh.indices[i].texcoord_index = data.indices[3*i+2];
+      }
+      mesh.material_ids = data.material_ids;
+      mesh.num_face_vertices.assign(data.material_ids.size(), 3);
+      materials->resize(data.materials.size(), tinyobj::material_t());
+      for(size_t i = 0; i < data.materials.size(); i++) {
+        tinyobj::material_t& mat = (*materials)[i];
+        for(int j = 0; j < 3; j++) {
+          mat.diffuse[j] = data.materials[i].diffuse[j];
+        }
+        mat.dissolve = data.materials[i].dissolve;
+        mat.ior = data.materials[i].ior;
+        mat.bump_texopt.bump_multiplier = data.materials[i].bump_multiplier;
+        mat.diffuse_texname = data.materials[i].diffuse_texname;
+        mat.bump_texname = data.materials[i].bump_texname;
+      }
+      return(true);
+    }
+  }
+  bool ret = tinyobj::LoadObj(attrib, shapes, materials, warn, err, inputfile.c_str(), basedir.c_str());
+  if(ret && cache.enabled()) {
+    MeshCacheData& data = cache.data;
+    data.vertices = attrib->vertices;
+    data.normals = attrib->normals;
+    data.texcoords = attrib->texcoords;
+    data.colors = attrib->colors;
+    for(size_t s = 0; s < shapes->size(); s++) {
+      const tinyobj::mesh_t& mesh = (*shapes)[s].mesh;
+      for(size_t i = 0; i < mesh.indices.size(); i++) {
+        data.indices.push_back(mesh.indices[i].vertex_index);
+        data.indices.push_back(mesh.indices[i].normal_index);
+        data.indices.push_back(mesh.indices[i].texcoord_index);
+      }
+      data.material_ids.insert(data.material_ids.end(), mesh.material_ids.begin(), mesh.material_ids.end());
+    }
+    data.materials.resize(materials->size());
+    for(size_t i = 0; i < materials->size(); i++) {
+      const tinyobj::material_t& mat = (*materials)[i];
+      for(int j = 0; j < 3; j++) {
+        data.materials[i].diffuse[j] = mat.diffuse[j];
+      }
+      data.materials[i].dissolve = mat.dissolve;
+      data.materials[i].ior = mat.ior;
+      data.materials[i].bump_multiplier = mat.bump_texopt.bump_multiplier;
+      data.materials[i].diffuse_texname = mat.diffuse_texname;
+      data.materials[i].bump_texname = mat.bump_texname;
+    }
+  }
+  return(ret);
+}
+
 
-trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, 
+trimesh::trimesh(std::string inputfile, std::string basedir, std::string cache_dir, Float scale, 
         Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : 
   hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
@@ -14,7 +115,8 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
   std::string warn, err;
   mat_ptr = nullptr;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
+  MeshCache cache(cache_dir, inputfile, scale, bvh_type, *ObjectToWorld);
+  bool ret = LoadObjCached(cache, &attrib, &shapes, &materials, &warn, &err, inputfile, basedir);
   bool has_sep = true;
   if(strlen(basedir.c_str()) == 0) {
     has_sep = false;
@@ -41,21 +143,25 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
     std::vector<bool > has_bump(materials.size()+1);
     std::vector<Float > bump_intensity(materials.size()+1);
     
-    std::vector<int > nx_mat(materials.size()+1);
-    std::vector<int > ny_mat(materials.size()+1);
-    std::vector<int > nn_mat(materials.size()+1);
-    
-    std::vector<int > nx_mat_bump(materials.size()+1);
-    std::vector<int > ny_mat_bump(materials.size()+1);
-    std::vector<int > nn_mat_bump(materials.size()+1);
+    //One pyramid per diffuse texture, shared by all the triangles using it
+    std::vector<std::shared_ptr<mipmap> > obj_mipmaps(materials.size()+1);
     int nx, ny, nn;
     
     for (size_t i = 0; i < materials.size(); i++) {
       if(strlen(materials[i].diffuse_texname.c_str()) > 0) {
-        if(has_sep) {
-          obj_materials.push_back(stbi_loadf((basedir + separator() + materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
+        std::string texname = has_sep ? basedir + separator() + materials[i].diffuse_texname : 
+          materials[i].diffuse_texname;
+        //Textures without an alpha channel can be paged in by the texture cache; ones with alpha are
+        //decoded up front for the alpha mask
+        if(texture_cache::enabled() && stbi_info(texname.c_str(), &nx, &ny, &nn) && nn != 4) {
+          obj_materials.push_back(nullptr);
+          obj_mipmaps[i] = texture_registry::Texture(texname);
         } else {
-          obj_materials.push_back(stbi_loadf((materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
+          std::shared_ptr<image_data> image = texture_registry::Decode(texname, texture_registry::kColorGamma);
+          nx = image ? image->nx : 0;
+          ny = image ? image->ny : 0;
+          nn = image ? image->channels : 0;
+          obj_materials.push_back(image);
         }
         if(nx == 0 || ny == 0 || nn == 0) {
           if(has_sep) {
@@ -66,14 +172,11 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
         }
         has_diffuse[i] = true;
         has_single_diffuse[i] = false;
-        nx_mat[i] = nx;
-        ny_mat[i] = ny;
-        nn_mat[i] = nn;
         has_alpha[i] = false;
         if(nn == 4) {
           for(int j = 0; j < nx - 1; j++) {
             for(int k = 0; k < ny - 1; k++) {
-              if(obj_materials[i][4*j + 4*nx*k + 3] != 1.0) {
+              if(obj_materials[i]->value(j, k, 3) != 1.0) {
                 has_alpha[i] = true;
                 break;
               }
@@ -109,11 +212,13 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
         has_transparency[i] = true; 
       }
       if(strlen(materials[i].bump_texname.c_str()) > 0) {
-        if(has_sep) {
-          bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        } else {
-          bump_materials[i] = stbi_loadf(materials[i].bump_texname.c_str(), &nx, &ny, &nn, 0);
-        }
+        std::string bumpname = has_sep ? basedir + separator() + materials[i].bump_texname : 
+          materials[i].bump_texname;
+        std::shared_ptr<image_data> image = texture_registry::Decode(bumpname, texture_registry::kColorGamma);
+        nx = image ? image->nx : 0;
+        ny = image ? image->ny : 0;
+        nn = image ? image->channels : 0;
+        bump_materials.push_back(image);
         if(nx == 0 || ny == 0 || nn == 0) {
           if(has_sep) {
             throw std::runtime_error("Could not find " + basedir + separator() + materials[i].bump_texname);
@@ -121,9 +226,6 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
             throw std::runtime_error("Could not find " + materials[i].bump_texname);
           }
         }
-        nx_mat_bump[i] = nx;
-        ny_mat_bump[i] = ny;
-        nn_mat_bump[i] = nn;
         bump_intensity[i] = materials[i].bump_texopt.bump_multiplier;
         has_bump[i] = true;
       } else {
@@ -133,6 +235,11 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
       }
     }
     bool has_normals = attrib.normals.size() > 0 ? true : false;
+    for (size_t i = 0; i < materials.size() && i < obj_materials.size(); i++) {
+      if(!obj_mipmaps[i] && has_diffuse[i] && !has_single_diffuse[i] && obj_materials[i]) {
+        obj_mipmaps[i] = texture_registry::Pyramid(obj_materials[i]);
+      }
+    }
     
     vec3f tris[3];
     vec3f normals[3];
@@ -183,7 +290,6 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
         if(material_num > -1) {
           if(has_alpha[material_num]) {
             alpha = std::make_shared<alpha_texture>(obj_materials[material_num], 
-                                      nx_mat[material_num], ny_mat[material_num], nn_mat[material_num], 
                                       vec3f(tx[0], tx[1], tx[2]), 
                                       vec3f(ty[0], ty[1], ty[2]));
             alpha_materials.push_back(alpha);
@@ -192,7 +298,6 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
           }
           if(has_bump[material_num]) {
             bump = std::make_shared<bump_texture>(bump_materials[material_num],
-                                    nx_mat_bump[material_num], ny_mat_bump[material_num], nn_mat_bump[material_num],
                                     vec3f(tx[0], tx[1], tx[2]),
                                     vec3f(ty[0], ty[1], ty[2]), bump_intensity[material_num]);
             bump_textures.push_back(bump);
@@ -218,8 +323,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
               if(has_single_diffuse[material_num]) {
                 tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse_materials[material_num]));
               } else {
-                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                                nx_mat[material_num], ny_mat[material_num],nn_mat[material_num],
+                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_mipmaps[material_num],
                                                                 tx[0],ty[0], tx[1],ty[1],tx[2],ty[2]));
               }
             } else {
@@ -241,8 +345,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
               if(has_single_diffuse[material_num]) {
                 tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse_materials[material_num]));
               } else {
-                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                                nx_mat[material_num],ny_mat[material_num],nn_mat[material_num],
+                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_mipmaps[material_num],
                                                                 tx[0],ty[0],
                                                                 tx[1],ty[1],
                                                                 tx[2],ty[2]));
@@ -256,14 +359,14 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale,
         }
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
+    tri_mesh_bvh = cache.BuildBVH(triangles, shutteropen, shutterclose, bvh_type, rng);
   } else {
     std::string mes = "Error reading " + inputfile + ": ";
     throw std::runtime_error(mes + warn + err);
   }
 }
 
-trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float sigma,
+trimesh::trimesh(std::string inputfile, std::string basedir, std::string cache_dir, Float scale, Float sigma,
         Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
       hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
@@ -273,7 +376,8 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
   std::string warn, err;
   mat_ptr = nullptr;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
+  MeshCache cache(cache_dir, inputfile, scale, bvh_type, *ObjectToWorld);
+  bool ret = LoadObjCached(cache, &attrib, &shapes, &materials, &warn, &err, inputfile, basedir);
   bool has_sep = true;
   if(strlen(basedir.c_str()) == 0) {
     has_sep = false;
@@ -299,22 +403,26 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
     std::vector<bool > has_bump(materials.size()+1);
     std::vector<Float > bump_intensity(materials.size()+1);
     
-    std::vector<int > nx_mat(materials.size()+1);
-    std::vector<int > ny_mat(materials.size()+1);
-    std::vector<int > nn_mat(materials.size()+1);
-    
-    std::vector<int > nx_mat_bump(materials.size()+1);
-    std::vector<int > ny_mat_bump(materials.size()+1);
-    std::vector<int > nn_mat_bump(materials.size()+1);
+    //One pyramid per diffuse texture, shared by all the triangles using it
+    std::vector<std::shared_ptr<mipmap> > obj_mipmaps(materials.size()+1);
     
     int nx,ny,nn;
     
     for (size_t i = 0; i < materials.size(); i++) {
       if(strlen(materials[i].diffuse_texname.c_str()) > 0) {
-        if(has_sep) {
-          obj_materials.push_back(stbi_loadf((basedir + separator() + materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
+        std::string texname = has_sep ? basedir + separator() + materials[i].diffuse_texname : 
+          materials[i].diffuse_texname;
+        //Textures without an alpha channel can be paged in by the texture cache; ones with alpha are
+        //decoded up front for the alpha mask
+        if(texture_cache::enabled() && stbi_info(texname.c_str(), &nx, &ny, &nn) && nn != 4) {
+          obj_materials.push_back(nullptr);
+          obj_mipmaps[i] = texture_registry::Texture(texname);
         } else {
-          obj_materials.push_back(stbi_loadf((materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
+          std::shared_ptr<image_data> image = texture_registry::Decode(texname, texture_registry::kColorGamma);
+          nx = image ? image->nx : 0;
+          ny = image ? image->ny : 0;
+          nn = image ? image->channels : 0;
+          obj_materials.push_back(image);
         }
         if(nx == 0 || ny == 0 || nn == 0) {
           if(has_sep) {
@@ -325,14 +433,11 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
         }
         has_diffuse[i] = true;
         has_single_diffuse[i] = false;
-        nx_mat[i] = nx;
-        ny_mat[i] = ny;
-        nn_mat[i] = nn;
         has_alpha[i] = false;
         if(nn == 4) {
           for(int j = 0; j < nx - 1; j++) {
             for(int k = 0; k < ny - 1; k++) {
-              if(obj_materials[i][4*j + 4*nx*k + 3] != 1.0) {
+              if(obj_materials[i]->value(j, k, 3) != 1.0) {
                 has_alpha[i] = true;
                 break;
               }
@@ -365,13 +470,13 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
         has_transparency[i] = true; 
       }
       if(strlen(materials[i].bump_texname.c_str()) > 0) {
-        bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        if(has_sep) {
-          bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        } else {
-          bump_materials[i] = stbi_loadf(materials[i].bump_texname.c_str(), &nx, &ny, &nn, 0);
-        }
-        
+        std::string bumpname = has_sep ? basedir + separator() + materials[i].bump_texname : 
+          materials[i].bump_texname;
+        std::shared_ptr<image_data> image = texture_registry::Decode(bumpname, texture_registry::kColorGamma);
+        nx = image ? image->nx : 0;
+        ny = image ? image->ny : 0;
+        nn = image ? image->channels : 0;
+        bump_materials.push_back(image);
         if(nx == 0 || ny == 0 || nn == 0) {
           if(has_sep) {
             throw std::runtime_error("Could not find " + basedir + separator() + materials[i].bump_texname);
@@ -379,9 +484,6 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
             throw std::runtime_error("Could not find " + materials[i].bump_texname);
           }
         }
-        nx_mat_bump[i] = nx;
-        ny_mat_bump[i] = ny;
-        nn_mat_bump[i] = nn;
         bump_intensity[i] = materials[i].bump_texopt.bump_multiplier;
         has_bump[i] = true;
       } else {
@@ -391,6 +493,11 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
       }
     }
     bool has_normals = attrib.normals.size() > 0 ? true : false;
+    for (size_t i = 0; i < materials.size() && i < obj_materials.size(); i++) {
+      if(!obj_mipmaps[i] && has_diffuse[i] && !has_single_diffuse[i] && obj_materials[i]) {
+        obj_mipmaps[i] = texture_registry::Pyramid(obj_materials[i]);
+      }
+    }
     vec3f tris[3];
     vec3f normals[3];
     Float tx[3];
@@ -432,7 +539,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
         int material_num = shapes[s].mesh.material_ids[f];
         if(material_num > -1) {
           if(has_alpha[material_num]) {
-            alpha = std::make_shared<alpha_texture>(obj_materials[material_num], nx, ny, nn, 
+            alpha = std::make_shared<alpha_texture>(obj_materials[material_num], 
                                       vec3f(tx[0], tx[1], tx[2]), 
                                       vec3f(ty[0], ty[1], ty[2]));
             alpha_materials.push_back(alpha);
@@ -442,9 +549,8 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
           }
           if(has_bump[material_num]) {
             bump = std::make_shared<bump_texture>(bump_materials[material_num],
-                                    nx_mat_bump[material_num], ny_mat_bump[material_num], nn_mat_bump[material_num],
-                                                                                                     vec3f(tx[0], tx[1], tx[2]),
-                                                                                                     vec3f(ty[0], ty[1], ty[2]), bump_intensity[material_num]);
+                                    vec3f(tx[0], tx[1], tx[2]),
+                                    vec3f(ty[0], ty[1], ty[2]), bump_intensity[material_num]);
             bump_textures.push_back(bump);
           } else {
             bump = nullptr;
@@ -465,8 +571,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
               if(has_single_diffuse[material_num]) {
                 tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(diffuse_materials[material_num]), sigma);
               } else {
-                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                               nx_mat[material_num], ny_mat[material_num],nn_mat[material_num],
+                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_mipmaps[material_num],
                                                                tx[0],ty[0], tx[1],ty[1],tx[2],ty[2]), sigma);
               }
             } else {
@@ -488,8 +593,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
               if(has_single_diffuse[material_num]) {
                 tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(diffuse_materials[material_num]), sigma);
               } else {
-                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                               nx_mat[material_num],ny_mat[material_num],nn_mat[material_num],
+                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_mipmaps[material_num],
                                                                                                                tx[0],ty[0],tx[1],ty[1],tx[2],ty[2]), sigma);
               }
             } else {
@@ -501,95 +605,124 @@ trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float
         }
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
+    tri_mesh_bvh = cache.BuildBVH(triangles, shutteropen, shutterclose, bvh_type, rng);
   } else {
     std::string mes = "Error reading " + inputfile + ": ";
     throw std::runtime_error(mes + warn + err);
   }
 }
 
-trimesh::trimesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-        Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
+trimesh::trimesh(std::string inputfile, std::string basedir, std::string cache_dir, std::shared_ptr<material> mat, 
+        Float scale, Float shutteropen, Float shutterclose, int bvh_type, int numbercores, random_gen rng,
         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
     hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t > shapes;
-  std::vector<tinyobj::material_t > materials;
-  std::string warn, err;
   mat_ptr = mat;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
-  bool has_sep = true;
-  if(strlen(basedir.c_str()) == 0) {
-    has_sep = false;
-  }
-  std::shared_ptr<alpha_texture> alpha = nullptr;
-  std::shared_ptr<bump_texture> bump = nullptr;
-  if(ret) {
-    int n = 0;
-    for (size_t s = 0; s < shapes.size(); s++) {
-      n += shapes[s].mesh.num_face_vertices.size();
+  //With a single material and no textures the mesh is stored as shared vertex/normal buffers
+  //plus indices, rather than as one `triangle` per face, and the file is read with the parallel
+  //geometry-only loader
+  MeshCache cache(cache_dir, inputfile, scale, bvh_type, *ObjectToWorld);
+  compact_mesh::PrepareCache(cache);
+  std::vector<vec3f> vertices;
+  std::vector<normal3f> normals;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> normal_indices;
+  if(cache.Load()) {
+    const MeshCacheData& data = cache.data;
+    vertices.resize(data.vertices.size() / 3);
+    for(size_t i = 0; i < vertices.size(); i++) {
+      vertices[i] = vec3f(data.vertices[3*i], data.vertices[3*i+1], data.vertices[3*i+2]);
     }
-    bool has_normals = attrib.normals.size() > 0 ? true : false;
-    vec3f tris[3];
-    vec3f normals[3];
-    for (size_t s = 0; s < shapes.size(); s++) {
-      
-      size_t index_offset = 0;
-      for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-        bool tempnormal = false;
-        
-        for (size_t v = 0; v < 3; v++) {
-          tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-          
-          tris[v] = vec3f(attrib.vertices[3*idx.vertex_index+0],
-                         attrib.vertices[3*idx.vertex_index+1],
-                                        attrib.vertices[3*idx.vertex_index+2])*scale;
-          
-          if(has_normals  && idx.normal_index != -1) {
-            tempnormal = true;
-            
-            normals[v] = vec3f(attrib.normals[3*idx.normal_index+0],
-                              attrib.normals[3*idx.normal_index+1],
-                                            attrib.normals[3*idx.normal_index+2]);
-          }
-        }
-        
-        index_offset += 3;
-        if(std::isnan(tris[0].x()) || std::isnan(tris[0].y()) || std::isnan(tris[0].z()) ||
-           std::isnan(tris[1].x()) || std::isnan(tris[1].y()) || std::isnan(tris[1].z()) ||
-           std::isnan(tris[2].x()) || std::isnan(tris[2].y()) || std::isnan(tris[2].z())) {
-          // triangles.pop_back();
-          n--;
-          continue;
-        }
-        if((normals[0].x() == 0 && normals[0].y() == 0 && normals[0].z() == 0) ||
-           (normals[1].x() == 0 && normals[1].y() == 0 && normals[1].z() == 0) ||
-           (normals[2].x() == 0 && normals[2].y() == 0 && normals[2].z() == 0)) {
-          has_normals = false;
+    normals.resize(data.normals.size() / 3);
+    for(size_t i = 0; i < normals.size(); i++) {
+      normals[i] = normal3f(data.normals[3*i], data.normals[3*i+1], data.normals[3*i+2]);
+    }
+    indices.resize(data.indices.size() / 3);
+    normal_indices.resize(indices.size());
+    for(size_t i = 0; i < indices.size(); i++) {
+      indices[i] = static_cast<uint32_t>(data.indices[3*i]);
+      normal_indices[i] = data.indices[3*i+1] < 0 ? compact_mesh::kNoNormal : 
+        static_cast<uint32_t>(data.indices[3*i+1]);
+    }
+  } else {
+    std::string err;
+    if(!LoadObjGeometry(inputfile, numbercores, vertices, normals, indices, normal_indices, err)) {
+      std::string mes = "Error reading " + inputfile + ": ";
+      throw std::runtime_error(mes + err);
+    }
+    if(cache.enabled()) {
+      MeshCacheData& data = cache.data;
+      data.vertices.resize(3 * vertices.size());
+      for(size_t i = 0; i < vertices.size(); i++) {
+        for(int j = 0; j < 3; j++) {
+          data.vertices[3*i+j] = vertices[i].e[j];
         }
-        
-        if(has_normals && tempnormal) {
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2],
-                                           normals[0],normals[1],normals[2], 
-                                           false,
-                                           mat_ptr, alpha,  bump, 
-                                           ObjectToWorld, WorldToObject, reverseOrientation));
-        } else {
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], false, 
-                                                   mat_ptr, alpha, bump, 
-                                                   ObjectToWorld, WorldToObject, reverseOrientation));
+      }
+      data.normals.resize(3 * normals.size());
+      for(size_t i = 0; i < normals.size(); i++) {
+        for(int j = 0; j < 3; j++) {
+          data.normals[3*i+j] = normals[i].e[j];
         }
       }
+      data.indices.resize(3 * indices.size());
+      for(size_t i = 0; i < indices.size(); i++) {
+        data.indices[3*i] = static_cast<int>(indices[i]);
+        data.indices[3*i+1] = normal_indices[i] == compact_mesh::kNoNormal ? -1 : static_cast<int>(normal_indices[i]);
+        data.indices[3*i+2] = -1;
+      }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  } else {
-    std::string mes = "Error reading " + inputfile + ": ";
-    throw std::runtime_error(mes + warn + err);
   }
+  for(size_t i = 0; i < vertices.size(); i++) {
+    vertices[i] *= scale;
+  }
+  
+  //Drop faces with NaN vertices. As with the per-triangle path, a zero-length normal disables
+  //shading normals for the rest of the mesh.
+  bool has_normals = !normals.empty();
+  size_t kept = 0;
+  for(size_t f = 0; f < indices.size() / 3; f++) {
+    bool is_nan = false;
+    bool tempnormal = true;
+    for(size_t v = 0; v < 3; v++) {
+      const vec3f& p = vertices[indices[3*f+v]];
+      if(std::isnan(p.x()) || std::isnan(p.y()) || std::isnan(p.z())) {
+        is_nan = true;
+      }
+      if(normal_indices[3*f+v] == compact_mesh::kNoNormal) {
+        tempnormal = false;
+      }
+    }
+    if(is_nan) {
+      continue;
+    }
+    for(size_t v = 0; v < 3 && has_normals && tempnormal; v++) {
+      const normal3f& n = normals[normal_indices[3*f+v]];
+      if(n.x() == 0 && n.y() == 0 && n.z() == 0) {
+        has_normals = false;
+      }
+    }
+    for(size_t v = 0; v < 3; v++) {
+      indices[3*kept+v] = indices[3*f+v];
+      normal_indices[3*kept+v] = has_normals && tempnormal ? normal_indices[3*f+v] : compact_mesh::kNoNormal;
+    }
+    kept++;
+  }
+  indices.resize(3 * kept);
+  normal_indices.resize(3 * kept);
+  if(normals.empty()) {
+    normal_indices.clear();
+  }
+  std::vector<vec2f> texcoords;
+  std::vector<uint32_t> texcoord_indices;
+  std::vector<uint16_t> material_ids;
+  std::vector<std::shared_ptr<material> > mesh_materials(1, mat_ptr);
+  compact_tri_mesh = std::make_shared<compact_mesh>(vertices, normals, indices, normal_indices,
+                                                    texcoords, texcoord_indices, material_ids, mesh_materials,
+                                                    cache, bvh_type,
+                                                    ObjectToWorld, WorldToObject, reverseOrientation);
 }
 
-trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_sigma,
+trimesh::trimesh(std::string inputfile, std::string basedir, std::string cache_dir, float vertex_color_sigma,
         Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, 
         random_gen rng,
         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
@@ -603,7 +736,8 @@ trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_
   std::shared_ptr<alpha_texture> alpha = nullptr;
   std::shared_ptr<bump_texture> bump = nullptr;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
+  MeshCache cache(cache_dir, inputfile, scale, bvh_type, *ObjectToWorld);
+  bool ret = LoadObjCached(cache, &attrib, &shapes, &materials, &warn, &err, inputfile, basedir);
   bool has_sep = true;
   if(strlen(basedir.c_str()) == 0) {
     has_sep = false;
@@ -672,7 +806,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_
         }
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
+    tri_mesh_bvh = cache.BuildBVH(triangles, shutteropen, shutterclose, bvh_type, rng);
   } else {
     std::string mes = "Error reading " + inputfile + ": ";
     throw std::runtime_error(mes + warn + err);
@@ -680,32 +814,53 @@ trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_
 }
 
 bool trimesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->hit(r, t_min, t_max, rec, rng));
+  }
   return(tri_mesh_bvh->hit(r, t_min, t_max, rec, rng));
 }
 
 bool trimesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->hit(r, t_min, t_max, rec, sampler));
+  }
   return(tri_mesh_bvh->hit(r, t_min, t_max, rec, sampler));
 }
 
 bool trimesh::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->bounding_box(t0,t1,box));
+  }
   return(tri_mesh_bvh->bounding_box(t0,t1,box));
 }
 
 
 Float trimesh::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->pdf_value(o,v, rng, time));
+  }
   return(triangles.pdf_value(o,v, rng, time));
 }
 
 Float trimesh::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->pdf_value(o,v, sampler, time));
+  }
   return(triangles.pdf_value(o,v, sampler, time));
   
 }
 
 vec3f trimesh::random(const point3f& o, random_gen& rng, Float time) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->random(o, rng, time));
+  }
   return(triangles.random(o, rng, time));
 }
 
 vec3f trimesh::random(const point3f& o, Sampler* sampler, Float time) {
+  if(compact_tri_mesh) {
+    return(compact_tri_mesh->random(o, sampler, time));
+  }
   return(triangles.random(o, sampler, time));
   
 }
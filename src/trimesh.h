@@ -4,10 +4,13 @@
 #include "triangle.h"
 #include "bvh_node.h"
 #include "rng.h"
+#include "meshcache.h"
+#include "compactmesh.h"
 #ifndef STBIMAGEH
 #define STBIMAGEH
 #include "stb_image.h"
 #endif
+#include "textureregistry.h"
 #include <Rcpp.h>
 
 inline char separator() {
@@ -21,24 +24,16 @@ inline char separator() {
 class trimesh : public hitable {
 public:
   trimesh() {}
-  ~trimesh() {
-    for(auto mat : obj_materials) {
-      if(mat) stbi_image_free(mat);
-    }
-    for(auto bump : bump_materials) {
-      if(bump) stbi_image_free(bump);
-    }
-  }
-  trimesh(std::string inputfile, std::string basedir, Float scale, 
+  trimesh(std::string inputfile, std::string basedir, std::string cache_dir, Float scale, 
           Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
-  trimesh(std::string inputfile, std::string basedir, Float scale, Float sigma,
+  trimesh(std::string inputfile, std::string basedir, std::string cache_dir, Float scale, Float sigma,
           Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
-  trimesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-          Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
+  trimesh(std::string inputfile, std::string basedir, std::string cache_dir, std::shared_ptr<material> mat, 
+          Float scale, Float shutteropen, Float shutterclose, int bvh_type, int numbercores, random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
-  trimesh(std::string inputfile, std::string basedir, float vertex_color_sigma,
+  trimesh(std::string inputfile, std::string basedir, std::string cache_dir, float vertex_color_sigma,
           Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, 
           random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
@@ -55,9 +50,12 @@ public:
     return(std::string("TriangleMesh"));
   }
   std::shared_ptr<bvh_node> tri_mesh_bvh;
+  //Used instead of `tri_mesh_bvh` and `triangles` by the single material constructor
+  std::shared_ptr<compact_mesh> compact_tri_mesh;
   std::shared_ptr<material> mat_ptr;
-  std::vector<Float* > obj_materials;
-  std::vector<Float* > bump_materials;
+  //Decoded images, shared through the texture registry with other meshes using the same files
+  std::vector<std::shared_ptr<image_data> > obj_materials;
+  std::vector<std::shared_ptr<image_data> > bump_materials;
   std::vector<std::shared_ptr<bump_texture> > bump_textures;
   std::vector<std::shared_ptr<alpha_texture> > alpha_materials;
   hitable_list triangles;
@@ -0,0 +1,288 @@
+#include "voxelgrid.h"
+#include "bvhstats.h"
+#include <cmath>
+
+const int voxel_grid::kBrickSize;
+const size_t voxel_grid::kBrickVoxels;
+const uint32_t voxel_grid::kEmptyBrick;
+
+static inline size_t local_index(const int v[3]) {
+  const int b = voxel_grid::kBrickSize;
+  return((v[0] % b) + b * ((v[1] % b) + b * (v[2] % b)));
+}
+
+static inline int min_axis(const Float t[3]) {
+  return(t[0] < t[1] ? (t[0] < t[2] ? 0 : 2) : (t[1] < t[2] ? 1 : 2));
+}
+
+voxel_grid::voxel_grid(const int* coords, const int* ids, size_t num_voxels, const int dims_[3], Float voxel_size_,
+                       const std::vector<std::shared_ptr<material> >& materials_,
+                       std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+                       bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation), materials(materials_), voxel_size(voxel_size_) {
+  if(!(voxel_size > 0)) {
+    throw std::runtime_error("Voxel size must be greater than zero");
+  }
+  if(materials.size() < 2 || materials.size() > 65536) {
+    throw std::runtime_error("Voxel grid must have between 1 and 65535 materials");
+  }
+  size_t num_bricks = 1;
+  for(int k = 0; k < 3; k++) {
+    dims[k] = dims_[k];
+    if(dims[k] < 1) {
+      throw std::runtime_error("Voxel grid dimensions must be at least one");
+    }
+    brick_dims[k] = (dims[k] + kBrickSize - 1) / kBrickSize;
+    num_bricks *= brick_dims[k];
+    grid_min[k] = -static_cast<Float>(dims[k]) * voxel_size / 2;
+  }
+  bricks.assign(num_bricks, kEmptyBrick);
+  int lo[3] = {dims[0], dims[1], dims[2]};
+  int hi[3] = {-1, -1, -1};
+  for(size_t i = 0; i < num_voxels; i++) {
+    int id = ids[i];
+    if(id == 0) {
+      continue;
+    }
+    if(id < 0 || static_cast<size_t>(id) >= materials.size()) {
+      throw std::runtime_error("Voxel material id out of range");
+    }
+    int v[3];
+    for(int k = 0; k < 3; k++) {
+      v[k] = coords[i + k * num_voxels] - 1;
+      if(v[k] < 0 || v[k] >= dims[k]) {
+        throw std::runtime_error("Voxel index outside of the voxel grid");
+      }
+      lo[k] = std::min(lo[k], v[k]);
+      hi[k] = std::max(hi[k], v[k]);
+    }
+    size_t b = v[0] / kBrickSize + brick_dims[0] * (v[1] / kBrickSize + brick_dims[1] * (v[2] / kBrickSize));
+    if(bricks[b] == kEmptyBrick) {
+      bricks[b] = static_cast<uint32_t>(brick_voxels.size() / kBrickVoxels);
+      brick_voxels.resize(brick_voxels.size() + kBrickVoxels, 0);
+    }
+    brick_voxels[bricks[b] * kBrickVoxels + local_index(v)] = static_cast<uint16_t>(id);
+  }
+  brick_voxels.shrink_to_fit();
+  for(int k = 0; k < 3; k++) {
+    //An empty grid gets inverted bounds, which every ray misses
+    bounds[0][k] = grid_min[k] + lo[k] * voxel_size;
+    bounds[1][k] = grid_min[k] + (hi[k] + 1) * voxel_size;
+  }
+}
+
+//Marches the brick grid and, inside each occupied brick, its voxels. `prev` is the id of the voxel
+//the ray is currently in; the first voxel with a different id ends the march, at the face it was
+//entered through. Normals point out of the filled voxel on either side of that face, towards the
+//ray origin when entering a voxel and away from it when leaving one for empty space.
+bool voxel_grid::closest_hit(const ray& r, Float t_min, Float t_max, Float& t, int& axis, Float& sign,
+                             uint16_t& id) const {
+  const point3f o = r.origin();
+  const vec3f d = r.direction();
+  Float t0 = t_min, t1 = t_max;
+  int entry_axis = -1, exit_axis = -1;
+  for(int k = 0; k < 3; k++) {
+    if(d[k] == 0) {
+      if(o[k] < bounds[0][k] || o[k] > bounds[1][k]) {
+        return(false);
+      }
+      continue;
+    }
+    Float tnear = (bounds[0][k] - o[k]) / d[k];
+    Float tfar  = (bounds[1][k] - o[k]) / d[k];
+    if(tnear > tfar) {
+      std::swap(tnear, tfar);
+    }
+    if(tnear > t0) {
+      t0 = tnear;
+      entry_axis = k;
+    }
+    if(tfar < t1) {
+      t1 = tfar;
+      exit_axis = k;
+    }
+  }
+  if(!(t0 <= t1)) {
+    return(false);
+  }
+
+  const Float brick_size = voxel_size * kBrickSize;
+  int step[3], b[3];
+  Float brick_delta[3], brick_next[3];
+  point3f p = o + t0 * d;
+  for(int k = 0; k < 3; k++) {
+    step[k] = d[k] > 0 ? 1 : (d[k] < 0 ? -1 : 0);
+    b[k] = static_cast<int>(clamp(std::floor((p[k] - grid_min[k]) / brick_size), 0, brick_dims[k] - 1));
+    if(step[k] == 0) {
+      brick_delta[k] = INFINITY;
+      brick_next[k] = INFINITY;
+    } else {
+      brick_delta[k] = brick_size / std::fabs(d[k]);
+      brick_next[k] = (grid_min[k] + (b[k] + (step[k] > 0)) * brick_size - o[k]) / d[k];
+    }
+  }
+
+  //A ray starting inside the filled region takes the id of its first voxel, one starting outside
+  //enters it from empty space
+  bool first = true;
+  uint16_t prev = 0;
+  Float t_enter = t0;
+  int enter_axis = entry_axis;
+  uint64_t bricks_visited = 0, voxels_visited = 0;
+  bool found = false;
+  while(!found) {
+    bricks_visited++;
+    uint32_t brick = bricks[b[0] + brick_dims[0] * (b[1] + brick_dims[1] * b[2])];
+    Float t_leave = ffmin(t1, ffmin(brick_next[0], ffmin(brick_next[1], brick_next[2])));
+    if(brick == kEmptyBrick) {
+      if(prev != 0) {
+        t = t_enter;
+        axis = enter_axis;
+        sign = step[axis];
+        id = prev;
+        found = true;
+        break;
+      }
+      first = false;
+    } else {
+      const uint16_t* brick_data = &brick_voxels[brick * kBrickVoxels];
+      point3f q = o + t_enter * d;
+      int v[3], lo[3], hi[3];
+      Float voxel_delta[3], voxel_next[3];
+      for(int k = 0; k < 3; k++) {
+        lo[k] = b[k] * kBrickSize;
+        hi[k] = std::min(lo[k] + kBrickSize, dims[k]) - 1;
+        v[k] = static_cast<int>(clamp(std::floor((q[k] - grid_min[k]) / voxel_size), lo[k], hi[k]));
+        if(step[k] == 0) {
+          voxel_delta[k] = INFINITY;
+          voxel_next[k] = INFINITY;
+        } else {
+          voxel_delta[k] = voxel_size / std::fabs(d[k]);
+          voxel_next[k] = (grid_min[k] + (v[k] + (step[k] > 0)) * voxel_size - o[k]) / d[k];
+        }
+      }
+      Float t_voxel = t_enter;
+      int voxel_axis = enter_axis;
+      while(true) {
+        voxels_visited++;
+        uint16_t current = brick_data[local_index(v)];
+        if(first) {
+          first = false;
+          if(entry_axis < 0) {
+            prev = current;
+          }
+        }
+        if(current != prev) {
+          t = t_voxel;
+          axis = voxel_axis;
+          sign = current != 0 ? -step[axis] : step[axis];
+          id = current != 0 ? current : prev;
+          found = true;
+          break;
+        }
+        int k = min_axis(voxel_next);
+        if(voxel_next[k] > t_leave) {
+          break;
+        }
+        v[k] += step[k];
+        if(v[k] < lo[k] || v[k] > hi[k]) {
+          break;
+        }
+        t_voxel = voxel_next[k];
+        voxel_axis = k;
+        voxel_next[k] += voxel_delta[k];
+      }
+      if(found) {
+        break;
+      }
+    }
+    int k = min_axis(brick_next);
+    if(brick_next[k] > t1) {
+      break;
+    }
+    b[k] += step[k];
+    if(b[k] < 0 || b[k] >= brick_dims[k]) {
+      break;
+    }
+    t_enter = brick_next[k];
+    enter_axis = k;
+    brick_next[k] += brick_delta[k];
+  }
+  //Leaving the filled region from inside a filled voxel
+  if(!found && prev != 0 && exit_axis >= 0) {
+    t = t1;
+    axis = exit_axis;
+    sign = step[axis];
+    id = prev;
+    found = true;
+  }
+  if(TraversalStats::Counting()) {
+    TraversalStats::grid_steps.fetch_add(bricks_visited + voxels_visited, std::memory_order_relaxed);
+  }
+  return(found && t > t_min);
+}
+
+void voxel_grid::fill_record(const ray& r, Float t, int axis, Float sign, uint16_t id, hit_record& rec) const {
+  point3f p = r.point_at_parameter(t);
+  //Snap the hit point onto the voxel face it lies on
+  p[axis] = grid_min[axis] + std::round((p[axis] - grid_min[axis]) / voxel_size) * voxel_size;
+  int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+  Float l1 = (p[a1] - grid_min[a1]) / voxel_size;
+  Float l2 = (p[a2] - grid_min[a2]) / voxel_size;
+  vec3f n(0, 0, 0), dpdu(0, 0, 0), dpdv(0, 0, 0);
+  n[axis] = sign;
+  dpdu[a1] = voxel_size;
+  dpdv[a2] = sign * voxel_size;
+
+  rec.t = t;
+  rec.p = p;
+  rec.normal = normal3f(n.x(), n.y(), n.z());
+  rec.u = l1 - std::floor(l1);
+  rec.v = l2 - std::floor(l2);
+  rec.dpdu = dpdu;
+  rec.dpdv = dpdv;
+  rec.has_bump = false;
+  rec.pError = gamma(7) * Abs(vec3f(p.x(), p.y(), p.z()));
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation ? -1 : 1;
+  rec.normal.make_unit_vector();
+  rec.shape = this;
+  rec.alpha_miss = false;
+  rec.mat_ptr = materials[id].get();
+}
+
+bool voxel_grid::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  ray r2 = (*WorldToObject)(r);
+  Float t, sign;
+  int axis;
+  uint16_t id;
+  if(!closest_hit(r2, t_min, t_max, t, axis, sign, id)) {
+    return(false);
+  }
+  fill_record(r2, t, axis, sign, id, rec);
+  return(true);
+}
+
+bool voxel_grid::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r2 = (*WorldToObject)(r);
+  Float t, sign;
+  int axis;
+  uint16_t id;
+  if(!closest_hit(r2, t_min, t_max, t, axis, sign, id)) {
+    return(false);
+  }
+  fill_record(r2, t, axis, sign, id, rec);
+  return(true);
+}
+
+bool voxel_grid::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(bounds[0].x() > bounds[1].x()) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(aabb(bounds[0], bounds[1]));
+  return(true);
+}
+
+size_t voxel_grid::memory_bytes() const {
+  return(bricks.capacity() * sizeof(uint32_t) + brick_voxels.capacity() * sizeof(uint16_t));
+}
@@ -0,0 +1,58 @@
+#ifndef VOXELGRIDH
+#define VOXELGRIDH
+
+#include "hitable.h"
+#include "material.h"
+#include <vector>
+#include <cstdint>
+
+//Grid of axis-aligned cubic voxels, each empty (id 0) or holding a material id. The grid is split
+//into bricks of kBrickSize^3 voxels and only bricks with at least one filled voxel are stored (two
+//bytes per voxel), so sparse grids cost little more than their filled regions. The grid is
+//centered on the origin.
+//
+//Rays are traversed with two nested 3D-DDAs (Amanatides & Woo): one over the bricks, which skips
+//empty bricks in a single step, and one over the voxels of each occupied brick. A surface is hit
+//wherever the voxel id changes along the ray, so rays starting inside filled voxels (e.g. refracted
+//rays in a dielectric) find the face they leave through.
+class voxel_grid : public hitable {
+public:
+  //`coords` holds the 1-based (x, y, z) index of each filled voxel as three columns of `num_voxels`
+  //rows, and `ids` its material id, indexing `materials` (whose first entry is unused).
+  voxel_grid(const int* coords, const int* ids, size_t num_voxels, const int dims[3], Float voxel_size,
+             const std::vector<std::shared_ptr<material> >& materials,
+             std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject,
+             bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("VoxelGrid"));
+  }
+  //Bytes used by the brick table and the voxels of occupied bricks
+  size_t memory_bytes() const;
+  size_t occupied_bricks() const {
+    return(brick_voxels.size() / kBrickVoxels);
+  }
+
+  static const int kBrickSize = 8;
+  static const size_t kBrickVoxels = kBrickSize * kBrickSize * kBrickSize;
+  static const uint32_t kEmptyBrick = 0xFFFFFFFF;
+  //Index of each brick's voxels in `brick_voxels`, or kEmptyBrick
+  std::vector<uint32_t> bricks;
+  std::vector<uint16_t> brick_voxels;
+  std::vector<std::shared_ptr<material> > materials;
+
+private:
+  bool closest_hit(const ray& r, Float t_min, Float t_max, Float& t, int& axis, Float& sign,
+                   uint16_t& id) const;
+  void fill_record(const ray& r, Float t, int axis, Float sign, uint16_t id, hit_record& rec) const;
+  int dims[3];
+  int brick_dims[3];
+  Float voxel_size;
+  point3f grid_min;
+  //Bounds of the filled voxels; rays are clipped to them before traversal
+  point3f bounds[2];
+};
+
+#endif